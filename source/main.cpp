@@ -1,6 +1,11 @@
 module;
 
+#include <chrono>
 #include <csignal>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
 
 #include <tracy/Tracy.hpp>
 
@@ -24,8 +29,45 @@ std::unique_ptr<LambdaSnail::networking::server_options> add_arguments(CLI::App&
     app.allow_extras();
 
     app.add_option<uint16_t>("-p,--port", options->port, "The port to listen at")->capture_default_str();
-    app.add_option<uint32_t>("--ci,--cleanup-interval", options->cleanup_interval_seconds, "The number of seconds between each check for deleted entries")->capture_default_str();
+    auto* const hz = app.add_option<uint32_t>("--hz", options->maintenance_hz, "The number of times per second expired keys are removed")->capture_default_str()->check(CLI::Range(1, 500));
+    app.add_option<uint32_t>("--ci,--cleanup-interval", options->cleanup_interval_seconds, "Deprecated, use --hz. The number of seconds between each check for deleted entries")->check(CLI::PositiveNumber)->excludes(hz);
+    app.add_option<uint32_t>("--expire-cycle-budget", options->expire_cycle_budget_us, "The number of microseconds each expire cycle may spend removing expired keys")->capture_default_str();
+    app.add_option<uint32_t>("--active-defrag-threshold", options->active_defrag_threshold, "The percentage of fragmentation at which values are moved to release memory, 0 to disable")->capture_default_str()->check(CLI::Range(0, 1000));
+    app.add_option<uint32_t>("--active-defrag-budget", options->active_defrag_budget_us, "The number of microseconds each round of active defragmentation may take")->capture_default_str();
     app.add_option<uint8_t>("-n,--num-databases", options->num_databases, "The number of databases (namespaces) to create in the server")->capture_default_str();
+    app.add_option<uint16_t>("--shards", options->num_shards, "The number of independently locked shards per database, rounded up to a power of two")->capture_default_str()->check(CLI::Range(1, 4096));
+    app.add_option<uint64_t>("--presize", options->presize_keys, "The number of keys to size each database for up front, useful when loading a dataset of known size")->capture_default_str();
+    app.add_option<uint64_t>("--maxmemory", options->max_memory, "The memory keys and values may use, for example 512mb, 0 for no limit")->capture_default_str()->transform(CLI::AsSizeValue(false));
+
+    std::map<std::string, LambdaSnail::server::eviction_policy> const policies{
+        { "noeviction", LambdaSnail::server::eviction_policy::noeviction },
+        { "allkeys-lru", LambdaSnail::server::eviction_policy::allkeys_lru },
+        { "allkeys-lfu", LambdaSnail::server::eviction_policy::allkeys_lfu },
+        { "volatile-ttl", LambdaSnail::server::eviction_policy::volatile_ttl }
+    };
+    app.add_option("--maxmemory-policy", options->max_memory_policy, "How keys are evicted when the memory limit is reached")->transform(CLI::CheckedTransformer(policies, CLI::ignore_case))->default_str("noeviction");
+    app.add_option<uint32_t>("--buffer-pool-limit", options->buffer_pool_limit_mb, "The most memory in MiB the pool of connection buffers may use")->capture_default_str()->check(CLI::Range(1u, 1u << 20));
+    app.add_option("--dir", options->dir, "The directory snapshots are written to and loaded from")->capture_default_str();
+    app.add_option("--dbfilename", options->db_filename, "The file name of the snapshot")->capture_default_str();
+    auto* const append_only = app.add_flag("--appendonly", options->append_only, "Log every change to an append-only file, which is replayed at startup");
+    app.add_option("--appendfilename", options->append_filename, "The file name of the append-only file")->capture_default_str();
+
+    std::map<std::string, LambdaSnail::server::fsync_policy> const fsync_policies{
+        { "always", LambdaSnail::server::fsync_policy::always },
+        { "everysec", LambdaSnail::server::fsync_policy::everysec },
+        { "no", LambdaSnail::server::fsync_policy::no }
+    };
+    app.add_option("--appendfsync", options->append_fsync, "When the append-only file is synced to disk")->transform(CLI::CheckedTransformer(fsync_policies, CLI::ignore_case))->default_str("everysec");
+    app.add_option<uint32_t>("--auto-aof-rewrite-percentage", options->auto_aof_rewrite_percentage, "The growth in percent since the last rewrite at which the append-only file is rewritten, 0 to disable")->capture_default_str();
+    app.add_option<uint64_t>("--auto-aof-rewrite-min-size", options->auto_aof_rewrite_min_size, "The size the append-only file must have before it is rewritten automatically, for example 64mb")->default_str("64mb")->transform(CLI::AsSizeValue(false));
+    auto* const mmap_dataset = app.add_option("--mmap-dataset", options->mmap_dataset, "Serve the first database read-only from a dataset built by build-dataset, which is mapped instead of loaded")->check(CLI::ExistingFile)->excludes(append_only);
+    app.add_option("--cold-tier-file", options->cold_tier_file, "Move large values that have not been used for a while to this file on local storage")->excludes(mmap_dataset);
+    app.add_option<uint64_t>("--cold-tier-min-size", options->cold_tier_min_size, "The smallest value that is moved to the cold tier, for example 4kb")->default_str("4kb")->transform(CLI::AsSizeValue(false));
+    // The access clock of the entries wraps after 65536 seconds, or 256 minutes with allkeys-lfu, which main checks
+    app.add_option<uint32_t>("--cold-tier-idle", options->cold_tier_idle, "The seconds a value must have gone unused before it is moved to the cold tier, at most 65535 or 15300 with allkeys-lfu")->capture_default_str()->check(CLI::Range(1, 65535));
+    app.add_option<uint16_t>("--io-threads", options->io_threads, "The number of threads serving client connections")->capture_default_str()->check(CLI::Range(1, 1024));
+    app.add_flag("--pin-threads", options->pin_threads, "Pin each I/O thread to its own CPU core");
+    app.add_flag("--reuse-port", options->reuse_port, "Accept connections on every I/O thread using SO_REUSEPORT, instead of distributing them from one thread");
 
     return options;
 }
@@ -45,11 +87,109 @@ int main(int argc, char const** argv)
 
     logger->get_system_logger()->info("The server is starting, the version is {}", LAMBDA_SNAIL_VERSION);
 
-    LambdaSnail::memory::buffer_pool buffer_pool{};
-
-    LambdaSnail::server::server server(options->num_databases);
-
-    LambdaSnail::server::timeout_worker maintenance_thread(server, logger);
+    if (options->cleanup_interval_seconds != 0)
+    {
+        // The maintenance thread also evicts keys and watches background saves, so it runs at least once per second
+        logger->get_system_logger()->warn("--cleanup-interval is deprecated, use --hz instead. Expired keys are removed every second");
+        options->maintenance_hz = 1;
+    }
+
+    LambdaSnail::memory::buffer_pool buffer_pool{ size_t{ options->buffer_pool_limit_mb } * 1024 * 1024 };
+
+    LambdaSnail::server::server server(options->num_databases, options->num_shards, options->presize_keys, options->max_memory, options->max_memory_policy);
+
+    server.set_buffer_pool(&buffer_pool);
+    server.set_snapshot_path(std::filesystem::path(options->dir) / options->db_filename);
+
+    // Attached before any keys are loaded, so that their access clocks start out at the time they were loaded
+    if (not options->cold_tier_file.empty())
+    {
+        if (auto const max_idle = LambdaSnail::server::access_clock::max_idle_time(options->max_memory_policy);
+            std::chrono::seconds(options->cold_tier_idle) > max_idle)
+        {
+            logger->get_system_logger()->error("--cold-tier-idle must be at most {} s with this --maxmemory-policy, idle times beyond that cannot be measured",
+                                               max_idle.count());
+            return 1;
+        }
+
+        auto tier = std::make_shared<LambdaSnail::server::cold_tier>(options->cold_tier_file, options->cold_tier_min_size,
+                                                                     std::chrono::seconds(options->cold_tier_idle));
+        if (auto const started = tier->start(); not started)
+        {
+            logger->get_system_logger()->error("Unable to create the cold tier file {}: {}", options->cold_tier_file, started.error());
+            return 1;
+        }
+
+        logger->get_system_logger()->info("Moving values of at least {} bytes that are unused for {} s to {}", options->cold_tier_min_size,
+                                          options->cold_tier_idle, options->cold_tier_file);
+        server.set_cold_tier(std::move(tier));
+    }
+
+    if (not options->mmap_dataset.empty())
+    {
+        auto const dataset = LambdaSnail::server::mapped_dataset::open(options->mmap_dataset);
+        if (not dataset)
+        {
+            logger->get_system_logger()->error("Unable to map the dataset {}: {}", options->mmap_dataset, dataset.error());
+            return 1;
+        }
+
+        logger->get_system_logger()->info("Mapped {} keys from {}, the server is read-only", (*dataset)->size(), options->mmap_dataset);
+        server.set_mapped_dataset(*dataset);
+    }
+    else if (std::filesystem::exists(server.get_snapshot_path()))
+    {
+        auto const start  = std::chrono::steady_clock::now();
+        auto const loaded = server.load_snapshot();
+        if (not loaded)
+        {
+            logger->get_system_logger()->error("Unable to load the snapshot {}: {}", server.get_snapshot_path().string(), loaded.error());
+            return 1;
+        }
+
+        auto const duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        logger->get_system_logger()->info("Loaded {} keys from {} in {} ms", *loaded, server.get_snapshot_path().string(), duration.count());
+    }
+
+    // The log holds the changes made since the snapshot was written, or since the log was started if that was later,
+    // and logs absolute values, so it is replayed on top of the snapshot
+    if (options->append_only)
+    {
+        auto append_log = std::make_shared<LambdaSnail::server::append_log>(std::filesystem::path(options->dir) / options->append_filename,
+                                                                            options->append_fsync, logger);
+        if (std::filesystem::exists(append_log->get_path()))
+        {
+            auto const start    = std::chrono::steady_clock::now();
+            auto const replayed = append_log->replay(server);
+            if (not replayed)
+            {
+                logger->get_system_logger()->error("Unable to replay the append-only file {}: {}", append_log->get_path().string(), replayed.error());
+                return 1;
+            }
+
+            if (replayed->truncated_bytes > 0)
+            {
+                logger->get_system_logger()->warn("Cut off {} bytes of an incomplete command at the end of {}", replayed->truncated_bytes,
+                                                  append_log->get_path().string());
+            }
+
+            auto const duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+            logger->get_system_logger()->info("Replayed {} commands from {} in {} ms", replayed->commands, append_log->get_path().string(), duration.count());
+        }
+
+        append_log->set_rewrite_trigger(options->auto_aof_rewrite_percentage, options->auto_aof_rewrite_min_size);
+        if (auto const started = append_log->start(); not started)
+        {
+            logger->get_system_logger()->error("Unable to open the append-only file {}: {}", append_log->get_path().string(), started.error());
+            return 1;
+        }
+
+        server.set_append_log(std::move(append_log));
+    }
+
+    LambdaSnail::server::timeout_worker maintenance_thread(server, logger, options->maintenance_hz, std::chrono::microseconds(options->expire_cycle_budget_us),
+                                                           options->active_defrag_threshold, std::chrono::microseconds(options->active_defrag_budget_us));
+    server.set_maintenance_worker(&maintenance_thread);
 
     tcp_server runner(server, maintenance_thread, logger, std::move(options));
     runner.run(buffer_pool); // TODO: Move parameter to ctor
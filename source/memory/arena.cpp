@@ -0,0 +1,95 @@
+module;
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <new>
+
+module memory;
+
+LambdaSnail::memory::arena::arena(size_t const block_size) noexcept : m_block_size(block_size)
+{
+}
+
+LambdaSnail::memory::arena::~arena()
+{
+    release_blocks();
+}
+
+void LambdaSnail::memory::arena::reset() noexcept
+{
+    if (not m_block)
+    {
+        return;
+    }
+
+    if (m_block->previous) [[unlikely]]
+    {
+        // Fold the blocks into one so that the next command of this size fits without growing
+        auto const capacity = m_capacity;
+        release_blocks();
+        try
+        {
+            add_block(capacity);
+        }
+        catch (std::bad_alloc const&)
+        {
+            // The arena simply starts out empty again
+        }
+
+        return;
+    }
+
+    m_cursor = reinterpret_cast<char*>(m_block + 1);
+}
+
+size_t LambdaSnail::memory::arena::capacity() const noexcept
+{
+    return m_capacity;
+}
+
+void* LambdaSnail::memory::arena::do_allocate(size_t const bytes, size_t const alignment)
+{
+    auto* aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(m_cursor) + alignment - 1) & ~(alignment - 1));
+    if (not m_cursor or aligned + bytes > m_end) [[unlikely]]
+    {
+        add_block(bytes + alignment);
+        aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(m_cursor) + alignment - 1) & ~(alignment - 1));
+    }
+
+    m_cursor = aligned + bytes;
+    return aligned;
+}
+
+bool LambdaSnail::memory::arena::do_is_equal(std::pmr::memory_resource const& other) const noexcept
+{
+    return this == &other;
+}
+
+void LambdaSnail::memory::arena::add_block(size_t const min_size)
+{
+    // Blocks double in size, so that a large command only needs a few of them
+    auto const size = std::max({ m_block_size, m_capacity, min_size });
+    auto* memory    = static_cast<block*>(::operator new(sizeof(block) + size));
+
+    m_block    = new (memory) block{ m_block, size };
+    m_cursor   = reinterpret_cast<char*>(m_block + 1);
+    m_end      = m_cursor + size;
+    m_capacity += size;
+}
+
+void LambdaSnail::memory::arena::release_blocks() noexcept
+{
+    while (m_block)
+    {
+        auto* previous = m_block->previous;
+        ::operator delete(m_block);
+        m_block = previous;
+    }
+
+    m_cursor   = nullptr;
+    m_end      = nullptr;
+    m_capacity = 0;
+}
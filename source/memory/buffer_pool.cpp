@@ -1,55 +1,239 @@
 module;
 
-#include <array>
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <cstdint>
+#include <memory>
 #include <mutex>
-#include <ranges>
-#include <shared_mutex>
+#include <new>
+#include <utility>
 #include <vector>
 
 module memory;
 
+LambdaSnail::memory::buffer_info::buffer_info(buffer_info&& info) noexcept :
+    buffer(std::exchange(info.buffer, nullptr)), size(std::exchange(info.size, 0)),
+    m_buffer_pool(std::exchange(info.m_buffer_pool, nullptr)), m_index(info.m_index)
+{
+}
+
+LambdaSnail::memory::buffer_info& LambdaSnail::memory::buffer_info::operator=(buffer_info&& info) noexcept
+{
+    if (this != &info)
+    {
+        if (m_buffer_pool)
+        {
+            m_buffer_pool->release_buffer(*this);
+        }
+
+        buffer        = std::exchange(info.buffer, nullptr);
+        size          = std::exchange(info.size, 0);
+        m_buffer_pool = std::exchange(info.m_buffer_pool, nullptr);
+        m_index       = info.m_index;
+    }
+
+    return *this;
+}
+
 LambdaSnail::memory::buffer_info::~buffer_info()
 {
-    m_buffer_pool.release_buffer(buffer);
+    if (m_buffer_pool)
+    {
+        m_buffer_pool->release_buffer(*this);
+    }
+}
+
+LambdaSnail::memory::buffer_pool::buffer_pool(size_t const memory_limit) : m_memory_limit(memory_limit)
+{
+    for (size_t i = 0; i < num_size_classes; ++i)
+    {
+        auto& size_class            = m_size_classes[i];
+        size_class.buffer_size      = min_buffer_size << i;
+        size_class.buffers_per_slab = std::max(size_t{ 1 }, slab_size / size_class.buffer_size);
+
+        // Enough slabs for a single size class to use up the whole limit
+        auto const slab_bytes = size_class.buffer_size * size_class.buffers_per_slab;
+        size_class.max_slabs  = std::min((memory_limit + slab_bytes - 1) / slab_bytes,
+                                         size_t{ empty_index } / size_class.buffers_per_slab);
+        size_class.slabs      = std::make_unique<std::atomic<char*>[]>(size_class.max_slabs);
+    }
 }
 
-LambdaSnail::memory::buffer_pool::buffer_pool()
+LambdaSnail::memory::buffer_pool::~buffer_pool()
 {
-    m_buffers.resize(1024);
-    size_t index = 0;
-    for (auto& allocation: m_buffers)
+    for (auto& size_class : m_size_classes)
     {
-        allocation.index = index++;
+        auto const num_slabs = size_class.num_slabs.load(std::memory_order_acquire);
+        for (size_t i = 0; i < num_slabs; ++i)
+        {
+            ::operator delete[](size_class.slabs[i].load(std::memory_order_relaxed));
+        }
     }
 }
 
-LambdaSnail::memory::buffer_info LambdaSnail::memory::buffer_pool::request_buffer() noexcept
+LambdaSnail::memory::buffer_info LambdaSnail::memory::buffer_pool::request_buffer(size_t const size) noexcept
 {
-    auto lock     = std::unique_lock{m_mutex};
-    auto const it = std::ranges::find_if(m_buffers.begin(), m_buffers.end(),
-                                         [](auto const& alloc) { return not alloc.isAllocated; });
-    if (it == m_buffers.end())
+    if (size > max_buffer_size) [[unlikely]]
     {
-        return { nullptr, 0, *this };
+        return {};
     }
 
-    auto& [buffer, isAllocated, index] = *it;
+    auto& size_class = m_size_classes[size_class_index(size)];
+    size_class.num_requests.fetch_add(1, std::memory_order_relaxed);
 
-    assert(not isAllocated);
-    isAllocated = true;
+    auto index = pop(size_class);
+    if (index == empty_index) [[unlikely]]
+    {
+        index = grow(size_class);
+        if (index == empty_index)
+        {
+            m_failed_requests.fetch_add(1, std::memory_order_relaxed);
+            return {};
+        }
+    }
+
+    return { buffer_at(size_class, index), size_class.buffer_size, *this, index };
+}
+
+void LambdaSnail::memory::buffer_pool::release_buffer(buffer_info& buffer) noexcept
+{
+    assert(buffer.m_buffer_pool == this);
+
+    auto& size_class = m_size_classes[size_class_index(buffer.size)];
+    assert(size_class.buffer_size == buffer.size);
+    assert(buffer_at(size_class, buffer.m_index) == buffer.buffer);
+
+    push(size_class, buffer.m_index);
+
+    buffer.buffer        = nullptr;
+    buffer.size          = 0;
+    buffer.m_buffer_pool = nullptr;
+}
+
+LambdaSnail::memory::buffer_pool_statistics LambdaSnail::memory::buffer_pool::get_statistics() const
+{
+    buffer_pool_statistics statistics{
+        .reserved_bytes  = m_reserved_bytes.load(std::memory_order_relaxed),
+        .memory_limit    = m_memory_limit,
+        .failed_requests = m_failed_requests.load(std::memory_order_relaxed)
+    };
 
-    return { buffer.data(), buffer.size(), *this };
+    statistics.size_classes.reserve(num_size_classes);
+    for (auto const& size_class : m_size_classes)
+    {
+        statistics.size_classes.push_back(size_class_statistics{
+            .buffer_size  = size_class.buffer_size,
+            .num_buffers  = size_class.num_slabs.load(std::memory_order_relaxed) * size_class.buffers_per_slab,
+            .num_free     = size_class.num_free.load(std::memory_order_relaxed),
+            .num_requests = size_class.num_requests.load(std::memory_order_relaxed)
+        });
+    }
+
+    return statistics;
 }
 
-void LambdaSnail::memory::buffer_pool::release_buffer(char* buffer) noexcept
+size_t LambdaSnail::memory::buffer_pool::size_class_index(size_t const size) noexcept
 {
-    auto lock        = std::shared_lock{m_mutex};
-    auto* allocation = reinterpret_cast<allocation_information<1024>*>(buffer);
+    if (size <= min_buffer_size)
+    {
+        return 0;
+    }
 
-    assert(allocation->index < 1024);
-    assert(&m_buffers[allocation->index] == allocation);
-    assert(allocation->isAllocated);
+    return static_cast<size_t>(std::bit_width(size - 1)) - std::countr_zero(min_buffer_size);
+}
 
-    allocation->isAllocated = false;
-}
\ No newline at end of file
+char* LambdaSnail::memory::buffer_pool::buffer_at(size_class const& size_class, uint32_t const index) const noexcept
+{
+    auto const slab   = index / size_class.buffers_per_slab;
+    auto const offset = index % size_class.buffers_per_slab;
+
+    return size_class.slabs[slab].load(std::memory_order_acquire) + offset * size_class.buffer_size;
+}
+
+uint32_t LambdaSnail::memory::buffer_pool::pop(size_class& size_class) noexcept
+{
+    auto head = size_class.free_head.load(std::memory_order_acquire);
+    while (true)
+    {
+        auto const index = static_cast<uint32_t>(head);
+        if (index == empty_index)
+        {
+            return empty_index;
+        }
+
+        // The buffer may be popped by another thread before we read its link, in which case the value read is
+        // garbage. Slabs are never freed, so the read itself is safe, and the tag makes the exchange below fail.
+        auto const next     = std::atomic_ref{ *reinterpret_cast<uint32_t*>(buffer_at(size_class, index)) }.load(std::memory_order_relaxed);
+        auto const new_head = ((head >> 32) + 1) << 32 | next;
+        if (size_class.free_head.compare_exchange_weak(head, new_head, std::memory_order_acquire, std::memory_order_acquire))
+        {
+            size_class.num_free.fetch_sub(1, std::memory_order_relaxed);
+            return index;
+        }
+    }
+}
+
+void LambdaSnail::memory::buffer_pool::push(size_class& size_class, uint32_t const index) noexcept
+{
+    auto link = std::atomic_ref{ *reinterpret_cast<uint32_t*>(buffer_at(size_class, index)) };
+
+    size_class.num_free.fetch_add(1, std::memory_order_relaxed);
+
+    auto head = size_class.free_head.load(std::memory_order_relaxed);
+    while (true)
+    {
+        link.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+        auto const new_head = ((head >> 32) + 1) << 32 | index;
+        if (size_class.free_head.compare_exchange_weak(head, new_head, std::memory_order_release, std::memory_order_relaxed))
+        {
+            return;
+        }
+    }
+}
+
+uint32_t LambdaSnail::memory::buffer_pool::grow(size_class& size_class) noexcept
+{
+    auto lock = std::unique_lock{ size_class.grow_mutex };
+
+    // Another thread may have added a slab while we were waiting for the lock
+    if (auto const index = pop(size_class); index != empty_index)
+    {
+        return index;
+    }
+
+    auto const num_slabs = size_class.num_slabs.load(std::memory_order_relaxed);
+    if (num_slabs == size_class.max_slabs)
+    {
+        return empty_index;
+    }
+
+    auto const slab_bytes = size_class.buffer_size * size_class.buffers_per_slab;
+    auto reserved         = m_reserved_bytes.load(std::memory_order_relaxed);
+    do
+    {
+        if (reserved + slab_bytes > m_memory_limit)
+        {
+            return empty_index;
+        }
+    } while (not m_reserved_bytes.compare_exchange_weak(reserved, reserved + slab_bytes, std::memory_order_relaxed));
+
+    auto* slab = static_cast<char*>(::operator new[](slab_bytes, std::nothrow));
+    if (not slab)
+    {
+        m_reserved_bytes.fetch_sub(slab_bytes, std::memory_order_relaxed);
+        return empty_index;
+    }
+
+    size_class.slabs[num_slabs].store(slab, std::memory_order_release);
+    size_class.num_slabs.store(num_slabs + 1, std::memory_order_release);
+
+    auto const first = static_cast<uint32_t>(num_slabs * size_class.buffers_per_slab);
+    for (auto i = static_cast<uint32_t>(size_class.buffers_per_slab) - 1; i > 0; --i)
+    {
+        push(size_class, first + i);
+    }
+
+    return first;
+}
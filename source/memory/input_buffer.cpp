@@ -0,0 +1,77 @@
+module;
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+module memory;
+
+LambdaSnail::memory::input_buffer::input_buffer(buffer_pool& pool) : m_pool(pool), m_pooled(pool.request_buffer())
+{
+    if (m_pooled.size == 0) [[unlikely]]
+    {
+        m_extended      = std::make_unique_for_overwrite<char[]>(buffer_pool::min_buffer_size);
+        m_extended_size = buffer_pool::min_buffer_size;
+    }
+}
+
+char* LambdaSnail::memory::input_buffer::data() noexcept
+{
+    return m_extended ? m_extended.get() : m_pooled.buffer;
+}
+
+size_t LambdaSnail::memory::input_buffer::capacity() const noexcept
+{
+    return m_extended ? m_extended_size : m_pooled.size;
+}
+
+void LambdaSnail::memory::input_buffer::reserve(size_t const required, size_t const used)
+{
+    if (required <= capacity())
+    {
+        return;
+    }
+
+    // Grow geometrically so that a request arriving in many small reads is not copied many times
+    auto const new_size = std::max(required, capacity() * 2);
+    if (new_size <= buffer_pool::max_buffer_size)
+    {
+        if (auto pooled = m_pool.request_buffer(new_size); pooled.size > 0) [[likely]]
+        {
+            std::memcpy(pooled.buffer, data(), used);
+
+            m_pooled = std::move(pooled);
+            m_extended.reset();
+            m_extended_size = 0;
+            return;
+        }
+    }
+
+    auto extended = std::make_unique_for_overwrite<char[]>(new_size);
+    std::memcpy(extended.get(), data(), used);
+
+    m_extended      = std::move(extended);
+    m_extended_size = new_size;
+}
+
+void LambdaSnail::memory::input_buffer::shrink() noexcept
+{
+    if (not m_extended and m_pooled.size == buffer_pool::min_buffer_size) [[likely]]
+    {
+        return;
+    }
+
+    if (auto pooled = m_pool.request_buffer(); pooled.size > 0)
+    {
+        m_pooled = std::move(pooled);
+        m_extended.reset();
+        m_extended_size = 0;
+    }
+    else if (m_extended and m_pooled.size > 0)
+    {
+        // Keep the pooled buffer we still hold rather than the larger heap allocation
+        m_extended.reset();
+        m_extended_size = 0;
+    }
+}
@@ -1,51 +1,345 @@
 module;
 
-#include <shared_mutex>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <vector>
 
 export module memory;
 
 namespace LambdaSnail::memory
 {
+    export class buffer_pool;
+
+    /**
+     * A buffer handed out by the pool, which returns it to the pool when destroyed. An empty buffer_info
+     * (a nullptr buffer with size zero) is returned when the pool cannot provide a buffer.
+     */
     export struct buffer_info final
     {
-        buffer_info(char* buf, size_t len, class buffer_pool& pool) : buffer(buf), size(len), m_buffer_pool(pool) {}
+        buffer_info() noexcept = default;
+        buffer_info(char* buf, size_t len, buffer_pool& pool, uint32_t index) : buffer(buf), size(len), m_buffer_pool(&pool), m_index(index) {}
 
         char* buffer{};
         size_t size{};
 
+        buffer_info(buffer_info&& info) noexcept;
+        buffer_info& operator =(buffer_info&& info) noexcept;
+
         buffer_info(const buffer_info& info) = delete;
         buffer_info& operator =(buffer_info const&) = delete;
 
         ~buffer_info();
     private:
-        buffer_pool& m_buffer_pool;
+        friend class buffer_pool;
+
+        buffer_pool* m_buffer_pool{};
+
+        /**
+         * The position of the buffer within its size class.
+         */
+        uint32_t m_index{};
     };
 
     /**
-     * Pool of buffers for small to medium sizes
-     * Keep track of how many available in each bucket?
-     *
+     * Counters of one size class of the buffer pool.
+     */
+    export struct size_class_statistics
+    {
+        size_t buffer_size{};
+        size_t num_buffers{};
+        size_t num_free{};
+        uint64_t num_requests{};
+    };
+
+    export struct buffer_pool_statistics
+    {
+        std::vector<size_class_statistics> size_classes{};
+        size_t reserved_bytes{};
+        size_t memory_limit{};
+
+        /**
+         * Requests that could not be served because the memory limit was reached.
+         */
+        uint64_t failed_requests{};
+    };
+
+    /**
+     * Pool of buffers in power of two size classes, from 1 KiB up to 4 MiB. Buffers are carved out of slabs
+     * that are allocated as the pool grows, up to a limit on the total memory, and are never returned to the
+     * system. Each size class keeps its free buffers in a lock-free stack, so requesting and releasing a buffer
+     * never blocks; only adding a slab to a size class takes a lock.
      */
     export class buffer_pool
     {
     public:
-        explicit buffer_pool();
+        static constexpr size_t min_buffer_size  = 1024;
+        static constexpr size_t num_size_classes = 13;
+        static constexpr size_t max_buffer_size  = min_buffer_size << (num_size_classes - 1);
+
+        /**
+         * The size of the slabs of the smaller size classes, larger buffers get a slab of their own.
+         */
+        static constexpr size_t slab_size = 256 * 1024;
+
+        static constexpr size_t default_memory_limit = size_t{ 1024 } * 1024 * 1024;
+
+        explicit buffer_pool(size_t memory_limit = default_memory_limit);
+        ~buffer_pool();
 
-        [[nodiscard]] buffer_info request_buffer() noexcept;
+        buffer_pool(buffer_pool const&)            = delete;
+        buffer_pool& operator=(buffer_pool const&) = delete;
 
-        void release_buffer(char* buffer) noexcept;
+        /**
+         * Returns a buffer of the smallest size class that holds the requested number of bytes. The buffer is
+         * empty if the size is larger than max_buffer_size or the memory limit has been reached.
+         */
+        [[nodiscard]] buffer_info request_buffer(size_t size = min_buffer_size) noexcept;
+
+        void release_buffer(buffer_info& buffer) noexcept;
+
+        [[nodiscard]] buffer_pool_statistics get_statistics() const;
 
     private:
-        template<size_t buffer_size>
-        struct allocation_information
+        static constexpr uint32_t empty_index = std::numeric_limits<uint32_t>::max();
+
+        struct size_class
         {
-            std::array<char, buffer_size> buffer{};
-            bool isAllocated{false};
-            size_t index{};
+            size_t buffer_size{};
+            size_t buffers_per_slab{};
+            size_t max_slabs{};
+
+            /**
+             * The index of the first free buffer in the lower half and a tag in the upper half, which is
+             * incremented on every update so that a stale head is never mistaken for the current one.
+             */
+            std::atomic<uint64_t> free_head{ empty_index };
+
+            /**
+             * Slabs are only ever appended, so readers can find a buffer by its index without locking.
+             */
+            std::unique_ptr<std::atomic<char*>[]> slabs{};
+            std::atomic<size_t> num_slabs{};
+            std::mutex grow_mutex{};
+
+            std::atomic<size_t> num_free{};
+            std::atomic<uint64_t> num_requests{};
         };
 
-        std::vector<allocation_information<1024>> m_buffers{};
-        std::shared_mutex m_mutex{};
+        [[nodiscard]] static size_t size_class_index(size_t size) noexcept;
+        [[nodiscard]] char* buffer_at(size_class const& size_class, uint32_t index) const noexcept;
+
+        [[nodiscard]] uint32_t pop(size_class& size_class) noexcept;
+        void push(size_class& size_class, uint32_t index) noexcept;
+
+        /**
+         * Adds a slab to the size class and returns one of its buffers, pushing the others onto the free list.
+         */
+        [[nodiscard]] uint32_t grow(size_class& size_class) noexcept;
+
+        std::array<size_class, num_size_classes> m_size_classes{};
+        std::atomic<size_t> m_reserved_bytes{};
+        std::atomic<uint64_t> m_failed_requests{};
+        size_t m_memory_limit{};
+    };
+
+    /**
+     * Receive buffer for a connection. Requests are read into a buffer from the pool, and when a
+     * request turns out to be larger than that, the data is moved to a buffer of a larger size class
+     * that is kept until the request has been consumed.
+     */
+    export class input_buffer
+    {
+    public:
+        /**
+         * Falls back to the heap when the pool has reached its memory limit.
+         */
+        explicit input_buffer(buffer_pool& pool);
+
+        [[nodiscard]] char* data() noexcept;
+        [[nodiscard]] size_t capacity() const noexcept;
+
+        /**
+         * Makes room for at least required bytes, keeping the first used bytes of the current buffer.
+         */
+        void reserve(size_t required, size_t used);
+
+        /**
+         * Moves back to a buffer of the smallest size class if a larger one is in use. Must only be
+         * called when the buffer holds no unconsumed data.
+         */
+        void shrink() noexcept;
+
+    private:
+        buffer_pool& m_pool;
+        buffer_info m_pooled;
+
+        /**
+         * Used for requests larger than the largest size class, or when the pool is exhausted.
+         */
+        std::unique_ptr<char[]> m_extended{};
+        size_t m_extended_size{};
+    };
+
+    /**
+     * Bump pointer allocator for the temporaries of a single command, such as the parsed arguments. Memory is
+     * only given back all at once by reset, which rewinds to the start of the arena. When a command needed more
+     * than one block, the blocks are replaced by a single block of their combined size, so that once a
+     * connection has seen its largest command, commands no longer allocate from the heap at all.
+     */
+    export class arena final : public std::pmr::memory_resource
+    {
+    public:
+        static constexpr size_t default_block_size = 4096;
+
+        explicit arena(size_t block_size = default_block_size) noexcept;
+        ~arena() override;
+
+        arena(arena const&)            = delete;
+        arena& operator=(arena const&) = delete;
+
+        void reset() noexcept;
+
+        /**
+         * The number of bytes held by the arena, whether or not they are in use.
+         */
+        [[nodiscard]] size_t capacity() const noexcept;
+
+    private:
+        struct block
+        {
+            block* previous;
+            size_t size;
+        };
+
+        void* do_allocate(size_t bytes, size_t alignment) override;
+        void do_deallocate(void*, size_t, size_t) noexcept override {}
+        [[nodiscard]] bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override;
+
+        void add_block(size_t min_size);
+        void release_blocks() noexcept;
+
+        block* m_block{};
+        char* m_cursor{};
+        char* m_end{};
+        size_t m_block_size{};
+        size_t m_capacity{};
+    };
+
+    export struct slab_statistics
+    {
+        /**
+         * The bytes handed out, rounded up to their size class, including the allocations too large for a size class.
+         */
+        size_t allocated_bytes{};
+
+        /**
+         * The bytes of all pages of the size classes, plus the large allocations.
+         */
+        size_t active_bytes{};
+        size_t num_pages{};
+        size_t num_large_allocations{};
+
+        [[nodiscard]] double fragmentation() const noexcept
+        {
+            return allocated_bytes == 0 ? 1.0 : static_cast<double>(active_bytes) / static_cast<double>(allocated_bytes);
+        }
+
+        [[nodiscard]] size_t wasted_bytes() const noexcept { return active_bytes - allocated_bytes; }
+    };
+
+    /**
+     * Allocator for many small objects of varying size, such as the stored values. Objects are grouped by size
+     * class into pages, which are returned to the system as soon as they are empty. New objects are allocated
+     * from the fullest pages, and should_move tells whether an object lives in a page that is emptier than the
+     * average page of its size class, so that moving the object to a new allocation helps to empty its page.
+     * Objects larger than max_object_size are allocated from the heap.
+     */
+    export class slab_allocator
+    {
+    public:
+        static constexpr size_t page_size       = 64 * 1024;
+        static constexpr size_t max_object_size = 8 * 1024;
+
+        slab_allocator();
+        ~slab_allocator();
+
+        slab_allocator(slab_allocator const&)            = delete;
+        slab_allocator& operator=(slab_allocator const&) = delete;
+
+        [[nodiscard]] void* allocate(size_t size);
+
+        /**
+         * The size must be the size the object was allocated with.
+         */
+        void deallocate(void* object, size_t size) noexcept;
+
+        [[nodiscard]] bool should_move(void const* object, size_t size) const noexcept;
+
+        [[nodiscard]] slab_statistics get_statistics() const;
+
+        /**
+         * The size of the allocation that serves a request of the given size.
+         */
+        [[nodiscard]] static size_t allocation_size(size_t size) noexcept;
+
+    private:
+        /**
+         * Sizes step by 16 bytes up to 128 bytes, and then in four steps per power of two.
+         */
+        static constexpr size_t num_size_classes = 32;
+
+        /**
+         * The header at the start of each page. Pages that are neither full nor used for new objects are
+         * kept in a list, from which the fullest is picked when the current page is full.
+         */
+        struct page_header
+        {
+            page_header* previous{};
+            page_header* next{};
+            void* free_list{};
+            uint32_t class_index{};
+            uint32_t capacity{};
+            uint32_t live{};
+
+            /**
+             * Objects are carved from the page in order when the free list is empty.
+             */
+            uint32_t carved{};
+            bool is_partial{};
+        };
+
+        static constexpr size_t page_header_size = 64;
+        static_assert(sizeof(page_header) <= page_header_size);
+
+        struct size_class
+        {
+            size_t object_size{};
+            uint32_t objects_per_page{};
+            mutable std::mutex mutex{};
+            page_header* current{};
+            page_header* partial{};
+            size_t num_pages{};
+            size_t num_objects{};
+        };
+
+        [[nodiscard]] static size_t size_class_index(size_t size) noexcept;
+        [[nodiscard]] static size_t class_size(size_t index) noexcept;
+        [[nodiscard]] static page_header* page_of(void const* object) noexcept;
+
+        /**
+         * Picks the page new objects are allocated from, the fullest of the partial pages or a new page.
+         */
+        [[nodiscard]] page_header* next_page(size_class& size_class);
+        void release_page(size_class& size_class, page_header* page) noexcept;
+        static void unlink(size_class& size_class, page_header* page) noexcept;
+
+        std::array<size_class, num_size_classes> m_size_classes{};
+        std::atomic<size_t> m_large_bytes{};
+        std::atomic<size_t> m_large_allocations{};
     };
-} // namespace LambdaSnail::memory
\ No newline at end of file
+} // namespace LambdaSnail::memory
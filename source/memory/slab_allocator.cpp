@@ -0,0 +1,268 @@
+module;
+
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+module memory;
+
+namespace
+{
+    /**
+     * The number of partial pages compared when looking for the fullest one, which bounds the work done
+     * when a page runs full.
+     */
+    constexpr size_t max_pages_compared = 64;
+}
+
+LambdaSnail::memory::slab_allocator::slab_allocator()
+{
+    for (size_t i = 0; i < num_size_classes; ++i)
+    {
+        auto& size_class            = m_size_classes[i];
+        size_class.object_size      = class_size(i);
+        size_class.objects_per_page = static_cast<uint32_t>((page_size - page_header_size) / size_class.object_size);
+    }
+}
+
+LambdaSnail::memory::slab_allocator::~slab_allocator()
+{
+    // Pages that still hold objects are released along with the allocator, the objects must not be used anymore
+    for (auto& size_class : m_size_classes)
+    {
+        if (size_class.current)
+        {
+            ::operator delete(size_class.current, std::align_val_t{ page_size });
+        }
+
+        while (size_class.partial)
+        {
+            auto* next = size_class.partial->next;
+            ::operator delete(size_class.partial, std::align_val_t{ page_size });
+            size_class.partial = next;
+        }
+    }
+}
+
+void* LambdaSnail::memory::slab_allocator::allocate(size_t const size)
+{
+    if (size > max_object_size) [[unlikely]]
+    {
+        m_large_bytes.fetch_add(size, std::memory_order_relaxed);
+        m_large_allocations.fetch_add(1, std::memory_order_relaxed);
+        return ::operator new(size);
+    }
+
+    auto& size_class = m_size_classes[size_class_index(size)];
+    auto lock        = std::unique_lock{ size_class.mutex };
+
+    auto* page = size_class.current;
+    if (not page or page->live == page->capacity) [[unlikely]]
+    {
+        page               = next_page(size_class);
+        size_class.current = page;
+    }
+
+    void* object;
+    if (page->free_list)
+    {
+        object          = page->free_list;
+        page->free_list = *static_cast<void**>(object);
+    }
+    else
+    {
+        object = reinterpret_cast<char*>(page) + page_header_size + page->carved * size_class.object_size;
+        ++page->carved;
+    }
+
+    ++page->live;
+    ++size_class.num_objects;
+
+    return object;
+}
+
+void LambdaSnail::memory::slab_allocator::deallocate(void* const object, size_t const size) noexcept
+{
+    if (size > max_object_size) [[unlikely]]
+    {
+        m_large_bytes.fetch_sub(size, std::memory_order_relaxed);
+        m_large_allocations.fetch_sub(1, std::memory_order_relaxed);
+        ::operator delete(object);
+        return;
+    }
+
+    auto const index = size_class_index(size);
+    auto& size_class = m_size_classes[index];
+    auto* page       = page_of(object);
+    assert(page->class_index == index);
+
+    auto lock = std::unique_lock{ size_class.mutex };
+
+    *static_cast<void**>(object) = page->free_list;
+    page->free_list              = object;
+    --page->live;
+    --size_class.num_objects;
+
+    if (page == size_class.current)
+    {
+        return;
+    }
+
+    if (page->live == 0)
+    {
+        release_page(size_class, page);
+        return;
+    }
+
+    // A page that was full becomes a candidate for new objects again
+    if (not page->is_partial)
+    {
+        page->previous = nullptr;
+        page->next     = size_class.partial;
+        if (size_class.partial)
+        {
+            size_class.partial->previous = page;
+        }
+
+        size_class.partial = page;
+        page->is_partial   = true;
+    }
+}
+
+bool LambdaSnail::memory::slab_allocator::should_move(void const* const object, size_t const size) const noexcept
+{
+    if (size > max_object_size)
+    {
+        return false;
+    }
+
+    auto const& size_class = m_size_classes[size_class_index(size)];
+    auto const* page       = page_of(object);
+
+    auto lock = std::unique_lock{ size_class.mutex };
+
+    if (page == size_class.current)
+    {
+        return false;
+    }
+
+    // Objects are moved out of the pages that are emptier than average. They end up in the current page and then
+    // in the fullest partial pages, so that the emptier pages are released and the average goes up.
+    return page->live * size_class.num_pages < size_class.num_objects;
+}
+
+LambdaSnail::memory::slab_statistics LambdaSnail::memory::slab_allocator::get_statistics() const
+{
+    slab_statistics statistics{
+        .allocated_bytes       = m_large_bytes.load(std::memory_order_relaxed),
+        .active_bytes          = m_large_bytes.load(std::memory_order_relaxed),
+        .num_large_allocations = m_large_allocations.load(std::memory_order_relaxed)
+    };
+
+    for (auto const& size_class : m_size_classes)
+    {
+        auto lock = std::unique_lock{ size_class.mutex };
+
+        statistics.allocated_bytes += size_class.num_objects * size_class.object_size;
+        statistics.active_bytes += size_class.num_pages * page_size;
+        statistics.num_pages += size_class.num_pages;
+    }
+
+    return statistics;
+}
+
+size_t LambdaSnail::memory::slab_allocator::allocation_size(size_t const size) noexcept
+{
+    return size > max_object_size ? size : class_size(size_class_index(size));
+}
+
+size_t LambdaSnail::memory::slab_allocator::size_class_index(size_t const size) noexcept
+{
+    if (size <= 128)
+    {
+        return size == 0 ? 0 : (size - 1) / 16;
+    }
+
+    // Sizes in (2^(bits - 1), 2^bits] map to four classes spaced 2^(bits - 3) apart
+    auto const bits = static_cast<size_t>(std::bit_width(size - 1));
+    return 8 + (bits - 8) * 4 + ((size - 1) >> (bits - 3)) - 4;
+}
+
+size_t LambdaSnail::memory::slab_allocator::class_size(size_t const index) noexcept
+{
+    if (index < 8)
+    {
+        return (index + 1) * 16;
+    }
+
+    auto const group = (index - 8) / 4;
+    auto const step  = (index - 8) % 4;
+    return (size_t{ 128 } << group) + (step + 1) * (size_t{ 32 } << group);
+}
+
+LambdaSnail::memory::slab_allocator::page_header* LambdaSnail::memory::slab_allocator::page_of(void const* const object) noexcept
+{
+    return reinterpret_cast<page_header*>(reinterpret_cast<uintptr_t>(object) & ~(uintptr_t{ page_size } - 1));
+}
+
+LambdaSnail::memory::slab_allocator::page_header* LambdaSnail::memory::slab_allocator::next_page(size_class& size_class)
+{
+    page_header* fullest = nullptr;
+    size_t compared = 0;
+    for (auto* candidate = size_class.partial; candidate and compared < max_pages_compared; candidate = candidate->next, ++compared)
+    {
+        if (not fullest or candidate->live > fullest->live)
+        {
+            fullest = candidate;
+        }
+    }
+
+    if (fullest)
+    {
+        unlink(size_class, fullest);
+        return fullest;
+    }
+
+    auto* memory = ::operator new(page_size, std::align_val_t{ page_size });
+    auto* result = new (memory) page_header{ .class_index = static_cast<uint32_t>(&size_class - m_size_classes.data()),
+                                             .capacity    = size_class.objects_per_page };
+    ++size_class.num_pages;
+
+    return result;
+}
+
+void LambdaSnail::memory::slab_allocator::release_page(size_class& size_class, page_header* const page) noexcept
+{
+    if (page->is_partial)
+    {
+        unlink(size_class, page);
+    }
+
+    page->~page_header();
+    ::operator delete(page, std::align_val_t{ page_size });
+    --size_class.num_pages;
+}
+
+void LambdaSnail::memory::slab_allocator::unlink(size_class& size_class, page_header* const page) noexcept
+{
+    if (page->previous)
+    {
+        page->previous->next = page->next;
+    }
+    else
+    {
+        size_class.partial = page->next;
+    }
+
+    if (page->next)
+    {
+        page->next->previous = page->previous;
+    }
+
+    page->previous   = nullptr;
+    page->next       = nullptr;
+    page->is_partial = false;
+}
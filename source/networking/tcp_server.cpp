@@ -10,12 +10,21 @@ module;
 #include <asio/placeholders.hpp>
 #include <asio/signal_set.hpp>
 #include <asio/write.hpp>
-#include <cstdio>
+#include <cstring>
 
+#include <cstdint>
 #include <exception>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <csignal>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include <tracy/Tracy.hpp>
 
 export module networking :resp.tcp_server;
@@ -33,8 +42,97 @@ namespace LambdaSnail::networking
     export struct server_options
     {
         uint16_t port{ 6379 };
-        uint32_t cleanup_interval_seconds{ 1024 };
+
+        /**
+         * The number of expire cycles per second, and the time each cycle may spend removing expired keys.
+         */
+        uint32_t maintenance_hz{ 10 };
+        uint32_t expire_cycle_budget_us{ 25'000 };
+
+        /**
+         * The interval of the maintenance before it ran several times per second, kept for existing command lines and
+         * mapped onto maintenance_hz. Zero when not given.
+         */
+        uint32_t cleanup_interval_seconds{ 0 };
+
+        /**
+         * Active defragmentation starts when the allocator of the stored values wastes more than this percentage
+         * of the memory in use, zero disables it. Each round may take up to the budget.
+         */
+        uint32_t active_defrag_threshold{ 10 };
+        uint32_t active_defrag_budget_us{ 10'000 };
+
         uint8_t num_databases{ 1 };
+
+        /**
+         * The number of independently locked shards in each database, rounded up to a power of two.
+         */
+        uint16_t num_shards{ 16 };
+
+        /**
+         * The number of keys each database is sized for up front, zero to let the databases grow as needed.
+         */
+        uint64_t presize_keys{ 0 };
+
+        /**
+         * The memory the keys and values may use in bytes, zero for no limit, and how to make room when they use more.
+         */
+        uint64_t max_memory{ 0 };
+        LambdaSnail::server::eviction_policy max_memory_policy{ LambdaSnail::server::eviction_policy::noeviction };
+
+        /**
+         * The most memory, in MiB, the pool of connection buffers may grow to before falling back to the heap.
+         */
+        uint32_t buffer_pool_limit_mb{ 1024 };
+
+        /**
+         * Where snapshots are written by SAVE and BGSAVE, and loaded from at startup.
+         */
+        std::string dir{ "." };
+        std::string db_filename{ "dump.lsdb" };
+
+        /**
+         * Log every change to an append-only file in the same directory, which is replayed at startup.
+         */
+        bool append_only{ false };
+        std::string append_filename{ "appendonly.aof" };
+        LambdaSnail::server::fsync_policy append_fsync{ LambdaSnail::server::fsync_policy::everysec };
+
+        /**
+         * The file is rewritten when it has grown by this percentage since the last rewrite and is at least the minimum size.
+         */
+        uint32_t auto_aof_rewrite_percentage{ LambdaSnail::server::append_log::default_rewrite_growth };
+        uint64_t auto_aof_rewrite_min_size{ LambdaSnail::server::append_log::default_rewrite_min_size };
+
+        /**
+         * Serve the first database from a dataset built by build-dataset, which is mapped into memory instead of
+         * loaded. The server is read-only and does not load the snapshot.
+         */
+        std::string mmap_dataset{};
+
+        /**
+         * Move values of at least the minimum size, in bytes, that have not been used for the idle time, in seconds, to
+         * this file on local storage. Empty to keep all values in memory.
+         */
+        std::string cold_tier_file{};
+        uint64_t cold_tier_min_size{ LambdaSnail::server::cold_tier::default_min_size };
+        uint32_t cold_tier_idle{ static_cast<uint32_t>(LambdaSnail::server::cold_tier::default_idle_time.count()) };
+
+        /**
+         * The number of threads serving connections, each with its own io_context.
+         */
+        uint16_t io_threads{ 1 };
+
+        /**
+         * Pin each I/O thread to its own core.
+         */
+        bool pin_threads{ false };
+
+        /**
+         * Let every I/O thread accept connections on its own SO_REUSEPORT socket and have the kernel
+         * balance them, instead of accepting on one thread and handing out connections round-robin.
+         */
+        bool reuse_port{ false };
     };
 }
 
@@ -42,11 +140,57 @@ using default_token_t = asio::deferred_t;
 using tcp_acceptor_t = default_token_t::as_default_on_t<asio::ip::tcp::acceptor>;
 using tcp_socket_t = default_token_t::as_default_on_t<asio::ip::tcp::socket>;
 
+/**
+ * Waits until the record of the append-only file has been synced. The flusher thread notifies the connection by
+ * cancelling a timer from the thread of the connection. Returns false if writing or syncing the file failed.
+ */
+asio::awaitable<bool> wait_until_durable(LambdaSnail::server::append_log& append_log, uint64_t const sequence)
+{
+    auto const executor = co_await asio::this_coro::executor;
+    asio::steady_timer timer(executor, asio::steady_timer::time_point::max());
+
+    // The timer is only cancelled once the coroutine is suspended below, as both run on the same thread
+    bool durable = false;
+    append_log.when_durable(sequence, [&timer, &durable, executor](bool const result) {
+        asio::post(executor, [&timer, &durable, result] {
+            durable = result;
+            timer.cancel();
+        });
+    });
+    co_await timer.async_wait(asio::as_tuple(asio::use_awaitable));
+    co_return durable;
+}
+
+/**
+ * Waits until the reader threads of the cold tier have loaded the cold values that the replies reference, which they
+ * report like the flusher of the append-only file. Returns whether all values could be read.
+ */
+asio::awaitable<bool> read_cold_values(LambdaSnail::server::command_dispatch& dispatch)
+{
+    auto const executor = co_await asio::this_coro::executor;
+    asio::steady_timer timer(executor, asio::steady_timer::time_point::max());
+
+    bool succeeded = false;
+    dispatch.read_cold_values([&timer, &succeeded, executor](bool const result) {
+        asio::post(executor, [&timer, &succeeded, result] {
+            succeeded = result;
+            timer.cancel();
+        });
+    });
+    co_await timer.async_wait(asio::as_tuple(asio::use_awaitable));
+    co_return succeeded;
+}
+
 /**
  * The connection coroutine is the glue that connects the client connection with the database.
- * Since this is not a real production server, requests are assumed to be 1 kiB for simplicity.
- * The buffer pool could be extended to serve buffers of various sizes to handle a more dynamic
- * (and maybe more realistic) workload.
+ * Requests are read into a buffer from the pool and parsed in place. A request that does not fit
+ * is kept across reads by the incremental parser, and the buffer is grown to the size the parser
+ * asks for.
+ *
+ * Clients may pipeline requests, so a single read can contain several commands as well as the
+ * beginning of a command that has not been fully received yet. All complete commands are executed
+ * in order and their responses are sent back in a single gathered write, while the incomplete tail
+ * is moved to the front of the buffer and completed by the following reads.
  */
 asio::awaitable<void> connection(
     tcp_socket_t socket,
@@ -56,20 +200,27 @@ asio::awaitable<void> connection(
 {
     logger->get_network_logger()->trace("Connection received on port: {}", socket.remote_endpoint().port());
 
-    auto buffer_info = buffer_pool.request_buffer();
-    if (buffer_info.size == 0)
-    {
-        // TODO: Add own concrete exception here
-        logger->get_network_logger()->error("Failed to acquire memory from buffer pool");
-        throw std::bad_alloc();
-    }
+    LambdaSnail::resp::incremental_parser parser;
+    auto* const append_log = dispatch->get_server().get_append_log();
+
+    // Kept between reads so that their capacity can be reused
+    LambdaSnail::resp::response_writer responses;
+    std::vector<asio::const_buffer> response_buffers;
 
     try
     {
-        while (true)
+        LambdaSnail::memory::input_buffer buffer(buffer_pool);
+
+        size_t buffered_bytes = 0;
+        size_t required_bytes = 0;
+        bool protocol_error   = false;
+
+        while (not protocol_error)
         {
+            buffer.reserve(required_bytes, buffered_bytes);
+
             auto [ec, n] = co_await socket.async_read_some(
-                asio::buffer(buffer_info.buffer, buffer_info.size),
+                asio::buffer(buffer.data() + buffered_bytes, buffer.capacity() - buffered_bytes),
                 asio::as_tuple(asio::use_awaitable));
             if (ec == asio::error::eof) [[unlikely]]
             {
@@ -84,40 +235,238 @@ asio::awaitable<void> connection(
                 break;
             }
 
-            LambdaSnail::resp::data_view const resp_data(std::string_view(buffer_info.buffer, n));
-            std::string response = dispatch->process_command(resp_data);
+            buffered_bytes += n;
 
-            auto [ec_w, n_written] = co_await async_write(socket, asio::buffer(response, response.size()), asio::as_tuple(asio::use_awaitable));
-            if (ec) [[unlikely]]
+            auto const first_sequence = append_log ? append_log->thread_sequence() : 0;
+
+            size_t frame_start  = 0;
+            size_t num_commands = 0;
+            required_bytes      = 0;
+            while (frame_start < buffered_bytes)
+            {
+                std::string_view const unprocessed(buffer.data() + frame_start, buffered_bytes - frame_start);
+                auto const result = parser.parse(unprocessed);
+
+                if (result.status == LambdaSnail::resp::incremental_parser::parse_status::incomplete)
+                {
+                    required_bytes = result.length;
+                    break;
+                }
+
+                if (result.status == LambdaSnail::resp::incremental_parser::parse_status::error) [[unlikely]]
+                {
+                    logger->get_network_logger()->error("Protocol error, closing connection: {}", result.error);
+                    responses.error("ERR Protocol error: ", result.error);
+                    protocol_error = true;
+                    break;
+                }
+
+                dispatch->process_command(unprocessed.substr(0, result.length), parser.arguments(), responses);
+                frame_start += result.length;
+                ++num_commands;
+            }
+
+            // Keep the beginning of the next request around until the rest of it arrives
+            buffered_bytes -= frame_start;
+            if (buffered_bytes > 0 and frame_start > 0)
+            {
+                std::memmove(buffer.data(), buffer.data() + frame_start, buffered_bytes);
+            }
+            else if (buffered_bytes == 0)
+            {
+                buffer.shrink();
+            }
+
+            if (responses.empty())
+            {
+                continue;
+            }
+
+            // With fsync=always the replies wait until the writes of the commands are on disk, which happens in one
+            // fsync for all clients that wrote in the meantime
+            if (append_log and append_log->get_fsync_policy() == LambdaSnail::server::fsync_policy::always)
+            {
+                auto const sequence = append_log->thread_sequence();
+                if (sequence != first_sequence and not append_log->is_durable(sequence))
+                {
+                    if (not co_await wait_until_durable(*append_log, sequence)) [[unlikely]]
+                    {
+                        // None of the commands is acknowledged, since their writes may not have reached the disk
+                        responses.clear();
+                        for (size_t i = 0; i < num_commands; ++i)
+                        {
+                            responses.error("MISCONF Errors writing to the AOF file, the write may not have been persisted");
+                        }
+                    }
+                }
+            }
+
+            // Replies to reads of cold values are complete once the values have been loaded, meanwhile the thread
+            // serves other connections
+            if (dispatch->has_cold_reads())
+            {
+                if (not co_await read_cold_values(*dispatch)) [[unlikely]]
+                {
+                    logger->get_network_logger()->error("Unable to read from the cold tier, closing connection");
+                    break;
+                }
+            }
+
+            for (auto const segment : responses.segments())
+            {
+                response_buffers.emplace_back(asio::buffer(segment));
+            }
+
+            // Values referenced by the replies stay pinned by the writer until the write has completed
+            auto [ec_w, n_written] = co_await async_write(socket, response_buffers, asio::as_tuple(asio::use_awaitable));
+
+            response_buffers.clear();
+            responses.clear();
+
+            if (ec_w) [[unlikely]]
             {
                 logger->get_network_logger()->error("Error while writing to socket: {}", ec_w.message());
+                break;
             }
         }
     }
+    catch (std::bad_alloc const&)
+    {
+        logger->get_network_logger()->error("Failed to acquire memory for the connection");
+    }
     catch (std::exception& e)
     {
-        std::printf("echo Exception: %s\n", e.what());
+        logger->get_network_logger()->error("Exception in connection: {}", e.what());
     }
 }
 
+/**
+ * A set of io contexts with one thread each. A connection stays on the context that it was assigned to
+ * for its whole lifetime, so the networking code never has to synchronize with other threads. Shared
+ * state, such as the databases, is responsible for its own synchronization.
+ */
+class io_context_pool
+{
+public:
+    explicit io_context_pool(size_t const num_contexts)
+    {
+        for (size_t i = 0; i < std::max(num_contexts, size_t{ 1 }); ++i)
+        {
+            // Each context is only ever run by one thread, which allows asio to skip some locking
+            auto& context = m_contexts.emplace_back(std::make_unique<asio::io_context>(1));
+            m_work_guards.emplace_back(asio::make_work_guard(*context));
+        }
+    }
+
+    [[nodiscard]] asio::io_context& get(size_t const index)
+    {
+        return *m_contexts[index];
+    }
+
+    /**
+     * Returns the contexts in turn, to spread connections accepted on a single thread.
+     */
+    [[nodiscard]] asio::io_context& next()
+    {
+        auto& context = *m_contexts[m_next_context];
+        m_next_context = (m_next_context + 1) % m_contexts.size();
+        return context;
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return m_contexts.size();
+    }
+
+    /**
+     * Runs the first context on the calling thread and the others on threads of their own. Returns
+     * once all contexts have been stopped.
+     */
+    void run(bool const pin_threads)
+    {
+        std::vector<std::jthread> threads;
+        for (size_t i = 1; i < m_contexts.size(); ++i)
+        {
+            threads.emplace_back([this, i, pin_threads]
+            {
+                if (pin_threads)
+                {
+                    pin_to_core(i);
+                }
+
+                m_contexts[i]->run();
+            });
+        }
+
+        if (pin_threads)
+        {
+            pin_to_core(0);
+        }
+
+        m_contexts[0]->run();
+    }
+
+    void stop()
+    {
+        m_work_guards.clear();
+        for (auto const& context : m_contexts)
+        {
+            context->stop();
+        }
+    }
+
+private:
+    static void pin_to_core(size_t const core)
+    {
+#ifdef __linux__
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(core % std::max(std::thread::hardware_concurrency(), 1u), &cpu_set);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+#endif
+    }
+
+    std::vector<std::unique_ptr<asio::io_context>> m_contexts{};
+    std::vector<asio::executor_work_guard<asio::io_context::executor_type>> m_work_guards{};
+    size_t m_next_context{};
+};
+
+/**
+ * Accepts connections on the port. If a pool is given, the connections are handed out to its contexts
+ * in turn, otherwise they are served by the context running the listener.
+ */
 asio::awaitable<void> listener(
     uint16_t port,
+    bool reuse_port,
+    io_context_pool* contexts,
     LambdaSnail::server::server& server,
     LambdaSnail::memory::buffer_pool& buffer_pool,
     std::shared_ptr<LambdaSnail::logging::logger> logger)
 {
     auto executor = co_await asio::this_coro::executor;
-    tcp_acceptor_t acceptor(executor, {asio::ip::tcp::v4(), port});
+    tcp_acceptor_t acceptor(executor);
+
+    // The socket options must be set before binding, so the acceptor is set up step by step
+    asio::ip::tcp::endpoint const endpoint{asio::ip::tcp::v4(), port};
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
 
 #ifndef _WIN32
-    // acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
-    // typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
-    // acceptor.set_option(reuse_port(true));
+    if (reuse_port)
+    {
+        typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port_option;
+        acceptor.set_option(reuse_port_option(true));
+    }
 #endif
 
+    acceptor.bind(endpoint);
+    acceptor.listen();
+
     while (true)
     {
-        auto [ec, socket] = co_await acceptor.async_accept(asio::as_tuple(asio::use_awaitable));
+        asio::any_io_executor const connection_executor = contexts ? contexts->next().get_executor() : executor;
+
+        auto [ec, socket] = co_await acceptor.async_accept(connection_executor, asio::as_tuple(asio::use_awaitable));
         if (ec)
         {
             logger->get_network_logger()->error("Error listening for connections: {}", ec.message());
@@ -125,7 +474,7 @@ asio::awaitable<void> listener(
         }
 
         auto dispatch = std::make_shared<LambdaSnail::server::command_dispatch>(server);
-        co_spawn(executor, connection(std::move(socket), dispatch, buffer_pool, logger), asio::detached);
+        co_spawn(connection_executor, connection(std::move(socket), dispatch, buffer_pool, logger), asio::detached);
     }
 }
 
@@ -138,10 +487,10 @@ public:
         std::shared_ptr<LambdaSnail::logging::logger> logger,
         std::unique_ptr<LambdaSnail::networking::server_options> options)
     :
+        m_io_contexts(options->io_threads),
         m_server(server),
         m_logger(logger),
         m_server_options(std::move(options)),
-        m_maintenance_timer(m_context),
         m_maintenance_thread(maintenance_thread)
     { }
 
@@ -151,7 +500,9 @@ public:
 
         try
         {
-            asio::signal_set signal_set{m_context};
+            auto& main_context = m_io_contexts.get(0);
+
+            asio::signal_set signal_set{main_context};
             signal_set.add(SIGINT);
             signal_set.add(SIGTERM);
 #if defined(SIGHUP)
@@ -168,24 +519,43 @@ public:
 #else
                     m_logger->get_system_logger()->info("The system received signal {}", signal);
 #endif
-                    m_maintenance_timer.cancel();
-                    m_context.stop();
+                    m_io_contexts.stop();
                 });
 
-            asio::co_spawn(m_context, listener(m_server_options->port, m_server, buffer_pool, m_logger), asio::detached);
+            if (m_server_options->reuse_port)
+            {
+                for (size_t i = 0; i < m_io_contexts.size(); ++i)
+                {
+                    asio::co_spawn(m_io_contexts.get(i), listener(m_server_options->port, true, nullptr, m_server, buffer_pool, m_logger), asio::detached);
+                }
+            }
+            else
+            {
+                auto* const contexts = m_io_contexts.size() > 1 ? &m_io_contexts : nullptr;
+                asio::co_spawn(main_context, listener(m_server_options->port, false, contexts, m_server, buffer_pool, m_logger), asio::detached);
+            }
+
+            m_logger->get_network_logger()->info("Serving connections on {} I/O threads", m_io_contexts.size());
 
-            m_logger->get_network_logger()->info("The maintenance thread will run every {} seconds", m_server_options->cleanup_interval_seconds);
-            m_maintenance_timer.expires_after(asio::chrono::seconds(m_server_options->cleanup_interval_seconds));
-            m_maintenance_timer.async_wait(std::bind(&tcp_server::maintenance_timer_handler, this, std::placeholders::_1, std::nullopt));
+            // Expiry runs on its own thread, so that it never blocks the I/O threads
+            m_maintenance_thread.start();
 
-            m_context.run();
+            // Returns when all I/O threads have been stopped and joined
+            m_io_contexts.run(m_server_options->pin_threads);
 
-            // Signal worker schedulers that no more scheduling should take place
-            m_should_shutdown = true;
+            m_maintenance_thread.stop();
 
-            // If we are using an asio::thread_pool, we should join here to wait for
-            // asio to be done (i.e., server shutdown)
-            // m_context.join();
+            // The flusher and the readers of the cold tier may still notify connections, so they are stopped before the
+            // I/O contexts are destroyed
+            if (auto* const append_log = m_server.get_append_log())
+            {
+                append_log->stop();
+            }
+
+            if (auto* const cold_tier = m_server.get_cold_tier())
+            {
+                cold_tier->stop();
+            }
         } catch (std::exception &e)
         {
             m_logger->get_system_logger()->error("Exception in server runner: {}", e.what());
@@ -198,46 +568,11 @@ public:
     }
 
 private:
-    std::atomic<bool> m_should_shutdown{ false };
-    asio::io_context m_context { 1 };
-    //asio::thread_pool m_context { m_thread_pool_size };
+    io_context_pool m_io_contexts;
 
     LambdaSnail::server::server& m_server;
     std::shared_ptr<LambdaSnail::logging::logger> m_logger{};
     std::unique_ptr<LambdaSnail::networking::server_options> m_server_options;
 
-    asio::steady_timer m_maintenance_timer;
     LambdaSnail::server::timeout_worker& m_maintenance_thread;
-
-    static constexpr int64_t worker_threads_result_max_wait_time = 500;
-
-    void maintenance_timer_handler(
-        std::error_code const ec,
-        std::optional<std::shared_future<void>> const& async_operation = std::nullopt)
-    {
-        if (ec)
-        {
-            this->m_logger->get_network_logger()->error("Error encountered by maintenance timer: {}", ec.message());
-            return;
-        }
-
-        if (m_should_shutdown)
-        {
-            return;
-        }
-
-        auto const operation = async_operation
-            .or_else([this]
-            {
-                return std::optional{ m_maintenance_thread.do_work_async().share() };
-            })
-            .and_then([this](std::shared_future<void> const& future)
-            {
-                auto const status = future.wait_for(std::chrono::microseconds(worker_threads_result_max_wait_time));
-                return status == std::future_status::ready ? std::nullopt : std::optional{ future };
-            });
-
-        m_maintenance_timer.expires_after(asio::chrono::seconds(m_server_options->cleanup_interval_seconds));
-        m_maintenance_timer.async_wait(std::bind(&tcp_server::maintenance_timer_handler, this, std::placeholders::_1, operation));
-    }
 };
\ No newline at end of file
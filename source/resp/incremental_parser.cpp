@@ -0,0 +1,260 @@
+module;
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include <tracy/Tracy.hpp>
+
+export module resp :resp.incremental_parser;
+
+import :resp.parser;
+
+namespace LambdaSnail::resp
+{
+    /**
+     * Finds the boundaries of RESP messages in a buffer that is filled one read at a time. The parser
+     * remembers how far it got into the current message, so a request spread over many reads is only
+     * scanned once. All positions are kept as offsets from the beginning of the message, which allows
+     * the owner of the buffer to move or grow it between calls.
+     *
+     * While scanning a command, an array of bulk strings, the parser records where each argument is, so
+     * that the command can be executed without parsing the message a second time.
+     */
+    export class incremental_parser
+    {
+    public:
+        enum class parse_status : uint8_t
+        {
+            complete,
+            incomplete,
+            error
+        };
+
+        struct result
+        {
+            parse_status status{};
+
+            /**
+             * For a complete message this is its length in bytes. For an incomplete message it is the
+             * smallest number of bytes the buffer needs to hold before another call can make progress,
+             * which lets the caller grow the buffer to fit a large bulk string in one step.
+             */
+            size_t length{};
+
+            std::string_view error{};
+        };
+
+        /**
+         * The payload of a bulk string, as an offset from the beginning of the message and a length.
+         */
+        struct argument
+        {
+            size_t offset{};
+            size_t length{};
+        };
+
+        /**
+         * Continues parsing the message at the start of the buffer. The buffer must start at the same
+         * position as in the previous call, and hold at least as many bytes, until the message is complete.
+         * Throws std::bad_alloc when there is no memory for the arguments of a large array.
+         */
+        [[nodiscard]] result parse(std::string_view buffer);
+
+        void reset() noexcept;
+
+        /**
+         * The arguments of the last complete message if it is a command, and empty otherwise. Valid until
+         * the next call to parse.
+         */
+        [[nodiscard]] std::span<argument const> arguments() const noexcept;
+
+        /**
+         * Limits matching the defaults of Redis, to protect the server from clients announcing
+         * arbitrarily large requests.
+         */
+        static constexpr int64_t max_bulk_length    = 512 * 1024 * 1024;
+        static constexpr int64_t max_array_length   = 1024 * 1024;
+        static constexpr size_t max_header_length   = 64;
+
+        /**
+         * The number of arguments the table is sized for up front, a larger array grows it as its arguments arrive.
+         */
+        static constexpr size_t max_reserved_arguments = 1024;
+
+    private:
+        enum class state : uint8_t
+        {
+            header,
+            bulk_body
+        };
+
+        [[nodiscard]] static bool parse_length(std::string_view digits, int64_t& length) noexcept;
+
+        state m_state{ state::header };
+        size_t m_pending_elements{ 1 };
+        size_t m_bulk_length{};
+
+        /**
+         * Offset of the first byte that has not been consumed by the parser.
+         */
+        size_t m_cursor{};
+
+        /**
+         * Offset from where to continue looking for the end of a header line that has only been partially received.
+         */
+        size_t m_scan_offset{};
+
+        std::vector<argument> m_arguments{};
+
+        /**
+         * Whether the message so far is an array of bulk strings, for which the argument table is kept.
+         */
+        bool m_is_command{};
+    };
+}
+
+LambdaSnail::resp::incremental_parser::result LambdaSnail::resp::incremental_parser::parse(std::string_view const buffer)
+{
+    ZoneScoped;
+
+    while (m_pending_elements > 0)
+    {
+        if (m_state == state::bulk_body)
+        {
+            auto const body_end = m_cursor + m_bulk_length + resp_end.size();
+            if (buffer.size() < body_end)
+            {
+                return { parse_status::incomplete, body_end };
+            }
+
+            if (buffer[body_end - 2] != '\r' or buffer[body_end - 1] != '\n') [[unlikely]]
+            {
+                return { parse_status::error, 0, "Bulk string is not terminated by CRLF" };
+            }
+
+            m_cursor = m_scan_offset = body_end;
+            m_state = state::header;
+            --m_pending_elements;
+            continue;
+        }
+
+        auto const line_end = find_crlf(buffer, m_scan_offset);
+        if (line_end == std::string_view::npos)
+        {
+            if (buffer.size() - m_cursor > max_header_length) [[unlikely]]
+            {
+                return { parse_status::error, 0, "Header line is too long" };
+            }
+
+            // The last byte may be the '\r' of the line ending, so it is scanned again next time
+            m_scan_offset = buffer.size() > m_cursor ? buffer.size() - 1 : m_cursor;
+            return { parse_status::incomplete, buffer.size() + 1 };
+        }
+
+        auto const header_start = m_cursor;
+        auto const header       = buffer.substr(m_cursor, line_end - m_cursor);
+        m_cursor = m_scan_offset = line_end + resp_end.size();
+
+        if (header.empty()) [[unlikely]]
+        {
+            return { parse_status::error, 0, "Empty header line" };
+        }
+
+        if (header_start == 0)
+        {
+            // The first header of a message, which decides whether it can be a command
+            m_is_command = false;
+        }
+
+        int64_t length{};
+        switch (static_cast<data_type>(header[0]))
+        {
+            case data_type::Array:
+                if (not parse_length(header.substr(1), length) or length > max_array_length) [[unlikely]]
+                {
+                    return { parse_status::error, 0, "Invalid array length" };
+                }
+
+                // Only the outermost array can be a command
+                m_is_command = header_start == 0;
+                if (m_is_command)
+                {
+                    m_arguments.clear();
+                    m_arguments.reserve(std::min(static_cast<size_t>(std::max(length, int64_t{ 0 })), max_reserved_arguments));
+                }
+
+                --m_pending_elements;
+                m_pending_elements += length > 0 ? static_cast<size_t>(length) : 0;
+                break;
+            case data_type::BulkString:
+                if (not parse_length(header.substr(1), length) or length > max_bulk_length) [[unlikely]]
+                {
+                    return { parse_status::error, 0, "Invalid bulk length" };
+                }
+
+                if (length < 0)
+                {
+                    // Null bulk string, there is no body to wait for
+                    m_is_command = false;
+                    --m_pending_elements;
+                    break;
+                }
+
+                if (m_is_command)
+                {
+                    m_arguments.push_back(argument{ .offset = m_cursor, .length = static_cast<size_t>(length) });
+                }
+
+                m_bulk_length = static_cast<size_t>(length);
+                m_state       = state::bulk_body;
+                break;
+            case data_type::SimpleString:
+            case data_type::SimpleError:
+            case data_type::Integer:
+            case data_type::Double:
+            case data_type::Boolean:
+            case data_type::Null:
+                m_is_command = false;
+                --m_pending_elements;
+                break;
+            default:
+                return { parse_status::error, 0, "Unsupported type" };
+        }
+    }
+
+    auto const length = m_cursor;
+    reset();
+
+    return { parse_status::complete, length };
+}
+
+std::span<LambdaSnail::resp::incremental_parser::argument const> LambdaSnail::resp::incremental_parser::arguments() const noexcept
+{
+    return m_is_command ? std::span<argument const>(m_arguments) : std::span<argument const>{};
+}
+
+void LambdaSnail::resp::incremental_parser::reset() noexcept
+{
+    m_state            = state::header;
+    m_pending_elements = 1;
+    m_bulk_length      = 0;
+    m_cursor           = 0;
+    m_scan_offset      = 0;
+}
+
+bool LambdaSnail::resp::incremental_parser::parse_length(std::string_view const digits, int64_t& length) noexcept
+{
+    if (digits.empty()) [[unlikely]]
+    {
+        return false;
+    }
+
+    auto const [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), length);
+
+    // Only -1 is a valid negative length, it is used for null arrays and bulk strings
+    return ec == std::errc{} and end == digits.data() + digits.size() and length >= -1;
+}
@@ -1,12 +1,21 @@
 module;
 
+#include <bit>
 #include <cassert>
 #include <cmath>
 #include <cstdint>
+#include <memory_resource>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <tracy/Tracy.hpp>
 
 /**
@@ -49,7 +58,19 @@ namespace LambdaSnail::resp
         profile_constexpr data_view(data_type type, std::string_view message);
         profile_constexpr explicit data_view(std::string_view message);
 
+        /**
+         * A bulk string whose length has already been decoded, holding only the payload.
+         */
+        profile_constexpr data_view(BulkString, std::string_view payload);
+
         data_type type{};
+
+        /**
+         * Set for bulk strings that hold only their payload, which materialize returns without decoding
+         * the header again.
+         */
+        bool is_decoded{};
+
         std::string_view value{};
 
         [[nodiscard]] profile_constexpr bool is_null() const;
@@ -59,7 +80,12 @@ namespace LambdaSnail::resp
 
         [[nodiscard]] profile_constexpr std::string_view materialize(SimpleString) const;
         [[nodiscard]] profile_constexpr std::string_view materialize(BulkString) const;
-        [[nodiscard]] profile_constexpr std::vector<data_view> materialize(Array) const;
+
+        /**
+         * The elements of the array, allocated from the given resource so that commands can keep their
+         * arguments in a per-connection arena.
+         */
+        [[nodiscard]] std::pmr::vector<data_view> materialize(Array, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) const;
     };
 
     class parser
@@ -84,20 +110,75 @@ namespace LambdaSnail::resp
 
     export inline namespace literals
     {
-        constexpr std::string resp_end  = "\r\n";
-        constexpr std::string resp_null = "_\r\n";
+        constexpr std::string resp_end = "\r\n";
+    }
+
+    /**
+     * Returns the offset of the first CRLF at or after the offset, or npos if there is none. Compares 32 bytes
+     * at a time with AVX2 and 16 bytes at a time with SSE2, when the compiler targets them, and falls back to
+     * comparing byte by byte for the tail of the buffer and on other targets.
+     */
+    constexpr size_t find_crlf(std::string_view const buffer, size_t offset = 0) noexcept
+    {
+        if !consteval
+        {
+#if defined(__AVX2__)
+            auto const carriage_return = _mm256_set1_epi8('\r');
+            auto const line_feed       = _mm256_set1_epi8('\n');
+            for (; offset + 33 <= buffer.size(); offset += 32)
+            {
+                // The second load is shifted by one byte, so that a match in both marks the '\r' of a CRLF
+                auto const first  = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(buffer.data() + offset));
+                auto const second = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(buffer.data() + offset + 1));
+                auto const mask   = static_cast<uint32_t>(_mm256_movemask_epi8(
+                        _mm256_and_si256(_mm256_cmpeq_epi8(first, carriage_return), _mm256_cmpeq_epi8(second, line_feed))));
+                if (mask != 0)
+                {
+                    return offset + static_cast<size_t>(std::countr_zero(mask));
+                }
+            }
+#elif defined(__SSE2__)
+            auto const carriage_return = _mm_set1_epi8('\r');
+            auto const line_feed       = _mm_set1_epi8('\n');
+            for (; offset + 17 <= buffer.size(); offset += 16)
+            {
+                // The second load is shifted by one byte, so that a match in both marks the '\r' of a CRLF
+                auto const first  = _mm_loadu_si128(reinterpret_cast<__m128i const*>(buffer.data() + offset));
+                auto const second = _mm_loadu_si128(reinterpret_cast<__m128i const*>(buffer.data() + offset + 1));
+                auto const mask   = static_cast<uint32_t>(_mm_movemask_epi8(
+                        _mm_and_si128(_mm_cmpeq_epi8(first, carriage_return), _mm_cmpeq_epi8(second, line_feed))));
+                if (mask != 0)
+                {
+                    return offset + static_cast<size_t>(std::countr_zero(mask));
+                }
+            }
+#endif
+        }
 
-        constexpr std::string operator""_resp_error(char const* str, size_t const len)
+        for (; offset + 1 < buffer.size(); ++offset)
         {
-            return static_cast<char>(data_type::SimpleError) + std::string(str, len) + resp_end;
+            if (buffer[offset] == '\r' and buffer[offset + 1] == '\n')
+            {
+                return offset;
+            }
         }
 
-        constexpr std::string operator""_resp_simple_string(char const* str, size_t const len)
+        return std::string_view::npos;
+    }
+
+    /**
+     * Decodes the length in the header of an array or bulk string, with the cursor on the first digit. Leaves
+     * the cursor on the '\r' that ends the header.
+     */
+    constexpr size_t decode_length(std::string_view::iterator& cursor) noexcept
+    {
+        size_t length{ 0 };
+        for (; *cursor != '\r'; ++cursor)
         {
-            return static_cast<char>(data_type::SimpleString) + std::string(str, len) + resp_end;
+            length = (length * 10) + static_cast<size_t>(*cursor - '0');
         }
 
-        constexpr std::string resp_ok = "OK"_resp_simple_string;
+        return length;
     }
 }
 
@@ -110,6 +191,9 @@ profile_constexpr LambdaSnail::resp::data_view::data_view(std::string_view messa
 
 profile_constexpr LambdaSnail::resp::data_view::data_view(data_type type, std::string_view message) : type(type), value(message) { }
 
+profile_constexpr LambdaSnail::resp::data_view::data_view(BulkString, std::string_view payload) :
+    type(data_type::BulkString), is_decoded(true), value(payload) { }
+
 profile_constexpr bool LambdaSnail::resp::data_view::is_null() const
 {
     return type == data_type::Null;
@@ -232,6 +316,11 @@ profile_constexpr std::string_view LambdaSnail::resp::data_view::materialize(Bul
 {
     ZoneScoped;
 
+    if(is_decoded) [[likely]]
+    {
+        return value;
+    }
+
     assert(*value.begin() == static_cast<char>(data_type::BulkString));
 
     if(value.size() == 1)
@@ -240,13 +329,7 @@ profile_constexpr std::string_view LambdaSnail::resp::data_view::materialize(Bul
     }
 
     auto cursor = value.begin() + 1;
-    size_t length {0};
-
-    while(*cursor != '\r')
-    {
-        length = (length*10)+(*cursor - '0');
-        ++cursor;
-    }
+    size_t const length = decode_length(cursor);
 
     if(not length) [[unlikely]]
     {
@@ -263,31 +346,25 @@ profile_constexpr std::string_view LambdaSnail::resp::data_view::materialize(Bul
     return { cursor, end };
 }
 
-profile_constexpr std::vector<LambdaSnail::resp::data_view> LambdaSnail::resp::data_view::materialize(Array) const
+std::pmr::vector<LambdaSnail::resp::data_view> LambdaSnail::resp::data_view::materialize(Array, std::pmr::memory_resource* const resource) const
 {
     ZoneScoped;
 
     assert(*value.begin() == static_cast<char>(data_type::Array));
 
     auto cursor = value.begin() + 1;
-    size_t length {0};
-
-    while(*cursor != '\r')
-    {
-        length = (length*10)+(*cursor - '0');
-        ++cursor;
-    }
+    size_t const length = decode_length(cursor);
 
     if(not length) [[unlikely]]
     {
-        return {};
+        return std::pmr::vector<data_view>(resource);
     }
 
     ++cursor;
     ++cursor;
 
     parser constexpr p;
-    std::vector<data_view> values(length);
+    std::pmr::vector<data_view> values(length, resource);
     for(size_t i = 0; i < length; ++i)
     {
         std::string_view::iterator end;
@@ -339,13 +416,7 @@ profile_constexpr LambdaSnail::resp::data_view LambdaSnail::resp::parser::parse_
     }
 
     auto cursor = start + 1;
-    size_t length {0};
-
-    while(*cursor != '\r')
-    {
-        length = (length*10)+(*cursor - '0');
-        ++cursor;
-    }
+    size_t const length = decode_length(cursor);
 
     if(not length) [[unlikely]]
     {
@@ -379,25 +450,15 @@ profile_constexpr LambdaSnail::resp::data_view LambdaSnail::resp::parser::parse_
     }
 
     auto cursor = start + 1;
-    size_t length {0};
-
-    while(*cursor != '\r')
-    {
-        length = (length*10)+(*cursor - '0');
-        ++cursor;
-    }
-
-    if(not length) [[unlikely]]
-    {
-        return { data_type::BulkString, {} };
-    }
+    size_t const length = decode_length(cursor);
 
     ++cursor; // '\r'
     ++cursor; // '\n'
 
-    //start = cursor;
+    // The length is decoded once, materializing the bulk string returns the payload as is
+    auto const payload = cursor;
     std::ranges::advance(cursor, static_cast<std::iter_difference_t<std::string_view::iterator>>(length));
-    data_view const data { data_type::BulkString, std::string_view(start, cursor) };
+    data_view const data { BulkString{}, std::string_view(payload, cursor) };
 
     ++cursor;
     ++cursor;
@@ -424,15 +485,10 @@ profile_constexpr LambdaSnail::resp::data_view LambdaSnail::resp::parser::find_e
     }
 
     data_view data { static_cast<data_type>(*start), {} };
-    for(auto i = start+1; i < message.cend(); ++i)
+    if(auto const line_end = find_crlf(message, static_cast<size_t>(start - message.begin())); line_end != std::string_view::npos) [[likely]]
     {
-        if(*i == '\n' and *(i-1) == '\r') [[unlikely]]
-        {
-            end = i+1; // one past the ending
-            data.value = std::string_view(start, end);
-            //data.type = static_cast<data_type>(*start);
-            break;
-        }
+        end = message.begin() + static_cast<std::iter_difference_t<std::string_view>>(line_end + resp_end.size()); // one past the ending
+        data.value = std::string_view(start, end);
     }
 
     // TODO: Do we validate here or when creating the actual data?
@@ -1,3 +1,5 @@
 export module resp;
 
 export import :resp.parser;
+export import :resp.incremental_parser;
+export import :resp.response_writer;
\ No newline at end of file
@@ -0,0 +1,333 @@
+module;
+
+#include <charconv>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <tracy/Tracy.hpp>
+
+export module resp :resp.response_writer;
+
+import :resp.parser;
+
+namespace LambdaSnail::resp
+{
+    export enum class protocol_version : uint8_t
+    {
+        resp2 = 2,
+        resp3 = 3
+    };
+
+    /**
+     * Replies that are sent often enough to be worth encoding once, up front.
+     */
+    export namespace replies
+    {
+        constexpr std::string_view ok          = "+OK\r\n";
+        constexpr std::string_view pong        = "+PONG\r\n";
+        constexpr std::string_view zero        = ":0\r\n";
+        constexpr std::string_view one         = ":1\r\n";
+        constexpr std::string_view empty_array = "*0\r\n";
+        constexpr std::string_view null_resp2  = "$-1\r\n";
+        constexpr std::string_view null_resp3  = "_\r\n";
+    }
+
+    /**
+     * Keeps referenced data alive until the reply has been written to the socket. The pin holds a reference
+     * on an object along with the function that releases it, which lets objects with an intrusive reference
+     * count be pinned without allocating.
+     */
+    export class value_pin
+    {
+    public:
+        using release_t = void (*)(void const* object) noexcept;
+
+        value_pin() noexcept = default;
+        value_pin(void const* object, release_t release) noexcept;
+
+        /**
+         * Pins an object owned by a shared pointer, this allocates a copy of the pointer.
+         */
+        template<typename value_t>
+        value_pin(std::shared_ptr<value_t> pointer) :
+            value_pin(new std::shared_ptr<void const>(std::move(pointer)),
+                      [](void const* object) noexcept { delete static_cast<std::shared_ptr<void const> const*>(object); })
+        { }
+
+        value_pin(value_pin&& other) noexcept;
+        value_pin& operator=(value_pin&& other) noexcept;
+
+        value_pin(value_pin const&)            = delete;
+        value_pin& operator=(value_pin const&) = delete;
+
+        ~value_pin();
+
+    private:
+        void const* m_object{};
+        release_t m_release{};
+    };
+
+    export using value_pin_t = value_pin;
+
+    /**
+     * Serializes typed replies into a buffer owned by the connection. The buffer is cleared but not
+     * released between requests, so after warming up a connection can reply without allocating. All
+     * replies to a pipelined batch end up next to each other and can be sent in a single write.
+     *
+     * Large bulk strings can be referenced instead of copied. The reply is then made up of several
+     * segments that alternate between the encoded buffer and the referenced values, meant to be sent
+     * with a scatter-gather write.
+     */
+    export class response_writer
+    {
+    public:
+        explicit response_writer(protocol_version version = protocol_version::resp3) noexcept;
+
+        void simple_string(std::string_view value);
+        void integer(int64_t value);
+        void bulk_string(std::string_view value);
+
+        /**
+         * Writes a bulk string, referencing the value rather than copying it if it is large enough for
+         * that to pay off. The pin is held until the writer is cleared.
+         */
+        void bulk_string(std::string_view value, value_pin_t pin);
+
+        /**
+         * Writes a bulk string that references the value whatever its size, for values that are filled in after the
+         * reply has been written, but before it is sent.
+         */
+        void deferred_bulk_string(std::string_view value, value_pin_t pin);
+
+        void array_header(size_t num_elements);
+        void null();
+
+        /**
+         * Writes a simple error, the parts are concatenated to form the message.
+         */
+        template<typename... parts_t>
+        void error(parts_t const&... parts)
+        {
+            m_buffer.push_back(static_cast<char>(data_type::SimpleError));
+            (m_buffer.append(std::string_view(parts)), ...);
+            m_buffer.append(resp_end);
+        }
+
+        /**
+         * Appends an already encoded reply, such as the ones in the replies namespace.
+         */
+        void raw(std::string_view encoded);
+
+        /**
+         * The encoded buffer, this does not include any referenced values.
+         */
+        [[nodiscard]] std::string_view view() const noexcept;
+
+        /**
+         * The full reply in the order it should be sent, including referenced values. The segments stay
+         * valid until the writer is modified.
+         */
+        [[nodiscard]] std::span<std::string_view const> segments();
+
+        [[nodiscard]] bool empty() const noexcept;
+
+        /**
+         * Discards the written replies and releases the pinned values. The capacity is kept unless a
+         * large reply made the buffer grow beyond what is reasonable to keep around for every connection.
+         */
+        void clear() noexcept;
+
+        [[nodiscard]] protocol_version protocol() const noexcept;
+        void set_protocol(protocol_version version) noexcept;
+
+        static constexpr size_t max_retained_capacity = 64 * 1024;
+
+        /**
+         * Below this size copying the value is cheaper than an extra segment in the write.
+         */
+        static constexpr size_t min_reference_size = 512;
+
+    private:
+        void length_header(data_type type, int64_t length);
+
+        struct reference
+        {
+            /**
+             * Position in the encoded buffer where the referenced value is inserted.
+             */
+            size_t offset{};
+            std::string_view value{};
+        };
+
+        std::string m_buffer{};
+        std::vector<reference> m_references{};
+        std::vector<value_pin_t> m_pins{};
+        std::vector<std::string_view> m_segments{};
+        protocol_version m_protocol;
+    };
+}
+
+LambdaSnail::resp::value_pin::value_pin(void const* const object, release_t const release) noexcept :
+    m_object(object), m_release(release)
+{ }
+
+LambdaSnail::resp::value_pin::value_pin(value_pin&& other) noexcept :
+    m_object(std::exchange(other.m_object, nullptr)), m_release(std::exchange(other.m_release, nullptr))
+{ }
+
+LambdaSnail::resp::value_pin& LambdaSnail::resp::value_pin::operator=(value_pin&& other) noexcept
+{
+    if (this != &other)
+    {
+        if (m_release)
+        {
+            m_release(m_object);
+        }
+
+        m_object  = std::exchange(other.m_object, nullptr);
+        m_release = std::exchange(other.m_release, nullptr);
+    }
+
+    return *this;
+}
+
+LambdaSnail::resp::value_pin::~value_pin()
+{
+    if (m_release)
+    {
+        m_release(m_object);
+    }
+}
+
+LambdaSnail::resp::response_writer::response_writer(protocol_version const version) noexcept : m_protocol(version) { }
+
+void LambdaSnail::resp::response_writer::simple_string(std::string_view const value)
+{
+    m_buffer.push_back(static_cast<char>(data_type::SimpleString));
+    m_buffer.append(value);
+    m_buffer.append(resp_end);
+}
+
+void LambdaSnail::resp::response_writer::integer(int64_t const value)
+{
+    length_header(data_type::Integer, value);
+}
+
+void LambdaSnail::resp::response_writer::bulk_string(std::string_view const value)
+{
+    ZoneScoped;
+
+    length_header(data_type::BulkString, static_cast<int64_t>(value.size()));
+    m_buffer.append(value);
+    m_buffer.append(resp_end);
+}
+
+void LambdaSnail::resp::response_writer::bulk_string(std::string_view const value, value_pin_t pin)
+{
+    if (value.size() < min_reference_size)
+    {
+        bulk_string(value);
+        return;
+    }
+
+    deferred_bulk_string(value, std::move(pin));
+}
+
+void LambdaSnail::resp::response_writer::deferred_bulk_string(std::string_view const value, value_pin_t pin)
+{
+    length_header(data_type::BulkString, static_cast<int64_t>(value.size()));
+    m_references.push_back({ m_buffer.size(), value });
+    m_pins.emplace_back(std::move(pin));
+    m_buffer.append(resp_end);
+}
+
+void LambdaSnail::resp::response_writer::array_header(size_t const num_elements)
+{
+    length_header(data_type::Array, static_cast<int64_t>(num_elements));
+}
+
+void LambdaSnail::resp::response_writer::null()
+{
+    m_buffer.append(m_protocol == protocol_version::resp3 ? replies::null_resp3 : replies::null_resp2);
+}
+
+void LambdaSnail::resp::response_writer::raw(std::string_view const encoded)
+{
+    m_buffer.append(encoded);
+}
+
+std::string_view LambdaSnail::resp::response_writer::view() const noexcept
+{
+    return m_buffer;
+}
+
+std::span<std::string_view const> LambdaSnail::resp::response_writer::segments()
+{
+    std::string_view const buffer = m_buffer;
+
+    m_segments.clear();
+
+    size_t start = 0;
+    for (auto const& [offset, value] : m_references)
+    {
+        if (offset > start)
+        {
+            m_segments.emplace_back(buffer.substr(start, offset - start));
+        }
+
+        m_segments.emplace_back(value);
+        start = offset;
+    }
+
+    if (start < buffer.size())
+    {
+        m_segments.emplace_back(buffer.substr(start));
+    }
+
+    return m_segments;
+}
+
+bool LambdaSnail::resp::response_writer::empty() const noexcept
+{
+    return m_buffer.empty();
+}
+
+void LambdaSnail::resp::response_writer::clear() noexcept
+{
+    m_buffer.clear();
+    m_references.clear();
+    m_pins.clear();
+    m_segments.clear();
+    if (m_buffer.capacity() > max_retained_capacity) [[unlikely]]
+    {
+        m_buffer.shrink_to_fit();
+    }
+}
+
+LambdaSnail::resp::protocol_version LambdaSnail::resp::response_writer::protocol() const noexcept
+{
+    return m_protocol;
+}
+
+void LambdaSnail::resp::response_writer::set_protocol(protocol_version const version) noexcept
+{
+    m_protocol = version;
+}
+
+void LambdaSnail::resp::response_writer::length_header(data_type const type, int64_t const length)
+{
+    // Type marker, sign, 19 digits and the line ending
+    char header[24];
+    header[0] = static_cast<char>(type);
+
+    auto* const end = std::to_chars(header + 1, header + sizeof(header) - 2, length).ptr;
+    end[0] = '\r';
+    end[1] = '\n';
+
+    m_buffer.append(header, end + 2);
+}
@@ -0,0 +1,871 @@
+module;
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <expected>
+#include <filesystem>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <tracy/Tracy.hpp>
+
+module server;
+
+namespace
+{
+    std::atomic<uint64_t> s_next_log_id{ 1 };
+
+    template<typename output_t>
+    void append_length(output_t& out, char const prefix, size_t const length)
+    {
+        std::array<char, 24> buffer{};
+        buffer[0]               = prefix;
+        auto const [end, error] = std::to_chars(buffer.data() + 1, buffer.data() + buffer.size(), length);
+        out.append(std::string_view(buffer.data(), end));
+        out.append(std::string_view("\r\n"));
+    }
+
+    /**
+     * Encodes the command as an array of bulk strings, the way clients send it, to a string or an append_log_writer.
+     */
+    template<typename output_t>
+    void encode_command(output_t& out, std::span<std::string_view const> const arguments)
+    {
+        append_length(out, '*', arguments.size());
+        for (auto const argument : arguments)
+        {
+            append_length(out, '$', argument.size());
+            out.append(argument);
+            out.append(std::string_view("\r\n"));
+        }
+    }
+
+    void encode_select(std::string& out, size_t const database)
+    {
+        std::array<char, 20> index{};
+        auto const [end, error] = std::to_chars(index.data(), index.data() + index.size(), database);
+        std::array<std::string_view, 2> const arguments{ "SELECT", std::string_view(index.data(), end) };
+        encode_command(out, arguments);
+    }
+
+    std::string error_message(int const error_number)
+    {
+        return std::error_code(error_number, std::generic_category()).message();
+    }
+}
+
+namespace LambdaSnail::server
+{
+    append_log_writer::append_log_writer(std::filesystem::path const& path) : m_buffer(buffer_size)
+    {
+        m_file = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (m_file < 0)
+        {
+            m_error = std::error_code(errno, std::generic_category());
+        }
+    }
+
+    append_log_writer::~append_log_writer()
+    {
+        if (m_file >= 0)
+        {
+            ::close(m_file);
+        }
+    }
+
+    void append_log_writer::write_command(std::span<std::string_view const> const arguments)
+    {
+        encode_command(*this, arguments);
+    }
+
+    void append_log_writer::write_command(std::span<std::string_view const> const arguments, size_t const cold_argument, entry const& cold)
+    {
+        append_length(*this, '*', arguments.size());
+        for (size_t i = 0; i < arguments.size(); ++i)
+        {
+            if (i != cold_argument)
+            {
+                append_length(*this, '$', arguments[i].size());
+                append(arguments[i]);
+            }
+            else
+            {
+                append_length(*this, '$', cold.value_size());
+                auto const is_read = entry::cold_file().read_chunks(cold.cold_offset(), cold.value_size(),
+                                                                    [this](std::string_view const chunk) { append(chunk); });
+                if (not is_read and not m_error)
+                {
+                    m_error = std::make_error_code(std::errc::io_error);
+                }
+            }
+
+            append(std::string_view("\r\n"));
+        }
+    }
+
+    std::expected<void, std::error_code> append_log_writer::finish()
+    {
+        flush();
+
+        if (not m_error and ::fsync(m_file) != 0)
+        {
+            m_error = std::error_code(errno, std::generic_category());
+        }
+
+        if (m_error)
+        {
+            return std::unexpected(m_error);
+        }
+
+        return {};
+    }
+
+    void append_log_writer::append(std::string_view data)
+    {
+        while (not data.empty() and not m_error)
+        {
+            auto const num_bytes = std::min(data.size(), m_buffer.size() - m_buffered);
+            std::memcpy(m_buffer.data() + m_buffered, data.data(), num_bytes);
+            m_buffered += num_bytes;
+            data.remove_prefix(num_bytes);
+
+            if (m_buffered == m_buffer.size())
+            {
+                flush();
+            }
+        }
+    }
+
+    void append_log_writer::flush()
+    {
+        size_t offset = 0;
+        while (offset < m_buffered and not m_error)
+        {
+            auto const written = ::write(m_file, m_buffer.data() + offset, m_buffered - offset);
+            if (written < 0)
+            {
+                if (errno != EINTR)
+                {
+                    m_error = std::error_code(errno, std::generic_category());
+                }
+
+                continue;
+            }
+
+            offset += static_cast<size_t>(written);
+        }
+
+        m_buffered = 0;
+    }
+
+    append_log::append_log(std::filesystem::path path, fsync_policy const policy, std::shared_ptr<LambdaSnail::logging::logger> logger) :
+        m_path(std::move(path)), m_policy(policy), m_logger(std::move(logger)), m_id(s_next_log_id.fetch_add(1, std::memory_order_relaxed))
+    {
+    }
+
+    append_log::~append_log()
+    {
+        stop();
+
+        if (m_file >= 0)
+        {
+            ::close(m_file);
+        }
+    }
+
+    std::expected<replay_result, std::string> append_log::replay(server& server) const
+    {
+        ZoneScoped;
+
+        auto const file = ::open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file < 0)
+        {
+            return std::unexpected(error_message(errno));
+        }
+
+        struct stat status{};
+        if (::fstat(file, &status) != 0)
+        {
+            auto const error = errno;
+            ::close(file);
+            return std::unexpected(error_message(error));
+        }
+
+        auto const size = static_cast<size_t>(status.st_size);
+        if (size == 0)
+        {
+            ::close(file);
+            return replay_result{};
+        }
+
+        auto* const mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+        ::close(file);
+        if (mapping == MAP_FAILED)
+        {
+            return std::unexpected(error_message(errno));
+        }
+
+        auto const unmap = [size](void* const address) { ::munmap(address, size); };
+        std::unique_ptr<void, decltype(unmap)> mapped(mapping, unmap);
+        ::madvise(mapping, size, MADV_SEQUENTIAL);
+
+        std::string_view const contents(static_cast<char const*>(mapping), size);
+
+        struct command_frame
+        {
+            size_t offset{};
+            size_t length{};
+        };
+
+        // The commands are split up by database first, so that the databases can be replayed in parallel. Databases
+        // are only ever changed by the commands logged for them.
+        std::vector<std::vector<command_frame>> frames(static_cast<size_t>(std::distance(server.begin(), server.end())));
+
+        resp::incremental_parser parser;
+        size_t database = 0;
+        size_t offset   = 0;
+        while (offset < contents.size())
+        {
+            auto const result = parser.parse(contents.substr(offset));
+            if (result.status == resp::incremental_parser::parse_status::incomplete)
+            {
+                break;
+            }
+
+            if (result.status == resp::incremental_parser::parse_status::error or parser.arguments().empty()) [[unlikely]]
+            {
+                return std::unexpected("Invalid command at offset " + std::to_string(offset));
+            }
+
+            auto const message   = contents.substr(offset, result.length);
+            auto const arguments = parser.arguments();
+            if (message.substr(arguments[0].offset, arguments[0].length) == "SELECT")
+            {
+                auto const index = arguments.size() == 2 ? message.substr(arguments[1].offset, arguments[1].length) : std::string_view{};
+                auto const [end, error] = std::from_chars(index.data(), index.data() + index.size(), database);
+                if (error != std::errc{} or end != index.data() + index.size() or database >= frames.size())
+                {
+                    return std::unexpected("The database selected at offset " + std::to_string(offset) + " does not exist");
+                }
+            }
+            else
+            {
+                frames[database].push_back(command_frame{ .offset = offset, .length = result.length });
+            }
+
+            offset += result.length;
+        }
+
+        std::vector<std::string> errors(frames.size());
+        {
+            std::vector<std::jthread> threads;
+            for (size_t i = 0; i < frames.size(); ++i)
+            {
+                if (frames[i].empty())
+                {
+                    continue;
+                }
+
+                threads.emplace_back([&server, &frames, &errors, contents, i] {
+                    ZoneScopedN("replay database");
+
+                    command_dispatch dispatch(server);
+                    dispatch.set_loading(true);
+                    if (not dispatch.handle_set_database(i)) [[unlikely]]
+                    {
+                        return;
+                    }
+
+                    resp::incremental_parser command_parser;
+                    resp::response_writer out;
+                    for (auto const& frame : frames[i])
+                    {
+                        auto const message = contents.substr(frame.offset, frame.length);
+                        if (command_parser.parse(message).status != resp::incremental_parser::parse_status::complete) [[unlikely]]
+                        {
+                            errors[i] = "Invalid command at offset " + std::to_string(frame.offset);
+                            return;
+                        }
+
+                        dispatch.process_command(message, command_parser.arguments(), out);
+                        if (out.view().starts_with('-')) [[unlikely]]
+                        {
+                            auto const reply = out.view().substr(1, out.view().find("\r\n") - 1);
+                            errors[i]        = "The command at offset " + std::to_string(frame.offset) + " failed: " + std::string(reply);
+                            return;
+                        }
+
+                        out.clear();
+                    }
+                });
+            }
+        }
+
+        for (auto const& error : errors)
+        {
+            if (not error.empty())
+            {
+                return std::unexpected(error);
+            }
+        }
+
+        replay_result result{ .truncated_bytes = contents.size() - offset };
+        for (auto const& database_frames : frames)
+        {
+            result.commands += database_frames.size();
+        }
+
+        if (result.truncated_bytes > 0)
+        {
+            // A crash while writing leaves an incomplete command behind, which new commands must not be appended to
+            mapped.reset();
+
+            std::error_code error;
+            std::filesystem::resize_file(m_path, offset, error);
+            if (error)
+            {
+                return std::unexpected("Unable to cut off the incomplete command at the end: " + error.message());
+            }
+        }
+
+        return result;
+    }
+
+    std::expected<void, std::string> append_log::start()
+    {
+        m_file = ::open(m_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (m_file < 0)
+        {
+            return std::unexpected(error_message(errno));
+        }
+
+        struct stat status{};
+        if (::fstat(m_file, &status) == 0)
+        {
+            m_file_size.store(static_cast<uint64_t>(status.st_size), std::memory_order_relaxed);
+            m_base_size.store(static_cast<uint64_t>(status.st_size), std::memory_order_relaxed);
+        }
+
+        m_last_sync = std::chrono::steady_clock::now();
+        m_thread    = std::jthread([this](std::stop_token const& stop_token) { run(stop_token); });
+        return {};
+    }
+
+    void append_log::stop()
+    {
+        m_thread.request_stop();
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+    }
+
+    void append_log::append(size_t const database, std::span<std::string_view const> const arguments)
+    {
+        ZoneScoped;
+
+        auto& buffer = local_buffer();
+        {
+            auto lock = std::lock_guard{buffer.mutex};
+
+            auto const offset = buffer.data.size();
+            encode_command(buffer.data, arguments);
+            buffer.records.reserve(buffer.records.size() + 1);
+
+            // The record is numbered once nothing can fail anymore, since the flusher waits for every number to show up
+            auto const sequence = m_next_sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+            buffer.records.push_back(record{ .sequence = sequence, .database = database, .offset = offset, .length = buffer.data.size() - offset });
+            buffer.last_sequence = sequence;
+        }
+
+        wake_flusher();
+    }
+
+    void append_log::wake_flusher()
+    {
+        if (not m_has_pending.exchange(true, std::memory_order_acq_rel))
+        {
+            // Taking the lock makes sure that the flusher has either seen the flag or is waiting to be notified
+            {
+                auto lock = std::lock_guard{m_mutex};
+            }
+
+            m_condition.notify_one();
+        }
+    }
+
+    uint64_t append_log::thread_sequence() const noexcept
+    {
+        auto const& cache = thread_cache();
+        return cache.log_id == m_id ? cache.buffer->last_sequence : 0;
+    }
+
+    bool append_log::is_durable(uint64_t const sequence) const noexcept
+    {
+        return sequence <= m_durable_sequence.load(std::memory_order_acquire);
+    }
+
+    void append_log::when_durable(uint64_t const sequence, std::function<void(bool)> on_done)
+    {
+        {
+            // The flusher marks the log as failed before it fails the waiters, so a waiter added later is not missed
+            auto lock = std::lock_guard{m_waiters_mutex};
+            if (not is_durable(sequence) and not has_failed())
+            {
+                m_waiters.push_back(waiter{ .sequence = sequence, .on_done = std::move(on_done) });
+                return;
+            }
+        }
+
+        on_done(is_durable(sequence));
+    }
+
+    bool append_log::has_failed() const noexcept
+    {
+        return m_failed.load(std::memory_order_relaxed);
+    }
+
+    fsync_policy append_log::get_fsync_policy() const noexcept
+    {
+        return m_policy;
+    }
+
+    std::filesystem::path const& append_log::get_path() const noexcept
+    {
+        return m_path;
+    }
+
+    void append_log::set_rewrite_trigger(uint32_t const growth_percentage, uint64_t const min_size)
+    {
+        m_rewrite_growth   = growth_percentage;
+        m_rewrite_min_size = min_size;
+    }
+
+    bool append_log::needs_rewrite() const noexcept
+    {
+        if (m_rewrite_growth == 0 or is_rewriting())
+        {
+            return false;
+        }
+
+        // A rewrite that keeps failing, for example because forking fails, is not retried on every cycle
+        if (auto const failures = m_rewrite_failures.load(std::memory_order_relaxed); failures > 0)
+        {
+            auto const delay        = std::min(rewrite_retry_delay * (int64_t{ 1 } << std::min(failures - 1, 16u)), max_rewrite_retry_delay);
+            auto const last_failure = std::chrono::steady_clock::time_point(
+                    std::chrono::steady_clock::duration(m_last_rewrite_failure.load(std::memory_order_relaxed)));
+            if (std::chrono::steady_clock::now() < last_failure + delay)
+            {
+                return false;
+            }
+        }
+
+        auto const size = m_file_size.load(std::memory_order_relaxed);
+        auto const base = std::max(m_base_size.load(std::memory_order_relaxed), uint64_t{ 1 });
+        return size >= m_rewrite_min_size and size > base and (size - base) * 100 / base >= m_rewrite_growth;
+    }
+
+    bool append_log::is_rewriting() const noexcept
+    {
+        return m_rewrite_sequence.load(std::memory_order_relaxed) != no_rewrite;
+    }
+
+    bool append_log::begin_rewrite()
+    {
+        auto lock = std::lock_guard{m_rewrite_mutex};
+        if (m_rewrite_sequence.load(std::memory_order_relaxed) != no_rewrite)
+        {
+            return false;
+        }
+
+        // Records are appended under the lock of a shard, so with every shard locked the numbers handed out so far
+        // are exactly the records that the forked child sees the effects of
+        m_rewrite_buffer.clear();
+        m_rewrite_selected_database = std::numeric_limits<size_t>::max();
+        m_rewrite_sequence.store(m_next_sequence.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return true;
+    }
+
+    void append_log::finish_rewrite(std::filesystem::path rewritten_path)
+    {
+        {
+            auto lock        = std::lock_guard{m_rewrite_mutex};
+            m_rewritten_path = std::move(rewritten_path);
+        }
+
+        wake_flusher();
+    }
+
+    void append_log::abort_rewrite()
+    {
+        auto lock = std::lock_guard{m_rewrite_mutex};
+        m_rewrite_sequence.store(no_rewrite, std::memory_order_relaxed);
+        m_rewritten_path.reset();
+        std::string().swap(m_rewrite_buffer);
+    }
+
+    void append_log::record_rewrite_failure() noexcept
+    {
+        m_last_rewrite_failure.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        m_rewrite_failures.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint32_t append_log::get_rewrite_failures() const noexcept
+    {
+        return m_rewrite_failures.load(std::memory_order_relaxed);
+    }
+
+    uint64_t append_log::get_file_size() const noexcept
+    {
+        return m_file_size.load(std::memory_order_relaxed);
+    }
+
+    append_log::cached_buffer& append_log::thread_cache() noexcept
+    {
+        thread_local cached_buffer cache{};
+        return cache;
+    }
+
+    append_log::thread_buffer& append_log::local_buffer()
+    {
+        auto& cache = thread_cache();
+        if (cache.log_id != m_id) [[unlikely]]
+        {
+            auto lock    = std::lock_guard{m_buffers_mutex};
+            cache.buffer = m_buffers.emplace_back(std::make_unique<thread_buffer>()).get();
+            cache.log_id = m_id;
+        }
+
+        return *cache.buffer;
+    }
+
+    void append_log::run(std::stop_token const& stop_token)
+    {
+        while (not stop_token.stop_requested())
+        {
+            {
+                auto lock = std::unique_lock{m_mutex};
+                m_condition.wait_for(lock, stop_token, fsync_interval, [this] { return m_has_pending.load(std::memory_order_acquire); });
+            }
+
+            // Cleared before the buffers are taken over, so that records appended in the meantime start another round
+            m_has_pending.store(false, std::memory_order_release);
+            flush();
+        }
+
+        // Whatever was appended before the log was stopped is still written
+        flush();
+        sync(true);
+    }
+
+    void append_log::flush()
+    {
+        ZoneScoped;
+
+        struct pending_record
+        {
+            uint64_t sequence{};
+            size_t database{};
+            std::string_view data{};
+        };
+
+        std::vector<pending_record> pending;
+        for (auto const& held : m_held_records)
+        {
+            pending.push_back(pending_record{ held.sequence, held.database, std::string_view(m_held_data).substr(held.offset, held.length) });
+        }
+
+        {
+            auto lock = std::lock_guard{m_buffers_mutex};
+            for (auto const& buffer : m_buffers)
+            {
+                {
+                    auto buffer_lock = std::lock_guard{buffer->mutex};
+                    std::swap(buffer->data, buffer->flushing_data);
+                    std::swap(buffer->records, buffer->flushing_records);
+                }
+
+                for (auto const& taken : buffer->flushing_records)
+                {
+                    pending.push_back(pending_record{ taken.sequence, taken.database, std::string_view(buffer->flushing_data).substr(taken.offset, taken.length) });
+                }
+            }
+        }
+
+        std::ranges::sort(pending, {}, &pending_record::sequence);
+
+        size_t num_written = 0;
+        {
+            // Records that the rewritten file does not contain are also collected while a rewrite is in progress
+            auto rewrite_lock           = std::lock_guard{m_rewrite_mutex};
+            auto const rewrite_sequence = m_rewrite_sequence.load(std::memory_order_relaxed);
+
+            for (; num_written < pending.size() and pending[num_written].sequence == m_written_sequence + 1; ++num_written)
+            {
+                auto const& next = pending[num_written];
+                if (next.database != m_selected_database)
+                {
+                    encode_select(m_output, next.database);
+                    m_selected_database = next.database;
+                }
+
+                m_output.append(next.data);
+                m_written_sequence = next.sequence;
+
+                if (next.sequence > rewrite_sequence)
+                {
+                    if (next.database != m_rewrite_selected_database)
+                    {
+                        encode_select(m_rewrite_buffer, next.database);
+                        m_rewrite_selected_database = next.database;
+                    }
+
+                    m_rewrite_buffer.append(next.data);
+                }
+            }
+        }
+
+        // Records behind a gap are kept until the records before them have been appended
+        std::string held_data;
+        std::vector<record> held_records;
+        for (auto const& next : std::span(pending).subspan(num_written))
+        {
+            held_records.push_back(record{ .sequence = next.sequence, .database = next.database, .offset = held_data.size(), .length = next.data.size() });
+            held_data.append(next.data);
+        }
+
+        m_held_data.swap(held_data);
+        m_held_records.swap(held_records);
+
+        {
+            auto lock = std::lock_guard{m_buffers_mutex};
+            for (auto const& buffer : m_buffers)
+            {
+                buffer->flushing_data.clear();
+                buffer->flushing_records.clear();
+            }
+        }
+
+        // Output that could not be written is kept and written along with the next round
+        size_t offset = 0;
+        while (offset < m_output.size())
+        {
+            auto const written = ::write(m_file, m_output.data() + offset, m_output.size() - offset);
+            if (written < 0 and errno == EINTR)
+            {
+                continue;
+            }
+
+            if (written < 0)
+            {
+                report_error("write", errno);
+                break;
+            }
+
+            offset += static_cast<size_t>(written);
+            m_needs_sync = true;
+        }
+
+        m_file_size.fetch_add(offset, std::memory_order_relaxed);
+        m_output.erase(0, offset);
+        if (not m_output.empty() or not sync())
+        {
+            // The log has been marked as failed, which refuses further writes until a round succeeds
+            fail_waiters();
+            return;
+        }
+
+        if (m_failed.exchange(false, std::memory_order_relaxed)) [[unlikely]]
+        {
+            m_logger->get_system_logger()->info("Writing to the append-only file {} has recovered", m_path.string());
+        }
+
+        m_durable_sequence.store(m_written_sequence, std::memory_order_release);
+        notify_waiters();
+
+        // The switch happens once everything collected so far is also in the current file
+        std::optional<std::filesystem::path> rewritten_path;
+        std::string collected;
+        {
+            auto rewrite_lock = std::lock_guard{m_rewrite_mutex};
+            if (m_rewritten_path)
+            {
+                rewritten_path = std::exchange(m_rewritten_path, std::nullopt);
+                collected.swap(m_rewrite_buffer);
+                m_rewrite_sequence.store(no_rewrite, std::memory_order_relaxed);
+            }
+        }
+
+        if (not rewritten_path)
+        {
+            return;
+        }
+
+        auto const size = switch_to_rewritten(*rewritten_path, collected);
+        if (not size)
+        {
+            m_logger->get_system_logger()->error("Unable to switch to the rewritten append-only file: {}", size.error());
+            record_rewrite_failure();
+
+            std::error_code error;
+            std::filesystem::remove(*rewritten_path, error);
+            return;
+        }
+
+        m_file_size.store(*size, std::memory_order_relaxed);
+        m_base_size.store(*size, std::memory_order_relaxed);
+        m_rewrite_failures.store(0, std::memory_order_relaxed);
+        m_logger->get_system_logger()->info("Switched to the rewritten append-only file, {} bytes", *size);
+    }
+
+    std::expected<uint64_t, std::string> append_log::switch_to_rewritten(std::filesystem::path const& rewritten_path, std::string_view collected)
+    {
+        ZoneScoped;
+
+        auto const file = ::open(rewritten_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (file < 0)
+        {
+            return std::unexpected(error_message(errno));
+        }
+
+        auto const fail = [file](int const error_number) {
+            ::close(file);
+            return std::unexpected(error_message(error_number));
+        };
+
+        while (not collected.empty())
+        {
+            auto const written = ::write(file, collected.data(), collected.size());
+            if (written < 0 and errno == EINTR)
+            {
+                continue;
+            }
+
+            if (written < 0)
+            {
+                return fail(errno);
+            }
+
+            collected.remove_prefix(static_cast<size_t>(written));
+        }
+
+        struct stat status{};
+        if (::fdatasync(file) != 0 or ::fstat(file, &status) != 0)
+        {
+            return fail(errno);
+        }
+
+        // Replaces the log in one step, a crash leaves either the old or the rewritten file behind
+        if (::rename(rewritten_path.c_str(), m_path.c_str()) != 0)
+        {
+            return fail(errno);
+        }
+
+        // Makes the rename itself durable
+        auto const directory_path = m_path.has_parent_path() ? m_path.parent_path() : std::filesystem::path(".");
+        if (auto const directory = ::open(directory_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC); directory >= 0)
+        {
+            ::fsync(directory);
+            ::close(directory);
+        }
+
+        ::close(m_file);
+        m_file = file;
+
+        // The rewritten file ends with whichever database was written last
+        m_selected_database = std::numeric_limits<size_t>::max();
+        m_needs_sync        = false;
+        m_last_sync         = std::chrono::steady_clock::now();
+
+        return static_cast<uint64_t>(status.st_size);
+    }
+
+    bool append_log::sync(bool const force)
+    {
+        if (not m_needs_sync)
+        {
+            return true;
+        }
+
+        auto const now = std::chrono::steady_clock::now();
+        auto const due = force or m_policy == fsync_policy::always or (m_policy == fsync_policy::everysec and now - m_last_sync >= fsync_interval);
+        if (not due)
+        {
+            return true;
+        }
+
+        ZoneScopedN("fsync");
+        if (::fdatasync(m_file) != 0)
+        {
+            report_error("sync", errno);
+            return false;
+        }
+
+        m_needs_sync = false;
+        m_last_sync  = now;
+        return true;
+    }
+
+    void append_log::notify_waiters()
+    {
+        std::vector<waiter> ready;
+        {
+            // The durable sequence is read under the lock, so that no waiter added after it was raised is missed
+            auto lock          = std::lock_guard{m_waiters_mutex};
+            auto const durable = m_durable_sequence.load(std::memory_order_acquire);
+            auto const waiting = std::ranges::partition(m_waiters, [durable](waiter const& waiter) { return waiter.sequence > durable; });
+            ready.assign(std::make_move_iterator(waiting.begin()), std::make_move_iterator(waiting.end()));
+            m_waiters.erase(waiting.begin(), waiting.end());
+        }
+
+        for (auto& waiter : ready)
+        {
+            waiter.on_done(true);
+        }
+    }
+
+    void append_log::fail_waiters()
+    {
+        std::vector<waiter> failed;
+        {
+            auto lock = std::lock_guard{m_waiters_mutex};
+            failed.swap(m_waiters);
+        }
+
+        for (auto& waiter : failed)
+        {
+            waiter.on_done(false);
+        }
+    }
+
+    void append_log::report_error(std::string_view const operation, int const error_number)
+    {
+        if (not m_failed.exchange(true, std::memory_order_relaxed))
+        {
+            m_logger->get_system_logger()->error("Unable to {} the append-only file {}: {}, writes are refused until it succeeds", operation,
+                                                 m_path.string(), error_message(error_number));
+        }
+    }
+}
@@ -0,0 +1,306 @@
+module;
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <tracy/Tracy.hpp>
+
+export module server :server.cold_storage;
+
+namespace LambdaSnail::server
+{
+    export struct cold_storage_statistics
+    {
+        uint64_t num_values{};
+        uint64_t stored_bytes{};
+
+        /**
+         * The logical size of the file. Released values are punched out of it, so it takes up about stored_bytes
+         * on disk.
+         */
+        uint64_t file_size{};
+        uint64_t reads{};
+    };
+
+    /**
+     * The file of the cold tier, to which values that have not been used for a while are moved. Values are appended
+     * and never moved or overwritten, an entry that refers to a value keeps its offset and length, see
+     * entry_encoding::cold. When the last entry that refers to a value is released, its space is given back to the
+     * file system by punching a hole in the file. Releases only queue the value, the maintenance thread punches the
+     * queued values in batches, so that the system calls are not made by clients or under the lock of a shard.
+     *
+     * The file only holds values of entries in memory, snapshots and the append-only file hold copies of the values,
+     * so it starts out empty every time the server starts.
+     */
+    export class cold_storage
+    {
+    public:
+        /**
+         * The size of the chunks that read_chunks reads at a time, from a buffer on the stack.
+         */
+        static constexpr size_t chunk_size = 64 * 1024;
+
+        cold_storage() = default;
+        ~cold_storage();
+
+        cold_storage(cold_storage const&)            = delete;
+        cold_storage& operator=(cold_storage const&) = delete;
+
+        /**
+         * Creates or truncates the file. Called before any value is moved to it.
+         */
+        [[nodiscard]] std::expected<void, std::string> open(std::filesystem::path const& path);
+        [[nodiscard]] bool is_open() const noexcept;
+
+        /**
+         * Appends the value and returns its offset, or nothing if writing failed.
+         */
+        [[nodiscard]] std::optional<uint64_t> append(std::string_view value);
+
+        /**
+         * Reads a value into the buffer, which has the size of the value.
+         */
+        [[nodiscard]] bool read(uint64_t offset, std::span<char> value) const;
+
+        /**
+         * Reads a value in chunks and passes them to the function, for writers that must not allocate.
+         */
+        template<typename function_t>
+        [[nodiscard]] bool read_chunks(uint64_t offset, size_t length, function_t&& function) const;
+
+        /**
+         * Queues the space of a value that is no longer referred to, to be given back to the file system by
+         * punch_released.
+         */
+        void release(uint64_t offset, size_t length);
+
+        /**
+         * Punches the queued values out of the file, merging neighbouring values into one hole. Returns the number
+         * of values, none while releases are held.
+         */
+        size_t punch_released();
+
+        /**
+         * While releases are held, because a forked child may still read the values, punch_released keeps them queued.
+         */
+        void hold_releases();
+        void resume_releases();
+
+        [[nodiscard]] cold_storage_statistics get_statistics() const noexcept;
+
+    private:
+        void punch_hole(uint64_t offset, size_t length) const noexcept;
+
+        int m_file{ -1 };
+        std::atomic<uint64_t> m_end{};
+        std::atomic<uint64_t> m_num_values{};
+        std::atomic<uint64_t> m_stored_bytes{};
+        mutable std::atomic<uint64_t> m_reads{};
+
+        std::mutex m_released_mutex{};
+        uint32_t m_hold_count{};
+        std::vector<std::pair<uint64_t, size_t>> m_released{};
+    };
+
+    template<typename function_t>
+    bool cold_storage::read_chunks(uint64_t offset, size_t length, function_t&& function) const
+    {
+        std::array<char, chunk_size> buffer;
+        while (length > 0)
+        {
+            auto const num_bytes = std::min(length, buffer.size());
+            if (not read(offset, std::span(buffer.data(), num_bytes)))
+            {
+                return false;
+            }
+
+            function(std::string_view(buffer.data(), num_bytes));
+            offset += num_bytes;
+            length -= num_bytes;
+        }
+
+        return true;
+    }
+}
+
+LambdaSnail::server::cold_storage::~cold_storage()
+{
+    if (m_file >= 0)
+    {
+        ::close(m_file);
+    }
+}
+
+std::expected<void, std::string> LambdaSnail::server::cold_storage::open(std::filesystem::path const& path)
+{
+    auto const file = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (file < 0)
+    {
+        return std::unexpected(std::error_code(errno, std::generic_category()).message());
+    }
+
+    if (m_file >= 0)
+    {
+        ::close(m_file);
+    }
+
+    m_file = file;
+    m_end.store(0, std::memory_order_relaxed);
+    m_num_values.store(0, std::memory_order_relaxed);
+    m_stored_bytes.store(0, std::memory_order_relaxed);
+
+    // Values released from the previous file have nothing to punch in the new one
+    auto lock = std::lock_guard{m_released_mutex};
+    m_released.clear();
+    return {};
+}
+
+bool LambdaSnail::server::cold_storage::is_open() const noexcept
+{
+    return m_file >= 0;
+}
+
+std::optional<uint64_t> LambdaSnail::server::cold_storage::append(std::string_view value)
+{
+    ZoneScoped;
+
+    auto const offset = m_end.fetch_add(value.size(), std::memory_order_relaxed);
+    for (auto position = offset; not value.empty();)
+    {
+        auto const written = ::pwrite(m_file, value.data(), value.size(), static_cast<off_t>(position));
+        if (written < 0 and errno == EINTR)
+        {
+            continue;
+        }
+
+        if (written <= 0)
+        {
+            // The range is left unused, punching it keeps whatever was written from taking up space
+            punch_hole(offset, static_cast<size_t>(position - offset));
+            return std::nullopt;
+        }
+
+        position += static_cast<uint64_t>(written);
+        value.remove_prefix(static_cast<size_t>(written));
+    }
+
+    m_num_values.fetch_add(1, std::memory_order_relaxed);
+    m_stored_bytes.fetch_add(m_end.load(std::memory_order_relaxed) - offset, std::memory_order_relaxed);
+    return offset;
+}
+
+bool LambdaSnail::server::cold_storage::read(uint64_t offset, std::span<char> value) const
+{
+    ZoneScoped;
+
+    m_reads.fetch_add(1, std::memory_order_relaxed);
+    while (not value.empty())
+    {
+        auto const num_read = ::pread(m_file, value.data(), value.size(), static_cast<off_t>(offset));
+        if (num_read < 0 and errno == EINTR)
+        {
+            continue;
+        }
+
+        if (num_read <= 0)
+        {
+            return false;
+        }
+
+        offset += static_cast<uint64_t>(num_read);
+        value = value.subspan(static_cast<size_t>(num_read));
+    }
+
+    return true;
+}
+
+void LambdaSnail::server::cold_storage::release(uint64_t const offset, size_t const length)
+{
+    m_num_values.fetch_sub(1, std::memory_order_relaxed);
+    m_stored_bytes.fetch_sub(length, std::memory_order_relaxed);
+
+    auto lock = std::lock_guard{m_released_mutex};
+    m_released.emplace_back(offset, length);
+}
+
+size_t LambdaSnail::server::cold_storage::punch_released()
+{
+    ZoneScoped;
+
+    std::vector<std::pair<uint64_t, size_t>> released;
+    {
+        auto lock = std::lock_guard{m_released_mutex};
+        if (m_hold_count > 0)
+        {
+            return 0;
+        }
+
+        released.swap(m_released);
+    }
+
+    // Values are appended one after the other, so values released together are often neighbours
+    std::ranges::sort(released);
+    for (size_t i = 0; i < released.size();)
+    {
+        auto const offset = released[i].first;
+        auto end          = offset + released[i].second;
+        for (++i; i < released.size() and released[i].first == end; ++i)
+        {
+            end += released[i].second;
+        }
+
+        punch_hole(offset, static_cast<size_t>(end - offset));
+    }
+
+    return released.size();
+}
+
+void LambdaSnail::server::cold_storage::hold_releases()
+{
+    auto lock = std::lock_guard{m_released_mutex};
+    ++m_hold_count;
+}
+
+void LambdaSnail::server::cold_storage::resume_releases()
+{
+    auto lock = std::lock_guard{m_released_mutex};
+    --m_hold_count;
+}
+
+LambdaSnail::server::cold_storage_statistics LambdaSnail::server::cold_storage::get_statistics() const noexcept
+{
+    return cold_storage_statistics{
+        .num_values   = m_num_values.load(std::memory_order_relaxed),
+        .stored_bytes = m_stored_bytes.load(std::memory_order_relaxed),
+        .file_size    = m_end.load(std::memory_order_relaxed),
+        .reads        = m_reads.load(std::memory_order_relaxed)
+    };
+}
+
+void LambdaSnail::server::cold_storage::punch_hole(uint64_t const offset, size_t const length) const noexcept
+{
+    if (length == 0)
+    {
+        return;
+    }
+
+    // Only whole blocks are freed, a block shared with a neighbouring value is freed along with the last of them.
+    // File systems without support for holes keep the space, which is not worth failing over.
+    ::fallocate(m_file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(length));
+}
@@ -0,0 +1,111 @@
+module;
+
+#include <algorithm>
+#include <chrono>
+#include <expected>
+#include <filesystem>
+#include <functional>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <tracy/Tracy.hpp>
+
+module server;
+
+namespace LambdaSnail::server
+{
+    namespace
+    {
+        /**
+         * How often an idle reader checks for a stop request.
+         */
+        constexpr std::chrono::milliseconds reader_poll_interval{ 100 };
+    }
+
+    cold_tier::cold_tier(std::filesystem::path path, size_t const min_size, std::chrono::seconds const idle_time, size_t const num_readers) :
+        m_path(std::move(path)), m_min_size(min_size), m_idle_time(idle_time), m_num_readers(std::max(num_readers, size_t{ 1 }))
+    {
+    }
+
+    cold_tier::~cold_tier()
+    {
+        stop();
+    }
+
+    std::expected<void, std::string> cold_tier::start()
+    {
+        if (auto const result = entry::cold_file().open(m_path); not result)
+        {
+            return std::unexpected(result.error());
+        }
+
+        for (size_t i = 0; i < m_num_readers; ++i)
+        {
+            m_threads.emplace_back([this](std::stop_token const& stop_token) { run(stop_token); });
+        }
+
+        return {};
+    }
+
+    void cold_tier::stop()
+    {
+        for (auto& thread : m_threads)
+        {
+            thread.request_stop();
+        }
+
+        // Wakes the readers up instead of waiting for the poll interval to pass
+        for (size_t i = 0; i < m_threads.size(); ++i)
+        {
+            m_queue.enqueue(job_t{});
+        }
+
+        m_threads.clear();
+    }
+
+    size_t cold_tier::get_min_size() const noexcept
+    {
+        return m_min_size;
+    }
+
+    std::chrono::seconds cold_tier::get_idle_time() const noexcept
+    {
+        return m_idle_time;
+    }
+
+    std::filesystem::path const& cold_tier::get_path() const noexcept
+    {
+        return m_path;
+    }
+
+    void cold_tier::submit(std::function<void()> job)
+    {
+        m_queue.enqueue(std::move(job));
+    }
+
+    void cold_tier::run(std::stop_token const& stop_token)
+    {
+        job_t job{};
+        while (not stop_token.stop_requested())
+        {
+            if (m_queue.wait_dequeue_timed(job, reader_poll_interval) and job)
+            {
+                ZoneScopedN("cold read");
+
+                job();
+                job = job_t{};
+            }
+        }
+
+        // Readers that were submitted before the tier was destroyed still get their answer
+        while (m_queue.try_dequeue(job))
+        {
+            if (job)
+            {
+                job();
+            }
+        }
+    }
+}
@@ -1,9 +1,17 @@
 module;
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <memory_resource>
+#include <span>
+#include <string>
 #include <string_view>
-#include <unordered_map>
-#include <variant>
+#include <utility>
+#include <vector>
 
 #include <tracy/Tracy.hpp>
 
@@ -11,79 +19,300 @@ module server;
 
 namespace LambdaSnail::server
 {
-    //auto command_dispatch::s_command_map = std::unordered_map<std::string_view, std::function<ICommandHandler*()>>
-    //{
-        // std::pair("PING",std::function( [](){ return new ping_handler; })),
-        // std::pair("ECHO",std::function( [](){ return new echo_handler; })),
-        // std::pair("GET", std::function([&](){ return new get_handler<database>{ *m_server.get_database(m_current_db) }; })),
-        // std::pair("SET", std::function([&](){ return new set_handler<database>{ *m_server.get_database(m_current_db) }; }))
-    //};
-
-    command_dispatch::command_dispatch(server &server) : m_server(server)
+    namespace
     {
+        template<typename... flags_t>
+        constexpr uint32_t make_flags(flags_t... flags)
+        {
+            return (static_cast<uint32_t>(flags) | ...);
+        }
 
+        /**
+         * The registry of all commands known to the server. New commands only need to be added here.
+         */
+        constexpr std::array s_commands
+        {
+            command_info{ "PING",         &ping_handler::execute,        -1, make_flags(command_flags::fast, command_flags::connection) },
+            command_info{ "ECHO",         &echo_handler::execute,         2, make_flags(command_flags::fast, command_flags::connection) },
+            command_info{ "SELECT",       &select_handler::execute,       2, make_flags(command_flags::fast, command_flags::connection) },
+            command_info{ "GET",          &get_handler::execute,          2, make_flags(command_flags::fast, command_flags::readonly) },
+            command_info{ "SET",          &set_handler::execute,         -3, make_flags(command_flags::write, command_flags::denyoom) },
+            command_info{ "MGET",         &mget_handler::execute,        -2, make_flags(command_flags::readonly, command_flags::fast) },
+            command_info{ "MSET",         &mset_handler::execute,        -3, make_flags(command_flags::write, command_flags::denyoom) },
+            command_info{ "MSETNX",       &msetnx_handler::execute,      -3, make_flags(command_flags::write, command_flags::denyoom) },
+            command_info{ "DEL",          &del_handler::execute,         -2, make_flags(command_flags::write) },
+            command_info{ "UNLINK",       &unlink_handler::execute,      -2, make_flags(command_flags::write, command_flags::fast) },
+            command_info{ "FLUSHDB",      &flushdb_handler::execute,     -1, make_flags(command_flags::write) },
+            command_info{ "FLUSHALL",     &flushall_handler::execute,    -1, make_flags(command_flags::write) },
+            command_info{ "SAVE",         &save_handler::execute,         1, make_flags(command_flags::none) },
+            command_info{ "BGSAVE",       &bgsave_handler::execute,      -1, make_flags(command_flags::none) },
+            command_info{ "LASTSAVE",     &lastsave_handler::execute,     1, make_flags(command_flags::fast) },
+            command_info{ "BGREWRITEAOF", &bgrewriteaof_handler::execute,  1, make_flags(command_flags::none) },
+            command_info{ "EXISTS",       &exists_handler::execute,      -2, make_flags(command_flags::readonly, command_flags::fast) },
+            command_info{ "MEMORY",       &memory_handler::execute,      -2, make_flags(command_flags::readonly) },
+            command_info{ "INCR",         &incr_handler::execute,         2, make_flags(command_flags::write, command_flags::fast, command_flags::denyoom) },
+            command_info{ "DECR",         &decr_handler::execute,         2, make_flags(command_flags::write, command_flags::fast, command_flags::denyoom) },
+            command_info{ "INCRBY",       &incrby_handler::execute,       3, make_flags(command_flags::write, command_flags::fast, command_flags::denyoom) },
+            command_info{ "DECRBY",       &decrby_handler::execute,       3, make_flags(command_flags::write, command_flags::fast, command_flags::denyoom) },
+            command_info{ "INCRBYFLOAT",  &incrbyfloat_handler::execute,  3, make_flags(command_flags::write, command_flags::fast, command_flags::denyoom) },
+        };
 
-    }
+        constexpr char to_upper(char const c)
+        {
+            return c >= 'a' and c <= 'z' ? static_cast<char>(c - ('a' - 'A')) : c;
+        }
 
-    std::shared_ptr<ICommandHandler> command_dispatch::get_command(std::string_view command_name)
-    {
-        // TODO: Find a nicer way to handle this
-        switch (command_name[0])
-        {
-            case 'P': // "PING"
-                return std::make_shared<ping_handler>();
-                break;
-            case 'E': // "ECHO"
-                return std::make_shared<echo_handler>();
-                break;
-            case 'G': // "GET"
-                return std::make_shared<get_handler>(m_server.get_database(m_current_db));
-                break;
-            case 'S': //"SET" or "SELECT
-                if (command_name.size() > 3 and command_name[2] == 'L') // SELECT
+        constexpr bool equals_ignore_case(std::string_view const command_name, std::string_view const input)
+        {
+            if (command_name.size() != input.size())
+            {
+                return false;
+            }
+
+            for (size_t i = 0; i < input.size(); ++i)
+            {
+                if (command_name[i] != to_upper(input[i]))
                 {
-                    return std::make_shared<select_handler>(*this);
+                    return false;
                 }
+            }
+
+            return true;
+        }
+
+        /**
+         * FNV-1a over the upper case name, so that lookups are case-insensitive without copying the name.
+         */
+        constexpr uint32_t command_hash(std::string_view const name, uint32_t const seed)
+        {
+            uint32_t hash = 2166136261u ^ seed;
+            for (char const c : name)
+            {
+                hash ^= static_cast<uint8_t>(to_upper(c));
+                hash *= 16777619u;
+            }
+
+            return hash;
+        }
+
+        /**
+         * Perfect hash table from command name to its index in the registry. The seed is searched
+         * for at compile time, so a lookup is one hash, one table read and one name comparison.
+         */
+        struct command_table
+        {
+            static constexpr size_t size        = 256;
+            static constexpr uint8_t empty_slot = 0xFF;
+
+            std::array<uint8_t, size> slots{};
+            uint32_t seed{};
+            size_t max_name_length{};
+        };
 
-                if (command_name.size() == 3 and command_name[2] == 'T') // SET
+        consteval command_table build_command_table()
+        {
+            static_assert(s_commands.size() < command_table::empty_slot);
+
+            command_table table{};
+            for (auto const& command : s_commands)
+            {
+                table.max_name_length = std::max(table.max_name_length, command.name.size());
+            }
+
+            for (uint32_t seed = 0;; ++seed)
+            {
+                table.seed = seed;
+                table.slots.fill(command_table::empty_slot);
+
+                bool has_collision = false;
+                for (size_t i = 0; i < s_commands.size() and not has_collision; ++i)
                 {
-                    return std::make_shared<set_handler>(m_server.get_database(m_current_db));
+                    auto& slot    = table.slots[command_hash(s_commands[i].name, seed) % command_table::size];
+                    has_collision = slot != command_table::empty_slot;
+                    slot          = static_cast<uint8_t>(i);
                 }
-                break;
-            default:
-                break;
+
+                if (not has_collision)
+                {
+                    return table;
+                }
+            }
         }
 
-        return std::make_shared<static_response_handler>("Unknown command: " + std::string(command_name));
+        constexpr command_table s_command_table = build_command_table();
+    }
+
+    command_dispatch::command_dispatch(server &server) : m_server(server), m_database(server.get_database(m_current_db).get())
+    {
     }
 
-    std::string command_dispatch::process_command(resp::data_view message)
+    command_info const* command_dispatch::find_command(std::string_view const command_name) noexcept
+    {
+        if (command_name.size() > s_command_table.max_name_length)
+        {
+            return nullptr;
+        }
+
+        auto const slot  = command_hash(command_name, s_command_table.seed) % command_table::size;
+        auto const index = s_command_table.slots[slot];
+        if (index == command_table::empty_slot or not equals_ignore_case(s_commands[index].name, command_name))
+        {
+            return nullptr;
+        }
+
+        return &s_commands[index];
+    }
+
+    void command_dispatch::process_command(resp::data_view message, resp::response_writer& out)
     {
         ZoneNamed(ProcessCommand, true);
 
-        auto const request = message.materialize(resp::Array{});
+        if (message.type != resp::data_type::Array) [[unlikely]]
+        {
+            out.error("Unable to parse request");
+            return;
+        }
+
+        // The arguments of the previous command are no longer referenced
+        m_scratch.reset();
+
+        execute(message.materialize(resp::Array{}, &m_scratch), out);
+    }
 
+    void command_dispatch::process_command(std::string_view const message, std::span<resp::incremental_parser::argument const> const arguments,
+                                           resp::response_writer& out)
+    {
+        ZoneNamed(ProcessCommand, true);
+
+        if (arguments.empty()) [[unlikely]]
+        {
+            process_command(resp::data_view(message), out);
+            return;
+        }
+
+        // The arguments of the previous command are no longer referenced
+        m_scratch.reset();
+
+        std::pmr::vector<resp::data_view> request(&m_scratch);
+        request.reserve(arguments.size());
+        for (auto const& argument : arguments)
+        {
+            request.emplace_back(resp::BulkString{}, message.substr(argument.offset, argument.length));
+        }
+
+        execute(request, out);
+    }
+
+    void command_dispatch::execute(std::span<resp::data_view const> const request, resp::response_writer& out)
+    {
         if (request.size() == 0 or request[0].type != LambdaSnail::resp::data_type::BulkString)
         {
-            return {"-Unable to parse request\r\n"};
+            out.error("Unable to parse request");
+            return;
         }
 
         auto const command_name = request[0].materialize(resp::BulkString{});
 
-        auto command = get_command(command_name);
-        return command->execute(request);
+        auto const* command = find_command(command_name);
+        if (not command) [[unlikely]]
+        {
+            out.error("ERR unknown command '", command_name, "'");
+            return;
+        }
+
+        if (not command->accepts_arity(request.size())) [[unlikely]]
+        {
+            out.error("ERR wrong number of arguments for '", command->name, "' command");
+            return;
+        }
+
+        if (command->has_flag(command_flags::write) and m_database->is_read_only()) [[unlikely]]
+        {
+            out.error("READONLY You can't write against a read only dataset.");
+            return;
+        }
+
+        // Keys are evicted before the command runs, as in Redis, so a write may take the memory over the limit
+        if (command->has_flag(command_flags::denyoom) and not m_loading and not m_server.free_memory_if_needed()) [[unlikely]]
+        {
+            out.error("OOM command not allowed when used memory > 'maxmemory'.");
+            return;
+        }
+
+        // As in Redis, writes are refused rather than lost while they cannot be logged
+        if (auto const* log = m_server.get_append_log(); log and command->has_flag(command_flags::write) and log->has_failed()) [[unlikely]]
+        {
+            out.error("MISCONF Errors writing to the AOF file, writes are refused until it can be written again");
+            return;
+        }
+
+        command->handler(*m_database, *this, request, out);
+    }
 
-        return {"-Unable to find command\r\n"};
+    std::pmr::memory_resource& command_dispatch::scratch() noexcept
+    {
+        return m_scratch;
     }
 
-    std::string command_dispatch::handle_set_database(server::database_handle_t handle)
+    bool command_dispatch::handle_set_database(server::database_handle_t handle)
     {
         if (m_server.is_valid_handle(handle))
         {
             m_current_db = handle;
-            return "+OK\r\n";
+            m_database   = m_server.get_database(handle).get();
+            return true;
         }
 
-        return "-Invalid database index\r\n";
+        return false;
+    }
+
+    server& command_dispatch::get_server() noexcept
+    {
+        return m_server;
+    }
+
+    void command_dispatch::set_loading(bool const loading) noexcept
+    {
+        m_loading = loading;
+    }
+
+    void command_dispatch::read_cold_value(database& db, std::string_view const key, entry_ptr cold, resp::response_writer& out)
+    {
+        // The reply references the loaded entry whatever the size of the value, since the value is not there yet
+        auto* const target = entry::create_loaded(*cold);
+        auto loaded        = entry_ptr(target);
+        out.deferred_bulk_string(loaded->value(), loaded.pin());
+        m_cold_reads.push_back(cold_read{ .db = &db, .key = std::string(key), .cold = std::move(cold), .loaded = std::move(loaded), .target = target });
+    }
+
+    bool command_dispatch::has_cold_reads() const noexcept
+    {
+        return not m_cold_reads.empty();
+    }
+
+    void command_dispatch::read_cold_values(std::function<void(bool)> on_read)
+    {
+        auto* const tier = m_server.get_cold_tier();
+        assert(tier);
+
+        // The values of a round of replies are read by a single job, one after the other
+        auto reads = std::make_shared<std::vector<cold_read>>(std::move(m_cold_reads));
+        m_cold_reads.clear();
+
+        tier->submit([reads, on_read = std::move(on_read)] {
+            bool succeeded = true;
+            for (auto const& read : *reads)
+            {
+                if (not read.target->load(*read.cold)) [[unlikely]]
+                {
+                    succeeded = false;
+                    continue;
+                }
+
+                read.db->promote(read.key, read.cold, read.loaded);
+            }
+
+            on_read(succeeded);
+        });
     }
-};
\ No newline at end of file
+};
@@ -1,208 +1,1378 @@
 module;
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <bit>
 #include <cassert>
+#include <cctype>
 #include <charconv>
+#include <cmath>
+#include <expected>
 #include <functional>
 #include <future>
 #include <iomanip>
-#include <random>
+#include <limits>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
 #include <shared_mutex>
+#include <span>
 #include <string>
-
-#include "oneapi/tbb/concurrent_unordered_map.h"
+#include <utility>
+#include <vector>
 
 #include <tracy/Tracy.hpp>
 
-module server;
+module server;
+
+using namespace LambdaSnail::resp::literals;
+
+namespace
+{
+    /**
+     * Writes the value of an entry as a bulk string, integer entries are formatted on the fly.
+     */
+    void write_entry(LambdaSnail::resp::response_writer& out, LambdaSnail::server::entry_ptr const& value)
+    {
+        if (value->encoding() == LambdaSnail::server::entry_encoding::integer)
+        {
+            std::array<char, 20> buffer{};
+            auto const [end, error] = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value->integer());
+            out.bulk_string(std::string_view(buffer.data(), end));
+            return;
+        }
+
+        // The entry is pinned by the writer, so large values can be sent without copying them
+        out.bulk_string(value->value(), value.pin());
+    }
+
+    /**
+     * Writes the value of a stored entry. The values of cold entries are read from the file of the cold tier before
+     * the reply is sent, see command_dispatch::read_cold_value.
+     */
+    void write_stored_entry(LambdaSnail::resp::response_writer& out, LambdaSnail::server::command_dispatch& dispatch,
+                            LambdaSnail::server::database& db, std::string_view const key, LambdaSnail::server::entry_ptr const& value)
+    {
+        if (value->encoding() == LambdaSnail::server::entry_encoding::cold) [[unlikely]]
+        {
+            dispatch.read_cold_value(db, key, value, out);
+            return;
+        }
+
+        write_entry(out, value);
+    }
+
+    /**
+     * Calls the function with the arguments of a SET that recreates the entry. The expiry time is given as an absolute
+     * time, so that replaying the command does not extend it.
+     */
+    template<typename function_t>
+    void with_set_command(std::string_view const key, LambdaSnail::server::entry const& value, function_t&& function)
+    {
+        std::array<char, 20> integer{};
+        auto value_view = std::string_view{};
+        if (value.encoding() == LambdaSnail::server::entry_encoding::integer)
+        {
+            auto const [end, error] = std::to_chars(integer.data(), integer.data() + integer.size(), value.integer());
+            value_view              = std::string_view(integer.data(), end);
+        }
+        else if (value.encoding() != LambdaSnail::server::entry_encoding::cold)
+        {
+            // The value of a cold entry is left empty, for the function to read it from the file of the cold tier
+            value_view = value.value();
+        }
+
+        if (not value.has_ttl())
+        {
+            std::array<std::string_view, 3> const arguments{ "SET", key, value_view };
+            function(arguments);
+            return;
+        }
+
+        std::array<char, 20> expiry{};
+        auto const milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(value.ttl().time_since_epoch()).count();
+        auto const [end, error] = std::to_chars(expiry.data(), expiry.data() + expiry.size(), milliseconds);
+
+        std::array<std::string_view, 5> const arguments{ "SET", key, value_view, "PXAT", std::string_view(expiry.data(), end) };
+        function(arguments);
+    }
+
+    /**
+     * Writes the value of a key that the database does not store from its mapped dataset, or null. The dataset outlives
+     * the reply, so large values are referenced without a pin and sent straight from the mapped pages.
+     */
+    void write_dataset_value(LambdaSnail::resp::response_writer& out, LambdaSnail::server::database const& db, std::string_view const key)
+    {
+        if (auto const value = db.get_dataset_value(key))
+        {
+            out.bulk_string(*value, LambdaSnail::resp::value_pin_t{});
+            return;
+        }
+
+        out.null();
+    }
+
+    void write_value_error(LambdaSnail::resp::response_writer& out, LambdaSnail::server::value_error const error)
+    {
+        switch (error)
+        {
+            case LambdaSnail::server::value_error::not_an_integer:
+                out.error("ERR value is not an integer or out of range");
+                break;
+            case LambdaSnail::server::value_error::not_a_float:
+                out.error("ERR value is not a valid float");
+                break;
+            case LambdaSnail::server::value_error::overflow:
+                out.error("ERR increment or decrement would overflow");
+                break;
+            case LambdaSnail::server::value_error::not_finite:
+                out.error("ERR increment would produce NaN or Infinity");
+                break;
+        }
+    }
+
+    /**
+     * The arguments from the first key on, as views of the bulk strings.
+     */
+    std::pmr::vector<std::string_view> materialize_keys(std::pmr::memory_resource& scratch, std::span<LambdaSnail::resp::data_view const> args,
+                                                        size_t const first = 1, size_t const step = 1)
+    {
+        std::pmr::vector<std::string_view> keys(&scratch);
+        keys.reserve((args.size() - first + step - 1) / step);
+        for (size_t i = first; i < args.size(); i += step)
+        {
+            keys.push_back(args[i].materialize(LambdaSnail::resp::BulkString{}));
+        }
+
+        return keys;
+    }
+
+    /**
+     * MSET and MSETNX take pairs of keys and values.
+     */
+    bool set_pairs(LambdaSnail::server::database& db, std::pmr::memory_resource& scratch, std::span<LambdaSnail::resp::data_view const> args,
+                   bool const only_if_none_exist)
+    {
+        auto const keys   = materialize_keys(scratch, args, 1, 2);
+        auto const values = materialize_keys(scratch, args, 2, 2);
+        return db.set_values(keys, values, only_if_none_exist);
+    }
+
+    /**
+     * The reply to MEMORY STATS, pairs of names and values as in Redis.
+     */
+    void write_memory_stats(LambdaSnail::server::database const& db, LambdaSnail::memory::buffer_pool const* const buffer_pool,
+                            LambdaSnail::server::timeout_worker const* const maintenance_worker, LambdaSnail::resp::response_writer& out)
+    {
+        auto const statistics = LambdaSnail::server::entry::allocator().get_statistics();
+
+        std::array<char, 32> ratio{};
+        auto const formatted = std::to_chars(ratio.data(), ratio.data() + ratio.size(), statistics.fragmentation(), std::chars_format::fixed, 2);
+
+        auto const lazy_free   = db.get_lazy_free_worker() ? db.get_lazy_free_worker()->get_statistics() : LambdaSnail::server::lazy_free_statistics{};
+        auto const cold        = LambdaSnail::server::entry::cold_file().get_statistics();
+        auto const buffers     = buffer_pool ? buffer_pool->get_statistics() : LambdaSnail::memory::buffer_pool_statistics{};
+        auto const maintenance = maintenance_worker ? maintenance_worker->get_statistics() : LambdaSnail::server::maintenance_statistics{};
+
+        size_t free_buffer_bytes = 0;
+        for (auto const& size_class : buffers.size_classes)
+        {
+            free_buffer_bytes += size_class.num_free * size_class.buffer_size;
+        }
+
+        out.array_header(48);
+        out.bulk_string("keys.count");
+        out.integer(static_cast<int64_t>(db.get_statistics().num_keys));
+        out.bulk_string("keys.evicted");
+        out.integer(static_cast<int64_t>(db.get_statistics().evicted_keys));
+        out.bulk_string("dataset.bytes");
+        out.integer(db.get_memory_limit().used_bytes.load(std::memory_order_relaxed));
+        out.bulk_string("allocator.allocated");
+        out.integer(static_cast<int64_t>(statistics.allocated_bytes));
+        out.bulk_string("allocator.active");
+        out.integer(static_cast<int64_t>(statistics.active_bytes));
+        out.bulk_string("allocator.pages");
+        out.integer(static_cast<int64_t>(statistics.num_pages));
+        out.bulk_string("allocator-fragmentation.ratio");
+        out.bulk_string(std::string_view(ratio.data(), formatted.ptr));
+        out.bulk_string("allocator-fragmentation.bytes");
+        out.integer(static_cast<int64_t>(statistics.wasted_bytes()));
+        out.bulk_string("lazyfree.pending-objects");
+        out.integer(static_cast<int64_t>(lazy_free.pending_objects));
+        out.bulk_string("lazyfree.freed-objects");
+        out.integer(static_cast<int64_t>(lazy_free.freed_objects));
+        out.bulk_string("coldtier.values");
+        out.integer(static_cast<int64_t>(cold.num_values));
+        out.bulk_string("coldtier.bytes");
+        out.integer(static_cast<int64_t>(cold.stored_bytes));
+        out.bulk_string("bufferpool.reserved");
+        out.integer(static_cast<int64_t>(buffers.reserved_bytes));
+        out.bulk_string("bufferpool.free");
+        out.integer(static_cast<int64_t>(free_buffer_bytes));
+        out.bulk_string("bufferpool.limit");
+        out.integer(static_cast<int64_t>(buffers.memory_limit));
+        out.bulk_string("bufferpool.failed-requests");
+        out.integer(static_cast<int64_t>(buffers.failed_requests));
+        out.bulk_string("maintenance.cycles");
+        out.integer(static_cast<int64_t>(maintenance.cycles));
+        out.bulk_string("maintenance.expired-keys");
+        out.integer(static_cast<int64_t>(maintenance.expired_keys));
+        out.bulk_string("maintenance.incomplete-cycles");
+        out.integer(static_cast<int64_t>(maintenance.incomplete_cycles));
+        out.bulk_string("maintenance.last-cycle-us");
+        out.integer(maintenance.last_cycle_duration.count());
+        out.bulk_string("maintenance.max-cycle-us");
+        out.integer(maintenance.max_cycle_duration.count());
+        out.bulk_string("maintenance.defrag-cycles");
+        out.integer(static_cast<int64_t>(maintenance.defrag_cycles));
+        out.bulk_string("maintenance.defragmented-entries");
+        out.integer(static_cast<int64_t>(maintenance.defragmented_entries));
+        out.bulk_string("maintenance.spilled-values");
+        out.integer(static_cast<int64_t>(maintenance.spilled_values));
+    }
+
+    /**
+     * FLUSHDB and FLUSHALL take an optional ASYNC or SYNC. Returns whether the flush is asynchronous, or nothing for
+     * any other argument.
+     */
+    std::optional<bool> parse_flush_mode(std::span<LambdaSnail::resp::data_view const> args)
+    {
+        if (args.size() == 1)
+        {
+            return false;
+        }
+
+        auto const mode     = args[1].materialize(LambdaSnail::resp::BulkString{});
+        auto const is_equal = [mode](std::string_view const name) {
+            return std::ranges::equal(mode, name, [](char const a, char const b) { return std::toupper(static_cast<unsigned char>(a)) == b; });
+        };
+
+        if (args.size() == 2 and is_equal("ASYNC"))
+        {
+            return true;
+        }
+
+        if (args.size() == 2 and is_equal("SYNC"))
+        {
+            return false;
+        }
+
+        return std::nullopt;
+    }
+
+    void increment_by(LambdaSnail::server::database& db, std::string_view const key, int64_t const delta, LambdaSnail::resp::response_writer& out)
+    {
+        auto const result = db.increment(key, delta);
+        if (not result)
+        {
+            write_value_error(out, result.error());
+            return;
+        }
+
+        out.integer(*result);
+    }
+}
+
+LambdaSnail::server::database::database(size_t const num_shards, size_t const expected_keys, std::shared_ptr<memory_limit> limit,
+                                        std::shared_ptr<lazy_free_worker> lazy_free) :
+    m_memory_limit(std::move(limit)),
+    m_lazy_free(std::move(lazy_free)),
+    m_shards(std::make_unique<shard[]>(std::bit_ceil(std::max(num_shards, size_t{ 1 })))),
+    m_shard_mask(std::bit_ceil(std::max(num_shards, size_t{ 1 })) - 1)
+{
+    for (size_t i = 0; i < this->num_shards(); ++i)
+    {
+        m_shards[i].limit     = m_memory_limit.get();
+        m_shards[i].lazy_free = m_lazy_free.get();
+    }
+
+    reserve(expected_keys);
+}
+
+void LambdaSnail::server::database::reserve(size_t const expected_keys)
+{
+    if (expected_keys == 0)
+    {
+        return;
+    }
+
+    // Keys are spread evenly over the shards, with some slack for the variance
+    m_reserved_keys_per_shard = expected_keys / num_shards() + expected_keys / num_shards() / 16 + 1;
+    for (size_t i = 0; i < num_shards(); ++i)
+    {
+        auto lock = std::unique_lock{m_shards[i].mutex};
+        m_shards[i].store.reserve(m_reserved_keys_per_shard);
+    }
+}
+
+size_t LambdaSnail::server::database::hash(std::string_view const key)
+{
+    return std::hash<std::string_view>{}(key);
+}
+
+LambdaSnail::server::database::shard& LambdaSnail::server::database::get_shard(size_t const hash) const
+{
+    // The upper bits select the shard, the lower bits are used for probing the table within the shard
+    return m_shards[(hash >> 32) & m_shard_mask];
+}
+
+bool LambdaSnail::server::database::is_live(entry_ptr const& entry, time_point_t const now)
+{
+    return entry and not entry->is_deleted() and not entry->has_expired(now);
+}
+
+size_t LambdaSnail::server::database::num_shards() const
+{
+    return m_shard_mask + 1;
+}
+
+LambdaSnail::server::entry_ptr LambdaSnail::server::database::get_value(std::string_view const key)
+{
+    auto const key_hash = hash(key);
+    auto& shard         = get_shard(key_hash);
+    auto lock           = std::shared_lock{shard.mutex};
+
+    return shard.lookup(key, key_hash, std::chrono::system_clock::now());
+}
+
+void LambdaSnail::server::database::set_value(std::string_view const key, std::string_view value,
+                                              std::chrono::time_point<std::chrono::system_clock> ttl)
+{
+    // Entries are never modified after they have been stored, a new entry replaces the old one instead.
+    // This allows replies to reference the stored value until they have been written to the socket,
+    // even if the key is overwritten in the meantime.
+    auto* const created = entry::create(value, 0, ttl);
+
+    auto const key_hash = hash(key);
+    auto& shard         = get_shard(key_hash);
+    auto lock           = std::unique_lock{shard.mutex};
+
+    shard.assign(key, key_hash, created);
+}
+
+void LambdaSnail::server::database::restore(std::string_view const key, entry* const value)
+{
+    if (value->has_expired(std::chrono::system_clock::now()))
+    {
+        entry_ptr const dropped(value);
+        return;
+    }
+
+    auto const key_hash = hash(key);
+    auto& shard         = get_shard(key_hash);
+    auto lock           = std::unique_lock{shard.mutex};
+
+    shard.assign(key, key_hash, value);
+}
+
+void LambdaSnail::server::database::get_values(std::span<std::string_view const> const keys, std::span<entry_ptr> const values)
+{
+    assert(keys.size() == values.size());
+
+    auto const now = std::chrono::system_clock::now();
+    for_each_shard(keys, [&](shard& shard, std::span<batch_key const> const batch) {
+        auto lock = std::shared_lock{shard.mutex};
+
+        for (auto const& key : batch)
+        {
+            shard.store.prefetch(key.hash);
+        }
+
+        for (auto const& key : batch)
+        {
+            values[key.index] = shard.lookup(keys[key.index], key.hash, now);
+        }
+    });
+}
+
+bool LambdaSnail::server::database::set_values(std::span<std::string_view const> const keys, std::span<std::string_view const> const values,
+                                               bool const only_if_none_exist)
+{
+    assert(keys.size() == values.size());
+
+    // Entries are created before any lock is taken
+    std::vector<entry_ptr> created;
+    created.reserve(keys.size());
+    for (auto const value : values)
+    {
+        created.emplace_back(entry::create(value, 0, time_point_t::min()));
+    }
+
+    auto batches = make_batches(keys);
+
+    // All shards involved are locked for the whole update, so that other clients see either none or all of the
+    // values. Shards are always locked in ascending order, which rules out deadlocks between batches.
+    std::vector<std::unique_lock<std::shared_mutex>> locks;
+    for_each_batch(batches, [&](shard& shard, std::span<batch_key const>) { locks.emplace_back(shard.mutex); });
+
+    if (only_if_none_exist)
+    {
+        auto const now  = std::chrono::system_clock::now();
+        bool any_exists = false;
+        for_each_batch(batches, [&](shard& shard, std::span<batch_key const> const batch) {
+            for (auto const& key : batch)
+            {
+                auto const* entry = shard.store.find(keys[key.index], key.hash);
+                any_exists |= entry and is_live(*entry, now);
+            }
+        });
+
+        if (any_exists)
+        {
+            return false;
+        }
+    }
+
+    for_each_batch(batches, [&](shard& shard, std::span<batch_key const> const batch) {
+        for (auto const& key : batch)
+        {
+            shard.store.prefetch(key.hash);
+        }
+
+        // A key that is given more than once gets the last value, as the keys of a batch keep their order
+        for (auto const& key : batch)
+        {
+            shard.assign(keys[key.index], key.hash, const_cast<entry*>(created[key.index].get()));
+        }
+    });
+
+    return true;
+}
+
+size_t LambdaSnail::server::database::erase_values(std::span<std::string_view const> const keys, bool const lazy_free)
+{
+    auto const now = std::chrono::system_clock::now();
+
+    // The entries are released after the locks, freeing large values does not hold up other clients
+    std::vector<entry_ptr> erased;
+    erased.reserve(keys.size());
+
+    size_t num_erased = 0;
+    for_each_shard(keys, [&](shard& shard, std::span<batch_key const> const batch) {
+        auto lock = std::unique_lock{shard.mutex};
+
+        for (auto const& key : batch)
+        {
+            shard.store.prefetch(key.hash);
+        }
+
+        for (auto const& key : batch)
+        {
+            auto* entry = shard.store.find(keys[key.index], key.hash);
+            if (not entry)
+            {
+                continue;
+            }
+
+            num_erased += is_live(*entry, now) ? 1 : 0;
+            shard.account(keys[key.index], entry->get(), nullptr);
+            shard.log_delete(keys[key.index]);
+            erased.push_back(std::move(*entry));
+            shard.store.erase(keys[key.index], key.hash);
+        }
+    });
+
+    if (lazy_free and m_lazy_free)
+    {
+        for (auto& value : erased)
+        {
+            m_lazy_free->release(std::move(value));
+        }
+    }
+
+    return num_erased;
+}
+
+void LambdaSnail::server::database::flush(bool const lazy_free)
+{
+    ZoneScoped;
+
+    std::vector<std::unique_ptr<flushed_shard>> flushed;
+    flushed.reserve(num_shards());
+    for (size_t i = 0; i < num_shards(); ++i)
+    {
+        // The empty tables that replace the shards are allocated before any shard is locked
+        flushed.push_back(std::make_unique<flushed_shard>());
+        if (m_reserved_keys_per_shard != 0)
+        {
+            flushed.back()->store.reserve(m_reserved_keys_per_shard);
+        }
+    }
+
+    {
+        // Locking all shards at once keeps writes from landing in a shard that has been flushed while others have
+        // not, so that the flush is logged as one command. Shards are locked in ascending order, like the multi-key
+        // commands, which rules out deadlocks with them.
+        std::vector<std::unique_lock<std::shared_mutex>> locks;
+        locks.reserve(num_shards());
+        for (size_t i = 0; i < num_shards(); ++i)
+        {
+            locks.emplace_back(m_shards[i].mutex);
+        }
+
+        for (size_t i = 0; i < num_shards(); ++i)
+        {
+            auto& shard = m_shards[i];
+            std::swap(flushed[i]->store, shard.store);
+            std::swap(flushed[i]->expiries, shard.expiries);
+
+            shard.limit->used_bytes.fetch_sub(shard.used_bytes, std::memory_order_relaxed);
+            shard.used_bytes    = 0;
+            shard.defrag_cursor = 0;
+            shard.spill_cursor  = 0;
+
+            // Queued deletes refer to keys that no longer exist
+            auto delete_lock = std::lock_guard{shard.delete_mutex};
+            shard.delete_keys.clear();
+        }
+
+        if (m_append_log)
+        {
+            std::array<std::string_view, 1> const arguments{ "FLUSHDB" };
+            m_append_log->append(m_index, arguments);
+        }
+    }
+
+    if (lazy_free and m_lazy_free)
+    {
+        for (auto& shard : flushed)
+        {
+            m_lazy_free->release(std::move(shard));
+        }
+    }
+}
+
+size_t LambdaSnail::server::database::count_existing(std::span<std::string_view const> const keys)
+{
+    auto const now = std::chrono::system_clock::now();
+
+    size_t num_existing = 0;
+    for_each_shard(keys, [&](shard& shard, std::span<batch_key const> const batch) {
+        auto lock = std::shared_lock{shard.mutex};
+
+        for (auto const& key : batch)
+        {
+            shard.store.prefetch(key.hash);
+        }
+
+        for (auto const& key : batch)
+        {
+            auto const* entry = shard.store.find(keys[key.index], key.hash);
+            num_existing += (entry and is_live(*entry, now)) or get_dataset_value(keys[key.index]) ? 1 : 0;
+        }
+    });
+
+    return num_existing;
+}
+
+std::vector<LambdaSnail::server::database::batch_key> LambdaSnail::server::database::make_batches(std::span<std::string_view const> const keys) const
+{
+    // Hashing all keys up front lets the keys be grouped by shard, so that every shard is locked once
+    std::vector<batch_key> batches;
+    batches.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        auto const key_hash = hash(keys[i]);
+        batches.push_back(batch_key{ .hash = key_hash, .index = i, .shard = (key_hash >> 32) & m_shard_mask });
+    }
+
+    std::ranges::stable_sort(batches, {}, &batch_key::shard);
+    return batches;
+}
+
+template<typename function_t>
+void LambdaSnail::server::database::for_each_batch(std::span<batch_key const> const batches, function_t&& function)
+{
+    for (auto begin = batches.begin(); begin != batches.end();)
+    {
+        auto const end = std::find_if(begin, batches.end(), [begin](batch_key const& key) { return key.shard != begin->shard; });
+        function(m_shards[begin->shard], std::span(begin, end));
+        begin = end;
+    }
+}
+
+template<typename function_t>
+void LambdaSnail::server::database::for_each_shard(std::span<std::string_view const> const keys, function_t&& function)
+{
+    auto const batches = make_batches(keys);
+    for_each_batch(batches, std::forward<function_t>(function));
+}
+
+template<typename step_t>
+bool LambdaSnail::server::database::for_each_shard_batch(size_t& next_shard, std::chrono::steady_clock::time_point const deadline, step_t&& step)
+{
+    for (size_t i = 0; i < num_shards(); ++i)
+    {
+        auto const shard_index = (next_shard + i) & m_shard_mask;
+
+        // Each batch releases the lock of the shard, so that clients are not paused for the whole cycle
+        bool incomplete = true;
+        while (incomplete)
+        {
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                next_shard = shard_index;
+                return true;
+            }
+
+            incomplete = step(m_shards[shard_index]);
+        }
+    }
+
+    return false;
+}
+
+LambdaSnail::server::entry_ptr LambdaSnail::server::database::shard::lookup(std::string_view const key, size_t const key_hash, time_point_t const now)
+{
+    auto const* entry = store.find(key, key_hash);
+    if (not entry or (*entry)->is_deleted())
+    {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return {};
+    }
+
+    if ((*entry)->has_ttl() and (*entry)->ttl() < now)
+    {
+        // Will be cleaned up in the background by the maintenance thread. Readers only hold a shared
+        // lock on the store, so the queue needs its own lock.
+        auto delete_lock = std::lock_guard{delete_mutex};
+        delete_keys[std::string(key)] = expiry_info{.version = (*entry)->version(), .delete_reason = delete_reason::ttl_expiry};
+
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return {};
+    }
+
+    hits.fetch_add(1, std::memory_order_relaxed);
+    touch(**entry, now);
+    return *entry;
+}
+
+void LambdaSnail::server::database::shard::assign(std::string_view const key, size_t const key_hash, entry* const value)
+{
+    auto value_wrapper = entry_ptr(value);
+
+    // Incrementing the version allows us to ignore the queue of entries to
+    // be deleted, as the maintenance thread will see that the version is different
+    // and abort the delete (unless exactly 2^32 sets are called before the next cleanup ...)
+    auto& stored_entry = *store.try_emplace(key, key_hash).first;
+    value->set_version(stored_entry ? stored_entry->version() + 1 : 0);
+
+    if (value->has_ttl())
+    {
+        expiries.add(key, value->ttl());
+    }
+
+    if (tracks_access())
+    {
+        value->set_access_clock(access_clock::initial(limit->policy, std::chrono::system_clock::now()));
+    }
+
+    account(key, stored_entry.get(), value);
+    release(std::exchange(stored_entry, std::move(value_wrapper)));
+    log_value(key, *value);
+}
+
+void LambdaSnail::server::database::shard::account(std::string_view const key, entry const* const old_value, entry const* const new_value) noexcept
+{
+    auto const footprint = [key](entry const* value) {
+        return value ? static_cast<int64_t>(store_t::element_size(key) + value->memory_usage()) : int64_t{ 0 };
+    };
+
+    if (auto const delta = footprint(new_value) - footprint(old_value); delta != 0)
+    {
+        limit->used_bytes.fetch_add(delta, std::memory_order_relaxed);
+        used_bytes += delta;
+    }
+}
+
+void LambdaSnail::server::database::shard::release(entry_ptr value) const
+{
+    if (lazy_free)
+    {
+        lazy_free->release(std::move(value));
+    }
+}
+
+void LambdaSnail::server::database::shard::log_value(std::string_view const key, entry const& value) const
+{
+    if (not log) [[likely]]
+    {
+        return;
+    }
+
+    with_set_command(key, value, [this](std::span<std::string_view const> const arguments) { log->append(database_index, arguments); });
+}
+
+void LambdaSnail::server::database::shard::log_delete(std::string_view const key) const
+{
+    if (not log) [[likely]]
+    {
+        return;
+    }
+
+    std::array<std::string_view, 2> const arguments{ "DEL", key };
+    log->append(database_index, arguments);
+}
+
+void LambdaSnail::server::database::shard::touch(entry const& value, time_point_t const now) const noexcept
+{
+    // The clock of a cold entry tells promote whether the key has been read before
+    if (tracks_access() and value.encoding() != entry_encoding::cold)
+    {
+        value.set_access_clock(access_clock::touch(limit->policy, value.access_clock(), now));
+    }
+}
+
+bool LambdaSnail::server::database::shard::tracks_access() const noexcept
+{
+    return limit->policy == eviction_policy::allkeys_lru or limit->policy == eviction_policy::allkeys_lfu or tier != nullptr;
+}
+
+std::expected<int64_t, LambdaSnail::server::value_error> LambdaSnail::server::database::increment(std::string_view const key, int64_t const delta)
+{
+    auto const now      = std::chrono::system_clock::now();
+    auto const key_hash = hash(key);
+    auto& shard         = get_shard(key_hash);
+    auto lock           = std::unique_lock{shard.mutex};
+
+    auto& stored_entry = *shard.store.try_emplace(key, key_hash).first;
+    if (not is_live(stored_entry, now))
+    {
+        auto const version = stored_entry ? stored_entry->version() + 1 : 0;
+        auto created       = entry_ptr(entry::create(delta, version, time_point_t::min()));
+        if (shard.tracks_access())
+        {
+            created->set_access_clock(access_clock::initial(m_memory_limit->policy, now));
+        }
+
+        shard.account(key, stored_entry.get(), created.get());
+        shard.release(std::exchange(stored_entry, std::move(created)));
+        shard.log_value(key, *stored_entry);
+        return delta;
+    }
+
+    shard.touch(*stored_entry, now);
+
+    if (stored_entry->encoding() != entry_encoding::integer)
+    {
+        return std::unexpected(value_error::not_an_integer);
+    }
+
+    auto const current = stored_entry->integer();
+    if ((delta > 0 and current > std::numeric_limits<int64_t>::max() - delta) or
+        (delta < 0 and current < std::numeric_limits<int64_t>::min() - delta))
+    {
+        return std::unexpected(value_error::overflow);
+    }
+
+    auto const result = current + delta;
+    // Counters are updated in place, which saves an allocation per update. Readers that still hold a
+    // reference see either the old or the new value.
+    const_cast<entry*>(stored_entry.get())->set_integer(result);
+    shard.log_value(key, *stored_entry);
+    return result;
+}
+
+std::expected<LambdaSnail::server::entry_ptr, LambdaSnail::server::value_error> LambdaSnail::server::database::increment_float(
+        std::string_view const key, double const delta)
+{
+    auto const now      = std::chrono::system_clock::now();
+    auto const key_hash = hash(key);
+    auto& shard         = get_shard(key_hash);
+    auto lock           = std::unique_lock{shard.mutex};
+
+    auto& stored_entry = *shard.store.try_emplace(key, key_hash).first;
+    auto const is_set  = is_live(stored_entry, now);
+
+    double current{};
+    if (is_set)
+    {
+        // Values that parse as a number are never moved to the cold tier, see shard::spill_cold_values
+        auto const value = stored_entry->encoding() == entry_encoding::integer ? std::optional{ static_cast<double>(stored_entry->integer()) }
+                         : stored_entry->encoding() == entry_encoding::cold    ? std::nullopt
+                                                                               : parse_double(stored_entry->value());
+        if (not value)
+        {
+            return std::unexpected(value_error::not_a_float);
+        }
+
+        current = *value;
+    }
+
+    auto const result = current + delta;
+    if (not std::isfinite(result))
+    {
+        return std::unexpected(value_error::not_finite);
+    }
+
+    // Fixed notation like Redis, the shortest representation that parses back to the same number
+    std::array<char, 512> buffer{};
+    auto const [end, error] = std::to_chars(buffer.data(), buffer.data() + buffer.size(), result, std::chars_format::fixed);
+    assert(error == std::errc{});
+
+    auto const version = stored_entry ? stored_entry->version() + 1 : 0;
+    auto const ttl     = is_set ? stored_entry->ttl() : time_point_t::min();
+    auto created       = entry_ptr(entry::create(std::string_view(buffer.data(), end), version, ttl));
+    if (shard.tracks_access())
+    {
+        auto const policy = m_memory_limit->policy;
+        created->set_access_clock(is_set ? access_clock::touch(policy, stored_entry->access_clock(), now) : access_clock::initial(policy, now));
+    }
+
+    shard.account(key, stored_entry.get(), created.get());
+    shard.release(std::exchange(stored_entry, std::move(created)));
+    shard.log_value(key, *stored_entry);
+
+    return stored_entry;
+}
+
+std::optional<size_t> LambdaSnail::server::database::memory_usage(std::string_view const key) const
+{
+    auto const key_hash = hash(key);
+    auto& shard         = get_shard(key_hash);
+    auto lock           = std::shared_lock{shard.mutex};
+
+    auto const* entry = shard.store.find(key, key_hash);
+    if (not entry)
+    {
+        return std::nullopt;
+    }
+
+    return store_t::element_size(key) + (*entry)->memory_usage();
+}
+
+LambdaSnail::server::expire_cycle_result LambdaSnail::server::database::handle_deletes(
+        time_point_t const now, std::chrono::steady_clock::time_point const deadline)
+{
+    expire_cycle_result result{};
+    result.incomplete = for_each_shard_batch(m_next_expire_shard, deadline, [&](shard& shard) {
+        auto const shard_result = shard.handle_deletes(now, expire_batch_size);
+        result.expired_keys += shard_result.expired_keys;
+        return shard_result.incomplete;
+    });
+
+    return result;
+}
+
+LambdaSnail::server::expire_cycle_result LambdaSnail::server::database::shard::handle_deletes(time_point_t now, size_t const max_keys)
+{
+    // For simplicity, we lock the entire shard while performing maintenance
+    auto lock = std::unique_lock{mutex};
+
+    // Growing tables are migrated by writes, this makes sure that the migration also finishes for shards
+    // that receive few writes, so that the memory of the old table is returned
+    store.migrate(maintenance_migrate_slots);
+
+    expire_cycle_result result{};
+
+    decltype(delete_keys) pending_deletes;
+    {
+        auto delete_lock = std::lock_guard{delete_mutex};
+        pending_deletes.swap(delete_keys);
+    }
+
+    // First check if we have deleted any keys or expired them passively
+    for (auto& [key, expiry]: pending_deletes)
+    {
+        auto const key_hash = hash(key);
+        auto* entry         = store.find(key, key_hash);
+        if (not entry) [[unlikely]]
+        {
+            continue;
+        }
+
+        // If the version differs the key has been set again since it was queued. An expired
+        // entry is deleted regardless, and so is an entry with the delete flag set.
+        bool const is_expired = (*entry)->has_ttl() and (*entry)->has_expired(now);
+        if (((*entry)->version() != expiry.version or not is_expired) and not (*entry)->is_deleted())
+        {
+            continue;
+        }
+
+        // If we get here, we are confident the key can be deleted
+        account(key, entry->get(), nullptr);
+        release(std::move(*entry));
+        store.erase(key, key_hash);
+        ++result.expired_keys;
+    }
+
+    // Then remove the keys that have expired since the last pass. The index still holds keys that have been
+    // overwritten or deleted since they were added, so the stored entry decides whether the key expires.
+    auto const num_due = expiries.expire(now, max_keys, [this, now, &result](std::string_view const key, time_point_t) {
+        auto const key_hash = hash(key);
+        auto* entry         = store.find(key, key_hash);
+        if (entry and (*entry)->has_ttl() and (*entry)->has_expired(now))
+        {
+            account(key, entry->get(), nullptr);
+            release(std::move(*entry));
+            store.erase(key, key_hash);
+            ++result.expired_keys;
+        }
+    });
+
+    expired_keys.fetch_add(result.expired_keys, std::memory_order_relaxed);
+    result.incomplete = num_due == max_keys;
+
+    // Every key holds at most one current record, so when the index is much larger than the store most of its records
+    // were left behind by overwrites and deletes
+    if (expiries.size() > 2 * store.size() + expiry_compact_batch_size)
+    {
+        auto const is_current = [this](std::string_view const key, time_point_t const ttl) {
+            auto const* entry = store.find(key, hash(key));
+            return entry and (*entry)->has_ttl() and (*entry)->ttl() == ttl;
+        };
+
+        result.incomplete = not expiries.compact(expiry_compact_batch_size, is_current) or result.incomplete;
+    }
+
+    return result;
+}
+
+LambdaSnail::server::defrag_cycle_result LambdaSnail::server::database::defragment(std::chrono::steady_clock::time_point const deadline)
+{
+    defrag_cycle_result result{};
+    result.incomplete = for_each_shard_batch(m_next_defrag_shard, deadline, [&](shard& shard) {
+        auto const shard_result = shard.defragment(defrag_batch_size);
+        result.moved_entries += shard_result.moved_entries;
+        return shard_result.incomplete;
+    });
+
+    return result;
+}
+
+LambdaSnail::server::defrag_cycle_result LambdaSnail::server::database::shard::defragment(size_t const max_slots)
+{
+    // Entries are only moved while the store holds the only reference, which cannot change under the exclusive lock
+    auto lock = std::unique_lock{mutex};
+
+    defrag_cycle_result result{};
+
+    auto const end = std::min(store.capacity(), defrag_cursor + max_slots);
+    for (; defrag_cursor < end; ++defrag_cursor)
+    {
+        if (store.is_occupied(defrag_cursor) and store.value_at(defrag_cursor).defragment())
+        {
+            ++result.moved_entries;
+        }
+    }
+
+    result.incomplete = defrag_cursor < store.capacity();
+    if (not result.incomplete)
+    {
+        defrag_cursor = 0;
+    }
+
+    return result;
+}
+
+LambdaSnail::server::spill_cycle_result LambdaSnail::server::database::spill_cold_values(
+        time_point_t const now, std::chrono::steady_clock::time_point const deadline)
+{
+    if (not m_cold_tier)
+    {
+        return {};
+    }
+
+    spill_cycle_result result{};
+    result.incomplete = for_each_shard_batch(m_next_spill_shard, deadline, [&](shard& shard) {
+        auto const shard_result = shard.spill_cold_values(now, spill_batch_size);
+        result.spilled_values += shard_result.spilled_values;
+        return shard_result.incomplete;
+    });
+
+    return result;
+}
+
+LambdaSnail::server::spill_cycle_result LambdaSnail::server::database::shard::spill_cold_values(time_point_t const now, size_t const max_slots)
+{
+    ZoneScoped;
+
+    struct candidate
+    {
+        std::string key{};
+        entry_ptr value{};
+        entry_ptr cold{};
+    };
+
+    auto const is_idle = [this, now](entry_ptr const& value) {
+        // Values that parse as a number stay in memory, so that the counter commands never need to read the file.
+        // Values referenced by replies are skipped, their memory would not be released yet.
+        return is_live(value, now) and value->encoding() == entry_encoding::raw and value->value_size() >= tier->get_min_size() and
+               value->use_count() == 1 and access_clock::idle_time(limit->policy, value->access_clock(), now) >= tier->get_idle_time() and
+               not parse_double(value->value());
+    };
+
+    spill_cycle_result result{};
+    std::vector<candidate> candidates;
+    {
+        auto lock = std::shared_lock{mutex};
+
+        auto const end = std::min(store.capacity(), spill_cursor + max_slots);
+        for (; spill_cursor < end; ++spill_cursor)
+        {
+            if (store.is_occupied(spill_cursor) and is_idle(store.value_at(spill_cursor)))
+            {
+                candidates.push_back(candidate{ .key = std::string(store.key_at(spill_cursor)), .value = store.value_at(spill_cursor) });
+            }
+        }
+
+        result.incomplete = spill_cursor < store.capacity();
+        if (not result.incomplete)
+        {
+            spill_cursor = 0;
+        }
+    }
+
+    if (candidates.empty())
+    {
+        return result;
+    }
+
+    // The values are written without holding the lock, clients of the shard are only paused to swap the entries
+    for (auto& candidate : candidates)
+    {
+        if (auto const offset = entry::cold_file().append(candidate.value->value()))
+        {
+            candidate.cold = entry_ptr(entry::create_cold(*candidate.value, *offset));
+        }
+    }
+
+    {
+        auto lock = std::unique_lock{mutex};
+        for (auto& candidate : candidates)
+        {
+            // Keys that have been written, removed or read in the meantime keep their value in memory, and the copy in
+            // the file is released along with the cold entry
+            auto* stored = store.find(candidate.key, hash(candidate.key));
+            if (not candidate.cold or not stored or stored->get() != candidate.value.get() or
+                candidate.value->access_clock() != candidate.cold->access_clock())
+            {
+                continue;
+            }
+
+            account(candidate.key, stored->get(), candidate.cold.get());
+            *stored = std::move(candidate.cold);
+            ++result.spilled_values;
+        }
+    }
+
+    for (auto& candidate : candidates)
+    {
+        release(std::move(candidate.value));
+    }
+
+    return result;
+}
+
+void LambdaSnail::server::database::promote(std::string_view const key, entry_ptr const& cold, entry_ptr const& loaded)
+{
+    assert(m_cold_tier);
+
+    auto const now      = std::chrono::system_clock::now();
+    auto const policy   = m_memory_limit->policy;
+    auto const key_hash = hash(key);
+    auto& shard         = get_shard(key_hash);
+
+    // Released after the lock, the lazy free worker punches its value out of the file
+    entry_ptr promoted;
+    {
+        auto lock    = std::unique_lock{shard.mutex};
+        auto* stored = shard.store.find(key, key_hash);
+        if (not stored or stored->get() != cold.get() or not is_live(*stored, now))
+        {
+            return;
+        }
+
+        if (access_clock::idle_time(policy, cold->access_clock(), now) >= m_cold_tier->get_idle_time())
+        {
+            cold->set_access_clock(access_clock::touch(policy, cold->access_clock(), now));
+            return;
+        }
 
-using namespace LambdaSnail::resp::literals;
+        loaded->set_access_clock(access_clock::touch(policy, cold->access_clock(), now));
+        shard.account(key, cold.get(), loaded.get());
+        promoted = std::exchange(*stored, loaded);
+    }
 
-bool LambdaSnail::server::entry_info::has_ttl() const
-{
-    return ttl != std::chrono::time_point<std::chrono::system_clock>::min();
+    shard.release(std::move(promoted));
 }
 
-bool LambdaSnail::server::entry_info::has_expired(time_point_t now) const { return ttl <= now; }
-
-bool LambdaSnail::server::entry_info::is_deleted() const { return flags & static_cast<flags_t>(entry_flags::deleted); }
+std::vector<std::shared_lock<std::shared_mutex>> LambdaSnail::server::database::lock_shared() const
+{
+    // Shards are locked in ascending order, like the multi-key commands, which rules out deadlocks with them
+    std::vector<std::shared_lock<std::shared_mutex>> locks;
+    locks.reserve(num_shards());
+    for (size_t i = 0; i < num_shards(); ++i)
+    {
+        locks.emplace_back(m_shards[i].mutex);
+    }
 
-void LambdaSnail::server::entry_info::set_deleted() { flags |= static_cast<flags_t>(entry_flags::deleted); }
+    return locks;
+}
 
-std::shared_ptr<LambdaSnail::server::entry_info> LambdaSnail::server::database::get_value(std::string const& key)
+void LambdaSnail::server::database::write_snapshot(snapshot_writer& writer, size_t const index, time_point_t const now) const
 {
-    auto lock = std::shared_lock{m_mutex};
+    ZoneScoped;
 
-    auto const it = m_store.find(key);
-    if (it == m_store.end() or it->second->is_deleted())
+    size_t num_keys = 0;
+    for (size_t i = 0; i < num_shards(); ++i)
     {
-        return nullptr;
+        num_keys += m_shards[i].store.size();
     }
 
-    if (it->second->has_ttl())
+    if (num_keys == 0)
     {
-        std::chrono::time_point<std::chrono::system_clock> const now = std::chrono::system_clock::now();
-        if (it->second->ttl < now)
-        {
-            // Will be cleaned up in the background by the maintenance thread
-            m_delete_keys[key] =
-                    expiry_info{.version = it->second->version, .delete_reason = delete_reason::ttl_expiry};
+        return;
+    }
 
-            return nullptr;
+    // The number of keys includes keys that have expired but not been removed yet, it only serves to presize the database
+    writer.begin_database(index, num_keys);
+    for (size_t i = 0; i < num_shards(); ++i)
+    {
+        auto const& store = m_shards[i].store;
+        for (size_t slot = 0; slot < store.capacity(); ++slot)
+        {
+            if (store.is_occupied(slot) and is_live(store.value_at(slot), now))
+            {
+                writer.write_entry(store.key_at(slot), *store.value_at(slot));
+            }
         }
     }
-
-    return it->second;
 }
 
-void LambdaSnail::server::database::set_value(std::string const& key, std::string_view value,
-                                              std::chrono::time_point<std::chrono::system_clock> ttl)
+void LambdaSnail::server::database::write_append_log(append_log_writer& writer, size_t const index, time_point_t const now) const
 {
-    auto lock = std::shared_lock{m_mutex};
+    ZoneScoped;
 
-    auto const it = m_store.find(key);
-    std::shared_ptr<entry_info> const value_wrapper =
-            (it == m_store.end()) ? std::make_shared<entry_info>() : it->second;
+    std::array<char, 20> index_buffer{};
+    auto const [end, error] = std::to_chars(index_buffer.data(), index_buffer.data() + index_buffer.size(), index);
 
-    value_wrapper->data  = std::string(value);
-    value_wrapper->ttl   = ttl;
-    value_wrapper->flags = {};
+    std::array<std::string_view, 2> const select{ "SELECT", std::string_view(index_buffer.data(), end) };
+    std::array<std::string_view, 1> const flush{ "FLUSHDB" };
+    writer.write_command(select);
+    writer.write_command(flush);
 
-    // Incrementing the version allows us to ignore the queue of entries to
-    // be deleted, as the maintenance thread will see that the version is different
-    // and abort the delete (unless exactly 2^32 sets are called before the next cleanup ...)
-    ++value_wrapper->version;
+    for (size_t i = 0; i < num_shards(); ++i)
+    {
+        auto const& store = m_shards[i].store;
+        for (size_t slot = 0; slot < store.capacity(); ++slot)
+        {
+            if (store.is_occupied(slot) and is_live(store.value_at(slot), now))
+            {
+                auto const& value = *store.value_at(slot);
+                with_set_command(store.key_at(slot), value, [&writer, &value](std::span<std::string_view const> const arguments) {
+                    if (value.encoding() == entry_encoding::cold)
+                    {
+                        writer.write_command(arguments, 2, value);
+                        return;
+                    }
 
-    m_store[key] = value_wrapper;
+                    writer.write_command(arguments);
+                });
+            }
+        }
+    }
 }
 
-void LambdaSnail::server::database::handle_deletes(time_point_t now, size_t max_num_tests)
+LambdaSnail::server::database_statistics LambdaSnail::server::database::get_statistics() const
 {
-    // For simplicity, we lock the entire database while performing maintenance
-    auto lock = std::unique_lock{m_mutex};
-
-    // First check if we have deleted any keys or expired hem passively
-    for (auto& [key, expiry]: m_delete_keys)
+    database_statistics statistics{};
+    for (size_t i = 0; i < num_shards(); ++i)
     {
-        auto entry_it = m_store.find(key);
-        if (entry_it == m_store.end()) [[unlikely]]
+        auto const& shard = m_shards[i];
         {
-            continue;
+            auto lock = std::shared_lock{shard.mutex};
+            statistics.num_keys += shard.store.size();
+            statistics.num_slots += shard.store.capacity();
         }
 
-        // Even if the version differs, the entry may have expired, so we check for that
-        // case as well, even if the delete reason is not due to an expired key.
-        // As an extra check we also abort the operation if the delete flag is not set.
-        if ((entry_it->second->version != expiry.version or not entry_it->second->has_expired(now)) or
-            not entry_it->second->is_deleted())
-        {
-            continue;
-        }
+        statistics.hits += shard.hits.load(std::memory_order_relaxed);
+        statistics.misses += shard.misses.load(std::memory_order_relaxed);
+        statistics.expired_keys += shard.expired_keys.load(std::memory_order_relaxed);
+        statistics.evicted_keys += shard.evicted_keys.load(std::memory_order_relaxed);
+    }
 
-        // If we get here, we are confident the key can be deleted
-        // m_store.unsafe_erase(entry_it);
-        m_store.erase(entry_it);
+    return statistics;
+}
+
+LambdaSnail::server::memory_limit const& LambdaSnail::server::database::get_memory_limit() const
+{
+    return *m_memory_limit;
+}
+
+LambdaSnail::server::lazy_free_worker const* LambdaSnail::server::database::get_lazy_free_worker() const
+{
+    return m_lazy_free.get();
+}
+
+void LambdaSnail::server::database::set_append_log(append_log* const log, size_t const index)
+{
+    m_append_log = log;
+    m_index      = index;
+    for (size_t i = 0; i < num_shards(); ++i)
+    {
+        auto lock                  = std::unique_lock{m_shards[i].mutex};
+        m_shards[i].log            = log;
+        m_shards[i].database_index = index;
+    }
+}
+
+void LambdaSnail::server::database::set_cold_tier(cold_tier const* const tier)
+{
+    m_cold_tier = tier;
+    for (size_t i = 0; i < num_shards(); ++i)
+    {
+        auto lock        = std::unique_lock{m_shards[i].mutex};
+        m_shards[i].tier = tier;
     }
+}
 
-    m_delete_keys.clear();
+void LambdaSnail::server::database::set_dataset(std::shared_ptr<mapped_dataset const> dataset)
+{
+    m_dataset = std::move(dataset);
+}
 
-    // A rare edge case perhaps, but no need to create random
-    // generator if this holds true
-    if (m_store.empty())
+std::optional<std::string_view> LambdaSnail::server::database::get_dataset_value(std::string_view const key) const noexcept
+{
+    if (not m_dataset) [[likely]]
     {
-        return;
+        return std::nullopt;
     }
 
-    // Now we test a few keys at random to see if they are expired
-    std::mt19937_64 random_engine(static_cast<uint64_t>(now.time_since_epoch().count()));
-    std::uniform_int_distribution<size_t> distribution(0, m_store.size());
+    return m_dataset->find(key);
+}
+
+bool LambdaSnail::server::database::is_read_only() const noexcept
+{
+    return m_dataset != nullptr;
+}
+
+void LambdaSnail::server::database::sample_eviction_candidates(eviction_pool& pool, size_t const database_index, size_t const num_samples) const
+{
+    auto const policy = m_memory_limit->policy;
+    auto const now    = std::chrono::system_clock::now();
 
-    for (size_t i = 0; i < max_num_tests; ++i)
+    for (size_t sample = 0; sample < num_samples; ++sample)
     {
-        auto store_it   = m_store.begin();
-        auto const incr = distribution(random_engine); // random_engine();
-        std::advance(store_it, static_cast<std::iter_difference_t<store_t::iterator>>(incr));
+        auto const& shard = m_shards[eviction_random() & m_shard_mask];
+        auto lock         = std::shared_lock{shard.mutex};
 
-        if (store_it == m_store.end())
+        if (shard.store.empty())
         {
-            break;
+            continue;
         }
 
-        if (store_it->second->has_ttl() and store_it->second->has_expired(now))
+        // Slots are scanned from a random position until a key is found, like the sampling of Redis. Tables do not
+        // shrink, so the scan is bounded for tables that have been mostly emptied.
+        auto const capacity = shard.store.capacity();
+        auto const start    = eviction_random() % capacity;
+        for (size_t offset = 0; offset < std::min(capacity, eviction_scan_limit); ++offset)
         {
-            m_store.erase(store_it);
+            auto const index = (start + offset) % capacity;
+            if (not shard.store.is_occupied(index))
+            {
+                continue;
+            }
+
+            auto const& value = shard.store.value_at(index);
+            if (not value or (policy == eviction_policy::volatile_ttl and not value->has_ttl()))
+            {
+                continue;
+            }
+
+            // Keys that expire sooner are evicted first
+            auto const score = policy == eviction_policy::volatile_ttl
+                    ? std::numeric_limits<uint64_t>::max() - static_cast<uint64_t>(value->ttl().time_since_epoch().count())
+                    : access_clock::eviction_score(policy, value->access_clock(), now);
+
+            pool.add(score, database_index, shard.store.key_at(index));
+            break;
         }
     }
 }
 
-std::string LambdaSnail::server::ping_handler::execute(std::vector<resp::data_view> const& args) noexcept
+bool LambdaSnail::server::database::evict(std::string_view const key)
 {
-    ZoneScoped;
+    auto const key_hash = hash(key);
+    auto& shard         = get_shard(key_hash);
+
+    // Released after the lock, like the values erased by DEL
+    entry_ptr evicted;
+    {
+        auto lock   = std::unique_lock{shard.mutex};
+        auto* entry = shard.store.find(key, key_hash);
+        if (not entry or not *entry)
+        {
+            return false;
+        }
 
-    assert(args.size() == 1);
-    return "PONG"_resp_simple_string;
+        shard.account(key, entry->get(), nullptr);
+        shard.log_delete(key);
+        evicted = std::move(*entry);
+        shard.store.erase(key, key_hash);
+    }
+
+    shard.release(std::move(evicted));
+    shard.evicted_keys.fetch_add(1, std::memory_order_relaxed);
+    return true;
 }
 
-std::string LambdaSnail::server::echo_handler::execute(std::vector<resp::data_view> const& args) noexcept
+void LambdaSnail::server::ping_handler::execute(database&, command_dispatch&, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
 {
     ZoneScoped;
 
-    if (args.size() != 2)
+    if (args.size() == 2)
     {
-        // TODO: Need clean way to specify RESP string literals
-        return "Malformed ECHO command"_resp_error;
+        out.bulk_string(args[1].materialize(resp::BulkString{}));
+        return;
     }
 
-    auto const str = args[1].materialize(resp::BulkString{});
-    return "$" + std::to_string(str.size()) + resp_end + std::string(str.data(), str.size()) + resp_end;
+    out.raw(resp::replies::pong);
 }
 
-LambdaSnail::server::static_response_handler::static_response_handler(std::string_view message) noexcept :
-    m_message(message)
+void LambdaSnail::server::echo_handler::execute(database&, command_dispatch&, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
 {
-}
+    ZoneScoped;
 
-std::string LambdaSnail::server::static_response_handler::execute(std::vector<resp::data_view> const& args) noexcept
-{
-    return std::string(m_message);
+    out.bulk_string(args[1].materialize(resp::BulkString{}));
 }
 
-std::string LambdaSnail::server::get_handler::execute(std::vector<LambdaSnail::resp::data_view> const& args) noexcept
+void LambdaSnail::server::get_handler::execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
 {
     ZoneScoped;
 
-    if (args.size() == 2)
-    {
-        auto const key = std::string(args[1].materialize(LambdaSnail::resp::BulkString{}));
+    auto const key = args[1].materialize(LambdaSnail::resp::BulkString{});
 
-        auto value = m_database->get_value(std::move(key));
-        if (value)
-        {
-            return value->data + resp_end;
-        }
+    auto const value = db.get_value(key);
+    if (value)
+    {
+        write_stored_entry(out, dispatch, db, key, value);
+        return;
     }
 
-    return resp_null;
+    write_dataset_value(out, db, key);
 }
 
-std::string LambdaSnail::server::set_handler::execute(std::vector<resp::data_view> const& args) noexcept
+void LambdaSnail::server::set_handler::execute(database& db, command_dispatch&, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
 {
     ZoneScoped;
 
     if (args.size() == 3)
     {
-        auto const key = std::string(args[1].materialize(resp::BulkString{}));
-        auto value     = args[2].value;
-        m_database->set_value(key, value);
-        return resp_ok;
+        auto const key = args[1].materialize(resp::BulkString{});
+        auto value     = args[2].materialize(resp::BulkString{});
+        db.set_value(key, value);
+        out.raw(resp::replies::ok);
+        return;
     }
 
     if (args.size() == 5)
     {
-        auto const key = std::string(args[1].materialize(resp::BulkString{}));
-        auto value     = args[2].value;
+        auto const key = args[1].materialize(resp::BulkString{});
+        auto value     = args[2].materialize(resp::BulkString{});
         auto option    = args[3].materialize(
-                resp::BulkString{}); // Assume EX or PX for now, also assume bulk string (can this be a simple string?)
+                resp::BulkString{}); // Assume EX, PX, EXAT or PXAT for now, also assume bulk string (can this be a simple string?)
 
         // Redis CLI sends a bulk string - need to refactor parsing part to handle various cases
         auto ttl_str = args[4].materialize(resp::BulkString{});
@@ -212,26 +1382,34 @@ std::string LambdaSnail::server::set_handler::execute(std::vector<resp::data_vie
         std::from_chars(ttl_str.data(), ttl_str.data() + ttl_str.length(), ttl);
         if (ttl == 0) [[unlikely]]
         {
-            return "Invalid option to SET command, EX and PX require a non-negative integer"_resp_error;
+            out.error("Invalid option to SET command, EX and PX require a non-negative integer");
+            return;
         }
 
         if (option == "EX")
         {
-            m_database->set_value(key, value, std::chrono::system_clock::now() + std::chrono::seconds(ttl));
+            db.set_value(key, value, std::chrono::system_clock::now() + std::chrono::seconds(ttl));
+        } else if (option == "EXAT")
+        {
+            db.set_value(key, value, time_point_t(std::chrono::seconds(ttl)));
+        } else if (option == "PXAT")
+        {
+            // The append-only file logs expiry times like this, as a unix time in milliseconds
+            db.set_value(key, value, time_point_t(std::chrono::milliseconds(ttl)));
         } else
         {
-            m_database->set_value(key, value, std::chrono::system_clock::now() + std::chrono::milliseconds(ttl));
+            db.set_value(key, value, std::chrono::system_clock::now() + std::chrono::milliseconds(ttl));
         }
 
-        return resp_ok;
+        out.raw(resp::replies::ok);
+        return;
     }
 
-
-    return "Unable to SET"_resp_error;
+    out.error("Unable to SET");
 }
 
 
-std::string LambdaSnail::server::select_handler::execute(std::vector<resp::data_view> const& args) noexcept
+void LambdaSnail::server::select_handler::execute(database&, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
 {
     ZoneScoped;
 
@@ -240,5 +1418,265 @@ std::string LambdaSnail::server::select_handler::execute(std::vector<resp::data_
 
     server::database_handle_t handle;
     std::from_chars(database.data(), database.data() + database.length(), handle);
-    return m_dispatch.handle_set_database(handle);
+    if (dispatch.handle_set_database(handle))
+    {
+        out.raw(resp::replies::ok);
+        return;
+    }
+
+    out.error("Invalid database index");
+}
+
+void LambdaSnail::server::memory_handler::execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    auto const subcommand    = args[1].materialize(resp::BulkString{});
+    auto const is_subcommand = [subcommand](std::string_view const name) {
+        return std::ranges::equal(subcommand, name, [](char const a, char const b) { return std::toupper(static_cast<unsigned char>(a)) == b; });
+    };
+
+    if (is_subcommand("STATS"))
+    {
+        write_memory_stats(db, dispatch.get_server().get_buffer_pool(), dispatch.get_server().get_maintenance_worker(), out);
+        return;
+    }
+
+    if (not is_subcommand("USAGE"))
+    {
+        out.error("ERR unknown subcommand '", subcommand, "'");
+        return;
+    }
+
+    // SAMPLES is accepted for compatibility, the usage is exact so there is nothing to sample
+    if (args.size() != 3 and args.size() != 5)
+    {
+        out.error("ERR wrong number of arguments for 'memory|usage' command");
+        return;
+    }
+
+    auto const usage = db.memory_usage(args[2].materialize(resp::BulkString{}));
+    if (not usage)
+    {
+        out.null();
+        return;
+    }
+
+    out.integer(static_cast<int64_t>(*usage));
+}
+
+void LambdaSnail::server::incr_handler::execute(database& db, command_dispatch&, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    increment_by(db, args[1].materialize(resp::BulkString{}), 1, out);
+}
+
+void LambdaSnail::server::decr_handler::execute(database& db, command_dispatch&, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    increment_by(db, args[1].materialize(resp::BulkString{}), -1, out);
+}
+
+void LambdaSnail::server::incrby_handler::execute(database& db, command_dispatch&, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    auto const delta = parse_integer(args[2].materialize(resp::BulkString{}));
+    if (not delta)
+    {
+        write_value_error(out, value_error::not_an_integer);
+        return;
+    }
+
+    increment_by(db, args[1].materialize(resp::BulkString{}), *delta, out);
+}
+
+void LambdaSnail::server::decrby_handler::execute(database& db, command_dispatch&, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    auto const delta = parse_integer(args[2].materialize(resp::BulkString{}));
+    if (not delta)
+    {
+        write_value_error(out, value_error::not_an_integer);
+        return;
+    }
+
+    if (*delta == std::numeric_limits<int64_t>::min()) [[unlikely]]
+    {
+        out.error("ERR decrement would overflow");
+        return;
+    }
+
+    increment_by(db, args[1].materialize(resp::BulkString{}), -*delta, out);
+}
+
+void LambdaSnail::server::incrbyfloat_handler::execute(database& db, command_dispatch&, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    auto const delta = parse_double(args[2].materialize(resp::BulkString{}));
+    if (not delta)
+    {
+        write_value_error(out, value_error::not_a_float);
+        return;
+    }
+
+    auto const result = db.increment_float(args[1].materialize(resp::BulkString{}), *delta);
+    if (not result)
+    {
+        write_value_error(out, result.error());
+        return;
+    }
+
+    write_entry(out, *result);
+}
+
+void LambdaSnail::server::mget_handler::execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    auto const keys = materialize_keys(dispatch.scratch(), args);
+    std::pmr::vector<entry_ptr> values(keys.size(), &dispatch.scratch());
+    db.get_values(keys, values);
+
+    out.array_header(values.size());
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        if (values[i])
+        {
+            write_stored_entry(out, dispatch, db, keys[i], values[i]);
+        }
+        else
+        {
+            write_dataset_value(out, db, keys[i]);
+        }
+    }
+}
+
+void LambdaSnail::server::mset_handler::execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    if (args.size() % 2 == 0)
+    {
+        out.error("ERR wrong number of arguments for 'MSET' command");
+        return;
+    }
+
+    set_pairs(db, dispatch.scratch(), args, false);
+    out.raw(resp::replies::ok);
+}
+
+void LambdaSnail::server::msetnx_handler::execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    if (args.size() % 2 == 0)
+    {
+        out.error("ERR wrong number of arguments for 'MSETNX' command");
+        return;
+    }
+
+    out.raw(set_pairs(db, dispatch.scratch(), args, true) ? resp::replies::one : resp::replies::zero);
+}
+
+void LambdaSnail::server::del_handler::execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    out.integer(static_cast<int64_t>(db.erase_values(materialize_keys(dispatch.scratch(), args))));
+}
+
+void LambdaSnail::server::unlink_handler::execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    out.integer(static_cast<int64_t>(db.erase_values(materialize_keys(dispatch.scratch(), args), true)));
+}
+
+void LambdaSnail::server::flushdb_handler::execute(database& db, command_dispatch&, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    auto const lazy_free = parse_flush_mode(args);
+    if (not lazy_free)
+    {
+        out.error("ERR syntax error");
+        return;
+    }
+
+    db.flush(*lazy_free);
+    out.raw(resp::replies::ok);
+}
+
+void LambdaSnail::server::flushall_handler::execute(database&, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    auto const lazy_free = parse_flush_mode(args);
+    if (not lazy_free)
+    {
+        out.error("ERR syntax error");
+        return;
+    }
+
+    dispatch.get_server().flush_all(*lazy_free);
+    out.raw(resp::replies::ok);
+}
+
+void LambdaSnail::server::save_handler::execute(database&, command_dispatch& dispatch, std::span<resp::data_view const>, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    if (auto const result = dispatch.get_server().save(); not result)
+    {
+        out.error("ERR ", result.error());
+        return;
+    }
+
+    out.raw(resp::replies::ok);
+}
+
+void LambdaSnail::server::bgsave_handler::execute(database&, command_dispatch& dispatch, std::span<resp::data_view const>, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    if (auto const result = dispatch.get_server().background_save(); not result)
+    {
+        out.error("ERR ", result.error());
+        return;
+    }
+
+    out.simple_string("Background saving started");
+}
+
+void LambdaSnail::server::bgrewriteaof_handler::execute(database&, command_dispatch& dispatch, std::span<resp::data_view const>, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    if (auto const result = dispatch.get_server().rewrite_append_log(); not result)
+    {
+        out.error("ERR ", result.error());
+        return;
+    }
+
+    out.simple_string("Background append only file rewriting started");
+}
+
+void LambdaSnail::server::lastsave_handler::execute(database&, command_dispatch& dispatch, std::span<resp::data_view const>, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    auto const last_save = dispatch.get_server().get_save_status().last_save;
+    out.integer(std::chrono::duration_cast<std::chrono::seconds>(last_save.time_since_epoch()).count());
+}
+
+void LambdaSnail::server::exists_handler::execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept
+{
+    ZoneScoped;
+
+    out.integer(static_cast<int64_t>(db.count_existing(materialize_keys(dispatch.scratch(), args))));
 }
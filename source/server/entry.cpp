@@ -0,0 +1,649 @@
+module;
+
+#include <atomic>
+#include <cassert>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+export module server :server.entry;
+
+import :server.cold_storage;
+import memory;
+import resp;
+
+namespace LambdaSnail::server
+{
+    export enum class entry_type : uint8_t
+    {
+        string = 0
+    };
+
+    export enum class entry_encoding : uint8_t
+    {
+        /**
+         * The value is stored in the same allocation as the header.
+         */
+        embedded = 0,
+
+        /**
+         * The header holds a pointer to a separate allocation with the value.
+         */
+        raw = 1,
+
+        /**
+         * The value is the canonical representation of a 64-bit integer, which is stored instead.
+         */
+        integer = 2,
+
+        /**
+         * The value has been moved to the cold tier, see cold_storage. The header holds its offset in the file.
+         */
+        cold = 3
+    };
+
+    /**
+     * Parses a 64-bit integer the way Redis does. Only the canonical representation is accepted: no sign for
+     * positive numbers, no leading zeros and no whitespace, so that formatting the result gives back the input.
+     */
+    export [[nodiscard]] std::optional<int64_t> parse_integer(std::string_view value) noexcept;
+
+    /**
+     * Parses a finite floating point number, rejecting whitespace, NaN and infinity.
+     */
+    export [[nodiscard]] std::optional<double> parse_double(std::string_view value) noexcept;
+
+    /**
+     * A stored value. The entry is a packed header followed by the expiry time, which is only stored for
+     * entries that have one, and then the value itself or a pointer to it. Values of up to max_embedded_size
+     * bytes are embedded, so that small entries take up a single allocation of at most 64 bytes. Values that
+     * are integers are stored as such.
+     *
+     * Entries are never modified after they have been stored, except for the flags and the value of integer
+     * entries, which the counter commands update in place. Entries are shared through an intrusive reference
+     * count, see entry_ptr.
+     */
+    export class entry
+    {
+    public:
+        using version_t    = uint32_t;
+        using time_point_t = std::chrono::time_point<std::chrono::system_clock>;
+
+        static constexpr size_t max_embedded_size = 40;
+
+        enum class entry_flags : uint8_t
+        {
+            no_state = 0,
+            deleted  = 1 << 0,
+            has_ttl  = 1 << 1
+        };
+
+        /**
+         * Creates an entry with a reference count of zero, see entry_ptr::make.
+         */
+        [[nodiscard]] static entry* create(std::string_view value, version_t version, time_point_t ttl);
+        [[nodiscard]] static entry* create(int64_t value, version_t version, time_point_t ttl);
+
+        /**
+         * Creates an entry that refers to the value of the source entry, which has been written to the cold tier at
+         * the offset. The entry keeps the version, expiry time and access clock of the source.
+         */
+        [[nodiscard]] static entry* create_cold(entry const& source, uint64_t offset);
+
+        /**
+         * Creates a raw encoded entry with the size, version and expiry time of a cold entry, whose value is filled
+         * in by load.
+         */
+        [[nodiscard]] static entry* create_loaded(entry const& cold);
+
+        /**
+         * Reads the value of a cold entry into this entry, which was created by create_loaded. Only meant to be
+         * called by the owner of the new entry, before the value is used.
+         */
+        [[nodiscard]] bool load(entry const& cold) noexcept;
+
+        /**
+         * The value of an entry that is neither integer nor cold encoded.
+         */
+        [[nodiscard]] std::string_view value() const noexcept;
+
+        /**
+         * The length of the value of an entry that is not integer encoded, including cold entries.
+         */
+        [[nodiscard]] uint32_t value_size() const noexcept { return m_size; }
+
+        /**
+         * The offset of the value of a cold entry in the file of the cold tier.
+         */
+        [[nodiscard]] uint64_t cold_offset() const noexcept;
+
+        /**
+         * The value of an integer encoded entry. Integers are read and written atomically, since they are
+         * updated in place while other threads may hold a reference to the entry.
+         */
+        [[nodiscard]] int64_t integer() const noexcept;
+        void set_integer(int64_t value) noexcept;
+
+        [[nodiscard]] entry_type type() const noexcept { return static_cast<entry_type>(m_kind >> 4); }
+        [[nodiscard]] entry_encoding encoding() const noexcept { return static_cast<entry_encoding>(m_kind & 0x0F); }
+        [[nodiscard]] version_t version() const noexcept { return m_version; }
+
+        /**
+         * Only meant to be called before the entry is stored, which allows creating the entry before the
+         * version of the entry it replaces is known.
+         */
+        void set_version(version_t version) noexcept { m_version = version; }
+
+        [[nodiscard]] bool has_ttl() const noexcept;
+        [[nodiscard]] time_point_t ttl() const noexcept;
+        [[nodiscard]] bool has_expired(time_point_t now) const noexcept;
+        [[nodiscard]] bool is_deleted() const noexcept;
+        void set_deleted() noexcept;
+
+        /**
+         * The access clock of the eviction policies, see access_clock. Readers that only hold a shared lock
+         * update it, so it is read and written atomically.
+         */
+        [[nodiscard]] uint16_t access_clock() const noexcept;
+        void set_access_clock(uint16_t clock) const noexcept;
+
+        /**
+         * The number of bytes allocated for the entry, including a value stored outside of it. Cold values do not
+         * count, since they are not in memory.
+         */
+        [[nodiscard]] size_t memory_usage() const noexcept;
+
+        void add_ref() const noexcept;
+        [[nodiscard]] uint32_t use_count() const noexcept;
+
+        /**
+         * Drops a reference and destroys the entry when it was the last one. The signature matches
+         * resp::value_pin::release_t.
+         */
+        static void release(void const* object) noexcept;
+
+        /**
+         * Entries and values stored outside of them are allocated from a slab allocator shared by all databases,
+         * which keeps them packed and allows active defragmentation.
+         */
+        [[nodiscard]] static memory::slab_allocator& allocator() noexcept;
+
+        /**
+         * The file of the cold tier, shared by all databases like the allocator. Values are only moved to it once
+         * it has been opened.
+         */
+        [[nodiscard]] static cold_storage& cold_file() noexcept;
+
+    private:
+        friend class entry_ptr;
+
+        /**
+         * Moves the entry, or the value stored outside of it, to new allocations when the allocator reports
+         * that this helps to release a sparse page. Returns the entry, which may have moved, or nullptr when
+         * nothing was moved. Requires that the caller holds the only reference.
+         */
+        [[nodiscard]] static entry* defragment(entry* source);
+
+        entry(uint32_t size, version_t version, entry_encoding encoding, bool has_ttl) noexcept;
+
+        [[nodiscard]] size_t value_offset() const noexcept;
+        [[nodiscard]] char const* payload() const noexcept;
+        [[nodiscard]] char* payload() noexcept;
+        [[nodiscard]] static entry* allocate(uint32_t size, version_t version, entry_encoding encoding, time_point_t ttl);
+        [[nodiscard]] static size_t allocation_size(uint32_t size, entry_encoding encoding, bool has_ttl) noexcept;
+
+        mutable std::atomic<uint32_t> m_refcount{};
+        version_t m_version{};
+        uint32_t m_size{};
+
+        /**
+         * The type in the upper four bits and the encoding in the lower four bits.
+         */
+        uint8_t m_kind{};
+        uint8_t m_flags{};
+        mutable uint16_t m_access_clock{};
+    };
+
+    static_assert(sizeof(entry) == 16);
+
+    /**
+     * An owning pointer to an entry, like a shared_ptr but without a separate control block.
+     */
+    export class entry_ptr
+    {
+    public:
+        entry_ptr() noexcept = default;
+        explicit entry_ptr(entry const* entry) noexcept;
+
+        [[nodiscard]] static entry_ptr make(std::string_view value, entry::version_t version = 0,
+                                            entry::time_point_t ttl = entry::time_point_t::min());
+
+        entry_ptr(entry_ptr const& other) noexcept;
+        entry_ptr(entry_ptr&& other) noexcept;
+        entry_ptr& operator=(entry_ptr const& other) noexcept;
+        entry_ptr& operator=(entry_ptr&& other) noexcept;
+        ~entry_ptr();
+
+        [[nodiscard]] entry const* get() const noexcept { return m_entry; }
+        [[nodiscard]] entry const* operator->() const noexcept { return m_entry; }
+        [[nodiscard]] entry const& operator*() const noexcept { return *m_entry; }
+        [[nodiscard]] explicit operator bool() const noexcept { return m_entry != nullptr; }
+
+        /**
+         * Pins the entry for a reply that references its value.
+         */
+        [[nodiscard]] resp::value_pin_t pin() const noexcept;
+
+        /**
+         * Moves the entry out of sparse allocator pages, see entry::defragment. Only done when this is the only
+         * reference to the entry. Returns whether the entry was moved.
+         */
+        bool defragment();
+
+    private:
+        entry const* m_entry{};
+    };
+}
+
+LambdaSnail::server::entry::entry(uint32_t const size, version_t const version, entry_encoding const encoding, bool const has_ttl) noexcept :
+    m_version(version),
+    m_size(size),
+    m_kind(static_cast<uint8_t>(static_cast<uint8_t>(entry_type::string) << 4 | static_cast<uint8_t>(encoding))),
+    m_flags(has_ttl ? static_cast<uint8_t>(entry_flags::has_ttl) : uint8_t{})
+{ }
+
+std::optional<int64_t> LambdaSnail::server::parse_integer(std::string_view const value) noexcept
+{
+    // At most 19 digits and a sign
+    if (value.empty() or value.size() > 20)
+    {
+        return std::nullopt;
+    }
+
+    auto const digits = value.front() == '-' ? value.substr(1) : value;
+    if (digits.empty() or (digits.front() == '0' and value.size() > 1))
+    {
+        return std::nullopt;
+    }
+
+    int64_t result{};
+    auto const [end, error] = std::from_chars(value.data(), value.data() + value.size(), result);
+    if (error != std::errc{} or end != value.data() + value.size())
+    {
+        return std::nullopt;
+    }
+
+    return result;
+}
+
+std::optional<double> LambdaSnail::server::parse_double(std::string_view const value) noexcept
+{
+    double result{};
+    auto const [end, error] = std::from_chars(value.data(), value.data() + value.size(), result);
+    if (value.empty() or error != std::errc{} or end != value.data() + value.size() or not std::isfinite(result))
+    {
+        return std::nullopt;
+    }
+
+    return result;
+}
+
+LambdaSnail::server::entry* LambdaSnail::server::entry::allocate(uint32_t const size, version_t const version,
+                                                                 entry_encoding const encoding, time_point_t const ttl)
+{
+    auto const has_ttl = ttl != time_point_t::min();
+
+    auto* memory = static_cast<char*>(allocator().allocate(allocation_size(size, encoding, has_ttl)));
+    auto* result = new (memory) entry(size, version, encoding, has_ttl);
+
+    if (has_ttl)
+    {
+        auto const ticks = ttl.time_since_epoch().count();
+        std::memcpy(memory + sizeof(entry), &ticks, sizeof(ticks));
+    }
+
+    return result;
+}
+
+LambdaSnail::server::entry* LambdaSnail::server::entry::create(std::string_view const value, version_t const version, time_point_t const ttl)
+{
+    if (auto const integer = parse_integer(value))
+    {
+        return create(*integer, version, ttl);
+    }
+
+    auto const encoding = value.size() <= max_embedded_size ? entry_encoding::embedded : entry_encoding::raw;
+    auto* result        = allocate(static_cast<uint32_t>(value.size()), version, encoding, ttl);
+
+    if (encoding == entry_encoding::embedded)
+    {
+        std::memcpy(result->payload(), value.data(), value.size());
+    }
+    else
+    {
+        auto* data = static_cast<char*>(allocator().allocate(value.size()));
+        std::memcpy(data, value.data(), value.size());
+        std::memcpy(result->payload(), &data, sizeof(data));
+    }
+
+    return result;
+}
+
+LambdaSnail::server::entry* LambdaSnail::server::entry::create(int64_t const value, version_t const version, time_point_t const ttl)
+{
+    auto* result = allocate(sizeof(int64_t), version, entry_encoding::integer, ttl);
+    new (result->payload()) int64_t(value);
+
+    return result;
+}
+
+LambdaSnail::server::entry* LambdaSnail::server::entry::create_cold(entry const& source, uint64_t const offset)
+{
+    assert(source.encoding() == entry_encoding::raw);
+
+    auto* result = allocate(source.m_size, source.m_version, entry_encoding::cold, source.ttl());
+    std::memcpy(result->payload(), &offset, sizeof(offset));
+    result->m_flags        = source.m_flags;
+    result->m_access_clock = source.access_clock();
+
+    return result;
+}
+
+LambdaSnail::server::entry* LambdaSnail::server::entry::create_loaded(entry const& cold)
+{
+    assert(cold.encoding() == entry_encoding::cold);
+
+    auto* result = allocate(cold.m_size, cold.m_version, entry_encoding::raw, cold.ttl());
+    auto* data   = static_cast<char*>(allocator().allocate(cold.m_size));
+    std::memcpy(result->payload(), &data, sizeof(data));
+    result->m_access_clock = cold.access_clock();
+
+    return result;
+}
+
+bool LambdaSnail::server::entry::load(entry const& cold) noexcept
+{
+    assert(encoding() == entry_encoding::raw and cold.encoding() == entry_encoding::cold and cold.m_size == m_size);
+
+    char* data;
+    std::memcpy(&data, payload(), sizeof(data));
+    return cold_file().read(cold.cold_offset(), std::span(data, m_size));
+}
+
+std::string_view LambdaSnail::server::entry::value() const noexcept
+{
+    assert(encoding() != entry_encoding::integer and encoding() != entry_encoding::cold);
+
+    if (encoding() == entry_encoding::embedded)
+    {
+        return { payload(), m_size };
+    }
+
+    char const* data;
+    std::memcpy(&data, payload(), sizeof(data));
+    return { data, m_size };
+}
+
+uint64_t LambdaSnail::server::entry::cold_offset() const noexcept
+{
+    assert(encoding() == entry_encoding::cold);
+
+    uint64_t offset;
+    std::memcpy(&offset, payload(), sizeof(offset));
+    return offset;
+}
+
+int64_t LambdaSnail::server::entry::integer() const noexcept
+{
+    assert(encoding() == entry_encoding::integer);
+
+    // The payload follows the 16 byte header and the optional 8 byte expiry time, so it is aligned
+    auto& value = *reinterpret_cast<int64_t*>(const_cast<char*>(payload()));
+    return std::atomic_ref(value).load(std::memory_order_relaxed);
+}
+
+void LambdaSnail::server::entry::set_integer(int64_t const value) noexcept
+{
+    assert(encoding() == entry_encoding::integer);
+
+    std::atomic_ref(*reinterpret_cast<int64_t*>(payload())).store(value, std::memory_order_relaxed);
+}
+
+bool LambdaSnail::server::entry::has_ttl() const noexcept
+{
+    return m_flags & static_cast<uint8_t>(entry_flags::has_ttl);
+}
+
+LambdaSnail::server::entry::time_point_t LambdaSnail::server::entry::ttl() const noexcept
+{
+    if (not has_ttl())
+    {
+        return time_point_t::min();
+    }
+
+    time_point_t::rep ticks;
+    std::memcpy(&ticks, reinterpret_cast<char const*>(this) + sizeof(entry), sizeof(ticks));
+    return time_point_t(time_point_t::duration(ticks));
+}
+
+bool LambdaSnail::server::entry::has_expired(time_point_t const now) const noexcept
+{
+    return has_ttl() and ttl() <= now;
+}
+
+bool LambdaSnail::server::entry::is_deleted() const noexcept
+{
+    return m_flags & static_cast<uint8_t>(entry_flags::deleted);
+}
+
+void LambdaSnail::server::entry::set_deleted() noexcept
+{
+    m_flags |= static_cast<uint8_t>(entry_flags::deleted);
+}
+
+uint16_t LambdaSnail::server::entry::access_clock() const noexcept
+{
+    return std::atomic_ref(m_access_clock).load(std::memory_order_relaxed);
+}
+
+void LambdaSnail::server::entry::set_access_clock(uint16_t const clock) const noexcept
+{
+    // Skipping unchanged clocks keeps readers of popular keys from writing to the same cache line
+    if (access_clock() != clock)
+    {
+        std::atomic_ref(m_access_clock).store(clock, std::memory_order_relaxed);
+    }
+}
+
+size_t LambdaSnail::server::entry::memory_usage() const noexcept
+{
+    auto const size = memory::slab_allocator::allocation_size(allocation_size(m_size, encoding(), has_ttl()));
+    return encoding() == entry_encoding::raw ? size + memory::slab_allocator::allocation_size(m_size) : size;
+}
+
+void LambdaSnail::server::entry::add_ref() const noexcept
+{
+    m_refcount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void LambdaSnail::server::entry::release(void const* const object) noexcept
+{
+    auto const* instance = static_cast<entry const*>(object);
+    if (instance->m_refcount.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+
+    if (instance->encoding() == entry_encoding::raw)
+    {
+        allocator().deallocate(const_cast<char*>(instance->value().data()), instance->m_size);
+    }
+    else if (instance->encoding() == entry_encoding::cold)
+    {
+        cold_file().release(instance->cold_offset(), instance->m_size);
+    }
+
+    auto const size        = allocation_size(instance->m_size, instance->encoding(), instance->has_ttl());
+    auto* mutable_instance = const_cast<entry*>(instance);
+    mutable_instance->~entry();
+    allocator().deallocate(mutable_instance, size);
+}
+
+uint32_t LambdaSnail::server::entry::use_count() const noexcept
+{
+    return m_refcount.load(std::memory_order_acquire);
+}
+
+LambdaSnail::memory::slab_allocator& LambdaSnail::server::entry::allocator() noexcept
+{
+    static memory::slab_allocator s_allocator;
+    return s_allocator;
+}
+
+LambdaSnail::server::cold_storage& LambdaSnail::server::entry::cold_file() noexcept
+{
+    static cold_storage s_cold_file;
+    return s_cold_file;
+}
+
+LambdaSnail::server::entry* LambdaSnail::server::entry::defragment(entry* const source)
+{
+    auto& slab_allocator = allocator();
+
+    bool moved_value = false;
+    if (source->encoding() == entry_encoding::raw and slab_allocator.should_move(source->value().data(), source->m_size))
+    {
+        auto* const old_data = const_cast<char*>(source->value().data());
+        auto* data           = static_cast<char*>(slab_allocator.allocate(source->m_size));
+        std::memcpy(data, old_data, source->m_size);
+        std::memcpy(source->payload(), &data, sizeof(data));
+        slab_allocator.deallocate(old_data, source->m_size);
+        moved_value = true;
+    }
+
+    auto const size = allocation_size(source->m_size, source->encoding(), source->has_ttl());
+    if (not slab_allocator.should_move(source, size))
+    {
+        return moved_value ? source : nullptr;
+    }
+
+    // The value, or the pointer to it, moves along with the expiry time
+    auto* memory = static_cast<char*>(slab_allocator.allocate(size));
+    auto* result = new (memory) entry(source->m_size, source->m_version, source->encoding(), source->has_ttl());
+    result->m_flags        = source->m_flags;
+    result->m_access_clock = source->access_clock();
+    std::memcpy(memory + sizeof(entry), reinterpret_cast<char const*>(source) + sizeof(entry), size - sizeof(entry));
+
+    source->~entry();
+    slab_allocator.deallocate(source, size);
+
+    return result;
+}
+
+size_t LambdaSnail::server::entry::value_offset() const noexcept
+{
+    return sizeof(entry) + (has_ttl() ? sizeof(time_point_t::rep) : 0);
+}
+
+char const* LambdaSnail::server::entry::payload() const noexcept
+{
+    return reinterpret_cast<char const*>(this) + value_offset();
+}
+
+char* LambdaSnail::server::entry::payload() noexcept
+{
+    return reinterpret_cast<char*>(this) + value_offset();
+}
+
+size_t LambdaSnail::server::entry::allocation_size(uint32_t const size, entry_encoding const encoding, bool const has_ttl) noexcept
+{
+    auto const header_size = sizeof(entry) + (has_ttl ? sizeof(time_point_t::rep) : 0);
+    switch (encoding)
+    {
+        case entry_encoding::raw:
+            return header_size + sizeof(char*);
+        case entry_encoding::cold:
+            return header_size + sizeof(uint64_t);
+        default:
+            return header_size + size;
+    }
+}
+
+LambdaSnail::server::entry_ptr::entry_ptr(entry const* const entry) noexcept : m_entry(entry)
+{
+    if (m_entry)
+    {
+        m_entry->add_ref();
+    }
+}
+
+LambdaSnail::server::entry_ptr LambdaSnail::server::entry_ptr::make(std::string_view const value, entry::version_t const version,
+                                                                    entry::time_point_t const ttl)
+{
+    return entry_ptr(entry::create(value, version, ttl));
+}
+
+LambdaSnail::server::entry_ptr::entry_ptr(entry_ptr const& other) noexcept : entry_ptr(other.m_entry) { }
+
+LambdaSnail::server::entry_ptr::entry_ptr(entry_ptr&& other) noexcept : m_entry(std::exchange(other.m_entry, nullptr)) { }
+
+LambdaSnail::server::entry_ptr& LambdaSnail::server::entry_ptr::operator=(entry_ptr const& other) noexcept
+{
+    auto copy = other;
+    std::swap(m_entry, copy.m_entry);
+    return *this;
+}
+
+LambdaSnail::server::entry_ptr& LambdaSnail::server::entry_ptr::operator=(entry_ptr&& other) noexcept
+{
+    auto moved = std::move(other);
+    std::swap(m_entry, moved.m_entry);
+    return *this;
+}
+
+LambdaSnail::server::entry_ptr::~entry_ptr()
+{
+    if (m_entry)
+    {
+        entry::release(m_entry);
+    }
+}
+
+bool LambdaSnail::server::entry_ptr::defragment()
+{
+    if (not m_entry or m_entry->use_count() != 1)
+    {
+        return false;
+    }
+
+    auto* const source = const_cast<entry*>(m_entry);
+    auto const* result = entry::defragment(source);
+    if (result == nullptr or result == source)
+    {
+        return result != nullptr;
+    }
+
+    // The reference held by this pointer moves to the new entry
+    result->add_ref();
+    m_entry = result;
+    return true;
+}
+
+LambdaSnail::resp::value_pin_t LambdaSnail::server::entry_ptr::pin() const noexcept
+{
+    if (not m_entry)
+    {
+        return {};
+    }
+
+    m_entry->add_ref();
+    return { m_entry, &entry::release };
+}
@@ -0,0 +1,296 @@
+module;
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+export module server :server.eviction;
+
+namespace LambdaSnail::server
+{
+    export enum class eviction_policy : uint8_t
+    {
+        /**
+         * Writes that need memory fail while the limit is exceeded.
+         */
+        noeviction,
+
+        /**
+         * Evicts the keys that have not been used for the longest time.
+         */
+        allkeys_lru,
+
+        /**
+         * Evicts the keys that are used the least often.
+         */
+        allkeys_lfu,
+
+        /**
+         * Evicts the keys with the nearest expiry time, keys without one are never evicted.
+         */
+        volatile_ttl
+    };
+
+    /**
+     * The memory limit shared by the databases of a server, along with the memory they use. The usage counts the
+     * keys and values stored, databases update it on every write and the server evicts keys when it exceeds the
+     * limit. A limit of zero bytes means no limit.
+     */
+    export struct memory_limit
+    {
+        size_t max_bytes{};
+        eviction_policy policy{ eviction_policy::noeviction };
+        std::atomic<int64_t> used_bytes{};
+
+        [[nodiscard]] bool is_exceeded() const noexcept
+        {
+            return max_bytes != 0 and used_bytes.load(std::memory_order_relaxed) > static_cast<int64_t>(max_bytes);
+        }
+    };
+
+    /**
+     * Entries keep a 16-bit access clock. With LRU it holds the time of the last access in seconds, which wraps
+     * after about 18 hours, so keys that have been idle for longer than that may look recent. With LFU it holds
+     * a logarithmic access counter in the lower byte and the time the counter was last decayed, in minutes, in
+     * the upper byte, as in Redis. With the other policies it holds the time of the last access like LRU, which the
+     * cold tier uses to find idle values.
+     */
+    export namespace access_clock
+    {
+        using time_point_t = std::chrono::time_point<std::chrono::system_clock>;
+
+        /**
+         * The counter of new keys, so that they are not evicted before they had a chance to be used.
+         */
+        constexpr uint8_t lfu_initial_counter = 5;
+        constexpr uint32_t lfu_log_factor     = 10;
+
+        /**
+         * The number of minutes after which an unused counter is decremented by one.
+         */
+        constexpr uint32_t lfu_decay_minutes = 1;
+
+        /**
+         * The initial clock of a new entry.
+         */
+        [[nodiscard]] uint16_t initial(eviction_policy policy, time_point_t now) noexcept;
+
+        /**
+         * The clock of an entry that has just been accessed.
+         */
+        [[nodiscard]] uint16_t touch(eviction_policy policy, uint16_t clock, time_point_t now) noexcept;
+
+        /**
+         * How suitable the entry is for eviction, higher scores are evicted first.
+         */
+        [[nodiscard]] uint64_t eviction_score(eviction_policy policy, uint16_t clock, time_point_t now) noexcept;
+
+        /**
+         * The time since the entry was last accessed, modulo the wrap around of the clock. With LFU it has a
+         * resolution of minutes and wraps after about four hours.
+         */
+        [[nodiscard]] std::chrono::seconds idle_time(eviction_policy policy, uint16_t clock, time_point_t now) noexcept;
+
+        /**
+         * The longest idle time the clock can tell apart from a recent access, 255 minutes with LFU and 65535
+         * seconds otherwise. Longer idle times are never reached.
+         */
+        [[nodiscard]] std::chrono::seconds max_idle_time(eviction_policy policy) noexcept;
+    }
+
+    /**
+     * A key that was sampled for eviction, and the database it belongs to.
+     */
+    export struct eviction_candidate
+    {
+        uint64_t score{};
+        size_t database{};
+        std::string key{};
+    };
+
+    /**
+     * The best candidates for eviction found by sampling. Each round of eviction samples a few keys and adds
+     * them to the pool, then evicts the best candidate of the pool. Candidates that are not evicted stay in the
+     * pool, so over several rounds the evicted keys get close to the ones an exact LRU or LFU would pick.
+     */
+    export class eviction_pool
+    {
+    public:
+        static constexpr size_t capacity = 16;
+
+        /**
+         * Adds the candidate if its score is better than the worst candidate of a full pool.
+         */
+        void add(uint64_t score, size_t database, std::string_view key);
+
+        /**
+         * Removes and returns the best candidate. The pool must not be empty.
+         */
+        [[nodiscard]] eviction_candidate take_best();
+
+        void clear() noexcept { m_candidates.clear(); }
+        [[nodiscard]] bool empty() const noexcept { return m_candidates.empty(); }
+        [[nodiscard]] size_t size() const noexcept { return m_candidates.size(); }
+
+    private:
+        /**
+         * Ordered by ascending score, so that the best candidate is at the back.
+         */
+        std::vector<eviction_candidate> m_candidates{};
+    };
+
+    /**
+     * A fast random number for sampling, from a generator local to the thread.
+     */
+    export [[nodiscard]] uint64_t eviction_random() noexcept;
+}
+
+namespace
+{
+    uint32_t minutes_of(LambdaSnail::server::access_clock::time_point_t const now) noexcept
+    {
+        return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::minutes>(now.time_since_epoch()).count());
+    }
+
+    uint16_t seconds_of(LambdaSnail::server::access_clock::time_point_t const now) noexcept
+    {
+        return static_cast<uint16_t>(std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count());
+    }
+
+    /**
+     * The counter after the decay for the time since it was last decayed.
+     */
+    uint8_t lfu_decayed(uint16_t const clock, LambdaSnail::server::access_clock::time_point_t const now) noexcept
+    {
+        auto const counter = static_cast<uint8_t>(clock & 0xFF);
+        auto const elapsed = (minutes_of(now) - (clock >> 8u)) & 0xFFu;
+        auto const periods = elapsed / LambdaSnail::server::access_clock::lfu_decay_minutes;
+
+        return periods >= counter ? uint8_t{ 0 } : static_cast<uint8_t>(counter - periods);
+    }
+
+    /**
+     * Increments the counter with a probability that falls as the counter grows, so that 8 bits suffice.
+     */
+    uint8_t lfu_incremented(uint8_t const counter) noexcept
+    {
+        if (counter == 255)
+        {
+            return counter;
+        }
+
+        auto const base        = counter > LambdaSnail::server::access_clock::lfu_initial_counter ? counter - LambdaSnail::server::access_clock::lfu_initial_counter : 0;
+        auto const probability = 1.0 / (base * LambdaSnail::server::access_clock::lfu_log_factor + 1.0);
+        auto const random      = static_cast<double>(LambdaSnail::server::eviction_random() >> 11) * 0x1.0p-53;
+
+        return random < probability ? static_cast<uint8_t>(counter + 1) : counter;
+    }
+
+    uint16_t lfu_clock(uint8_t const counter, LambdaSnail::server::access_clock::time_point_t const now) noexcept
+    {
+        return static_cast<uint16_t>((minutes_of(now) & 0xFFu) << 8u | counter);
+    }
+}
+
+uint16_t LambdaSnail::server::access_clock::initial(eviction_policy const policy, time_point_t const now) noexcept
+{
+    switch (policy)
+    {
+        case eviction_policy::allkeys_lfu:
+            return lfu_clock(lfu_initial_counter, now);
+        default:
+            return seconds_of(now);
+    }
+}
+
+uint16_t LambdaSnail::server::access_clock::touch(eviction_policy const policy, uint16_t const clock, time_point_t const now) noexcept
+{
+    switch (policy)
+    {
+        case eviction_policy::allkeys_lfu:
+            return lfu_clock(lfu_incremented(lfu_decayed(clock, now)), now);
+        default:
+            return seconds_of(now);
+    }
+}
+
+uint64_t LambdaSnail::server::access_clock::eviction_score(eviction_policy const policy, uint16_t const clock, time_point_t const now) noexcept
+{
+    switch (policy)
+    {
+        case eviction_policy::allkeys_lru:
+            // The idle time in seconds, modulo the wrap around of the clock
+            return static_cast<uint16_t>(seconds_of(now) - clock);
+        case eviction_policy::allkeys_lfu:
+            return 255u - lfu_decayed(clock, now);
+        default:
+            return 0;
+    }
+}
+
+std::chrono::seconds LambdaSnail::server::access_clock::idle_time(eviction_policy const policy, uint16_t const clock, time_point_t const now) noexcept
+{
+    if (policy == eviction_policy::allkeys_lfu)
+    {
+        return std::chrono::minutes((minutes_of(now) - (clock >> 8u)) & 0xFFu);
+    }
+
+    return std::chrono::seconds(static_cast<uint16_t>(seconds_of(now) - clock));
+}
+
+std::chrono::seconds LambdaSnail::server::access_clock::max_idle_time(eviction_policy const policy) noexcept
+{
+    if (policy == eviction_policy::allkeys_lfu)
+    {
+        return std::chrono::minutes(0xFFu);
+    }
+
+    return std::chrono::seconds(0xFFFFu);
+}
+
+void LambdaSnail::server::eviction_pool::add(uint64_t const score, size_t const database, std::string_view const key)
+{
+    if (m_candidates.size() == capacity and score <= m_candidates.front().score)
+    {
+        return;
+    }
+
+    // A key that is sampled again only keeps its latest score
+    auto const existing = std::ranges::find_if(m_candidates, [database, key](eviction_candidate const& candidate) {
+        return candidate.database == database and candidate.key == key;
+    });
+    if (existing != m_candidates.end())
+    {
+        m_candidates.erase(existing);
+    }
+    else if (m_candidates.size() == capacity)
+    {
+        m_candidates.erase(m_candidates.begin());
+    }
+
+    auto const position = std::ranges::upper_bound(m_candidates, score, {}, &eviction_candidate::score);
+    m_candidates.insert(position, eviction_candidate{ .score = score, .database = database, .key = std::string(key) });
+}
+
+LambdaSnail::server::eviction_candidate LambdaSnail::server::eviction_pool::take_best()
+{
+    auto candidate = std::move(m_candidates.back());
+    m_candidates.pop_back();
+    return candidate;
+}
+
+uint64_t LambdaSnail::server::eviction_random() noexcept
+{
+    // xorshift64*, seeded differently for every thread
+    thread_local uint64_t state = 0x9E3779B97F4A7C15ull ^ reinterpret_cast<uintptr_t>(&state);
+
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1Dull;
+}
@@ -0,0 +1,175 @@
+module;
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+export module server :server.expiry_index;
+
+import :server.flat_table;
+
+namespace LambdaSnail::server
+{
+    /**
+     * An index of keys by the time they expire, so that the active expiry only visits keys that have
+     * actually expired. Keys are kept in buckets that each cover a short span of time, ordered by their
+     * start, which makes adding a key cheap and lets the expired keys be collected bucket by bucket.
+     *
+     * The index is not updated when a key is overwritten or deleted. Every key is handed out once for every
+     * time it was added, and the caller checks the stored entry to decide whether it still expires. The records
+     * left behind by overwrites are dropped by compact, so that keys whose ttl is refreshed often do not make the
+     * index grow without bound.
+     */
+    export class expiry_index
+    {
+    public:
+        using time_point_t = std::chrono::time_point<std::chrono::system_clock>;
+
+        static constexpr std::chrono::milliseconds bucket_width{ 100 };
+
+        void add(std::string_view key, time_point_t ttl);
+
+        /**
+         * Removes up to max_keys keys that expire at or before now from the index and passes them to the
+         * function along with their expiry time. Only the bucket that now falls into is scanned for keys
+         * that have not expired yet. Returns the number of keys passed to the function.
+         */
+        template<typename function_t>
+        size_t expire(time_point_t const now, size_t const max_keys, function_t&& function)
+        {
+            auto const current_bucket = bucket_of(now);
+
+            size_t num_expired = 0;
+            auto bucket        = m_buckets.begin();
+            while (bucket != m_buckets.end() and bucket->first <= current_bucket and num_expired < max_keys)
+            {
+                auto& records = bucket->second;
+
+                // Expired keys are moved to the end of the current bucket, all keys of earlier buckets have expired
+                auto const first_expired = bucket->first < current_bucket
+                        ? records.begin()
+                        : std::partition(records.begin(), records.end(), [now](record const& r) { return r.ttl > now; });
+
+                auto const num_available = static_cast<size_t>(records.end() - first_expired);
+                auto const num_taken     = std::min(num_available, max_keys - num_expired);
+                for (auto expired = records.end() - static_cast<ptrdiff_t>(num_taken); expired != records.end(); ++expired)
+                {
+                    function(expired->key.view(), expired->ttl);
+                }
+
+                records.erase(records.end() - static_cast<ptrdiff_t>(num_taken), records.end());
+                num_expired += num_taken;
+
+                if (records.empty())
+                {
+                    bucket = m_buckets.erase(bucket);
+                }
+                else if (num_taken == num_available)
+                {
+                    // Only keys that have not expired yet are left in the current bucket
+                    break;
+                }
+            }
+
+            m_size -= num_expired;
+            return num_expired;
+        }
+
+        /**
+         * Visits up to max_records records, continuing where the previous call stopped, and drops the ones for which
+         * is_current returns false along with duplicate records of a key. Only whole buckets are visited. Returns true
+         * once the last bucket has been visited, the next call then starts over with the first one.
+         */
+        template<typename predicate_t>
+        bool compact(size_t const max_records, predicate_t&& is_current)
+        {
+            size_t num_visited = 0;
+            auto bucket        = m_buckets.lower_bound(m_compact_cursor);
+            while (bucket != m_buckets.end() and num_visited < max_records)
+            {
+                auto& records = bucket->second;
+                num_visited += records.size();
+
+                auto const num_before = records.size();
+                std::erase_if(records, [&is_current](record const& r) { return not is_current(r.key.view(), r.ttl); });
+
+                // The records that are left all hold the ttl stored at their key, so records of the same key are equal
+                std::ranges::sort(records, {}, [](record const& r) { return r.key.view(); });
+                auto const duplicates = std::ranges::unique(records, {}, [](record const& r) { return r.key.view(); });
+                records.erase(duplicates.begin(), duplicates.end());
+
+                m_size -= num_before - records.size();
+                bucket = records.empty() ? m_buckets.erase(bucket) : std::next(bucket);
+            }
+
+            if (bucket == m_buckets.end())
+            {
+                m_compact_cursor = std::numeric_limits<int64_t>::min();
+                return true;
+            }
+
+            m_compact_cursor = bucket->first;
+            return false;
+        }
+
+        void clear();
+
+        /**
+         * The number of keys in the index, including keys that have been overwritten since they were added.
+         */
+        [[nodiscard]] size_t size() const noexcept;
+        [[nodiscard]] bool empty() const noexcept;
+
+    private:
+        struct record
+        {
+            time_point_t ttl;
+            compact_key key;
+        };
+
+        [[nodiscard]] static int64_t bucket_of(time_point_t time_point);
+
+        std::map<int64_t, std::vector<record>> m_buckets{};
+        size_t m_size{};
+
+        /**
+         * The bucket the next call to compact starts with.
+         */
+        int64_t m_compact_cursor{ std::numeric_limits<int64_t>::min() };
+    };
+}
+
+void LambdaSnail::server::expiry_index::add(std::string_view const key, time_point_t const ttl)
+{
+    m_buckets[bucket_of(ttl)].push_back(record{ .ttl = ttl, .key = compact_key(key) });
+    ++m_size;
+}
+
+void LambdaSnail::server::expiry_index::clear()
+{
+    m_buckets.clear();
+    m_size           = 0;
+    m_compact_cursor = std::numeric_limits<int64_t>::min();
+}
+
+size_t LambdaSnail::server::expiry_index::size() const noexcept
+{
+    return m_size;
+}
+
+bool LambdaSnail::server::expiry_index::empty() const noexcept
+{
+    return m_size == 0;
+}
+
+int64_t LambdaSnail::server::expiry_index::bucket_of(time_point_t const time_point)
+{
+    return std::chrono::floor<std::chrono::milliseconds>(time_point).time_since_epoch() / bucket_width;
+}
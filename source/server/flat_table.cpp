@@ -0,0 +1,742 @@
+module;
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define LAMBDA_SNAIL_FLAT_TABLE_SSE2
+#endif
+
+export module server :server.flat_table;
+
+namespace LambdaSnail::server
+{
+    /**
+     * An owning string for keys in the flat table. Keys of up to 15 bytes are stored inline, which keeps
+     * most keys in the same cache line as the rest of the slot. Longer keys are stored on the heap.
+     */
+    export class compact_key
+    {
+    public:
+        compact_key() noexcept = default;
+        explicit compact_key(std::string_view key);
+
+        compact_key(compact_key&& other) noexcept;
+        compact_key& operator=(compact_key&& other) noexcept;
+
+        compact_key(compact_key const&)            = delete;
+        compact_key& operator=(compact_key const&) = delete;
+
+        ~compact_key();
+
+        [[nodiscard]] std::string_view view() const noexcept;
+        [[nodiscard]] bool is_inline() const noexcept;
+
+        static constexpr size_t max_inline_size = 15;
+
+    private:
+        static constexpr uint8_t heap_marker = 0xFF;
+
+        /**
+         * The last byte holds the length of an inline key, or the heap marker. For keys on the heap the
+         * first bytes hold the pointer followed by the length.
+         */
+        alignas(8) char m_bytes[16]{};
+
+        [[nodiscard]] uint8_t tag() const noexcept { return static_cast<uint8_t>(m_bytes[15]); }
+        [[nodiscard]] char* heap_data() const noexcept;
+        [[nodiscard]] uint32_t heap_size() const noexcept;
+    };
+
+    /**
+     * A group of control bytes that is probed as a unit, with SSE2 when available. A control byte is either
+     * empty, deleted (a tombstone) or holds the lowest seven bits of the hash of the key in the slot.
+     */
+    struct alignas(16) control_group
+    {
+        static constexpr size_t width     = 16;
+        static constexpr int8_t empty     = static_cast<int8_t>(0x80);
+        static constexpr int8_t deleted   = static_cast<int8_t>(0xFE);
+
+        int8_t bytes[width];
+
+        [[nodiscard]] uint32_t match(int8_t tag) const noexcept;
+        [[nodiscard]] uint32_t match_empty() const noexcept;
+
+        /**
+         * Empty and deleted are the only control bytes with the sign bit set.
+         */
+        [[nodiscard]] uint32_t match_free() const noexcept;
+    };
+
+    export template<typename value_t>
+    class incremental_table;
+
+    /**
+     * Open addressing hash table from string keys to values, in the style of the Swiss tables. Slots
+     * are organized in groups of 16 whose control bytes are compared in parallel, so that most lookups
+     * touch one group of control bytes and one slot. The hash is passed in by the caller, which lets the
+     * database hash a key once for selecting the shard and probing the table, and lookups only need a
+     * string_view of the key.
+     */
+    export template<typename value_t>
+    class flat_table
+    {
+    public:
+        static constexpr size_t npos = static_cast<size_t>(-1);
+
+        flat_table() = default;
+        explicit flat_table(size_t num_elements) { reserve(num_elements); }
+
+        flat_table(flat_table&& other) noexcept { swap(other); }
+        flat_table& operator=(flat_table&& other) noexcept
+        {
+            flat_table(std::move(other)).swap(*this);
+            return *this;
+        }
+
+        flat_table(flat_table const&)            = delete;
+        flat_table& operator=(flat_table const&) = delete;
+
+        ~flat_table() { destroy(); }
+
+        [[nodiscard]] value_t* find(std::string_view key, size_t hash) noexcept
+        {
+            auto const index = find_index(key, hash);
+            return index == npos ? nullptr : &m_slots[index].value;
+        }
+
+        [[nodiscard]] value_t const* find(std::string_view key, size_t hash) const noexcept
+        {
+            auto const index = find_index(key, hash);
+            return index == npos ? nullptr : &m_slots[index].value;
+        }
+
+        /**
+         * Returns the value stored for the key, inserting a default constructed value if there is none.
+         * The second member tells whether the value was inserted.
+         */
+        std::pair<value_t*, bool> try_emplace(std::string_view key, size_t hash)
+        {
+            if (auto const index = find_index(key, hash); index != npos)
+            {
+                return { &m_slots[index].value, false };
+            }
+
+            if (needs_rehash()) [[unlikely]]
+            {
+                rehash(next_capacity());
+            }
+
+            return { &insert_new(compact_key(key), hash)->value, true };
+        }
+
+        /**
+         * Moves the element in an occupied slot into another table, which must not contain the key. This
+         * is used for migrating elements between tables without rehashing either of them as a whole.
+         */
+        void move_to(size_t const index, flat_table& target)
+        {
+            assert(is_occupied(index));
+
+            if (target.needs_rehash()) [[unlikely]]
+            {
+                target.rehash(target.next_capacity());
+            }
+
+            auto& old_slot  = m_slots[index];
+            auto const hash = std::hash<std::string_view>{}(old_slot.key.view());
+            auto* new_slot  = target.insert_new(std::move(old_slot.key), hash);
+            new_slot->value = std::move(old_slot.value);
+
+            erase_at(index);
+        }
+
+        bool erase(std::string_view key, size_t hash)
+        {
+            auto const index = find_index(key, hash);
+            if (index == npos)
+            {
+                return false;
+            }
+
+            erase_at(index);
+            return true;
+        }
+
+        /**
+         * Erases the element in an occupied slot, see is_occupied.
+         */
+        void erase_at(size_t const index)
+        {
+            assert(is_occupied(index));
+
+            std::destroy_at(&m_slots[index]);
+            --m_size;
+
+            // A group that still has an empty slot has never been full, so no probe sequence has passed
+            // through it and the slot can be marked as empty instead of leaving a tombstone
+            if (m_control[index / control_group::width].match_empty())
+            {
+                set_control(index, control_group::empty);
+            }
+            else
+            {
+                set_control(index, control_group::deleted);
+                ++m_tombstones;
+            }
+        }
+
+        /**
+         * Makes room for the number of elements without further rehashing.
+         */
+        void reserve(size_t const num_elements)
+        {
+            auto const required = capacity_for(num_elements);
+            if (required > m_capacity)
+            {
+                rehash(required);
+            }
+        }
+
+        void clear()
+        {
+            destroy();
+            m_control.reset();
+            m_slots      = nullptr;
+            m_capacity   = 0;
+            m_size       = 0;
+            m_tombstones = 0;
+        }
+
+        /**
+         * Hints the processor to load the control bytes that a lookup for the hash will probe first.
+         */
+        void prefetch(size_t const hash) const noexcept
+        {
+            if (m_capacity == 0)
+            {
+                return;
+            }
+
+            auto const group = h1(hash) & group_mask();
+#if defined(__GNUC__) || defined(__clang__)
+            __builtin_prefetch(&m_control[group]);
+            __builtin_prefetch(&m_slots[group * control_group::width]);
+#endif
+        }
+
+        [[nodiscard]] size_t size() const noexcept { return m_size; }
+        [[nodiscard]] bool empty() const noexcept { return m_size == 0; }
+
+        /**
+         * Whether inserting another element rehashes the table.
+         */
+        [[nodiscard]] bool needs_rehash() const noexcept { return m_size + m_tombstones + 1 > max_load(m_capacity); }
+
+        /**
+         * The number of slots, slot indices range from zero up to the capacity.
+         */
+        [[nodiscard]] size_t capacity() const noexcept { return m_capacity; }
+
+        [[nodiscard]] bool is_occupied(size_t const index) const noexcept { return control(index) >= 0; }
+
+        /**
+         * The memory taken up by an element in the table: its slot and control byte, and the key if it is
+         * stored outside of the slot. Does not include memory owned by the value.
+         */
+        [[nodiscard]] static constexpr size_t element_size(std::string_view const key) noexcept
+        {
+            return sizeof(slot) + 1 + (key.size() > compact_key::max_inline_size ? key.size() : 0);
+        }
+
+        [[nodiscard]] std::string_view key_at(size_t const index) const noexcept { return m_slots[index].key.view(); }
+        [[nodiscard]] value_t& value_at(size_t const index) noexcept { return m_slots[index].value; }
+        [[nodiscard]] value_t const& value_at(size_t const index) const noexcept { return m_slots[index].value; }
+
+        template<typename function_t>
+        void for_each(function_t&& function)
+        {
+            for (size_t i = 0; i < m_capacity; ++i)
+            {
+                if (is_occupied(i))
+                {
+                    function(m_slots[i].key.view(), m_slots[i].value);
+                }
+            }
+        }
+
+        void swap(flat_table& other) noexcept
+        {
+            std::swap(m_control, other.m_control);
+            std::swap(m_slots, other.m_slots);
+            std::swap(m_capacity, other.m_capacity);
+            std::swap(m_size, other.m_size);
+            std::swap(m_tombstones, other.m_tombstones);
+        }
+
+    private:
+        friend class incremental_table<value_t>;
+
+        struct slot
+        {
+            explicit slot(compact_key&& k) : key(std::move(k)) { }
+
+            compact_key key;
+            value_t value{};
+        };
+
+        [[nodiscard]] static constexpr size_t h1(size_t const hash) noexcept { return hash >> 7; }
+        [[nodiscard]] static constexpr int8_t h2(size_t const hash) noexcept { return static_cast<int8_t>(hash & 0x7F); }
+
+        /**
+         * At most 7/8 of the slots are in use, which keeps probe sequences short.
+         */
+        [[nodiscard]] static constexpr size_t max_load(size_t const capacity) noexcept { return capacity - capacity / 8; }
+
+        [[nodiscard]] static constexpr size_t capacity_for(size_t const num_elements) noexcept
+        {
+            return std::bit_ceil(std::max(num_elements + num_elements / 7 + 1, control_group::width));
+        }
+
+        /**
+         * Grow if the live elements take up most of the space, otherwise the tombstones are cleared by
+         * rehashing into a table of the same size.
+         */
+        [[nodiscard]] size_t next_capacity() const noexcept
+        {
+            auto const should_grow = m_size + 1 > max_load(m_capacity) / 2;
+            return should_grow ? std::max(m_capacity * 2, control_group::width) : m_capacity;
+        }
+
+        [[nodiscard]] size_t group_mask() const noexcept { return m_capacity / control_group::width - 1; }
+        [[nodiscard]] int8_t control(size_t const index) const noexcept
+        {
+            return m_control[index / control_group::width].bytes[index % control_group::width];
+        }
+
+        void set_control(size_t const index, int8_t const value) noexcept
+        {
+            m_control[index / control_group::width].bytes[index % control_group::width] = value;
+        }
+
+        [[nodiscard]] size_t find_index(std::string_view const key, size_t const hash) const noexcept
+        {
+            if (m_capacity == 0)
+            {
+                return npos;
+            }
+
+            auto const tag  = h2(hash);
+            auto const mask = group_mask();
+
+            // Triangular probing over the groups visits every group once when the number of groups is a power of two
+            auto group = h1(hash) & mask;
+            for (size_t probe = 0; probe <= mask; ++probe)
+            {
+                auto const& control = m_control[group];
+                for (auto matches = control.match(tag); matches != 0; matches &= matches - 1)
+                {
+                    auto const index = group * control_group::width + static_cast<size_t>(std::countr_zero(matches));
+                    if (m_slots[index].key.view() == key) [[likely]]
+                    {
+                        return index;
+                    }
+                }
+
+                if (control.match_empty()) [[likely]]
+                {
+                    return npos;
+                }
+
+                group = (group + probe + 1) & mask;
+            }
+
+            return npos;
+        }
+
+        [[nodiscard]] size_t find_free_index(size_t const hash) const noexcept
+        {
+            auto const mask = group_mask();
+
+            auto group = h1(hash) & mask;
+            for (size_t probe = 0;; ++probe)
+            {
+                if (auto const free = m_control[group].match_free(); free != 0)
+                {
+                    return group * control_group::width + static_cast<size_t>(std::countr_zero(free));
+                }
+
+                group = (group + probe + 1) & mask;
+            }
+        }
+
+        /**
+         * Inserts a key that is not in the table, there must be room for it.
+         */
+        slot* insert_new(compact_key&& key, size_t const hash)
+        {
+            auto const index = find_free_index(hash);
+            if (control(index) == control_group::deleted)
+            {
+                --m_tombstones;
+            }
+
+            set_control(index, h2(hash));
+            ++m_size;
+
+            return std::construct_at(&m_slots[index], std::move(key));
+        }
+
+        void rehash(size_t const new_capacity)
+        {
+            assert(new_capacity >= control_group::width and std::has_single_bit(new_capacity));
+            assert(max_load(new_capacity) >= m_size);
+
+            flat_table rehashed;
+            rehashed.m_control  = std::make_unique<control_group[]>(new_capacity / control_group::width);
+            rehashed.m_slots    = std::allocator<slot>{}.allocate(new_capacity);
+            rehashed.m_capacity = new_capacity;
+            for (size_t i = 0; i < new_capacity / control_group::width; ++i)
+            {
+                std::memset(rehashed.m_control[i].bytes, static_cast<uint8_t>(control_group::empty), control_group::width);
+            }
+
+            for (size_t i = 0; i < m_capacity; ++i)
+            {
+                if (not is_occupied(i))
+                {
+                    continue;
+                }
+
+                auto& old_slot  = m_slots[i];
+                auto const hash = std::hash<std::string_view>{}(old_slot.key.view());
+                auto* new_slot  = rehashed.insert_new(std::move(old_slot.key), hash);
+                new_slot->value = std::move(old_slot.value);
+            }
+
+            swap(rehashed);
+        }
+
+        void destroy() noexcept
+        {
+            if (not m_slots)
+            {
+                return;
+            }
+
+            // Drained tables are released without scanning their control bytes
+            for (size_t i = 0; i < m_capacity and m_size > 0; ++i)
+            {
+                if (is_occupied(i))
+                {
+                    std::destroy_at(&m_slots[i]);
+                }
+            }
+
+            std::allocator<slot>{}.deallocate(m_slots, m_capacity);
+            m_slots = nullptr;
+        }
+
+        std::unique_ptr<control_group[]> m_control{};
+        slot* m_slots{};
+        size_t m_capacity{};
+        size_t m_size{};
+        size_t m_tombstones{};
+    };
+
+    /**
+     * A flat table that grows incrementally, like the dictionaries of Redis. When the table is full, a larger
+     * table is allocated and the elements are migrated a few slots at a time by every write and by the
+     * maintenance work, instead of all at once by the write that happened to fill the table. Lookups check
+     * both tables while a migration is in progress.
+     */
+    export template<typename value_t>
+    class incremental_table
+    {
+    public:
+        /**
+         * The number of slots of the old table that each write migrates.
+         */
+        static constexpr size_t migrate_step = 64;
+
+        [[nodiscard]] value_t* find(std::string_view key, size_t hash) noexcept
+        {
+            if (auto* value = m_table.find(key, hash))
+            {
+                return value;
+            }
+
+            return is_rehashing() ? m_old_table.find(key, hash) : nullptr;
+        }
+
+        [[nodiscard]] value_t const* find(std::string_view key, size_t hash) const noexcept
+        {
+            if (auto const* value = m_table.find(key, hash))
+            {
+                return value;
+            }
+
+            return is_rehashing() ? m_old_table.find(key, hash) : nullptr;
+        }
+
+        /**
+         * See flat_table::try_emplace. New keys are always inserted into the new table.
+         */
+        std::pair<value_t*, bool> try_emplace(std::string_view key, size_t hash)
+        {
+            migrate(migrate_step);
+
+            if (is_rehashing())
+            {
+                if (auto* value = m_old_table.find(key, hash))
+                {
+                    return { value, false };
+                }
+            }
+
+            if (m_table.needs_rehash()) [[unlikely]]
+            {
+                if (auto* value = m_table.find(key, hash))
+                {
+                    return { value, false };
+                }
+
+                // The new table is sized to hold all elements of the old table while it is being filled, so
+                // this only finishes a migration early after an unusual mix of inserts and erases
+                migrate(m_old_table.capacity());
+                if (m_table.needs_rehash())
+                {
+                    start_rehash();
+                }
+            }
+
+            return m_table.try_emplace(key, hash);
+        }
+
+        bool erase(std::string_view key, size_t hash)
+        {
+            migrate(migrate_step);
+            return m_table.erase(key, hash) or (is_rehashing() and m_old_table.erase(key, hash));
+        }
+
+        /**
+         * Slot indices first cover the old table and then the new table.
+         */
+        void erase_at(size_t const index)
+        {
+            index < m_old_table.capacity() ? m_old_table.erase_at(index) : m_table.erase_at(index - m_old_table.capacity());
+        }
+
+        /**
+         * Migrates up to the given number of slots from the old table, if a migration is in progress.
+         */
+        void migrate(size_t const max_slots)
+        {
+            if (not is_rehashing())
+            {
+                return;
+            }
+
+            auto const end = std::min(m_migrate_index + max_slots, m_old_table.capacity());
+            for (; m_migrate_index < end and not m_old_table.empty(); ++m_migrate_index)
+            {
+                if (m_old_table.is_occupied(m_migrate_index))
+                {
+                    m_old_table.move_to(m_migrate_index, m_table);
+                }
+            }
+
+            if (m_old_table.empty())
+            {
+                m_old_table.clear();
+                m_migrate_index = 0;
+            }
+        }
+
+        /**
+         * Makes room for the number of elements, intended for presizing empty tables.
+         */
+        void reserve(size_t const num_elements)
+        {
+            migrate(m_old_table.capacity());
+            m_table.reserve(num_elements);
+        }
+
+        void clear()
+        {
+            m_table.clear();
+            m_old_table.clear();
+            m_migrate_index = 0;
+        }
+
+        void prefetch(size_t const hash) const noexcept { m_table.prefetch(hash); }
+
+        [[nodiscard]] static constexpr size_t element_size(std::string_view const key) noexcept
+        {
+            return flat_table<value_t>::element_size(key);
+        }
+
+        [[nodiscard]] bool is_rehashing() const noexcept { return m_old_table.capacity() != 0; }
+        [[nodiscard]] size_t size() const noexcept { return m_table.size() + m_old_table.size(); }
+        [[nodiscard]] bool empty() const noexcept { return size() == 0; }
+        [[nodiscard]] size_t capacity() const noexcept { return m_table.capacity() + m_old_table.capacity(); }
+
+        [[nodiscard]] bool is_occupied(size_t const index) const noexcept
+        {
+            return index < m_old_table.capacity() ? m_old_table.is_occupied(index) : m_table.is_occupied(index - m_old_table.capacity());
+        }
+
+        [[nodiscard]] std::string_view key_at(size_t const index) const noexcept
+        {
+            return index < m_old_table.capacity() ? m_old_table.key_at(index) : m_table.key_at(index - m_old_table.capacity());
+        }
+
+        [[nodiscard]] value_t& value_at(size_t const index) noexcept
+        {
+            return index < m_old_table.capacity() ? m_old_table.value_at(index) : m_table.value_at(index - m_old_table.capacity());
+        }
+
+        [[nodiscard]] value_t const& value_at(size_t const index) const noexcept
+        {
+            return index < m_old_table.capacity() ? m_old_table.value_at(index) : m_table.value_at(index - m_old_table.capacity());
+        }
+
+        template<typename function_t>
+        void for_each(function_t&& function)
+        {
+            m_old_table.for_each(function);
+            m_table.for_each(function);
+        }
+
+    private:
+        void start_rehash()
+        {
+            assert(not is_rehashing());
+
+            m_old_table.swap(m_table);
+            m_table.rehash(m_old_table.next_capacity());
+            m_migrate_index = 0;
+        }
+
+        flat_table<value_t> m_table{};
+
+        /**
+         * The table that is being migrated, which has no capacity when no migration is in progress.
+         */
+        flat_table<value_t> m_old_table{};
+        size_t m_migrate_index{};
+    };
+}
+
+LambdaSnail::server::compact_key::compact_key(std::string_view const key)
+{
+    if (key.size() <= max_inline_size)
+    {
+        std::memcpy(m_bytes, key.data(), key.size());
+        m_bytes[15] = static_cast<char>(key.size());
+        return;
+    }
+
+    auto* data       = new char[key.size()];
+    auto const size  = static_cast<uint32_t>(key.size());
+    std::memcpy(data, key.data(), key.size());
+    std::memcpy(m_bytes, &data, sizeof(data));
+    std::memcpy(m_bytes + sizeof(data), &size, sizeof(size));
+    m_bytes[15] = static_cast<char>(heap_marker);
+}
+
+LambdaSnail::server::compact_key::compact_key(compact_key&& other) noexcept
+{
+    std::memcpy(m_bytes, other.m_bytes, sizeof(m_bytes));
+    other.m_bytes[15] = 0;
+}
+
+LambdaSnail::server::compact_key& LambdaSnail::server::compact_key::operator=(compact_key&& other) noexcept
+{
+    if (this != &other)
+    {
+        this->~compact_key();
+        std::memcpy(m_bytes, other.m_bytes, sizeof(m_bytes));
+        other.m_bytes[15] = 0;
+    }
+
+    return *this;
+}
+
+LambdaSnail::server::compact_key::~compact_key()
+{
+    if (not is_inline())
+    {
+        delete[] heap_data();
+    }
+}
+
+std::string_view LambdaSnail::server::compact_key::view() const noexcept
+{
+    return is_inline() ? std::string_view(m_bytes, tag()) : std::string_view(heap_data(), heap_size());
+}
+
+bool LambdaSnail::server::compact_key::is_inline() const noexcept
+{
+    return tag() != heap_marker;
+}
+
+char* LambdaSnail::server::compact_key::heap_data() const noexcept
+{
+    char* data;
+    std::memcpy(&data, m_bytes, sizeof(data));
+    return data;
+}
+
+uint32_t LambdaSnail::server::compact_key::heap_size() const noexcept
+{
+    uint32_t size;
+    std::memcpy(&size, m_bytes + sizeof(char*), sizeof(size));
+    return size;
+}
+
+uint32_t LambdaSnail::server::control_group::match(int8_t const tag) const noexcept
+{
+#ifdef LAMBDA_SNAIL_FLAT_TABLE_SSE2
+    auto const control = _mm_load_si128(reinterpret_cast<__m128i const*>(bytes));
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(tag), control)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < width; ++i)
+    {
+        mask |= static_cast<uint32_t>(bytes[i] == tag) << i;
+    }
+
+    return mask;
+#endif
+}
+
+uint32_t LambdaSnail::server::control_group::match_empty() const noexcept
+{
+    return match(empty);
+}
+
+uint32_t LambdaSnail::server::control_group::match_free() const noexcept
+{
+#ifdef LAMBDA_SNAIL_FLAT_TABLE_SSE2
+    auto const control = _mm_load_si128(reinterpret_cast<__m128i const*>(bytes));
+    return static_cast<uint32_t>(_mm_movemask_epi8(control));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < width; ++i)
+    {
+        mask |= static_cast<uint32_t>(bytes[i] < 0) << i;
+    }
+
+    return mask;
+#endif
+}
@@ -0,0 +1,98 @@
+module;
+
+#include <atomic>
+#include <memory>
+#include <stop_token>
+#include <thread>
+#include <utility>
+#include <variant>
+
+#include <tracy/Tracy.hpp>
+
+module server;
+
+namespace LambdaSnail::server
+{
+    lazy_free_worker::lazy_free_worker() :
+        m_thread([this](std::stop_token const& stop_token) { run(stop_token); })
+    {
+    }
+
+    lazy_free_worker::~lazy_free_worker()
+    {
+        m_thread.request_stop();
+
+        // Wakes the thread up instead of waiting for the poll interval to pass
+        m_queue.enqueue(job_t{});
+    }
+
+    void lazy_free_worker::release(entry_ptr value)
+    {
+        if (not value or value->use_count() != 1 or value->memory_usage() < value_threshold) [[likely]]
+        {
+            return;
+        }
+
+        enqueue(std::move(value));
+    }
+
+    void lazy_free_worker::release(std::unique_ptr<flushed_shard> flushed)
+    {
+        if (not flushed)
+        {
+            return;
+        }
+
+        enqueue(std::move(flushed));
+    }
+
+    lazy_free_statistics lazy_free_worker::get_statistics() const
+    {
+        return lazy_free_statistics{
+            .pending_objects = m_pending_objects.load(std::memory_order_relaxed),
+            .freed_objects   = m_freed_objects.load(std::memory_order_relaxed)
+        };
+    }
+
+    void lazy_free_worker::enqueue(job_t job)
+    {
+        m_pending_objects.fetch_add(1, std::memory_order_relaxed);
+        if (not m_queue.enqueue(std::move(job))) [[unlikely]]
+        {
+            // The queue could not allocate room for the job, which has then been freed here
+            m_pending_objects.fetch_sub(1, std::memory_order_relaxed);
+            m_freed_objects.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void lazy_free_worker::run(std::stop_token const& stop_token)
+    {
+        auto const free_job = [this](job_t& job) {
+            ZoneScopedN("lazy free");
+
+            bool const is_empty = std::visit([](auto const& object) { return not object; }, job);
+            job                 = job_t{};
+
+            if (not is_empty)
+            {
+                m_pending_objects.fetch_sub(1, std::memory_order_relaxed);
+                m_freed_objects.fetch_add(1, std::memory_order_relaxed);
+            }
+        };
+
+        job_t job{};
+        while (not stop_token.stop_requested())
+        {
+            if (m_queue.wait_dequeue_timed(job, poll_interval))
+            {
+                free_job(job);
+            }
+        }
+
+        // Whatever was handed over before the worker was destroyed is still freed
+        while (m_queue.try_dequeue(job))
+        {
+            free_job(job);
+        }
+    }
+}
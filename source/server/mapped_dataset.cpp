@@ -0,0 +1,428 @@
+module;
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <tracy/Tracy.hpp>
+
+export module server :server.mapped_dataset;
+
+namespace LambdaSnail::server
+{
+    /**
+     * The layout of a memory mapped dataset, an immutable table of keys and values that is built offline and served
+     * straight from the mapped file:
+     *
+     *     header                                    padded to slots_offset
+     *     hash offset                               once per slot
+     *     key_length value_length key value         once per key
+     *
+     * The slots are an open addressing hash table with linear probing that is at most half full, so a lookup reads one
+     * or two slots and then the record. The offset of an empty slot is zero, other offsets are from the start of the
+     * file. Integers are stored in the byte order of the machine, which must be little endian, so that the file is
+     * used as is.
+     */
+    export namespace mapped_dataset_format
+    {
+        static_assert(std::endian::native == std::endian::little);
+
+        constexpr std::string_view magic = "LSMD";
+        constexpr uint32_t version       = 1;
+        constexpr uint64_t slots_offset  = 64;
+
+        struct header
+        {
+            std::array<char, 4> magic{};
+            uint32_t version{};
+            uint64_t num_keys{};
+            uint64_t num_slots{};
+            uint64_t file_size{};
+        };
+
+        struct slot
+        {
+            uint64_t hash{};
+            uint64_t offset{};
+        };
+
+        struct record_header
+        {
+            uint32_t key_length{};
+            uint32_t value_length{};
+        };
+
+        static_assert(sizeof(header) <= slots_offset);
+        static_assert(sizeof(slot) == 16 and sizeof(record_header) == 8);
+
+        /**
+         * The hash of a key, eight bytes at a time. It is part of the format, so unlike the hash of the databases it
+         * must be the same for every build.
+         */
+        constexpr uint64_t hash(std::string_view const key) noexcept
+        {
+            constexpr uint64_t multiplier = 0x9E3779B97F4A7C15ULL;
+
+            auto const load = [&key](size_t const offset, size_t const length) {
+                uint64_t word = 0;
+                for (size_t i = 0; i < length; ++i)
+                {
+                    word |= static_cast<uint64_t>(static_cast<uint8_t>(key[offset + i])) << (8 * i);
+                }
+
+                return word;
+            };
+
+            uint64_t state = key.size() * multiplier;
+            size_t offset  = 0;
+            for (; offset + 8 <= key.size(); offset += 8)
+            {
+                state = std::rotl((state ^ load(offset, 8)) * multiplier, 31);
+            }
+
+            state ^= load(offset, key.size() - offset);
+
+            // Finalizer of SplitMix64, so that every bit of the key affects the slot
+            state = (state ^ (state >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            state = (state ^ (state >> 27)) * 0x94D049BB133111EBULL;
+            return state ^ (state >> 31);
+        }
+    }
+
+    /**
+     * Builds a mapped dataset. The records are encoded as they are added, and the table is laid out by write.
+     */
+    export class mapped_dataset_builder
+    {
+    public:
+        /**
+         * Adds a key, a key that is added again keeps the last value. Returns false if the key or the value is too
+         * large for the format.
+         */
+        bool add(std::string_view key, std::string_view value);
+
+        [[nodiscard]] size_t size() const noexcept;
+
+        /**
+         * Writes the dataset to a temporary file next to the path and renames it into place, so that servers that
+         * have the previous file mapped keep serving it. Returns the size of the file.
+         */
+        [[nodiscard]] std::expected<size_t, std::string> write(std::filesystem::path const& path) const;
+
+    private:
+        struct record
+        {
+            uint64_t hash{};
+            uint64_t offset{};
+        };
+
+        [[nodiscard]] std::string_view key_at(uint64_t offset) const noexcept;
+
+        std::string m_records{};
+        std::vector<record> m_index{};
+    };
+
+    /**
+     * A dataset mapped into memory. Lookups read the mapped pages directly, nothing is loaded or copied when the file
+     * is opened, and servers that map the same file share its pages in the page cache.
+     */
+    export class mapped_dataset
+    {
+    public:
+        ~mapped_dataset();
+
+        mapped_dataset(mapped_dataset const&)            = delete;
+        mapped_dataset& operator=(mapped_dataset const&) = delete;
+
+        /**
+         * Maps the file and checks its header. The records are checked as they are looked up.
+         */
+        [[nodiscard]] static std::expected<std::shared_ptr<mapped_dataset const>, std::string> open(std::filesystem::path const& path);
+
+        /**
+         * Returns the value of the key, which points into the mapping and stays valid as long as the dataset.
+         */
+        [[nodiscard]] std::optional<std::string_view> find(std::string_view key) const noexcept;
+
+        [[nodiscard]] size_t size() const noexcept;
+
+    private:
+        mapped_dataset(std::string_view data, mapped_dataset_format::header const& header) noexcept;
+
+        std::string_view m_data{};
+        mapped_dataset_format::slot const* m_slots{};
+        uint64_t m_slot_mask{};
+        uint64_t m_num_keys{};
+    };
+}
+
+namespace
+{
+    std::string error_text(int const error_number)
+    {
+        return std::error_code(error_number, std::generic_category()).message();
+    }
+
+    bool write_all(int const file, std::string_view data)
+    {
+        while (not data.empty())
+        {
+            auto const written = ::write(file, data.data(), data.size());
+            if (written < 0 and errno == EINTR)
+            {
+                continue;
+            }
+
+            if (written < 0)
+            {
+                return false;
+            }
+
+            data.remove_prefix(static_cast<size_t>(written));
+        }
+
+        return true;
+    }
+
+    template<typename value_t>
+    std::string_view as_bytes(value_t const& value) noexcept
+    {
+        return { reinterpret_cast<char const*>(&value), sizeof(value_t) };
+    }
+}
+
+bool LambdaSnail::server::mapped_dataset_builder::add(std::string_view const key, std::string_view const value)
+{
+    if (key.size() > UINT32_MAX or value.size() > UINT32_MAX)
+    {
+        return false;
+    }
+
+    mapped_dataset_format::record_header const header{ .key_length = static_cast<uint32_t>(key.size()), .value_length = static_cast<uint32_t>(value.size()) };
+
+    m_index.push_back(record{ .hash = mapped_dataset_format::hash(key), .offset = m_records.size() });
+    m_records.append(as_bytes(header));
+    m_records.append(key);
+    m_records.append(value);
+    return true;
+}
+
+size_t LambdaSnail::server::mapped_dataset_builder::size() const noexcept
+{
+    return m_index.size();
+}
+
+std::string_view LambdaSnail::server::mapped_dataset_builder::key_at(uint64_t const offset) const noexcept
+{
+    mapped_dataset_format::record_header header{};
+    std::memcpy(&header, m_records.data() + offset, sizeof(header));
+    return std::string_view(m_records).substr(offset + sizeof(header), header.key_length);
+}
+
+std::expected<size_t, std::string> LambdaSnail::server::mapped_dataset_builder::write(std::filesystem::path const& path) const
+{
+    ZoneScoped;
+
+    using namespace mapped_dataset_format;
+
+    auto const num_slots   = std::bit_ceil(std::max<uint64_t>(2 * m_index.size(), 16));
+    auto const data_offset = slots_offset + num_slots * sizeof(slot);
+    auto const mask        = num_slots - 1;
+
+    std::vector<slot> slots(num_slots);
+    uint64_t num_keys = 0;
+    for (auto const& [key_hash, offset] : m_index)
+    {
+        auto index = key_hash & mask;
+        while (slots[index].offset != 0 and not (slots[index].hash == key_hash and key_at(slots[index].offset - data_offset) == key_at(offset)))
+        {
+            index = (index + 1) & mask;
+        }
+
+        num_keys += slots[index].offset == 0 ? 1 : 0;
+        slots[index] = slot{ .hash = key_hash, .offset = data_offset + offset };
+    }
+
+    // Records of keys that were added again stay in the file, unreferenced
+    header file_header{ .version = version, .num_keys = num_keys, .num_slots = num_slots, .file_size = data_offset + m_records.size() };
+    std::ranges::copy(magic, file_header.magic.begin());
+
+    std::array<char, slots_offset> padded_header{};
+    std::memcpy(padded_header.data(), &file_header, sizeof(file_header));
+
+    auto const temporary_path = std::filesystem::path(path).concat(".tmp");
+    auto const file           = ::open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file < 0)
+    {
+        return std::unexpected(error_text(errno));
+    }
+
+    std::string_view const slot_bytes(reinterpret_cast<char const*>(slots.data()), slots.size() * sizeof(slot));
+    bool const written = write_all(file, std::string_view(padded_header.data(), padded_header.size())) and write_all(file, slot_bytes) and
+                         write_all(file, m_records) and ::fsync(file) == 0;
+    auto const error = errno;
+    ::close(file);
+
+    if (not written)
+    {
+        std::error_code ignored;
+        std::filesystem::remove(temporary_path, ignored);
+        return std::unexpected(error_text(error));
+    }
+
+    std::error_code rename_error;
+    std::filesystem::rename(temporary_path, path, rename_error);
+    if (rename_error)
+    {
+        std::error_code ignored;
+        std::filesystem::remove(temporary_path, ignored);
+        return std::unexpected(rename_error.message());
+    }
+
+    return static_cast<size_t>(file_header.file_size);
+}
+
+LambdaSnail::server::mapped_dataset::mapped_dataset(std::string_view const data, mapped_dataset_format::header const& header) noexcept :
+    m_data(data), m_slots(reinterpret_cast<mapped_dataset_format::slot const*>(data.data() + mapped_dataset_format::slots_offset)),
+    m_slot_mask(header.num_slots - 1), m_num_keys(header.num_keys)
+{
+}
+
+LambdaSnail::server::mapped_dataset::~mapped_dataset()
+{
+    ::munmap(const_cast<char*>(m_data.data()), m_data.size());
+}
+
+std::expected<std::shared_ptr<LambdaSnail::server::mapped_dataset const>, std::string> LambdaSnail::server::mapped_dataset::open(std::filesystem::path const& path)
+{
+    ZoneScoped;
+
+    using namespace mapped_dataset_format;
+
+    auto const file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file < 0)
+    {
+        return std::unexpected(error_text(errno));
+    }
+
+    struct stat status{};
+    if (::fstat(file, &status) != 0)
+    {
+        auto const error = errno;
+        ::close(file);
+        return std::unexpected(error_text(error));
+    }
+
+    auto const size = static_cast<size_t>(status.st_size);
+    if (size < slots_offset)
+    {
+        ::close(file);
+        return std::unexpected("The file is too small to be a dataset");
+    }
+
+    // A shared mapping of a file that is never written to, so every process serving it uses the same pages
+    auto* const mapping = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0);
+    ::close(file);
+    if (mapping == MAP_FAILED)
+    {
+        return std::unexpected(error_text(errno));
+    }
+
+    std::string_view const data(static_cast<char const*>(mapping), size);
+
+    header file_header{};
+    std::memcpy(&file_header, data.data(), sizeof(file_header));
+
+    auto const max_slots = (size - slots_offset) / sizeof(slot);
+    std::string_view error;
+    if (std::string_view(file_header.magic.data(), file_header.magic.size()) != magic)
+    {
+        error = "The file is not a dataset";
+    }
+    else if (file_header.version != version)
+    {
+        error = "Unsupported dataset version";
+    }
+    else if (file_header.file_size != size)
+    {
+        error = "The dataset is truncated";
+    }
+    else if (not std::has_single_bit(file_header.num_slots) or file_header.num_slots > max_slots or file_header.num_keys >= file_header.num_slots)
+    {
+        error = "Invalid dataset header";
+    }
+
+    if (not error.empty())
+    {
+        ::munmap(mapping, size);
+        return std::unexpected(std::string(error));
+    }
+
+    // Lookups jump around the file, reading ahead would only fetch pages that are not needed
+    ::madvise(mapping, size, MADV_RANDOM);
+
+    return std::shared_ptr<mapped_dataset const>(new mapped_dataset(data, file_header));
+}
+
+std::optional<std::string_view> LambdaSnail::server::mapped_dataset::find(std::string_view const key) const noexcept
+{
+    using namespace mapped_dataset_format;
+
+    auto const key_hash = hash(key);
+    for (uint64_t index = key_hash & m_slot_mask, num_probes = 0; num_probes <= m_slot_mask; index = (index + 1) & m_slot_mask, ++num_probes)
+    {
+        auto const& slot = m_slots[index];
+        if (slot.offset == 0)
+        {
+            return std::nullopt;
+        }
+
+        if (slot.hash != key_hash)
+        {
+            continue;
+        }
+
+        if (slot.offset > m_data.size() - sizeof(record_header)) [[unlikely]]
+        {
+            continue;
+        }
+
+        record_header header{};
+        std::memcpy(&header, m_data.data() + slot.offset, sizeof(header));
+
+        auto const record = m_data.substr(slot.offset + sizeof(header));
+        if (record.size() < uint64_t{ header.key_length } + header.value_length) [[unlikely]]
+        {
+            continue;
+        }
+
+        if (record.substr(0, header.key_length) == key)
+        {
+            return record.substr(header.key_length, header.value_length);
+        }
+    }
+
+    return std::nullopt;
+}
+
+size_t LambdaSnail::server::mapped_dataset::size() const noexcept
+{
+    return static_cast<size_t>(m_num_keys);
+}
@@ -1,23 +1,64 @@
 module;
 
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <expected>
+#include <filesystem>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <tracy/Tracy.hpp>
 
 module server;
 
+namespace
+{
+    /**
+     * Snapshots are written next to the final file, so that renaming it into place does not cross file systems.
+     */
+    std::filesystem::path temporary_snapshot_path(std::filesystem::path const& path, pid_t const pid)
+    {
+        return path.parent_path() / ("temp-" + std::to_string(pid) + ".lsdb");
+    }
+
+    std::filesystem::path temporary_append_log_path(std::filesystem::path const& path, pid_t const pid)
+    {
+        return path.parent_path() / ("temp-rewriteaof-" + std::to_string(pid) + ".aof");
+    }
+}
+
 namespace LambdaSnail::server
 {
-    server::server(size_t num_databases)
+    server::server(size_t num_databases, size_t num_shards, size_t expected_keys, size_t max_memory, eviction_policy policy) :
+        m_num_shards(num_shards), m_expected_keys(expected_keys), m_memory_limit(std::make_shared<memory_limit>()),
+        m_lazy_free(std::make_shared<lazy_free_worker>())
     {
+        m_memory_limit->max_bytes = max_memory;
+        m_memory_limit->policy    = policy;
+
         for (int i = 0; i < num_databases; ++i)
         {
-            m_databases.emplace_back(std::make_shared<database>());
+            m_databases.emplace_back(std::make_shared<database>(m_num_shards, m_expected_keys, m_memory_limit, m_lazy_free));
         }
     }
 
     server::database_handle_t server::create_database()
     {
-        m_databases.emplace_back(std::make_shared<database>());
+        m_databases.emplace_back(std::make_shared<database>(m_num_shards, m_expected_keys, m_memory_limit, m_lazy_free));
+        m_databases.back()->set_append_log(m_append_log.get(), m_databases.size() - 1);
+        m_databases.back()->set_cold_tier(m_cold_tier.get());
         return m_databases.size() - 1;
     }
 
@@ -32,6 +73,432 @@ namespace LambdaSnail::server
         return database_no < m_databases.size();
     }
 
+    bool server::free_memory_if_needed()
+    {
+        if (not m_memory_limit->is_exceeded()) [[likely]]
+        {
+            return true;
+        }
+
+        if (m_memory_limit->policy == eviction_policy::noeviction)
+        {
+            return false;
+        }
+
+        auto lock = std::lock_guard{m_eviction_mutex};
+        while (m_memory_limit->is_exceeded())
+        {
+            for (size_t i = 0; i < m_databases.size(); ++i)
+            {
+                m_databases[i]->sample_eviction_candidates(m_eviction_pool, i, eviction_samples);
+            }
+
+            // Candidates may have been deleted or evicted since they were sampled
+            bool evicted = false;
+            while (not evicted and not m_eviction_pool.empty())
+            {
+                auto const candidate = m_eviction_pool.take_best();
+                evicted              = m_databases[candidate.database]->evict(candidate.key);
+            }
+
+            if (not evicted)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void server::flush_all(bool const lazy_free)
+    {
+        for (auto const& database : m_databases)
+        {
+            database->flush(lazy_free);
+        }
+    }
+
+    memory_limit const& server::get_memory_limit() const
+    {
+        return *m_memory_limit;
+    }
+
+    lazy_free_statistics server::get_lazy_free_statistics() const
+    {
+        return m_lazy_free->get_statistics();
+    }
+
+    void server::set_snapshot_path(std::filesystem::path path)
+    {
+        auto lock       = std::lock_guard{m_save_mutex};
+        m_snapshot_path = std::move(path);
+    }
+
+    std::filesystem::path const& server::get_snapshot_path() const
+    {
+        return m_snapshot_path;
+    }
+
+    std::expected<void, std::string> server::save()
+    {
+        ZoneScoped;
+
+        auto lock = std::lock_guard{m_save_mutex};
+        if (m_save_child > 0)
+        {
+            return std::unexpected("Background save already in progress");
+        }
+
+        std::vector<std::vector<std::shared_lock<std::shared_mutex>>> database_locks;
+        for (auto const& database : m_databases)
+        {
+            database_locks.push_back(database->lock_shared());
+        }
+
+        auto const temporary_path = temporary_snapshot_path(m_snapshot_path, ::getpid());
+        snapshot_writer writer(temporary_path);
+
+        auto const error   = write_snapshot(writer, temporary_path.c_str(), m_snapshot_path.c_str());
+        m_last_save_failed = static_cast<bool>(error);
+        if (error)
+        {
+            return std::unexpected("Unable to write the snapshot: " + error.message());
+        }
+
+        m_last_save = std::chrono::system_clock::now();
+        return {};
+    }
+
+    std::expected<void, std::string> server::background_save()
+    {
+        ZoneScoped;
+
+        auto lock = std::lock_guard{m_save_mutex};
+        if (m_save_child > 0)
+        {
+            return std::unexpected("Background save already in progress");
+        }
+
+        if (m_rewrite_child > 0)
+        {
+            return std::unexpected("Background append only file rewriting in progress");
+        }
+
+        // The file is created and the paths are built before forking, the child inherits the open file
+        auto const temporary_path = temporary_snapshot_path(m_snapshot_path, ::getpid());
+        snapshot_writer writer(temporary_path);
+        if (auto const error = writer.error())
+        {
+            m_last_save_failed = true;
+            return std::unexpected("Unable to create the snapshot: " + error.message());
+        }
+
+        pid_t child{};
+        {
+            // Writes are paused while forking, so that the child sees every shard in a consistent state
+            std::vector<std::vector<std::shared_lock<std::shared_mutex>>> database_locks;
+            for (auto const& database : m_databases)
+            {
+                database_locks.push_back(database->lock_shared());
+            }
+
+            // The child reads cold values from the file, so their space is only released once it has exited
+            entry::cold_file().hold_releases();
+
+            child = ::fork();
+            if (child == 0)
+            {
+                // Only the forking thread exists in the child, which therefore must not allocate or wait for any
+                // lock that another thread of the server may have held, and exits without running any destructors
+                auto const error = write_snapshot(writer, temporary_path.c_str(), m_snapshot_path.c_str());
+                std::_Exit(error ? EXIT_FAILURE : EXIT_SUCCESS);
+            }
+        }
+
+        if (child < 0)
+        {
+            auto const error = std::error_code(errno, std::generic_category());
+            entry::cold_file().resume_releases();
+            m_last_save_failed = true;
+
+            std::error_code ignored;
+            std::filesystem::remove(temporary_path, ignored);
+            return std::unexpected("Unable to fork: " + error.message());
+        }
+
+        m_save_child = child;
+        return {};
+    }
+
+    std::optional<bool> server::poll_background_save()
+    {
+        auto lock = std::lock_guard{m_save_mutex};
+        if (m_save_child <= 0) [[likely]]
+        {
+            return std::nullopt;
+        }
+
+        int status{};
+        auto const pid = ::waitpid(m_save_child, &status, WNOHANG);
+        if (pid == 0 or (pid < 0 and errno == EINTR))
+        {
+            return std::nullopt;
+        }
+
+        auto const succeeded = pid > 0 and WIFEXITED(status) and WEXITSTATUS(status) == EXIT_SUCCESS;
+        if (succeeded)
+        {
+            m_last_save = std::chrono::system_clock::now();
+        }
+        else
+        {
+            // A child that was killed leaves its temporary file behind, which is named after the server
+            std::error_code error;
+            std::filesystem::remove(temporary_snapshot_path(m_snapshot_path, ::getpid()), error);
+        }
+
+        entry::cold_file().resume_releases();
+        m_last_save_failed = not succeeded;
+        m_save_child       = -1;
+        return succeeded;
+    }
+
+    save_status server::get_save_status() const
+    {
+        auto lock = std::lock_guard{m_save_mutex};
+        return save_status{ .last_save = m_last_save, .last_save_failed = m_last_save_failed, .in_progress = m_save_child > 0 };
+    }
+
+    std::error_code server::write_snapshot(snapshot_writer& writer, char const* const temporary_path, char const* const snapshot_path) const
+    {
+        ZoneScoped;
+
+        auto const now = std::chrono::system_clock::now();
+        for (size_t i = 0; i < m_databases.size(); ++i)
+        {
+            m_databases[i]->write_snapshot(writer, i, now);
+        }
+
+        if (auto const result = writer.finish(); not result)
+        {
+            ::unlink(temporary_path);
+            return result.error();
+        }
+
+        // Replaces the previous snapshot in one step, so that a crash never leaves a partial snapshot behind
+        if (::rename(temporary_path, snapshot_path) != 0)
+        {
+            auto const error = std::error_code(errno, std::generic_category());
+            ::unlink(temporary_path);
+            return error;
+        }
+
+        return {};
+    }
+
+    std::expected<size_t, std::string> server::load_snapshot()
+    {
+        ZoneScoped;
+
+        auto reader = snapshot_reader::open(m_snapshot_path);
+        if (not reader)
+        {
+            return std::unexpected(reader.error());
+        }
+
+        database* target{};
+        return reader->read(
+                [this, &target](size_t const index, size_t const num_keys) {
+                    if (index >= m_databases.size())
+                    {
+                        return false;
+                    }
+
+                    target = m_databases[index].get();
+                    target->reserve(num_keys);
+                    return true;
+                },
+                [&target](std::string_view const key, entry* const value) { target->restore(key, value); });
+    }
+
+    void server::set_append_log(std::shared_ptr<append_log> log)
+    {
+        m_append_log = std::move(log);
+        for (size_t i = 0; i < m_databases.size(); ++i)
+        {
+            m_databases[i]->set_append_log(m_append_log.get(), i);
+        }
+    }
+
+    append_log* server::get_append_log() const noexcept
+    {
+        return m_append_log.get();
+    }
+
+    void server::set_mapped_dataset(std::shared_ptr<mapped_dataset const> dataset)
+    {
+        m_mapped_dataset = std::move(dataset);
+        m_databases.front()->set_dataset(m_mapped_dataset);
+    }
+
+    void server::set_cold_tier(std::shared_ptr<cold_tier> tier)
+    {
+        m_cold_tier = std::move(tier);
+        for (auto const& database : m_databases)
+        {
+            database->set_cold_tier(m_cold_tier.get());
+        }
+    }
+
+    cold_tier* server::get_cold_tier() const noexcept
+    {
+        return m_cold_tier.get();
+    }
+
+    void server::set_buffer_pool(LambdaSnail::memory::buffer_pool const* const pool)
+    {
+        m_buffer_pool = pool;
+    }
+
+    LambdaSnail::memory::buffer_pool const* server::get_buffer_pool() const noexcept
+    {
+        return m_buffer_pool;
+    }
+
+    void server::set_maintenance_worker(timeout_worker const* const worker)
+    {
+        m_maintenance_worker = worker;
+    }
+
+    timeout_worker const* server::get_maintenance_worker() const noexcept
+    {
+        return m_maintenance_worker;
+    }
+
+    std::expected<void, std::string> server::rewrite_append_log()
+    {
+        ZoneScoped;
+
+        if (not m_append_log)
+        {
+            return std::unexpected("The append only file is disabled");
+        }
+
+        auto lock = std::lock_guard{m_save_mutex};
+        if (m_rewrite_child > 0 or m_append_log->is_rewriting())
+        {
+            return std::unexpected("Background append only file rewriting already in progress");
+        }
+
+        if (m_save_child > 0)
+        {
+            return std::unexpected("Background save in progress");
+        }
+
+        // The file is created before forking, as for a background save. Its name is only reused once the log has
+        // switched to the previous rewritten file, which is_rewriting checks above
+        auto const temporary_path = temporary_append_log_path(m_append_log->get_path(), ::getpid());
+        append_log_writer writer(temporary_path);
+        if (auto const error = writer.error())
+        {
+            m_append_log->record_rewrite_failure();
+            return std::unexpected("Unable to create the rewritten append only file: " + error.message());
+        }
+
+        pid_t child{};
+        {
+            // As for a background save, and the log takes the records after this point as the ones to add to the file
+            std::vector<std::vector<std::shared_lock<std::shared_mutex>>> database_locks;
+            for (auto const& database : m_databases)
+            {
+                database_locks.push_back(database->lock_shared());
+            }
+
+            if (not m_append_log->begin_rewrite()) [[unlikely]]
+            {
+                return std::unexpected("Background append only file rewriting already in progress");
+            }
+
+            entry::cold_file().hold_releases();
+
+            child = ::fork();
+            if (child == 0)
+            {
+                // The rewritten file is left to the server, which removes it if the child fails
+                std::_Exit(write_append_log(writer) ? EXIT_FAILURE : EXIT_SUCCESS);
+            }
+        }
+
+        if (child < 0)
+        {
+            auto const error = std::error_code(errno, std::generic_category());
+            entry::cold_file().resume_releases();
+            m_append_log->abort_rewrite();
+            m_append_log->record_rewrite_failure();
+
+            std::error_code ignored;
+            std::filesystem::remove(temporary_path, ignored);
+            return std::unexpected("Unable to fork: " + error.message());
+        }
+
+        m_rewrite_child = child;
+        return {};
+    }
+
+    std::optional<bool> server::poll_append_log_rewrite()
+    {
+        auto lock = std::lock_guard{m_save_mutex};
+        if (m_rewrite_child <= 0) [[likely]]
+        {
+            return std::nullopt;
+        }
+
+        int status{};
+        auto const pid = ::waitpid(m_rewrite_child, &status, WNOHANG);
+        if (pid == 0 or (pid < 0 and errno == EINTR))
+        {
+            return std::nullopt;
+        }
+
+        auto const temporary_path = temporary_append_log_path(m_append_log->get_path(), ::getpid());
+        auto const succeeded      = pid > 0 and WIFEXITED(status) and WEXITSTATUS(status) == EXIT_SUCCESS;
+        if (succeeded)
+        {
+            // The flusher appends what was logged meanwhile and switches to the file after its next round
+            m_append_log->finish_rewrite(temporary_path);
+        }
+        else
+        {
+            m_append_log->abort_rewrite();
+            m_append_log->record_rewrite_failure();
+
+            std::error_code error;
+            std::filesystem::remove(temporary_path, error);
+        }
+
+        entry::cold_file().resume_releases();
+        m_rewrite_child = -1;
+        return succeeded;
+    }
+
+    std::error_code server::write_append_log(append_log_writer& writer) const
+    {
+        ZoneScoped;
+
+        auto const now = std::chrono::system_clock::now();
+        for (size_t i = 0; i < m_databases.size(); ++i)
+        {
+            m_databases[i]->write_append_log(writer, i, now);
+        }
+
+        if (auto const result = writer.finish(); not result)
+        {
+            return result.error();
+        }
+
+        return {};
+    }
+
     // server::database_size_t server::get_database_size(database_handle_t database_no) const
     // {
     //     assert(database_no < m_databases.size());
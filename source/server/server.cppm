@@ -1,18 +1,43 @@
 module;
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <expected>
+#include <filesystem>
 #include <functional>
-#include <future>
+#include <limits>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
 #include <shared_mutex>
+#include <span>
+#include <stop_token>
 #include <string>
+#include <system_error>
 #include <thread>
 #include <type_traits>
 #include <unordered_map>
 #include <utility>
+#include <variant>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <blockingconcurrentqueue.h>
 
 export module server;
 
+export import :server.entry;
+export import :server.eviction;
+export import :server.flat_table;
+export import :server.expiry_index;
+export import :server.snapshot;
+export import :server.mapped_dataset;
+export import :server.cold_storage;
+
 import logging;
 import memory;
 import resp;
@@ -21,201 +46,1508 @@ namespace LambdaSnail::server
 {
     export typedef std::chrono::time_point<std::chrono::system_clock> time_point_t;
 
-    struct entry_info
-    {
-        enum class entry_flags
-        {
-            no_state = 0,
-            deleted  = 1 << 0,
-            hase_ttl = 1 << 1
-        };
+    using store_t = incremental_table<entry_ptr>;
 
-        typedef uint32_t version_t;
-        typedef uint32_t flags_t;
+    /**
+     * Counters kept by every shard of a database, summed up when read.
+     */
+    export struct database_statistics
+    {
+        size_t num_keys{};
 
-        std::string data;
-        version_t version{};
-        flags_t flags{};
-        time_point_t ttl{time_point_t::min()};
-        [[nodiscard]] bool has_ttl() const;
-        [[nodiscard]] bool has_expired(time_point_t now) const;
-        [[nodiscard]] bool is_deleted() const;
-        void set_deleted();
+        /**
+         * The slots of the tables of all shards, including the old tables of shards that are growing.
+         */
+        size_t num_slots{};
+        uint64_t hits{};
+        uint64_t misses{};
+        uint64_t expired_keys{};
+        uint64_t evicted_keys{};
     };
 
-    using store_t = std::unordered_map<std::string, std::shared_ptr<entry_info>>;
-
-    struct ICommandHandler
+    /**
+     * The outcome of removing expired keys within a time budget.
+     */
+    export struct expire_cycle_result
     {
-        [[nodiscard]] virtual std::string execute(std::vector<resp::data_view> const& args) noexcept = 0;
-        virtual ~ICommandHandler()                                                                   = default;
+        size_t expired_keys{};
+
+        /**
+         * Set when the budget ran out before all keys that are due had been removed.
+         */
+        bool incomplete{};
     };
 
-    struct ping_handler final : public ICommandHandler
+    /**
+     * The outcome of active defragmentation within a time budget.
+     */
+    export struct defrag_cycle_result
     {
-        [[nodiscard]] std::string execute(std::vector<resp::data_view> const& args) noexcept override;
+        size_t moved_entries{};
 
-        ~ping_handler() override = default;
+        /**
+         * Set when the budget ran out before every slot had been visited.
+         */
+        bool incomplete{};
     };
 
-    struct echo_handler final : public ICommandHandler
+    /**
+     * The outcome of moving values to the cold tier within a time budget.
+     */
+    export struct spill_cycle_result
     {
-        [[nodiscard]] std::string execute(std::vector<resp::data_view> const& args) noexcept override;
-        ~echo_handler() override = default;
+        size_t spilled_values{};
+
+        /**
+         * The number of released values punched out of the file, see cold_storage::punch_released.
+         */
+        size_t released_values{};
+
+        /**
+         * Set when the budget ran out before every slot had been visited.
+         */
+        bool incomplete{};
     };
 
-    struct static_response_handler final : public ICommandHandler
+    /**
+     * The reasons a value cannot be updated by the counter commands.
+     */
+    export enum class value_error : uint8_t
     {
-        explicit static_response_handler(std::string_view) noexcept;
-        [[nodiscard]] std::string execute(std::vector<resp::data_view> const& args) noexcept override;
-        ~static_response_handler() override = default;
-
-    private:
-        std::string m_message;
+        not_an_integer,
+        not_a_float,
+        overflow,
+        not_finite
     };
 
-    struct get_handler final : public ICommandHandler
+    /**
+     * The contents of a shard removed by a flush.
+     */
+    struct flushed_shard
     {
-        explicit get_handler(std::shared_ptr<class database> database) noexcept : m_database(std::move(database)) {}
-        [[nodiscard]] std::string execute(std::vector<resp::data_view> const& args) noexcept override;
-        ~get_handler() override = default;
+        store_t store{};
+        expiry_index expiries{};
+    };
 
-    private:
-        std::shared_ptr<database> m_database;
+    /**
+     * Counters of the lazy free thread, see lazy_free_worker.
+     */
+    export struct lazy_free_statistics
+    {
+        uint64_t pending_objects{};
+        uint64_t freed_objects{};
     };
 
-    struct set_handler final : public ICommandHandler
+    /**
+     * Frees large values and flushed databases on a background thread, like the lazy free of Redis, so that
+     * releasing many megabytes does not pause the clients of a shard. Objects are handed over through a
+     * lock-free queue and freed in the order in which they arrive.
+     */
+    export class lazy_free_worker
     {
-        explicit set_handler(std::shared_ptr<database> database) : m_database(database) {}
+    public:
+        /**
+         * Values that take up at least this many bytes are freed in the background when they are deleted,
+         * overwritten, expired or evicted. Smaller values are cheaper to free than to hand over.
+         */
+        static constexpr size_t value_threshold = 64 * 1024;
+
+        lazy_free_worker();
+        ~lazy_free_worker();
 
-        [[nodiscard]] std::string execute(std::vector<resp::data_view> const& args) noexcept override;
+        lazy_free_worker(lazy_free_worker const&)            = delete;
+        lazy_free_worker& operator=(lazy_free_worker const&) = delete;
+
+        /**
+         * Hands the value to the background thread if it is large and this is the last reference to it,
+         * otherwise it is released on the calling thread.
+         */
+        void release(entry_ptr value);
+        void release(std::unique_ptr<flushed_shard> flushed);
 
-        ~set_handler() override = default;
+        [[nodiscard]] lazy_free_statistics get_statistics() const;
 
     private:
-        std::shared_ptr<database> m_database;
+        using job_t = std::variant<entry_ptr, std::unique_ptr<flushed_shard>>;
+
+        /**
+         * How often the thread checks for a stop request while the queue is empty.
+         */
+        static constexpr std::chrono::milliseconds poll_interval{ 100 };
+
+        void enqueue(job_t job);
+        void run(std::stop_token const& stop_token);
+
+        moodycamel::BlockingConcurrentQueue<job_t> m_queue{};
+        std::atomic<uint64_t> m_pending_objects{};
+        std::atomic<uint64_t> m_freed_objects{};
+        std::jthread m_thread{};
     };
 
-    export class database
+    /**
+     * The cold tier moves large values that have not been used for a while to a file on local storage, see
+     * cold_storage, leaving only their keys and metadata in memory. The maintenance thread moves the values, and reads
+     * of cold values are carried out by a pool of reader threads, so that neither pauses the I/O threads.
+     *
+     * A read does not bring a value back into memory right away, since most cold keys are only read now and then.
+     * The first read marks the key as used, and a second read within the idle time promotes the value.
+     */
+    export class cold_tier
     {
     public:
-        explicit database() = default;
+        static constexpr size_t default_min_size = 4 * 1024;
+        static constexpr std::chrono::seconds default_idle_time{ 3600 };
+        static constexpr size_t default_num_readers = 4;
 
-        // TODO: should probably return a variant or expected so we can return an error as well
-        [[nodiscard]] std::shared_ptr<entry_info> get_value(std::string const& key);
+        /**
+         * The time each maintenance cycle may spend moving values to the file.
+         */
+        static constexpr std::chrono::microseconds spill_budget{ 5'000 };
+
+        /**
+         * Values of at least the minimum size that have not been used for the idle time are moved to the file. The
+         * idle time is measured with the access clock of the entries, see access_clock::idle_time, and must not
+         * exceed access_clock::max_idle_time of the eviction policy.
+         */
+        cold_tier(std::filesystem::path path, size_t min_size = default_min_size, std::chrono::seconds idle_time = default_idle_time,
+                  size_t num_readers = default_num_readers);
+        ~cold_tier();
+
+        cold_tier(cold_tier const&)            = delete;
+        cold_tier& operator=(cold_tier const&) = delete;
 
-        void set_value(std::string const& key, std::string_view value, time_point_t ttl = time_point_t::min());
+        /**
+         * Creates the file, see cold_storage::open, and starts the reader threads.
+         */
+        [[nodiscard]] std::expected<void, std::string> start();
+
+        /**
+         * Stops the reader threads once they have run the jobs submitted so far. Called while whoever is notified by
+         * the jobs is still around, the destructor does the same.
+         */
+        void stop();
+
+        [[nodiscard]] size_t get_min_size() const noexcept;
+        [[nodiscard]] std::chrono::seconds get_idle_time() const noexcept;
+        [[nodiscard]] std::filesystem::path const& get_path() const noexcept;
 
         /**
-         * Implements the active expiry by testing some random keys in the database among the
-         * possible keys with expiry.
+         * Runs the job on one of the reader threads.
          */
-        void handle_deletes(time_point_t now, size_t max_num_tests = 10);
+        void submit(std::function<void()> job);
 
     private:
-        store_t m_store{1000};
+        using job_t = std::function<void()>;
 
-        enum class delete_reason : uint8_t
-        {
-            ttl_expiry   = 0,
-            user_deleted = 2 << 0
-        };
+        void run(std::stop_token const& stop_token);
 
-        struct expiry_info
-        {
-            /**
-             * The version of the value that should be deleted. If this differs from the actual value, then
-             * we abort the operation.
-             */
-            entry_info::version_t version{};
-            delete_reason delete_reason{};
-        };
+        std::filesystem::path m_path{};
+        size_t m_min_size{};
+        std::chrono::seconds m_idle_time{};
+        size_t m_num_readers{};
+
+        moodycamel::BlockingConcurrentQueue<job_t> m_queue{};
+        std::vector<std::jthread> m_threads{};
+    };
+
+    export class server;
+    export class timeout_worker;
 
+    /**
+     * When the append-only file is synced to disk, as in Redis.
+     */
+    export enum class fsync_policy : uint8_t
+    {
         /**
-         * Instead of deleting key/values from the database, key/values to be deleted are added
-         * to this list and cleaned up from a background thread. This avoids the need for synchronizing
-         * updates in two concurrent data structures during regular operations (GET, SET).
-         * TODO: Use queue instead?
+         * After every round of writes, clients that wrote are only answered once their writes are on disk.
          */
-        std::unordered_map<std::string, expiry_info> m_delete_keys;
+        always,
+        everysec,
 
         /**
-         * The key-value store is read by connections concurrently but always from a single thread,
-         * so is "safe" to access without locking it first. However, may periodically wish to perform
-         * maintenance work on the database, such as clean up expired keys etc. In those cases the
-         * shared mutex allows us to lock the entire map for a short duration - just in case.
+         * Leaves it to the operating system.
          */
-        mutable std::shared_mutex m_mutex{};
+        no
     };
 
     /**
-     * A server is a collection of databases and the member functions used to manage these.
+     * The outcome of replaying an append-only file.
      */
-    export class server
+    export struct replay_result
+    {
+        size_t commands{};
+
+        /**
+         * The size of an incomplete command at the end of the file, left behind by a crash, which has been cut off.
+         */
+        size_t truncated_bytes{};
+    };
+
+    /**
+     * Writes a rewritten append-only file through a large buffer. Like the snapshot_writer, it does not allocate after
+     * construction or take any locks, so that it can be constructed before forking and used by the child process. The
+     * first error is kept and reported by finish.
+     */
+    class append_log_writer
     {
     public:
-        typedef size_t database_handle_t;
-        typedef size_t database_size_t;
-        typedef std::vector<std::shared_ptr<database>>::const_iterator database_iterator_t;
+        static constexpr size_t buffer_size = 1024 * 1024;
 
-        explicit server(size_t num_databases);
+        /**
+         * Creates or truncates the file. Check the result of finish for errors.
+         */
+        explicit append_log_writer(std::filesystem::path const& path);
+        ~append_log_writer();
 
-        database_handle_t create_database();
-        [[nodiscard]] std::shared_ptr<database> get_database(database_handle_t database_no) const;
-        [[nodiscard]] bool is_valid_handle(database_handle_t database_no) const;
+        append_log_writer(append_log_writer const&)            = delete;
+        append_log_writer& operator=(append_log_writer const&) = delete;
 
-        [[nodiscard]] database_iterator_t begin() const;
-        [[nodiscard]] database_iterator_t end() const;
+        /**
+         * The first error so far, such as failing to create the file.
+         */
+        [[nodiscard]] std::error_code error() const noexcept { return m_error; }
 
-    private:
-        std::vector<std::shared_ptr<database>> m_databases{};
-    };
+        void write_command(std::span<std::string_view const> arguments);
 
-    export class command_dispatch
-    {
-    public:
-        explicit command_dispatch(server& server);
-        [[nodiscard]] std::string process_command(resp::data_view message);
+        /**
+         * Writes a command with the value of a cold entry in place of one of the arguments, which is read from the file
+         * of the cold tier in chunks.
+         */
+        void write_command(std::span<std::string_view const> arguments, size_t cold_argument, entry const& cold);
 
-        std::string handle_set_database(server::database_handle_t handle);
+        /**
+         * Flushes the buffer and syncs the file to disk.
+         */
+        [[nodiscard]] std::expected<void, std::error_code> finish();
 
-    private:
-        [[nodiscard]] std::shared_ptr<ICommandHandler> get_command(std::string_view command_name);
+        /**
+         * Appends encoded data to the file.
+         */
+        void append(std::string_view data);
 
-        static std::unordered_map<std::string_view, std::function<ICommandHandler*()>> s_command_map;
-        server& m_server;
+    private:
+        void flush();
 
-        server::database_handle_t m_current_db{};
+        int m_file{ -1 };
+        std::vector<char> m_buffer{};
+        size_t m_buffered{};
+        std::error_code m_error{};
     };
 
     /**
-     * The timeout worker is the mechanism for active expiry of keys. At periodic intervals
-     * it will test some random keys in the databases and if they are expired, remove them.
+     * The append-only file. Databases log the effect of every change while they hold the lock of the shard, as SET
+     * commands with an absolute expiry time, DEL and FLUSHDB, so that replaying the file gives the same keys however the
+     * writes of different connections interleaved.
+     *
+     * Each thread appends to a buffer of its own, whose lock is only ever contended when the flusher thread takes the
+     * buffer over. Records are numbered as they are appended, and the flusher writes them in that order, many at a time,
+     * with a SELECT whenever the database changes. With fsync_policy::always, every round of writes is followed by
+     * a single fsync for all of its records, after which the clients that wrote them are answered.
+     *
+     * The file is compacted by a rewrite, which writes the keys from a forked child while the flusher collects the
+     * records appended in the meantime. The flusher appends those to the rewritten file and renames it over the log
+     * between two rounds of writes, so that clients are never paused for the switch.
      */
-    export class timeout_worker
+    export class append_log
     {
     public:
-        explicit timeout_worker(server& server, std::shared_ptr<LambdaSnail::logging::logger> m_logger);
+        static constexpr std::string_view default_file_name = "appendonly.aof";
+
+        /**
+         * How often the file is synced with fsync_policy::everysec.
+         */
+        static constexpr std::chrono::seconds fsync_interval{ 1 };
+
+        /**
+         * By default the file is rewritten when it has doubled in size since the last rewrite, or since the server
+         * started, and is at least 64 MiB, as in Redis.
+         */
+        static constexpr uint32_t default_rewrite_growth = 100;
+        static constexpr uint64_t default_rewrite_min_size = 64 * 1024 * 1024;
+
+        /**
+         * After a rewrite has failed, the next automatic rewrite waits for the retry delay, which doubles with every
+         * consecutive failure up to the maximum. Redis likewise waits at least 5 seconds before retrying a failed save.
+         */
+        static constexpr std::chrono::seconds rewrite_retry_delay{ 5 };
+        static constexpr std::chrono::seconds max_rewrite_retry_delay{ 3600 };
+
+        append_log(std::filesystem::path path, fsync_policy policy, std::shared_ptr<LambdaSnail::logging::logger> logger);
+        ~append_log();
+
+        append_log(append_log const&)            = delete;
+        append_log& operator=(append_log const&) = delete;
+
+        /**
+         * Replays the file into the databases of the server, which must not have the log attached yet. The commands of
+         * each database are replayed on a thread of their own, without checking the memory limit. An incomplete command
+         * at the end of the file is cut off.
+         */
+        [[nodiscard]] std::expected<replay_result, std::string> replay(server& server) const;
+
+        /**
+         * Opens the file for appending and starts the flusher thread.
+         */
+        [[nodiscard]] std::expected<void, std::string> start();
+
+        /**
+         * Writes and syncs what has been appended so far and stops the flusher thread. Called once nothing appends
+         * to the log anymore.
+         */
+        void stop();
+
+        /**
+         * Appends a command with the given arguments for the database. Called with the lock of the shard held that
+         * the command changes.
+         */
+        void append(size_t database, std::span<std::string_view const> arguments);
+
+        /**
+         * The number of the last record appended by the calling thread.
+         */
+        [[nodiscard]] uint64_t thread_sequence() const noexcept;
+
+        /**
+         * Whether the record, and all records before it, have been written and synced according to the policy.
+         */
+        [[nodiscard]] bool is_durable(uint64_t sequence) const noexcept;
+
+        /**
+         * Calls the function from the flusher thread with true once the record is durable, or right away if it already
+         * is. When writing or syncing the file fails, it is called with false instead, so that clients are answered
+         * with an error rather than kept waiting until the file recovers.
+         */
+        void when_durable(uint64_t sequence, std::function<void(bool)> on_done);
+
+        /**
+         * Set while the file cannot be written to or synced, in which case writes are refused until a round of
+         * writes has been written and synced again.
+         */
+        [[nodiscard]] bool has_failed() const noexcept;
+
+        [[nodiscard]] fsync_policy get_fsync_policy() const noexcept;
+        [[nodiscard]] std::filesystem::path const& get_path() const noexcept;
+
+        /**
+         * The growth in percent of the size after the last rewrite at which the file is rewritten, provided that it
+         * is at least the minimum size. A growth of zero disables automatic rewrites. Set before the log is started.
+         */
+        void set_rewrite_trigger(uint32_t growth_percentage, uint64_t min_size);
+
+        /**
+         * Whether the file has grown enough to be rewritten, no rewrite is in progress, and the retry delay after a
+         * failed rewrite has passed.
+         */
+        [[nodiscard]] bool needs_rewrite() const noexcept;
+
+        /**
+         * Whether a rewrite has begun and the flusher has not yet switched to the rewritten file or given it up.
+         */
+        [[nodiscard]] bool is_rewriting() const noexcept;
+
+        /**
+         * Starts collecting the records appended from now on, which the rewritten file will not contain. Called with
+         * all shards locked, right before forking the child that writes the rewritten file. Returns false while the
+         * previous rewrite is still in progress.
+         */
+        [[nodiscard]] bool begin_rewrite();
+
+        /**
+         * Hands the rewritten file to the flusher thread, which appends the collected records and replaces the log.
+         */
+        void finish_rewrite(std::filesystem::path rewritten_path);
+        void abort_rewrite();
 
         /**
-         * Periodically cleans up pending deletes and tests a few random keys from each database
-         * for expiry.
+         * Counts a rewrite that could not be started or did not finish, which delays the next automatic rewrite. A
+         * successful switch to a rewritten file resets the count.
          */
-        void do_work() const;
-        [[nodiscard]] std::future<void> do_work_async() const;
+        void record_rewrite_failure() noexcept;
+
+        /**
+         * The number of rewrites that have failed since the last one that succeeded.
+         */
+        [[nodiscard]] uint32_t get_rewrite_failures() const noexcept;
+
+        [[nodiscard]] uint64_t get_file_size() const noexcept;
 
     private:
-        LambdaSnail::server::server& m_server;
+        /**
+         * A record in the buffer of a thread.
+         */
+        struct record
+        {
+            uint64_t sequence{};
+            size_t database{};
+            size_t offset{};
+            size_t length{};
+        };
+
+        struct thread_buffer
+        {
+            std::mutex mutex{};
+            std::string data{};
+            std::vector<record> records{};
+
+            /**
+             * The contents taken over by the flusher, swapped with the above so that their capacity is reused.
+             */
+            std::string flushing_data{};
+            std::vector<record> flushing_records{};
+
+            /**
+             * Only used by the thread that owns the buffer.
+             */
+            uint64_t last_sequence{};
+        };
+
+        /**
+         * The buffer of the calling thread for the log it appended to last, so that appending does not look it up.
+         */
+        struct cached_buffer
+        {
+            uint64_t log_id{};
+            thread_buffer* buffer{};
+        };
+
+        struct waiter
+        {
+            uint64_t sequence{};
+            std::function<void(bool)> on_done{};
+        };
+
+        [[nodiscard]] static cached_buffer& thread_cache() noexcept;
+        [[nodiscard]] thread_buffer& local_buffer();
+
+        void run(std::stop_token const& stop_token);
+
+        /**
+         * Collects the records of all threads and writes those that follow the last written record without a gap.
+         * Records that follow a gap wait for the next round, the missing records are still being appended.
+         */
+        void flush();
+
+        /**
+         * Syncs the file when the policy asks for it, or regardless with force. Returns false if syncing failed.
+         */
+        bool sync(bool force = false);
+        void notify_waiters();
+
+        /**
+         * Calls every waiter with false, after the round of writes that they wait for has failed.
+         */
+        void fail_waiters();
+
+        /**
+         * Wakes the flusher unless it has been woken already.
+         */
+        void wake_flusher();
+
+        /**
+         * Marks the log as failed, which is logged once until it recovers.
+         */
+        void report_error(std::string_view operation, int error_number);
+
+        /**
+         * Appends the collected records to the rewritten file and renames it over the log. Runs on the flusher
+         * thread, after a round has been written completely. Returns the new size of the log.
+         */
+        [[nodiscard]] std::expected<uint64_t, std::string> switch_to_rewritten(std::filesystem::path const& rewritten_path, std::string_view collected);
+
+        std::filesystem::path m_path{};
+        fsync_policy m_policy{};
         std::shared_ptr<LambdaSnail::logging::logger> m_logger{};
+
+        /**
+         * Tells apart logs that have existed at the same address, for the buffers cached by the threads.
+         */
+        uint64_t const m_id{};
+        int m_file{ -1 };
+
+        std::mutex m_buffers_mutex{};
+        std::vector<std::unique_ptr<thread_buffer>> m_buffers{};
+
+        std::atomic<uint64_t> m_next_sequence{};
+        std::atomic<uint64_t> m_durable_sequence{};
+        std::atomic<bool> m_has_pending{};
+        std::atomic<bool> m_failed{};
+
+        /**
+         * Only used by the flusher thread.
+         */
+        uint64_t m_written_sequence{};
+        size_t m_selected_database{ std::numeric_limits<size_t>::max() };
+        std::string m_output{};
+        std::string m_held_data{};
+        std::vector<record> m_held_records{};
+        bool m_needs_sync{};
+        std::chrono::steady_clock::time_point m_last_sync{};
+
+        std::mutex m_waiters_mutex{};
+        std::vector<waiter> m_waiters{};
+
+        static constexpr uint64_t no_rewrite = std::numeric_limits<uint64_t>::max();
+
+        /**
+         * Guards the state of a rewrite. The flusher collects the records that follow the rewrite sequence, the last
+         * record that the rewritten file contains, until the rewritten path is handed over.
+         */
+        std::mutex m_rewrite_mutex{};
+        std::atomic<uint64_t> m_rewrite_sequence{ no_rewrite };
+        std::string m_rewrite_buffer{};
+        size_t m_rewrite_selected_database{ std::numeric_limits<size_t>::max() };
+        std::optional<std::filesystem::path> m_rewritten_path{};
+
+        uint32_t m_rewrite_growth{ default_rewrite_growth };
+        uint64_t m_rewrite_min_size{ default_rewrite_min_size };
+        std::atomic<uint32_t> m_rewrite_failures{};
+
+        /**
+         * The steady clock time of the last failed rewrite, in its own ticks.
+         */
+        std::atomic<int64_t> m_last_rewrite_failure{};
+        std::atomic<uint64_t> m_file_size{};
+
+        /**
+         * The size of the file after the last rewrite, or when the log was started.
+         */
+        std::atomic<uint64_t> m_base_size{};
+
+        std::mutex m_mutex{};
+        std::condition_variable_any m_condition{};
+        std::jthread m_thread{};
     };
 
-    struct select_handler final : public ICommandHandler
+    export class database
     {
-        explicit select_handler(command_dispatch& dispatch) noexcept : m_dispatch(dispatch) {}
-        [[nodiscard]] std::string execute(std::vector<resp::data_view> const& args) noexcept override;
-        ~select_handler() override = default;
+    public:
+        static constexpr size_t default_num_shards = 16;
 
-    private:
-        command_dispatch& m_dispatch;
+        /**
+         * The number of slots each shard migrates per maintenance cycle while it is growing, in addition to
+         * the slots migrated by writes.
+         */
+        static constexpr size_t maintenance_migrate_slots = 4096;
+
+        /**
+         * The maximum number of expired keys removed while holding the lock of a shard.
+         */
+        static constexpr size_t expire_batch_size = 256;
+
+        /**
+         * The number of expiry index records visited while holding the lock of a shard to drop stale records. The index
+         * is compacted once it holds more than twice as many records as the shard holds keys, plus this many.
+         */
+        static constexpr size_t expiry_compact_batch_size = 4096;
+
+        /**
+         * The number of slots visited while holding the lock of a shard during active defragmentation.
+         */
+        static constexpr size_t defrag_batch_size = 1024;
+
+        /**
+         * The number of slots visited per batch when moving values to the cold tier. The values are written to the
+         * file between a shared and an exclusive lock of the shard.
+         */
+        static constexpr size_t spill_batch_size = 1024;
+
+        /**
+         * The maximum number of slots scanned for a key when sampling keys for eviction.
+         */
+        static constexpr size_t eviction_scan_limit = 256;
+
+        /**
+         * The number of shards is rounded up to the nearest power of two. The expected number of keys
+         * presizes the shards, so that loading a dataset of known size does not need to grow them.
+         */
+        explicit database(size_t num_shards = default_num_shards, size_t expected_keys = 0,
+                          std::shared_ptr<memory_limit> limit = std::make_shared<memory_limit>(),
+                          std::shared_ptr<lazy_free_worker> lazy_free = nullptr);
+
+        // TODO: should probably return a variant or expected so we can return an error as well
+        [[nodiscard]] entry_ptr get_value(std::string_view key);
+
+        void set_value(std::string_view key, std::string_view value, time_point_t ttl = time_point_t::min());
+
+        /**
+         * Stores an entry read from a snapshot, taking ownership of it. Entries that have expired in the meantime
+         * are dropped.
+         */
+        void restore(std::string_view key, entry* value);
+
+        /**
+         * Makes room for the number of keys in every shard, intended for presizing an empty database. The room is kept
+         * when the database is flushed.
+         */
+        void reserve(size_t expected_keys);
+
+        /**
+         * The multi-key variants hash all keys first and then visit every shard once, taking its lock once for
+         * all keys in the shard and prefetching their slots before probing the table.
+         */
+        void get_values(std::span<std::string_view const> keys, std::span<entry_ptr> values);
+
+        /**
+         * Sets all keys at once, clients see either none or all of the new values. With only_if_none_exist
+         * nothing is set if any of the keys exists. Returns whether the values were set.
+         */
+        bool set_values(std::span<std::string_view const> keys, std::span<std::string_view const> values, bool only_if_none_exist = false);
+
+        /**
+         * Returns the number of keys that existed. With lazy_free, as used by UNLINK, large values are freed
+         * in the background.
+         */
+        size_t erase_values(std::span<std::string_view const> keys, bool lazy_free = false);
+
+        /**
+         * Removes all keys. All shards are locked together and swapped for empty ones, which are sized like the shards
+         * were presized, see reserve. The old contents are freed after the locks are released, or in the background
+         * with lazy_free.
+         */
+        void flush(bool lazy_free = false);
+
+        /**
+         * Returns the number of keys that exist, keys given more than once are counted every time.
+         */
+        [[nodiscard]] size_t count_existing(std::span<std::string_view const> keys);
+
+        /**
+         * Adds the delta to the integer stored at the key, which is created if it does not exist. Integer
+         * entries are updated in place and keep their expiry time. Returns the new value.
+         */
+        [[nodiscard]] std::expected<int64_t, value_error> increment(std::string_view key, int64_t delta);
+
+        /**
+         * Adds the delta to the number stored at the key, which is created if it does not exist. The result
+         * replaces the entry and keeps its expiry time. Returns the new entry.
+         */
+        [[nodiscard]] std::expected<entry_ptr, value_error> increment_float(std::string_view key, double delta);
+
+        /**
+         * The number of bytes taken up by the key and its value, including the slot in the table. Returns
+         * nothing if the key does not exist.
+         */
+        [[nodiscard]] std::optional<size_t> memory_usage(std::string_view key) const;
+
+        /**
+         * Implements the active expiry by removing the keys of each shard that have expired according to
+         * the expiry index, and advances the migration of growing shards. Keys are removed in batches and
+         * only one shard is locked at a time, for the duration of a batch. Stops when the deadline has passed,
+         * in which case the next call starts with the shard where this one stopped.
+         */
+        expire_cycle_result handle_deletes(time_point_t now, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+
+        /**
+         * Implements active defragmentation by moving the entries that live in sparse pages of the allocator
+         * to new allocations, so that those pages can be released. Visits the slots of each shard in batches,
+         * like handle_deletes, and stops when all shards have been visited or the deadline has passed, in which
+         * case the next call continues where this one stopped.
+         */
+        defrag_cycle_result defragment(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+
+        /**
+         * Moves the values that have been idle for long enough to the cold tier. Visits the slots of each shard in
+         * batches, like defragment, and does nothing without a cold tier.
+         */
+        spill_cycle_result spill_cold_values(time_point_t now, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+
+        /**
+         * Called once the value of a cold entry has been loaded for a read. Replaces the cold entry with the loaded
+         * one if the key was read before within the idle time of the cold tier, otherwise only marks the key as read.
+         * Nothing changes if the key has been written since the cold entry was read.
+         */
+        void promote(std::string_view key, entry_ptr const& cold, entry_ptr const& loaded);
+
+        /**
+         * Samples keys at random and adds them to the pool of eviction candidates, scored by the eviction policy.
+         */
+        void sample_eviction_candidates(eviction_pool& pool, size_t database_index, size_t num_samples) const;
+
+        /**
+         * Removes a key chosen for eviction. Returns false if the key no longer exists.
+         */
+        bool evict(std::string_view key);
+
+        /**
+         * Takes a shared lock on every shard, which keeps out all writes until the locks are released.
+         */
+        [[nodiscard]] std::vector<std::shared_lock<std::shared_mutex>> lock_shared() const;
+
+        /**
+         * Writes a section with all live keys to the snapshot. Takes no locks, the caller keeps out writes, see
+         * lock_shared, or runs in a child process forked from the server.
+         */
+        void write_snapshot(snapshot_writer& writer, size_t index, time_point_t now) const;
+
+        /**
+         * Writes the commands that recreate the live keys to a rewritten append-only file, preceded by a FLUSHDB so that
+         * the file replaces whatever came before it. Takes no locks, like write_snapshot.
+         */
+        void write_append_log(append_log_writer& writer, size_t index, time_point_t now) const;
+
+        [[nodiscard]] database_statistics get_statistics() const;
+        [[nodiscard]] size_t num_shards() const;
+        [[nodiscard]] memory_limit const& get_memory_limit() const;
+
+        /**
+         * Returns nullptr when the database frees everything on the calling thread.
+         */
+        [[nodiscard]] lazy_free_worker const* get_lazy_free_worker() const;
+
+        /**
+         * Logs every change to the append-only file from now on, under the index of the database. Attached before
+         * clients connect.
+         */
+        void set_append_log(append_log* log, size_t index);
+
+        /**
+         * Serves the keys of the mapped dataset behind the keys stored in the database. Attached before clients
+         * connect and kept for the lifetime of the database, so replies may reference its values without pinning.
+         */
+        void set_dataset(std::shared_ptr<mapped_dataset const> dataset);
+
+        /**
+         * Looks a key that is not stored in the database up in the mapped dataset, see set_dataset.
+         */
+        [[nodiscard]] std::optional<std::string_view> get_dataset_value(std::string_view key) const noexcept;
+
+        /**
+         * A database that serves a mapped dataset refuses write commands, since the dataset cannot be changed.
+         */
+        [[nodiscard]] bool is_read_only() const noexcept;
+
+        /**
+         * Moves idle values to the cold tier from now on, see spill_cold_values. Attached before clients connect.
+         */
+        void set_cold_tier(cold_tier const* tier);
+
+    private:
+        enum class delete_reason : uint8_t
+        {
+            ttl_expiry   = 0,
+            user_deleted = 2 << 0
+        };
+
+        struct expiry_info
+        {
+            /**
+             * The version of the value that should be deleted. If this differs from the actual value, then
+             * we abort the operation.
+             */
+            entry::version_t version{};
+            delete_reason delete_reason{};
+        };
+
+        /**
+         * A part of the keyspace with its own lock, so that writers to different shards never contend
+         * and maintenance only ever pauses the clients of a single shard. Shards are aligned to cache lines
+         * to keep the locks and counters of neighbouring shards from sharing a line.
+         */
+        struct alignas(64) shard
+        {
+            store_t store{};
+
+            /**
+             * Instead of deleting key/values from the database, key/values to be deleted are added
+             * to this list and cleaned up from a background thread. This avoids the need for synchronizing
+             * updates in two concurrent data structures during regular operations (GET, SET).
+             * TODO: Use queue instead?
+             */
+            std::unordered_map<std::string, expiry_info> delete_keys{};
+            std::mutex delete_mutex{};
+
+            /**
+             * Connections may be served by several I/O threads. Reads take a shared lock, while writes and the
+             * maintenance work performed by the timeout worker take an exclusive lock.
+             */
+            mutable std::shared_mutex mutex{};
+
+            /**
+             * Keys with a ttl, by the time they expire. Guarded by the shard lock like the store.
+             */
+            expiry_index expiries{};
+
+            std::atomic<uint64_t> hits{};
+            std::atomic<uint64_t> misses{};
+            std::atomic<uint64_t> expired_keys{};
+            std::atomic<uint64_t> evicted_keys{};
+
+            /**
+             * The limit shared by all databases of the server, which tracks the memory in use.
+             */
+            memory_limit* limit{};
+
+            /**
+             * The part of the memory in use that belongs to this shard, guarded by the shard lock.
+             */
+            int64_t used_bytes{};
+
+            lazy_free_worker* lazy_free{};
+
+            append_log* log{};
+            size_t database_index{};
+
+            cold_tier const* tier{};
+
+            /**
+             * The next slot visited by active defragmentation, only used by the maintenance thread.
+             */
+            size_t defrag_cursor{};
+            size_t spill_cursor{};
+
+            expire_cycle_result handle_deletes(time_point_t now, size_t max_keys);
+            defrag_cycle_result defragment(size_t max_slots);
+            spill_cycle_result spill_cold_values(time_point_t now, size_t max_slots);
+
+            /**
+             * Finds a live entry, queueing it for deletion if it has expired. Requires at least a shared lock.
+             */
+            [[nodiscard]] entry_ptr lookup(std::string_view key, size_t hash, time_point_t now);
+
+            /**
+             * Stores a newly created entry, taking ownership of it. Requires an exclusive lock.
+             */
+            void assign(std::string_view key, size_t hash, entry* value);
+
+            /**
+             * Updates the memory in use for a key whose value changes from old_value to new_value, either of
+             * which is nullptr when the key is added or removed.
+             */
+            void account(std::string_view key, entry const* old_value, entry const* new_value) noexcept;
+
+            /**
+             * Drops a value that has been removed from the store, large values are freed by the lazy free worker.
+             */
+            void release(entry_ptr value) const;
+
+            /**
+             * Logs the value now stored at the key, or the removal of the key, to the append-only file if there is one.
+             * Requires an exclusive lock.
+             */
+            void log_value(std::string_view key, entry const& value) const;
+            void log_delete(std::string_view key) const;
+
+            /**
+             * Marks an entry as accessed for the eviction policy and the cold tier. Cold entries are left to promote.
+             */
+            void touch(entry const& value, time_point_t now) const noexcept;
+
+            /**
+             * Whether the access clocks of the entries are kept up to date. Only LRU, LFU and the cold tier read
+             * them, so with the other policies reads and writes leave the clocks alone.
+             */
+            [[nodiscard]] bool tracks_access() const noexcept;
+        };
+
+        /**
+         * A key of a multi-key command along with its position among the keys.
+         */
+        struct batch_key
+        {
+            size_t hash{};
+            size_t index{};
+            size_t shard{};
+        };
+
+        /**
+         * Hashes the keys and orders them by shard, keeping the order of the keys within a shard.
+         */
+        [[nodiscard]] std::vector<batch_key> make_batches(std::span<std::string_view const> keys) const;
+
+        /**
+         * Calls the function with each shard and the keys that belong to it, in ascending order of the shards.
+         */
+        template<typename function_t>
+        void for_each_batch(std::span<batch_key const> batches, function_t&& function);
+
+        template<typename function_t>
+        void for_each_shard(std::span<std::string_view const> keys, function_t&& function);
+
+        /**
+         * Runs the step of a maintenance cycle on the shards, one batch per call, starting with the shard where the previous
+         * cycle with the same cursor stopped. The step returns whether the shard has batches left. Returns whether the
+         * deadline passed before every shard was done, the cursor then points at the shard to continue with.
+         */
+        template<typename step_t>
+        bool for_each_shard_batch(size_t& next_shard, std::chrono::steady_clock::time_point deadline, step_t&& step);
+
+        [[nodiscard]] shard& get_shard(size_t hash) const;
+
+        /**
+         * Whether the entry in a slot holds a value that has not been deleted or expired.
+         */
+        [[nodiscard]] static bool is_live(entry_ptr const& entry, time_point_t now);
+        [[nodiscard]] static size_t hash(std::string_view key);
+
+        std::shared_ptr<memory_limit> m_memory_limit;
+        std::shared_ptr<lazy_free_worker> m_lazy_free;
+        append_log* m_append_log{};
+        size_t m_index{};
+        std::shared_ptr<mapped_dataset const> m_dataset{};
+        cold_tier const* m_cold_tier{};
+        std::unique_ptr<shard[]> m_shards;
+        size_t m_shard_mask{};
+
+        /**
+         * The number of keys each shard was presized for, see reserve.
+         */
+        size_t m_reserved_keys_per_shard{};
+
+        /**
+         * The shard the next expire cycle starts with, only used by the maintenance thread.
+         */
+        size_t m_next_expire_shard{};
+        size_t m_next_defrag_shard{};
+        size_t m_next_spill_shard{};
+    };
+
+    /**
+     * The state of the snapshots of a server, see server::save.
+     */
+    export struct save_status
+    {
+        /**
+         * When the last save completed successfully, or the time the server started.
+         */
+        time_point_t last_save{};
+        bool last_save_failed{};
+        bool in_progress{};
+    };
+
+    /**
+     * A server is a collection of databases and the member functions used to manage these.
+     */
+    export class server
+    {
+    public:
+        typedef size_t database_handle_t;
+        typedef size_t database_size_t;
+        typedef std::vector<std::shared_ptr<database>>::const_iterator database_iterator_t;
+
+        /**
+         * The number of keys that are sampled from each database for every key that is evicted.
+         */
+        static constexpr size_t eviction_samples = 5;
+
+        /**
+         * A max memory of zero bytes means no limit.
+         */
+        explicit server(size_t num_databases, size_t num_shards = database::default_num_shards, size_t expected_keys = 0,
+                        size_t max_memory = 0, eviction_policy policy = eviction_policy::noeviction);
+
+        database_handle_t create_database();
+        [[nodiscard]] std::shared_ptr<database> get_database(database_handle_t database_no) const;
+        [[nodiscard]] bool is_valid_handle(database_handle_t database_no) const;
+
+        /**
+         * Evicts keys according to the eviction policy until the memory in use is within the limit. Returns false
+         * when the limit is still exceeded, because the policy does not allow eviction or there is nothing left
+         * that it allows to evict.
+         */
+        bool free_memory_if_needed();
+
+        /**
+         * Removes all keys from all databases, see database::flush.
+         */
+        void flush_all(bool lazy_free = false);
+
+        [[nodiscard]] memory_limit const& get_memory_limit() const;
+        [[nodiscard]] lazy_free_statistics get_lazy_free_statistics() const;
+
+        /**
+         * The file snapshots are written to and loaded from.
+         */
+        void set_snapshot_path(std::filesystem::path path);
+        [[nodiscard]] std::filesystem::path const& get_snapshot_path() const;
+
+        /**
+         * Writes a snapshot of all databases on the calling thread, pausing writes for the duration. The snapshot
+         * is written to a temporary file, which replaces the previous snapshot when it is complete.
+         */
+        std::expected<void, std::string> save();
+
+        /**
+         * Writes a snapshot from a forked child process, which sees the databases as they were at the time of the
+         * fork thanks to copy on write. Writes are only paused while forking. The file and the paths are prepared
+         * before forking, so that the child only writes, syncs and renames the file.
+         */
+        std::expected<void, std::string> background_save();
+
+        /**
+         * Reaps the child of a background save once it has exited. Returns whether the save succeeded, or nothing
+         * while no background save has finished.
+         */
+        std::optional<bool> poll_background_save();
+
+        [[nodiscard]] save_status get_save_status() const;
+
+        /**
+         * Loads the snapshot into the databases, which are expected to be empty, presizing each of them for the
+         * number of keys it holds. Returns the number of keys that were read.
+         */
+        std::expected<size_t, std::string> load_snapshot();
+
+        /**
+         * Logs the changes to all databases to the append-only file from now on, see append_log. Set before clients
+         * connect, after the file has been replayed.
+         */
+        void set_append_log(std::shared_ptr<append_log> log);
+
+        /**
+         * Returns nullptr when the server runs without an append-only file.
+         */
+        [[nodiscard]] append_log* get_append_log() const noexcept;
+
+        /**
+         * Serves the mapped dataset from the first database, which becomes read-only, see database::set_dataset. The
+         * other databases stay writable. Set before clients connect.
+         */
+        void set_mapped_dataset(std::shared_ptr<mapped_dataset const> dataset);
+
+        /**
+         * Moves idle values of all databases to the cold tier, which has been started. Set before clients connect.
+         */
+        void set_cold_tier(std::shared_ptr<cold_tier> tier);
+
+        /**
+         * Returns nullptr when the server runs without a cold tier.
+         */
+        [[nodiscard]] cold_tier* get_cold_tier() const noexcept;
+
+        /**
+         * The pool the connections take their buffers from, reported by MEMORY STATS. Set before clients connect.
+         */
+        void set_buffer_pool(LambdaSnail::memory::buffer_pool const* pool);
+
+        /**
+         * Returns nullptr when no pool has been set.
+         */
+        [[nodiscard]] LambdaSnail::memory::buffer_pool const* get_buffer_pool() const noexcept;
+
+        /**
+         * The maintenance thread, whose counters are reported by MEMORY STATS. Set before clients connect.
+         */
+        void set_maintenance_worker(timeout_worker const* worker);
+
+        /**
+         * Returns nullptr when no maintenance thread has been set.
+         */
+        [[nodiscard]] timeout_worker const* get_maintenance_worker() const noexcept;
+
+        /**
+         * Rewrites the append-only file from a forked child, like a background save, see append_log. Cannot run
+         * alongside a background save. A rewrite that cannot be started or fails is recorded with the log, which
+         * delays the next automatic rewrite.
+         */
+        std::expected<void, std::string> rewrite_append_log();
+
+        /**
+         * Reaps the child of a rewrite once it has exited, and hands the rewritten file to the log. Returns whether the
+         * child succeeded, or nothing while no rewrite has finished.
+         */
+        std::optional<bool> poll_append_log_rewrite();
+
+        [[nodiscard]] database_iterator_t begin() const;
+        [[nodiscard]] database_iterator_t end() const;
+
+    private:
+        std::vector<std::shared_ptr<database>> m_databases{};
+        size_t m_num_shards{};
+        size_t m_expected_keys{};
+
+        std::shared_ptr<memory_limit> m_memory_limit{};
+        std::shared_ptr<lazy_free_worker> m_lazy_free{};
+        std::shared_ptr<append_log> m_append_log{};
+        std::shared_ptr<mapped_dataset const> m_mapped_dataset{};
+        std::shared_ptr<cold_tier> m_cold_tier{};
+        LambdaSnail::memory::buffer_pool const* m_buffer_pool{};
+        timeout_worker const* m_maintenance_worker{};
+
+        /**
+         * Writes the snapshot through the writer, which has been opened on the temporary file, and renames the file to
+         * the snapshot path, or removes it on failure. Does not allocate, so that a forked child can call it.
+         */
+        [[nodiscard]] std::error_code write_snapshot(snapshot_writer& writer, char const* temporary_path, char const* snapshot_path) const;
+
+        /**
+         * Writes the rewritten append-only file through the writer, which the log takes over once the child has exited.
+         * Does not allocate, like write_snapshot.
+         */
+        [[nodiscard]] std::error_code write_append_log(append_log_writer& writer) const;
+
+        std::filesystem::path m_snapshot_path{ snapshot_format::default_file_name };
+
+        /**
+         * Guards the state of the snapshots and of the append-only file rewrites below. Held for the duration of SAVE.
+         */
+        mutable std::mutex m_save_mutex{};
+        pid_t m_save_child{ -1 };
+        pid_t m_rewrite_child{ -1 };
+        time_point_t m_last_save{ std::chrono::system_clock::now() };
+        bool m_last_save_failed{};
+
+        /**
+         * Evictions are performed by one thread at a time, the others wait until the memory is within the limit.
+         */
+        std::mutex m_eviction_mutex{};
+        eviction_pool m_eviction_pool{};
+    };
+
+    export class command_dispatch;
+
+    enum class command_flags : uint32_t
+    {
+        none       = 0,
+        write      = 1 << 0,
+        readonly   = 1 << 1,
+        fast       = 1 << 2,
+        connection = 1 << 3,
+
+        /**
+         * The command may use more memory, so it is refused when the memory limit is exceeded.
+         */
+        denyoom    = 1 << 4
+    };
+
+    /**
+     * Handlers are stateless functions that receive the database selected by the connection. The
+     * dispatch is passed along for the few commands that change the state of the connection.
+     */
+    using command_handler_t = void (*)(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out);
+
+    struct command_info
+    {
+        std::string_view name;
+        command_handler_t handler;
+
+        /**
+         * As in Redis, a positive arity is the exact number of arguments (including the command name) and
+         * a negative arity is the minimum number of arguments.
+         */
+        int32_t arity;
+        uint32_t flags;
+
+        [[nodiscard]] constexpr bool has_flag(command_flags flag) const { return flags & static_cast<uint32_t>(flag); }
+        [[nodiscard]] constexpr bool accepts_arity(size_t num_args) const
+        {
+            return arity >= 0 ? num_args == static_cast<size_t>(arity) : num_args >= static_cast<size_t>(-arity);
+        }
+    };
+
+    export class command_dispatch
+    {
+    public:
+        explicit command_dispatch(server& server);
+        /**
+         * Executes the command and appends the reply to the writer.
+         */
+        void process_command(resp::data_view message, resp::response_writer& out);
+
+        /**
+         * Executes a command whose arguments have been located by the incremental parser, without parsing the
+         * message again. Messages without an argument table are parsed as above.
+         */
+        void process_command(std::string_view message, std::span<resp::incremental_parser::argument const> arguments, resp::response_writer& out);
+
+        /**
+         * Scratch memory for the temporaries of the command being executed, released when the next command starts.
+         */
+        [[nodiscard]] std::pmr::memory_resource& scratch() noexcept;
+
+        [[nodiscard]] bool handle_set_database(server::database_handle_t handle);
+        [[nodiscard]] server& get_server() noexcept;
+
+        /**
+         * Set while replaying a persisted file, whose writes were accepted before. As in Redis, they are neither
+         * refused nor make room by evicting keys when the memory limit is exceeded.
+         */
+        void set_loading(bool loading) noexcept;
+
+        /**
+         * Finds a command in the registry, ignoring the case of the name. Returns nullptr for unknown commands.
+         */
+        [[nodiscard]] static command_info const* find_command(std::string_view command_name) noexcept;
+
+        /**
+         * Writes the reply to a read of a cold entry, which references a buffer that the value is loaded into later,
+         * see read_cold_values.
+         */
+        void read_cold_value(database& db, std::string_view key, entry_ptr cold, resp::response_writer& out);
+
+        /**
+         * Whether replies written since the last call to read_cold_values wait for cold values.
+         */
+        [[nodiscard]] bool has_cold_reads() const noexcept;
+
+        /**
+         * Loads the cold values of the replies written so far on a reader thread of the cold tier, and then calls the
+         * function from that thread with whether all of them could be read. The replies must not be sent before.
+         */
+        void read_cold_values(std::function<void(bool)> on_read);
+
+    private:
+        /**
+         * A cold value that a reply waits for. The reply holds the loaded entry, whose value is filled in by a reader.
+         */
+        struct cold_read
+        {
+            database* db{};
+            std::string key{};
+            entry_ptr cold{};
+            entry_ptr loaded{};
+
+            /**
+             * The loaded entry, which only this read writes to until its value has been loaded.
+             */
+            entry* target{};
+        };
+
+        void execute(std::span<resp::data_view const> request, resp::response_writer& out);
+
+        server& m_server;
+
+        server::database_handle_t m_current_db{};
+
+        /**
+         * Cached pointer to the selected database, databases live as long as the server so this saves
+         * a shared_ptr copy on every command.
+         */
+        database* m_database{};
+
+        memory::arena m_scratch{};
+
+        std::vector<cold_read> m_cold_reads{};
+        bool m_loading{};
+    };
+
+    struct ping_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct echo_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct get_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct set_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct mget_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct mset_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct msetnx_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct del_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct unlink_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct flushdb_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct flushall_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct save_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct bgsave_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct lastsave_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct bgrewriteaof_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct exists_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct memory_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct incr_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct decr_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct incrby_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct decrby_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct incrbyfloat_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    struct select_handler final
+    {
+        static void execute(database& db, command_dispatch& dispatch, std::span<resp::data_view const> args, resp::response_writer& out) noexcept;
+    };
+
+    /**
+     * Counters of the maintenance thread, see timeout_worker.
+     */
+    export struct maintenance_statistics
+    {
+        uint64_t cycles{};
+        uint64_t expired_keys{};
+
+        /**
+         * The number of cycles that ran out of budget before all expired keys had been removed.
+         */
+        uint64_t incomplete_cycles{};
+        std::chrono::microseconds last_cycle_duration{};
+        std::chrono::microseconds max_cycle_duration{};
+
+        uint64_t defrag_cycles{};
+        uint64_t defragmented_entries{};
+
+        uint64_t spilled_values{};
+    };
+
+    /**
+     * The timeout worker is the mechanism for active expiry of keys. It runs on its own thread, and a
+     * number of times per second removes the keys that have expired from all databases. Each cycle is given
+     * a time budget, after which the remaining keys are left for the next cycle.
+     *
+     * When the allocator of the stored values wastes more than the defrag threshold, in percent of the memory in
+     * use, each cycle is followed by a round of active defragmentation with a budget of its own. With a cold tier,
+     * idle values are then moved to it, see cold_tier.
+     */
+    export class timeout_worker
+    {
+    public:
+        static constexpr uint32_t default_hz = 10;
+        static constexpr std::chrono::microseconds default_cycle_budget{ 25'000 };
+        static constexpr uint32_t default_defrag_threshold = 10;
+        static constexpr std::chrono::microseconds default_defrag_budget{ 10'000 };
+
+        /**
+         * Fragmentation is ignored while the allocator wastes less than this many bytes.
+         */
+        static constexpr size_t defrag_ignore_bytes = 16 * 1024 * 1024;
+
+        /**
+         * A defrag threshold of zero disables active defragmentation.
+         */
+        explicit timeout_worker(server& server, std::shared_ptr<LambdaSnail::logging::logger> m_logger,
+                                uint32_t hz = default_hz, std::chrono::microseconds cycle_budget = default_cycle_budget,
+                                uint32_t defrag_threshold = default_defrag_threshold,
+                                std::chrono::microseconds defrag_budget = default_defrag_budget);
+
+        /**
+         * Starts the maintenance thread, which runs until stop is called or the worker is destroyed.
+         */
+        void start();
+        void stop();
+
+        /**
+         * Runs a single expire cycle on the calling thread.
+         */
+        expire_cycle_result run_cycle(time_point_t now);
+
+        /**
+         * Runs a round of active defragmentation on the calling thread, regardless of the fragmentation.
+         */
+        defrag_cycle_result run_defrag_cycle();
+
+        /**
+         * Moves idle values to the cold tier on the calling thread, within the budget of the cold tier.
+         */
+        spill_cycle_result run_spill_cycle(time_point_t now);
+
+        [[nodiscard]] bool needs_defrag() const;
+
+        [[nodiscard]] maintenance_statistics get_statistics() const;
+
+    private:
+        void run(std::stop_token const& stop_token);
+
+        /**
+         * Runs a step of a cycle on every database, starting with the database that follows the one where the previous
+         * cycle ran out of budget, so that a busy database cannot keep the others from their turn. The step returns
+         * whether it ran out of budget, which ends the cycle. Returns whether the cycle ended early.
+         */
+        template<typename step_t>
+        bool for_each_database(size_t& next_database, step_t&& step);
+
+        LambdaSnail::server::server& m_server;
+        std::shared_ptr<LambdaSnail::logging::logger> m_logger{};
+
+        std::chrono::microseconds m_period{};
+        std::chrono::microseconds m_cycle_budget{};
+        uint32_t m_defrag_threshold{};
+        std::chrono::microseconds m_defrag_budget{};
+
+        std::atomic<uint64_t> m_cycles{};
+        std::atomic<uint64_t> m_expired_keys{};
+        std::atomic<uint64_t> m_incomplete_cycles{};
+        std::atomic<int64_t> m_last_cycle_duration{};
+        std::atomic<int64_t> m_max_cycle_duration{};
+        std::atomic<uint64_t> m_defrag_cycles{};
+        std::atomic<uint64_t> m_defragmented_entries{};
+        std::atomic<uint64_t> m_spilled_values{};
+
+        /**
+         * The database each kind of cycle starts with, only used by the maintenance thread.
+         */
+        size_t m_next_expire_database{};
+        size_t m_next_defrag_database{};
+        size_t m_next_spill_database{};
+
+        std::mutex m_mutex{};
+        std::condition_variable_any m_condition{};
+        std::jthread m_thread{};
     };
 } // namespace LambdaSnail::server
@@ -0,0 +1,587 @@
+module;
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <tracy/Tracy.hpp>
+
+export module server :server.snapshot;
+
+import :server.cold_storage;
+import :server.entry;
+
+namespace LambdaSnail::server
+{
+    /**
+     * The layout of a snapshot file. A snapshot starts with the magic and the version, followed by a section
+     * for every database that holds keys, and ends with the end marker and a checksum of everything before it:
+     *
+     *     "LSDB" version
+     *     database index num_keys                  once per database
+     *     [expire_time ttl] type key value         once per key
+     *     end crc64
+     *
+     * Indices, lengths and counts are LEB128 varints, and strings are prefixed with their length. Integer values
+     * are zigzag encoded varints, so that small numbers take a byte or two, and the expiry time is in milliseconds
+     * since the epoch, as a little endian 64-bit integer.
+     */
+    export namespace snapshot_format
+    {
+        constexpr std::string_view magic = "LSDB";
+        constexpr uint8_t version        = 1;
+
+        enum class opcode : uint8_t
+        {
+            string_value  = 0,
+            integer_value = 1,
+            expire_time   = 0xFC,
+            database      = 0xFE,
+            end           = 0xFF
+        };
+
+        constexpr std::string_view default_file_name = "dump.lsdb";
+    }
+
+    /**
+     * The CRC-64 with the Jones polynomial that Redis uses to check its snapshots.
+     */
+    export class crc64
+    {
+    public:
+        void update(std::string_view const data) noexcept
+        {
+            for (char const c : data)
+            {
+                m_value = s_table[(m_value ^ static_cast<uint8_t>(c)) & 0xFF] ^ (m_value >> 8);
+            }
+        }
+
+        [[nodiscard]] uint64_t value() const noexcept { return m_value; }
+
+    private:
+        static constexpr uint64_t polynomial = 0x95AC9329AC4BC9B5ULL;
+
+        static constexpr std::array<uint64_t, 256> s_table = [] {
+            std::array<uint64_t, 256> table{};
+            for (uint64_t i = 0; i < table.size(); ++i)
+            {
+                uint64_t crc = i;
+                for (int bit = 0; bit < 8; ++bit)
+                {
+                    crc = crc & 1 ? (crc >> 1) ^ polynomial : crc >> 1;
+                }
+
+                table[i] = crc;
+            }
+
+            return table;
+        }();
+
+        uint64_t m_value{};
+    };
+
+    /**
+     * Writes a snapshot through a large buffer. Does not allocate after construction, or take any locks, so that
+     * it can be constructed before forking and used by the child process of a multithreaded server. The first error
+     * is kept and reported by finish, the following writes are ignored.
+     */
+    export class snapshot_writer
+    {
+    public:
+        static constexpr size_t buffer_size = 1024 * 1024;
+
+        /**
+         * Creates or truncates the file. Check the result of finish for errors.
+         */
+        explicit snapshot_writer(std::filesystem::path const& path);
+        ~snapshot_writer();
+
+        snapshot_writer(snapshot_writer const&)            = delete;
+        snapshot_writer& operator=(snapshot_writer const&) = delete;
+
+        /**
+         * The first error so far, such as failing to create the file.
+         */
+        [[nodiscard]] std::error_code error() const noexcept { return m_error; }
+
+        void begin_database(size_t index, size_t num_keys);
+        void write_entry(std::string_view key, entry const& value);
+
+        /**
+         * Writes the checksum, flushes the buffer and syncs the file to disk. Returns the size of the file.
+         */
+        [[nodiscard]] std::expected<size_t, std::error_code> finish();
+
+    private:
+        void write(std::string_view data);
+        void write_byte(uint8_t value);
+        void write_varint(uint64_t value);
+        void write_string(std::string_view value);
+        void flush();
+
+        int m_file{ -1 };
+        std::vector<char> m_buffer{};
+        size_t m_buffered{};
+        size_t m_written{};
+        crc64 m_checksum{};
+        std::error_code m_error{};
+    };
+
+    /**
+     * Reads a snapshot from a memory mapped file. The checksum is verified before any entry is read, so a
+     * truncated or corrupted file is rejected as a whole.
+     */
+    export class snapshot_reader
+    {
+    public:
+        snapshot_reader() = default;
+        ~snapshot_reader();
+
+        snapshot_reader(snapshot_reader&& other) noexcept;
+        snapshot_reader& operator=(snapshot_reader&& other) noexcept;
+
+        [[nodiscard]] static std::expected<snapshot_reader, std::string> open(std::filesystem::path const& path);
+
+        /**
+         * Calls on_database with the index and the number of keys at the start of every database section, which
+         * returns false to reject the database, and on_entry with the key and a newly created entry for every key
+         * in the section. Returns the number of keys.
+         */
+        template<typename database_function_t, typename entry_function_t>
+        [[nodiscard]] std::expected<size_t, std::string> read(database_function_t&& on_database, entry_function_t&& on_entry);
+
+    private:
+        [[nodiscard]] bool read_byte(uint8_t& value) noexcept;
+        [[nodiscard]] bool read_varint(uint64_t& value) noexcept;
+        [[nodiscard]] bool read_string(std::string_view& value) noexcept;
+        [[nodiscard]] bool read_fixed64(uint64_t& value) noexcept;
+
+        std::string_view m_data{};
+        size_t m_cursor{};
+    };
+
+    template<typename database_function_t, typename entry_function_t>
+    std::expected<size_t, std::string> snapshot_reader::read(database_function_t&& on_database, entry_function_t&& on_entry)
+    {
+        ZoneScoped;
+
+        using snapshot_format::opcode;
+
+        bool has_database = false;
+        size_t num_keys   = 0;
+        auto ttl          = entry::time_point_t::min();
+        while (true)
+        {
+            uint8_t code{};
+            if (not read_byte(code)) [[unlikely]]
+            {
+                return std::unexpected("Unexpected end of the snapshot");
+            }
+
+            switch (static_cast<opcode>(code))
+            {
+                case opcode::end:
+                    return num_keys;
+                case opcode::database:
+                {
+                    uint64_t index{};
+                    uint64_t database_keys{};
+                    if (not read_varint(index) or not read_varint(database_keys)) [[unlikely]]
+                    {
+                        return std::unexpected("Invalid database section");
+                    }
+
+                    if (not on_database(static_cast<size_t>(index), static_cast<size_t>(database_keys)))
+                    {
+                        return std::unexpected("The snapshot holds database " + std::to_string(index) + ", which the server does not have");
+                    }
+
+                    has_database = true;
+                    break;
+                }
+                case opcode::expire_time:
+                {
+                    uint64_t milliseconds{};
+                    if (not read_fixed64(milliseconds)) [[unlikely]]
+                    {
+                        return std::unexpected("Invalid expiry time");
+                    }
+
+                    ttl = entry::time_point_t(std::chrono::duration_cast<entry::time_point_t::duration>(
+                            std::chrono::milliseconds(static_cast<int64_t>(milliseconds))));
+                    break;
+                }
+                case opcode::string_value:
+                case opcode::integer_value:
+                {
+                    std::string_view key;
+                    if (not has_database or not read_string(key)) [[unlikely]]
+                    {
+                        return std::unexpected("Invalid key");
+                    }
+
+                    entry* value{};
+                    if (static_cast<opcode>(code) == opcode::string_value)
+                    {
+                        std::string_view string;
+                        if (not read_string(string)) [[unlikely]]
+                        {
+                            return std::unexpected("Invalid string value");
+                        }
+
+                        value = entry::create(string, 0, ttl);
+                    }
+                    else
+                    {
+                        uint64_t zigzag{};
+                        if (not read_varint(zigzag)) [[unlikely]]
+                        {
+                            return std::unexpected("Invalid integer value");
+                        }
+
+                        value = entry::create(static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1), 0, ttl);
+                    }
+
+                    on_entry(key, value);
+                    ttl = entry::time_point_t::min();
+                    ++num_keys;
+                    break;
+                }
+                default:
+                    return std::unexpected("Unknown record type " + std::to_string(code));
+            }
+        }
+    }
+}
+
+LambdaSnail::server::snapshot_writer::snapshot_writer(std::filesystem::path const& path) : m_buffer(buffer_size)
+{
+    m_file = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_file < 0)
+    {
+        m_error = std::error_code(errno, std::generic_category());
+        return;
+    }
+
+    write(snapshot_format::magic);
+    write_byte(snapshot_format::version);
+}
+
+LambdaSnail::server::snapshot_writer::~snapshot_writer()
+{
+    if (m_file >= 0)
+    {
+        ::close(m_file);
+    }
+}
+
+void LambdaSnail::server::snapshot_writer::begin_database(size_t const index, size_t const num_keys)
+{
+    write_byte(std::to_underlying(snapshot_format::opcode::database));
+    write_varint(index);
+    write_varint(num_keys);
+}
+
+void LambdaSnail::server::snapshot_writer::write_entry(std::string_view const key, entry const& value)
+{
+    using snapshot_format::opcode;
+
+    if (value.has_ttl())
+    {
+        auto const milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(value.ttl().time_since_epoch()).count();
+        write_byte(std::to_underlying(opcode::expire_time));
+
+        std::array<char, sizeof(uint64_t)> bytes{};
+        for (size_t i = 0; i < bytes.size(); ++i)
+        {
+            bytes[i] = static_cast<char>(static_cast<uint64_t>(milliseconds) >> (8 * i));
+        }
+
+        write(std::string_view(bytes.data(), bytes.size()));
+    }
+
+    if (value.encoding() == entry_encoding::integer)
+    {
+        auto const integer = value.integer();
+        write_byte(std::to_underlying(opcode::integer_value));
+        write_string(key);
+        write_varint((static_cast<uint64_t>(integer) << 1) ^ static_cast<uint64_t>(integer >> 63));
+        return;
+    }
+
+    write_byte(std::to_underlying(opcode::string_value));
+    write_string(key);
+
+    if (value.encoding() != entry_encoding::cold) [[likely]]
+    {
+        write_string(value.value());
+        return;
+    }
+
+    // Cold values are copied from the file of the cold tier in chunks, which are loaded as regular values
+    write_varint(value.value_size());
+    auto const is_read = entry::cold_file().read_chunks(value.cold_offset(), value.value_size(), [this](std::string_view const chunk) { write(chunk); });
+    if (not is_read and not m_error)
+    {
+        m_error = std::make_error_code(std::errc::io_error);
+    }
+}
+
+std::expected<size_t, std::error_code> LambdaSnail::server::snapshot_writer::finish()
+{
+    ZoneScoped;
+
+    write_byte(std::to_underlying(snapshot_format::opcode::end));
+
+    // The checksum covers everything up to and including the end marker
+    auto const checksum = m_checksum.value();
+    std::array<char, sizeof(uint64_t)> bytes{};
+    for (size_t i = 0; i < bytes.size(); ++i)
+    {
+        bytes[i] = static_cast<char>(checksum >> (8 * i));
+    }
+
+    write(std::string_view(bytes.data(), bytes.size()));
+    flush();
+
+    if (not m_error and ::fsync(m_file) != 0)
+    {
+        m_error = std::error_code(errno, std::generic_category());
+    }
+
+    if (m_error)
+    {
+        return std::unexpected(m_error);
+    }
+
+    return m_written;
+}
+
+void LambdaSnail::server::snapshot_writer::write(std::string_view data)
+{
+    m_checksum.update(data);
+    while (not data.empty() and not m_error)
+    {
+        auto const num_bytes = std::min(data.size(), m_buffer.size() - m_buffered);
+        std::memcpy(m_buffer.data() + m_buffered, data.data(), num_bytes);
+        m_buffered += num_bytes;
+        data.remove_prefix(num_bytes);
+
+        if (m_buffered == m_buffer.size())
+        {
+            flush();
+        }
+    }
+}
+
+void LambdaSnail::server::snapshot_writer::write_byte(uint8_t const value)
+{
+    auto const byte = static_cast<char>(value);
+    write(std::string_view(&byte, 1));
+}
+
+void LambdaSnail::server::snapshot_writer::write_varint(uint64_t value)
+{
+    std::array<char, 10> bytes{};
+    size_t length = 0;
+    do
+    {
+        bytes[length++] = static_cast<char>((value & 0x7F) | (value >= 0x80 ? 0x80 : 0));
+        value >>= 7;
+    } while (value != 0);
+
+    write(std::string_view(bytes.data(), length));
+}
+
+void LambdaSnail::server::snapshot_writer::write_string(std::string_view const value)
+{
+    write_varint(value.size());
+    write(value);
+}
+
+void LambdaSnail::server::snapshot_writer::flush()
+{
+    size_t offset = 0;
+    while (offset < m_buffered and not m_error)
+    {
+        auto const written = ::write(m_file, m_buffer.data() + offset, m_buffered - offset);
+        if (written < 0)
+        {
+            if (errno != EINTR)
+            {
+                m_error = std::error_code(errno, std::generic_category());
+            }
+
+            continue;
+        }
+
+        offset += static_cast<size_t>(written);
+    }
+
+    m_written += offset;
+    m_buffered = 0;
+}
+
+LambdaSnail::server::snapshot_reader::~snapshot_reader()
+{
+    if (not m_data.empty())
+    {
+        ::munmap(const_cast<char*>(m_data.data()), m_data.size());
+    }
+}
+
+LambdaSnail::server::snapshot_reader::snapshot_reader(snapshot_reader&& other) noexcept :
+    m_data(std::exchange(other.m_data, {})), m_cursor(std::exchange(other.m_cursor, 0))
+{
+}
+
+LambdaSnail::server::snapshot_reader& LambdaSnail::server::snapshot_reader::operator=(snapshot_reader&& other) noexcept
+{
+    std::swap(m_data, other.m_data);
+    std::swap(m_cursor, other.m_cursor);
+    return *this;
+}
+
+std::expected<LambdaSnail::server::snapshot_reader, std::string> LambdaSnail::server::snapshot_reader::open(std::filesystem::path const& path)
+{
+    ZoneScoped;
+
+    auto const file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file < 0)
+    {
+        return std::unexpected(std::error_code(errno, std::generic_category()).message());
+    }
+
+    struct stat status{};
+    if (::fstat(file, &status) != 0)
+    {
+        auto const error = std::error_code(errno, std::generic_category());
+        ::close(file);
+        return std::unexpected(error.message());
+    }
+
+    auto const size = static_cast<size_t>(status.st_size);
+    if (size < snapshot_format::magic.size() + 1 + 1 + sizeof(uint64_t))
+    {
+        ::close(file);
+        return std::unexpected("The file is too small to be a snapshot");
+    }
+
+    auto* const mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+    ::close(file);
+    if (mapping == MAP_FAILED)
+    {
+        return std::unexpected(std::error_code(errno, std::generic_category()).message());
+    }
+
+    // The file is read front to back once, so the kernel can read ahead aggressively
+    ::madvise(mapping, size, MADV_SEQUENTIAL);
+
+    snapshot_reader reader;
+    reader.m_data = std::string_view(static_cast<char const*>(mapping), size);
+
+    if (not reader.m_data.starts_with(snapshot_format::magic))
+    {
+        return std::unexpected("The file is not a snapshot");
+    }
+
+    if (static_cast<uint8_t>(reader.m_data[snapshot_format::magic.size()]) != snapshot_format::version)
+    {
+        return std::unexpected("Unsupported snapshot version");
+    }
+
+    crc64 checksum;
+    checksum.update(reader.m_data.substr(0, size - sizeof(uint64_t)));
+
+    reader.m_cursor = size - sizeof(uint64_t);
+    uint64_t expected{};
+    if (not reader.read_fixed64(expected) or expected != checksum.value())
+    {
+        return std::unexpected("The checksum of the snapshot does not match, the file is corrupted");
+    }
+
+    // Entries are read from behind the header, and the checksum is no longer part of the records
+    reader.m_data   = reader.m_data.substr(0, size - sizeof(uint64_t));
+    reader.m_cursor = snapshot_format::magic.size() + 1;
+
+    return reader;
+}
+
+bool LambdaSnail::server::snapshot_reader::read_byte(uint8_t& value) noexcept
+{
+    if (m_cursor >= m_data.size()) [[unlikely]]
+    {
+        return false;
+    }
+
+    value = static_cast<uint8_t>(m_data[m_cursor++]);
+    return true;
+}
+
+bool LambdaSnail::server::snapshot_reader::read_varint(uint64_t& value) noexcept
+{
+    value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        uint8_t byte{};
+        if (not read_byte(byte)) [[unlikely]]
+        {
+            return false;
+        }
+
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool LambdaSnail::server::snapshot_reader::read_string(std::string_view& value) noexcept
+{
+    uint64_t length{};
+    if (not read_varint(length) or length > m_data.size() - m_cursor) [[unlikely]]
+    {
+        return false;
+    }
+
+    value = m_data.substr(m_cursor, static_cast<size_t>(length));
+    m_cursor += static_cast<size_t>(length);
+    return true;
+}
+
+bool LambdaSnail::server::snapshot_reader::read_fixed64(uint64_t& value) noexcept
+{
+    if (m_data.size() - m_cursor < sizeof(uint64_t)) [[unlikely]]
+    {
+        return false;
+    }
+
+    value = 0;
+    for (size_t i = 0; i < sizeof(uint64_t); ++i)
+    {
+        value |= static_cast<uint64_t>(static_cast<uint8_t>(m_data[m_cursor + i])) << (8 * i);
+    }
+
+    m_cursor += sizeof(uint64_t);
+    return true;
+}
@@ -1,14 +1,27 @@
 module;
 
+#include <algorithm>
 #include <chrono>
-#include <future>
+#include <cstddef>
+#include <mutex>
 #include <stdexcept>
+#include <stop_token>
+#include <thread>
+
+#include <tracy/Tracy.hpp>
 
 module server;
 
 namespace LambdaSnail::server
 {
-    timeout_worker::timeout_worker(server& server, std::shared_ptr<LambdaSnail::logging::logger> logger) : m_server(server), m_logger(logger)
+    timeout_worker::timeout_worker(server& server, std::shared_ptr<LambdaSnail::logging::logger> logger,
+                                   uint32_t const hz, std::chrono::microseconds const cycle_budget,
+                                   uint32_t const defrag_threshold, std::chrono::microseconds const defrag_budget) :
+        m_server(server), m_logger(logger),
+        m_period(std::chrono::microseconds(std::chrono::seconds(1)) / std::max(hz, uint32_t{ 1 })),
+        m_cycle_budget(std::min(cycle_budget, m_period)),
+        m_defrag_threshold(defrag_threshold),
+        m_defrag_budget(std::min(defrag_budget, m_period))
     {
         if (not m_logger)
         {
@@ -16,24 +29,228 @@ namespace LambdaSnail::server
         }
     }
 
-    void timeout_worker::do_work() const
+    void timeout_worker::start()
+    {
+        m_logger->get_system_logger()->info("Database maintenance thread started, running every {} us with a budget of {} us",
+                                            m_period.count(), m_cycle_budget.count());
+
+        m_thread = std::jthread([this](std::stop_token const& stop_token) { run(stop_token); });
+    }
+
+    void timeout_worker::stop()
+    {
+        m_thread.request_stop();
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+    }
+
+    expire_cycle_result timeout_worker::run_cycle(time_point_t const now)
     {
-        m_logger->get_system_logger()->info("Database maintenance thread started");
+        ZoneScoped;
+
+        auto const start    = std::chrono::steady_clock::now();
+        auto const deadline = start + m_cycle_budget;
+
+        expire_cycle_result result{};
+        result.incomplete = for_each_database(m_next_expire_database, [&](database& db) {
+            auto const database_result = db.handle_deletes(now, deadline);
+            result.expired_keys += database_result.expired_keys;
+            return database_result.incomplete;
+        });
+
+        auto const duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+        m_cycles.fetch_add(1, std::memory_order_relaxed);
+        m_expired_keys.fetch_add(result.expired_keys, std::memory_order_relaxed);
+        m_incomplete_cycles.fetch_add(result.incomplete ? 1 : 0, std::memory_order_relaxed);
+        m_last_cycle_duration.store(duration.count(), std::memory_order_relaxed);
+        if (duration.count() > m_max_cycle_duration.load(std::memory_order_relaxed))
+        {
+            // Only the maintenance thread writes the maximum
+            m_max_cycle_duration.store(duration.count(), std::memory_order_relaxed);
+        }
+
+        if (result.expired_keys > 0 or result.incomplete)
+        {
+            m_logger->get_system_logger()->debug("Expire cycle removed {} keys in {} us{}", result.expired_keys, duration.count(),
+                                                 result.incomplete ? ", the remaining keys are left for the next cycle" : "");
+        }
+
+        return result;
+    }
+
+    defrag_cycle_result timeout_worker::run_defrag_cycle()
+    {
+        ZoneScoped;
+
+        auto const start    = std::chrono::steady_clock::now();
+        auto const deadline = start + m_defrag_budget;
+
+        defrag_cycle_result result{};
+        result.incomplete = for_each_database(m_next_defrag_database, [&](database& db) {
+            auto const database_result = db.defragment(deadline);
+            result.moved_entries += database_result.moved_entries;
+            return database_result.incomplete;
+        });
+
+        m_defrag_cycles.fetch_add(1, std::memory_order_relaxed);
+        m_defragmented_entries.fetch_add(result.moved_entries, std::memory_order_relaxed);
+
+        if (result.moved_entries > 0)
+        {
+            auto const duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+            m_logger->get_system_logger()->debug("Defrag cycle moved {} entries in {} us", result.moved_entries, duration.count());
+        }
+
+        return result;
+    }
+
+    spill_cycle_result timeout_worker::run_spill_cycle(time_point_t const now)
+    {
+        ZoneScoped;
+
+        auto const start    = std::chrono::steady_clock::now();
+        auto const deadline = start + std::min<std::chrono::microseconds>(cold_tier::spill_budget, m_period);
+
+        spill_cycle_result result{ .released_values = entry::cold_file().punch_released() };
+        result.incomplete = for_each_database(m_next_spill_database, [&](database& db) {
+            auto const database_result = db.spill_cold_values(now, deadline);
+            result.spilled_values += database_result.spilled_values;
+            return database_result.incomplete;
+        });
+
+        m_spilled_values.fetch_add(result.spilled_values, std::memory_order_relaxed);
+
+        if (result.spilled_values > 0 or result.released_values > 0)
+        {
+            auto const duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+            m_logger->get_system_logger()->debug("Spill cycle moved {} values to the cold tier and released {} in {} us", result.spilled_values,
+                                                 result.released_values, duration.count());
+        }
 
-        time_point_t now = std::chrono::system_clock::now();
+        return result;
+    }
 
-        for (auto const& database : m_server)
+    template<typename step_t>
+    bool timeout_worker::for_each_database(size_t& next_database, step_t&& step)
+    {
+        auto const num_databases = static_cast<size_t>(m_server.end() - m_server.begin());
+        for (size_t i = 0; i < num_databases; ++i)
         {
-            if (database)
+            auto const index     = (next_database + i) % num_databases;
+            auto const& database = m_server.begin()[static_cast<ptrdiff_t>(index)];
+            if (database and step(*database))
             {
-                //m_logger->get_system_logger()->trace("Performing maintenance on database {}", database->);
-                database->handle_deletes(now);
+                // The next cycle starts with the following database, the one that ran out of budget continues where
+                // it stopped once it is its turn again
+                next_database = index + 1;
+                return true;
             }
         }
+
+        return false;
     }
 
-    std::future<void> timeout_worker::do_work_async() const
+    bool timeout_worker::needs_defrag() const
     {
-        return std::async(std::launch::async, [&](){ do_work(); });
+        if (m_defrag_threshold == 0)
+        {
+            return false;
+        }
+
+        auto const statistics = entry::allocator().get_statistics();
+        return statistics.wasted_bytes() >= defrag_ignore_bytes and
+               statistics.wasted_bytes() * 100 > statistics.allocated_bytes * m_defrag_threshold;
+    }
+
+    maintenance_statistics timeout_worker::get_statistics() const
+    {
+        return maintenance_statistics{
+            .cycles               = m_cycles.load(std::memory_order_relaxed),
+            .expired_keys         = m_expired_keys.load(std::memory_order_relaxed),
+            .incomplete_cycles    = m_incomplete_cycles.load(std::memory_order_relaxed),
+            .last_cycle_duration  = std::chrono::microseconds(m_last_cycle_duration.load(std::memory_order_relaxed)),
+            .max_cycle_duration   = std::chrono::microseconds(m_max_cycle_duration.load(std::memory_order_relaxed)),
+            .defrag_cycles        = m_defrag_cycles.load(std::memory_order_relaxed),
+            .defragmented_entries = m_defragmented_entries.load(std::memory_order_relaxed),
+            .spilled_values       = m_spilled_values.load(std::memory_order_relaxed)
+        };
+    }
+
+    void timeout_worker::run(std::stop_token const& stop_token)
+    {
+        auto next_cycle = std::chrono::steady_clock::now() + m_period;
+        while (not stop_token.stop_requested())
+        {
+            {
+                auto lock = std::unique_lock{m_mutex};
+                if (m_condition.wait_until(lock, stop_token, next_cycle, [] { return false; }) or stop_token.stop_requested())
+                {
+                    break;
+                }
+            }
+
+            run_cycle(std::chrono::system_clock::now());
+
+            // Writes evict keys themselves when they exceed the memory limit, this catches up when none arrive
+            m_server.free_memory_if_needed();
+
+            if (auto const saved = m_server.poll_background_save())
+            {
+                if (*saved)
+                {
+                    m_logger->get_system_logger()->info("Background save finished");
+                }
+                else
+                {
+                    m_logger->get_system_logger()->error("Background save failed");
+                }
+            }
+
+            if (auto const rewritten = m_server.poll_append_log_rewrite())
+            {
+                if (*rewritten)
+                {
+                    m_logger->get_system_logger()->info("Background append only file rewriting finished");
+                }
+                else
+                {
+                    m_logger->get_system_logger()->error("Background append only file rewriting failed, {} times in a row",
+                                                         m_server.get_append_log()->get_rewrite_failures());
+                }
+            }
+
+            if (auto const* log = m_server.get_append_log(); log and log->needs_rewrite())
+            {
+                // Refused while a background save is running, the next cycle tries again. Failures are recorded by the
+                // log, which delays the next attempt
+                auto const failures = log->get_rewrite_failures();
+                if (auto const started = m_server.rewrite_append_log())
+                {
+                    m_logger->get_system_logger()->info("Starting automatic rewriting of the append only file, {} bytes", log->get_file_size());
+                }
+                else if (log->get_rewrite_failures() != failures)
+                {
+                    m_logger->get_system_logger()->error("Unable to start automatic rewriting of the append only file: {}", started.error());
+                }
+            }
+
+            if (needs_defrag())
+            {
+                run_defrag_cycle();
+            }
+
+            if (m_server.get_cold_tier())
+            {
+                run_spill_cycle(std::chrono::system_clock::now());
+            }
+
+            // Cycles that take longer than the period are not caught up on
+            next_cycle = std::max(next_cycle + m_period, std::chrono::steady_clock::now());
+        }
+
+        m_logger->get_system_logger()->info("Database maintenance thread stopped");
     }
 }
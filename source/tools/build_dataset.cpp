@@ -0,0 +1,125 @@
+module;
+
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#include <CLI/CLI.hpp>
+
+export module build_dataset;
+
+import server;
+
+/**
+ * Builds a dataset for --mmap-dataset offline, from one database of a snapshot or from a file with a tab separated
+ * key and value on every line.
+ */
+int main(int argc, char const** argv)
+{
+    CLI::App app{"Builds a read-only dataset that the server maps into memory with --mmap-dataset."};
+
+    std::string input;
+    std::string output;
+    size_t database = 0;
+    bool tab_separated = false;
+
+    app.add_option("input", input, "A snapshot, or a file with a key and a value separated by a tab on every line with --tsv")->required()->check(CLI::ExistingFile);
+    app.add_option("output", output, "The dataset file to write, which replaces the previous one without disturbing servers that map it")->required();
+    app.add_option("-d,--database", database, "The database of the snapshot to take the keys from")->capture_default_str();
+    app.add_flag("--tsv", tab_separated, "Read tab separated lines instead of a snapshot");
+    CLI11_PARSE(app, argc, argv);
+
+    LambdaSnail::server::mapped_dataset_builder builder;
+    size_t num_skipped = 0;
+    size_t num_too_large = 0;
+
+    if (tab_separated)
+    {
+        std::ifstream file(input);
+        std::string line;
+        for (size_t line_number = 1; std::getline(file, line); ++line_number)
+        {
+            auto const separator = line.find('\t');
+            if (separator == std::string::npos)
+            {
+                std::cerr << "Line " << line_number << " has no tab between the key and the value\n";
+                return 1;
+            }
+
+            num_too_large += builder.add(std::string_view(line).substr(0, separator), std::string_view(line).substr(separator + 1)) ? 0 : 1;
+        }
+    }
+    else
+    {
+        auto reader = LambdaSnail::server::snapshot_reader::open(input);
+        if (not reader)
+        {
+            std::cerr << "Unable to open the snapshot " << input << ": " << reader.error() << "\n";
+            return 1;
+        }
+
+        size_t current_database = 0;
+        auto const now          = std::chrono::system_clock::now();
+        auto const read         = reader->read(
+                [&current_database](size_t const index, size_t) {
+                    current_database = index;
+                    return true;
+                },
+                [&](std::string_view const key, LambdaSnail::server::entry* const value) {
+                    LambdaSnail::server::entry_ptr const owned(value);
+                    if (current_database != database)
+                    {
+                        return;
+                    }
+
+                    // The dataset is immutable, keys that would expire are left out rather than kept forever
+                    if (owned->has_ttl())
+                    {
+                        num_skipped += owned->has_expired(now) ? 0 : 1;
+                        return;
+                    }
+
+                    if (owned->encoding() == LambdaSnail::server::entry_encoding::integer)
+                    {
+                        std::array<char, 20> integer{};
+                        auto const [end, error] = std::to_chars(integer.data(), integer.data() + integer.size(), owned->integer());
+                        builder.add(key, std::string_view(integer.data(), end));
+                        return;
+                    }
+
+                    num_too_large += builder.add(key, owned->value()) ? 0 : 1;
+                });
+
+        if (not read)
+        {
+            std::cerr << "Unable to read the snapshot " << input << ": " << read.error() << "\n";
+            return 1;
+        }
+    }
+
+    auto const written = builder.write(output);
+    if (not written)
+    {
+        std::cerr << "Unable to write the dataset " << output << ": " << written.error() << "\n";
+        return 1;
+    }
+
+    std::cout << "Wrote " << builder.size() << " keys to " << output << ", " << *written << " bytes\n";
+    if (num_skipped > 0)
+    {
+        std::cout << "Left out " << num_skipped << " keys with an expiry time\n";
+    }
+
+    if (num_too_large > 0)
+    {
+        std::cout << "Left out " << num_too_large << " keys or values larger than 4 GiB\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,336 @@
+import logging;
+import server;
+
+#include <gtest/gtest.h>
+
+#include "test_helpers.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <unistd.h>
+
+namespace AppendLogTests
+{
+    using namespace LambdaSnail::server;
+    using namespace TestHelpers;
+    using namespace std::chrono_literals;
+
+    /**
+     * Waits for the records appended by the calling thread, returns whether they became durable.
+     */
+    bool wait_until_durable(append_log& log)
+    {
+        std::promise<bool> done;
+        auto result = done.get_future();
+        log.when_durable(log.thread_sequence(), [&done](bool const durable) { done.set_value(durable); });
+
+        return result.wait_for(5s) == std::future_status::ready and result.get();
+    }
+
+    /**
+     * Logs changes to three databases, with a key in the second database that is flushed.
+     */
+    void write_log(std::filesystem::path const& path)
+    {
+        std::filesystem::remove(path);
+
+        server server(3, 4);
+        auto const log = std::make_shared<append_log>(path, fsync_policy::always, test_logger());
+        ASSERT_TRUE(log->start());
+        server.set_append_log(log);
+
+        for (size_t i = 0; i < 100; ++i)
+        {
+            server.get_database(i % 3)->set_value("key:" + std::to_string(i), "value:" + std::to_string(i));
+        }
+
+        server.get_database(1)->flush(false);
+        server.get_database(1)->set_value("after flush", "1");
+        server.get_database(2)->set_value("integer", "42");
+
+        std::string_view const deleted[] = { "key:0" };
+        EXPECT_EQ(server.get_database(0)->erase_values(deleted, false), 1);
+
+        EXPECT_TRUE(wait_until_durable(*log));
+        log->stop();
+    }
+
+    void expect_replayed(server const& server)
+    {
+        auto const first = server.get_database(0);
+        EXPECT_FALSE(first->get_value("key:0"));
+        ASSERT_TRUE(first->get_value("key:3"));
+        EXPECT_EQ(first->get_value("key:3")->value(), "value:3");
+        EXPECT_EQ(first->get_statistics().num_keys, 33);
+
+        auto const second = server.get_database(1);
+        EXPECT_FALSE(second->get_value("key:1"));
+        ASSERT_TRUE(second->get_value("after flush"));
+        EXPECT_EQ(second->get_statistics().num_keys, 1);
+
+        auto const third = server.get_database(2);
+        ASSERT_TRUE(third->get_value("integer"));
+        EXPECT_EQ(third->get_value("integer")->integer(), 42);
+        EXPECT_EQ(third->get_statistics().num_keys, 34);
+    }
+
+    TEST(AppendLogTests, CommandsAreEncodedAsTheyAreSent)
+    {
+        auto const path = test_path("encoding.aof");
+        std::filesystem::remove(path);
+
+        auto const ttl = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() + 1h);
+        {
+            server server(3, 4);
+            auto const log = std::make_shared<append_log>(path, fsync_policy::always, test_logger());
+            ASSERT_TRUE(log->start());
+            server.set_append_log(log);
+
+            server.get_database(0)->set_value("a", "1");
+            server.get_database(2)->set_value("b", "two");
+            server.get_database(2)->set_value("c", "x", ttl);
+
+            std::string_view const deleted[] = { "a" };
+            EXPECT_EQ(server.get_database(0)->erase_values(deleted, false), 1);
+
+            EXPECT_TRUE(wait_until_durable(*log));
+            EXPECT_FALSE(log->has_failed());
+            log->stop();
+        }
+
+        // A SELECT is written whenever the database changes, and expiry times are absolute
+        auto const milliseconds = std::to_string(ttl.time_since_epoch().count());
+        std::string const expected = "*2\r\n$6\r\nSELECT\r\n$1\r\n0\r\n"
+                                     "*3\r\n$3\r\nSET\r\n$1\r\na\r\n$1\r\n1\r\n"
+                                     "*2\r\n$6\r\nSELECT\r\n$1\r\n2\r\n"
+                                     "*3\r\n$3\r\nSET\r\n$1\r\nb\r\n$3\r\ntwo\r\n"
+                                     "*5\r\n$3\r\nSET\r\n$1\r\nc\r\n$1\r\nx\r\n$4\r\nPXAT\r\n$" + std::to_string(milliseconds.size()) + "\r\n" + milliseconds + "\r\n"
+                                     "*2\r\n$6\r\nSELECT\r\n$1\r\n0\r\n"
+                                     "*2\r\n$3\r\nDEL\r\n$1\r\na\r\n";
+        EXPECT_EQ(read_file(path), expected);
+
+        std::filesystem::remove(path);
+    }
+
+    TEST(AppendLogTests, ReplayRestoresEveryDatabase)
+    {
+        auto const path = test_path("replay.aof");
+        write_log(path);
+
+        // The logged writes were accepted before, so replaying them neither evicts keys nor fails on the memory limit
+        server server(3, 4, 0, 1, eviction_policy::noeviction);
+        append_log log(path, fsync_policy::everysec, test_logger());
+        auto const result = log.replay(server);
+        ASSERT_TRUE(result) << result.error();
+        EXPECT_EQ(result->commands, 104);
+        EXPECT_EQ(result->truncated_bytes, 0);
+        expect_replayed(server);
+
+        std::filesystem::remove(path);
+    }
+
+    TEST(AppendLogTests, IncompleteTailIsCutOff)
+    {
+        auto const path = test_path("truncated.aof");
+        write_log(path);
+
+        // A crash in the middle of a write leaves part of a command behind
+        auto const size = std::filesystem::file_size(path);
+        std::string_view const incomplete = "*3\r\n$3\r\nSET\r\n$4\r\nkey:";
+        std::ofstream(path, std::ios::app | std::ios::binary) << incomplete;
+
+        {
+            server server(3, 4);
+            auto const log = std::make_shared<append_log>(path, fsync_policy::always, test_logger());
+            auto const result = log->replay(server);
+            ASSERT_TRUE(result) << result.error();
+            EXPECT_EQ(result->truncated_bytes, incomplete.size());
+            EXPECT_EQ(std::filesystem::file_size(path), size);
+            expect_replayed(server);
+
+            // Commands appended after the cut follow the last complete command
+            ASSERT_TRUE(log->start());
+            server.set_append_log(log);
+            server.get_database(2)->set_value("appended", "after replay");
+            EXPECT_TRUE(wait_until_durable(*log));
+            log->stop();
+        }
+
+        server server(3, 4);
+        append_log log(path, fsync_policy::everysec, test_logger());
+        auto const result = log.replay(server);
+        ASSERT_TRUE(result) << result.error();
+        EXPECT_EQ(result->truncated_bytes, 0);
+        ASSERT_TRUE(server.get_database(2)->get_value("appended"));
+        EXPECT_EQ(server.get_database(2)->get_value("appended")->value(), "after replay");
+
+        std::filesystem::remove(path);
+    }
+
+    TEST(AppendLogTests, CorruptedFileIsRejected)
+    {
+        auto const path = test_path("corrupted.aof");
+        write_log(path);
+
+        auto contents = read_file(path);
+        contents[contents.find("*3", contents.size() / 2)] = '?';
+        write_file(path, contents);
+
+        server corrupted(3, 4);
+        auto const corrupted_result = append_log(path, fsync_policy::everysec, test_logger()).replay(corrupted);
+        ASSERT_FALSE(corrupted_result);
+        EXPECT_NE(corrupted_result.error().find("Invalid command"), std::string::npos);
+
+        // The log selects a database that the server does not have
+        write_log(path);
+        server fewer_databases(2, 4);
+        auto const fewer_result = append_log(path, fsync_policy::everysec, test_logger()).replay(fewer_databases);
+        ASSERT_FALSE(fewer_result);
+        EXPECT_NE(fewer_result.error().find("does not exist"), std::string::npos);
+
+        std::filesystem::remove(path);
+    }
+
+    TEST(AppendLogTests, WaitersFailWhenTheFileCannotBeWritten)
+    {
+        if (not std::filesystem::exists("/dev/full"))
+        {
+            GTEST_SKIP() << "Writing to /dev/full fails with ENOSPC, which the test relies on";
+        }
+
+        server server(1, 4);
+        auto const log = std::make_shared<append_log>("/dev/full", fsync_policy::always, test_logger());
+        ASSERT_TRUE(log->start());
+        server.set_append_log(log);
+
+        // The waiter is answered rather than kept waiting, and so is the next one while the log has failed
+        server.get_database(0)->set_value("key", "value");
+        EXPECT_FALSE(wait_until_durable(*log));
+        EXPECT_TRUE(log->has_failed());
+        EXPECT_FALSE(log->is_durable(log->thread_sequence()));
+        EXPECT_FALSE(wait_until_durable(*log));
+
+        log->stop();
+    }
+
+    /**
+     * Reaps the rewrite child and waits until the flusher has switched to the rewritten file or given it up.
+     */
+    std::optional<bool> wait_for_rewrite(server& server, append_log const& log)
+    {
+        std::optional<bool> succeeded;
+        for (int i = 0; i < 500 and (not succeeded or log.is_rewriting()); ++i)
+        {
+            std::this_thread::sleep_for(10ms);
+            if (not succeeded)
+            {
+                succeeded = server.poll_append_log_rewrite();
+            }
+        }
+
+        return succeeded;
+    }
+
+    TEST(AppendLogTests, RewriteCompactsTheLog)
+    {
+        auto const path = test_path("rewrite.aof");
+        std::filesystem::remove(path);
+
+        {
+            server server(2, 4);
+            auto const log = std::make_shared<append_log>(path, fsync_policy::always, test_logger());
+            ASSERT_TRUE(log->start());
+            server.set_append_log(log);
+
+            for (size_t i = 0; i < 1000; ++i)
+            {
+                server.get_database(0)->set_value("key:" + std::to_string(i % 10), "value:" + std::to_string(i));
+            }
+
+            server.get_database(1)->set_value("before", "rewrite");
+            EXPECT_TRUE(wait_until_durable(*log));
+            auto const size_before = log->get_file_size();
+
+            ASSERT_TRUE(server.rewrite_append_log());
+            EXPECT_TRUE(log->is_rewriting());
+            EXPECT_FALSE(server.rewrite_append_log());
+
+            // Writes made while the child runs are added to the rewritten file
+            server.get_database(1)->set_value("during", "rewrite");
+
+            auto const succeeded = wait_for_rewrite(server, *log);
+            ASSERT_TRUE(succeeded);
+            EXPECT_TRUE(*succeeded);
+            EXPECT_FALSE(log->is_rewriting());
+            EXPECT_LT(log->get_file_size(), size_before / 10);
+            EXPECT_EQ(log->get_rewrite_failures(), 0);
+
+            server.get_database(1)->set_value("after", "rewrite");
+            EXPECT_TRUE(wait_until_durable(*log));
+            log->stop();
+        }
+
+        server server(2, 4);
+        auto const result = append_log(path, fsync_policy::everysec, test_logger()).replay(server);
+        ASSERT_TRUE(result) << result.error();
+        for (size_t i = 0; i < 10; ++i)
+        {
+            auto const value = server.get_database(0)->get_value("key:" + std::to_string(i));
+            ASSERT_TRUE(value);
+            EXPECT_EQ(value->value(), "value:" + std::to_string(990 + i));
+        }
+
+        for (auto const key : { "before", "during", "after" })
+        {
+            ASSERT_TRUE(server.get_database(1)->get_value(key)) << key;
+        }
+
+        std::filesystem::remove(path);
+    }
+
+    TEST(AppendLogTests, FailedRewriteDelaysTheNextOne)
+    {
+        auto const path = test_path("failing.aof");
+        std::filesystem::remove(path);
+
+        server server(1, 4);
+        auto const log = std::make_shared<append_log>(path, fsync_policy::always, test_logger());
+        log->set_rewrite_trigger(100, 1);
+        ASSERT_TRUE(log->start());
+        server.set_append_log(log);
+
+        server.get_database(0)->set_value("key", "value");
+        EXPECT_TRUE(wait_until_durable(*log));
+        EXPECT_TRUE(log->needs_rewrite());
+
+        // A directory in place of the temporary file of the rewrite keeps it from being created
+        auto const blocked = path.parent_path() / ("temp-rewriteaof-" + std::to_string(::getpid()) + ".aof");
+        ASSERT_TRUE(std::filesystem::create_directory(blocked));
+
+        EXPECT_FALSE(server.rewrite_append_log());
+        EXPECT_EQ(log->get_rewrite_failures(), 1);
+        EXPECT_FALSE(log->is_rewriting());
+        EXPECT_FALSE(log->needs_rewrite());
+
+        // A rewrite that is asked for is not delayed, and succeeding resets the failures
+        std::filesystem::remove(blocked);
+        ASSERT_TRUE(server.rewrite_append_log());
+
+        auto const succeeded = wait_for_rewrite(server, *log);
+        ASSERT_TRUE(succeeded);
+        EXPECT_TRUE(*succeeded);
+        EXPECT_EQ(log->get_rewrite_failures(), 0);
+        EXPECT_FALSE(log->needs_rewrite());
+
+        log->stop();
+        std::filesystem::remove(path);
+    }
+} // namespace AppendLogTests
@@ -0,0 +1,111 @@
+import memory;
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+namespace BufferPoolTests
+{
+    using LambdaSnail::memory::buffer_info;
+    using LambdaSnail::memory::buffer_pool;
+
+    TEST(BufferPoolTests, SizeClassBoundaries)
+    {
+        buffer_pool pool{ 16 * 1024 * 1024 };
+
+        EXPECT_EQ(pool.request_buffer(0).size, buffer_pool::min_buffer_size);
+        EXPECT_EQ(pool.request_buffer(1024).size, 1024);
+        EXPECT_EQ(pool.request_buffer(1025).size, 2048);
+        EXPECT_EQ(pool.request_buffer(4 * 1024 * 1024 - 1).size, buffer_pool::max_buffer_size);
+
+        auto const largest = pool.request_buffer(buffer_pool::max_buffer_size);
+        EXPECT_EQ(largest.size, buffer_pool::max_buffer_size);
+        EXPECT_NE(largest.buffer, nullptr);
+
+        // Larger requests are left to the heap, they do not count as failed
+        auto const too_large = pool.request_buffer(buffer_pool::max_buffer_size + 1);
+        EXPECT_EQ(too_large.size, 0);
+        EXPECT_EQ(too_large.buffer, nullptr);
+        EXPECT_EQ(pool.get_statistics().failed_requests, 0);
+    }
+
+    TEST(BufferPoolTests, MemoryLimit)
+    {
+        buffer_pool pool{ buffer_pool::max_buffer_size };
+
+        auto const first = pool.request_buffer(buffer_pool::max_buffer_size);
+        ASSERT_NE(first.buffer, nullptr);
+
+        auto const second = pool.request_buffer(buffer_pool::max_buffer_size);
+        EXPECT_EQ(second.buffer, nullptr);
+
+        auto const statistics = pool.get_statistics();
+        EXPECT_EQ(statistics.reserved_bytes, buffer_pool::max_buffer_size);
+        EXPECT_EQ(statistics.failed_requests, 1);
+    }
+
+    TEST(BufferPoolTests, ReleasedBuffersAreReused)
+    {
+        buffer_pool pool;
+
+        char* released = nullptr;
+        {
+            auto const buffer = pool.request_buffer(2000);
+            released          = buffer.buffer;
+        }
+
+        EXPECT_EQ(pool.request_buffer(2048).buffer, released);
+    }
+
+    TEST(BufferPoolTests, ConcurrentRequestsAcrossSizeClasses)
+    {
+        buffer_pool pool;
+
+        constexpr size_t num_threads    = 8;
+        constexpr size_t num_iterations = 20000;
+        constexpr size_t num_held       = 4;
+
+        std::vector<std::jthread> threads;
+        for (size_t t = 0; t < num_threads; ++t)
+        {
+            threads.emplace_back([&pool, t] {
+                std::vector<buffer_info> held(num_held);
+                for (size_t i = 0; i < num_iterations; ++i)
+                {
+                    auto& slot = held[i % num_held];
+
+                    // A buffer that was handed out twice would have been overwritten by the other thread
+                    if (slot.buffer)
+                    {
+                        uint64_t first{};
+                        uint64_t last{};
+                        std::memcpy(&first, slot.buffer, sizeof(first));
+                        std::memcpy(&last, slot.buffer + slot.size - sizeof(last), sizeof(last));
+                        ASSERT_EQ(first, t);
+                        ASSERT_EQ(last, t);
+                    }
+
+                    slot = pool.request_buffer(buffer_pool::min_buffer_size << ((i * 7 + t) % buffer_pool::num_size_classes));
+                    ASSERT_NE(slot.buffer, nullptr);
+
+                    uint64_t const tag = t;
+                    std::memcpy(slot.buffer, &tag, sizeof(tag));
+                    std::memcpy(slot.buffer + slot.size - sizeof(tag), &tag, sizeof(tag));
+                }
+            });
+        }
+        threads.clear();
+
+        // Every buffer has been returned to its size class
+        auto const statistics = pool.get_statistics();
+        ASSERT_EQ(statistics.size_classes.size(), buffer_pool::num_size_classes);
+        for (auto const& size_class : statistics.size_classes)
+        {
+            EXPECT_EQ(size_class.num_free, size_class.num_buffers) << "size class " << size_class.buffer_size;
+        }
+        EXPECT_EQ(statistics.failed_requests, 0);
+    }
+} // namespace BufferPoolTests
@@ -0,0 +1,267 @@
+import resp;
+import server;
+
+#include <gtest/gtest.h>
+
+#include "test_helpers.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+namespace ColdTierTests
+{
+    using namespace LambdaSnail::server;
+    using namespace TestHelpers;
+    using namespace std::chrono_literals;
+
+    /**
+     * A value that is not the same in every block, so that reads at the wrong offset are noticed.
+     */
+    std::string make_value(size_t const size, char const first)
+    {
+        std::string value(size, first);
+        for (size_t i = 0; i < size; ++i)
+        {
+            value[i] = static_cast<char>(first + i % 26);
+        }
+
+        return value;
+    }
+
+    void make_idle(database& db, std::string_view const key)
+    {
+        db.get_value(key)->set_access_clock(access_clock::initial(eviction_policy::noeviction, std::chrono::system_clock::now() - 1h));
+    }
+
+    uint64_t allocated_bytes(std::filesystem::path const& path)
+    {
+        struct stat status{};
+        EXPECT_EQ(::stat(path.c_str(), &status), 0);
+        return static_cast<uint64_t>(status.st_blocks) * 512;
+    }
+
+    class ColdTierTests : public testing::Test
+    {
+    protected:
+        void SetUp() override
+        {
+            m_tier = std::make_shared<cold_tier>(test_path("cold.bin"), 1024, 10s, 2);
+            ASSERT_TRUE(m_tier->start());
+            m_server.set_cold_tier(m_tier);
+        }
+
+        void TearDown() override
+        {
+            std::filesystem::remove(m_tier->get_path());
+        }
+
+        server m_server{ 1, 4 };
+        std::shared_ptr<cold_tier> m_tier{};
+    };
+
+    TEST_F(ColdTierTests, IdleValuesAreSpilledAndRead)
+    {
+        auto const db = m_server.get_database(0);
+        command_dispatch dispatch(m_server);
+
+        auto const large = make_value(8000, 'a');
+        db->set_value("large", large);
+        db->set_value("ttl", large, std::chrono::system_clock::now() + 1h);
+        db->set_value("recent", large);
+        db->set_value("small", "too small");
+        db->set_value("number", "0." + std::string(2000, '5'));
+        for (auto const key : { "large", "ttl", "small", "number" })
+        {
+            make_idle(*db, key);
+        }
+
+        // Only large values that do not parse as a number are moved
+        auto const used_bytes = db->get_memory_limit().used_bytes.load();
+        auto const result     = db->spill_cold_values(std::chrono::system_clock::now());
+        EXPECT_EQ(result.spilled_values, 2);
+        EXPECT_FALSE(result.incomplete);
+        EXPECT_EQ(db->get_value("large")->encoding(), entry_encoding::cold);
+        EXPECT_EQ(db->get_value("ttl")->encoding(), entry_encoding::cold);
+        EXPECT_EQ(db->get_value("recent")->encoding(), entry_encoding::raw);
+        EXPECT_EQ(db->get_value("small")->encoding(), entry_encoding::embedded);
+        EXPECT_EQ(db->get_value("number")->encoding(), entry_encoding::raw);
+        EXPECT_LT(db->get_memory_limit().used_bytes.load(), used_bytes - 2 * large.size());
+        EXPECT_EQ(entry::cold_file().get_statistics().num_values, 2);
+
+        bool waited = false;
+        EXPECT_EQ(run_command(dispatch, { "GET", "large" }, &waited), bulk_string(large));
+        EXPECT_TRUE(waited);
+        EXPECT_EQ(run_command(dispatch, { "MGET", "small", "ttl", "missing" }), "*3\r\n" + bulk_string("too small") + bulk_string(large) + "_\r\n");
+
+        // The counter commands never read the file
+        EXPECT_EQ(run_command(dispatch, { "INCR", "ttl" }), "-ERR value is not an integer or out of range\r\n");
+        EXPECT_EQ(run_command(dispatch, { "INCRBYFLOAT", "ttl", "1" }), "-ERR value is not a valid float\r\n");
+        EXPECT_EQ(db->get_value("ttl")->encoding(), entry_encoding::cold);
+        EXPECT_TRUE(db->get_value("ttl")->has_ttl());
+    }
+
+    TEST_F(ColdTierTests, SecondReadPromotesTheValue)
+    {
+        auto const db = m_server.get_database(0);
+        command_dispatch dispatch(m_server);
+
+        auto const large = make_value(8000, 'a');
+        db->set_value("large", large);
+        make_idle(*db, "large");
+        ASSERT_EQ(db->spill_cold_values(std::chrono::system_clock::now()).spilled_values, 1);
+
+        // The first read only marks the key as used
+        EXPECT_EQ(run_command(dispatch, { "GET", "large" }), bulk_string(large));
+        EXPECT_EQ(db->get_value("large")->encoding(), entry_encoding::cold);
+
+        bool waited = false;
+        EXPECT_EQ(run_command(dispatch, { "GET", "large" }, &waited), bulk_string(large));
+        EXPECT_TRUE(waited);
+        EXPECT_EQ(db->get_value("large")->encoding(), entry_encoding::raw);
+        EXPECT_EQ(db->get_value("large")->value(), large);
+        EXPECT_EQ(entry::cold_file().get_statistics().num_values, 0);
+
+        // Reads of a promoted value are answered right away
+        EXPECT_EQ(run_command(dispatch, { "GET", "large" }, &waited), bulk_string(large));
+        EXPECT_FALSE(waited);
+    }
+
+    TEST_F(ColdTierTests, ReadOfAnOverwrittenKeyReturnsTheOldValue)
+    {
+        auto const db = m_server.get_database(0);
+        command_dispatch dispatch(m_server);
+
+        auto const large = make_value(8000, 'a');
+        db->set_value("key", large);
+        make_idle(*db, "key");
+        ASSERT_EQ(db->spill_cold_values(std::chrono::system_clock::now()).spilled_values, 1);
+
+        LambdaSnail::resp::response_writer out;
+        for (std::string_view const command : { "*2\r\n$3\r\nGET\r\n$3\r\nkey\r\n", "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$3\r\nnew\r\n",
+                                                "*2\r\n$3\r\nGET\r\n$3\r\nkey\r\n" })
+        {
+            dispatch.process_command(LambdaSnail::resp::data_view(command), out);
+        }
+
+        std::promise<bool> read;
+        auto result = read.get_future();
+        dispatch.read_cold_values([&read](bool const succeeded) { read.set_value(succeeded); });
+        ASSERT_TRUE(result.get());
+
+        std::string reply;
+        for (auto const segment : out.segments())
+        {
+            reply += segment;
+        }
+
+        EXPECT_EQ(reply, bulk_string(large) + "+OK\r\n" + bulk_string("new"));
+        EXPECT_EQ(db->get_value("key")->value(), "new");
+    }
+
+    TEST_F(ColdTierTests, ReleasedValuesArePunchedOutInBatches)
+    {
+        constexpr size_t num_values = 8;
+        constexpr size_t value_size = 64 * 1024;
+
+        auto const db = m_server.get_database(0);
+        for (size_t i = 0; i < num_values; ++i)
+        {
+            auto const key = "key:" + std::to_string(i);
+            db->set_value(key, make_value(value_size, 'a'));
+            make_idle(*db, key);
+        }
+
+        ASSERT_EQ(db->spill_cold_values(std::chrono::system_clock::now()).spilled_values, num_values);
+        auto const path = m_tier->get_path();
+        EXPECT_GE(allocated_bytes(path), num_values * value_size);
+
+        // Releases are only queued, the space is given back by the next batch
+        std::vector<std::string> keys;
+        for (size_t i = 0; i < num_values / 2; ++i)
+        {
+            keys.push_back("key:" + std::to_string(i));
+        }
+
+        std::vector<std::string_view> const erased(keys.begin(), keys.end());
+        EXPECT_EQ(db->erase_values(erased), num_values / 2);
+        EXPECT_EQ(entry::cold_file().get_statistics().num_values, num_values / 2);
+        EXPECT_GE(allocated_bytes(path), num_values * value_size);
+
+        EXPECT_EQ(entry::cold_file().punch_released(), num_values / 2);
+        EXPECT_LT(allocated_bytes(path), (num_values / 2 + 1) * value_size);
+        EXPECT_EQ(entry::cold_file().punch_released(), 0);
+
+        // Values that remain are still read from the file
+        EXPECT_EQ(db->get_value("key:7")->encoding(), entry_encoding::cold);
+        command_dispatch dispatch(m_server);
+        EXPECT_EQ(run_command(dispatch, { "GET", "key:7" }), bulk_string(make_value(value_size, 'a')));
+    }
+
+    TEST_F(ColdTierTests, ReleasesAreHeldWhileAChildReadsTheFile)
+    {
+        constexpr size_t value_size = 64 * 1024;
+
+        auto const db            = m_server.get_database(0);
+        auto const snapshot_path = test_path("dump.lsdb");
+        m_server.set_snapshot_path(snapshot_path);
+
+        db->set_value("key", make_value(value_size, 'a'));
+        make_idle(*db, "key");
+        ASSERT_EQ(db->spill_cold_values(std::chrono::system_clock::now()).spilled_values, 1);
+
+        ASSERT_TRUE(m_server.background_save());
+        std::string_view const keys[] = { "key" };
+        EXPECT_EQ(db->erase_values(keys), 1);
+        EXPECT_EQ(entry::cold_file().punch_released(), 0);
+        EXPECT_GE(allocated_bytes(m_tier->get_path()), value_size);
+
+        std::optional<bool> succeeded;
+        for (int i = 0; i < 500 and not succeeded; ++i)
+        {
+            std::this_thread::sleep_for(10ms);
+            succeeded = m_server.poll_background_save();
+        }
+
+        ASSERT_TRUE(succeeded);
+        EXPECT_TRUE(*succeeded);
+        EXPECT_EQ(entry::cold_file().punch_released(), 1);
+        EXPECT_LT(allocated_bytes(m_tier->get_path()), value_size);
+
+        // The child saw the value that was deleted after the fork
+        server loaded(1, 4);
+        loaded.set_snapshot_path(snapshot_path);
+        ASSERT_TRUE(loaded.load_snapshot());
+        ASSERT_TRUE(loaded.get_database(0)->get_value("key"));
+        EXPECT_EQ(loaded.get_database(0)->get_value("key")->value(), make_value(value_size, 'a'));
+
+        std::filesystem::remove(snapshot_path);
+    }
+
+    TEST_F(ColdTierTests, StopRunsTheSubmittedJobs)
+    {
+        std::atomic<size_t> num_run{};
+        for (size_t i = 0; i < 100; ++i)
+        {
+            m_tier->submit([&num_run] {
+                std::this_thread::sleep_for(100us);
+                num_run.fetch_add(1);
+            });
+        }
+
+        m_tier->stop();
+        EXPECT_EQ(num_run.load(), 100);
+
+        // Stopping again, as the destructor does, has nothing left to do
+        m_tier->stop();
+    }
+} // namespace ColdTierTests
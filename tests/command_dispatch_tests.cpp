@@ -0,0 +1,110 @@
+import server;
+
+#include <gtest/gtest.h>
+
+#include "test_helpers.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <string_view>
+
+namespace CommandDispatchTests
+{
+    using namespace LambdaSnail::server;
+    using namespace TestHelpers;
+
+    constexpr std::string_view command_names[] = {
+        "PING", "ECHO", "SELECT", "GET", "SET", "MGET", "MSET", "MSETNX", "DEL", "UNLINK", "FLUSHDB", "FLUSHALL", "SAVE", "BGSAVE",
+        "LASTSAVE", "BGREWRITEAOF", "EXISTS", "MEMORY", "INCR", "DECR", "INCRBY", "DECRBY", "INCRBYFLOAT"
+    };
+
+    TEST(CommandDispatchTests, CommandsAreFoundIgnoringCase)
+    {
+        for (auto const name : command_names)
+        {
+            auto const* const command = command_dispatch::find_command(name);
+            ASSERT_NE(command, nullptr) << name;
+            EXPECT_EQ(command->name, name);
+
+            std::string lower(name);
+            for (auto& c : lower)
+            {
+                c = static_cast<char>(c - 'A' + 'a');
+            }
+
+            EXPECT_EQ(command_dispatch::find_command(lower), command) << lower;
+
+            std::string mixed = lower;
+            mixed[0]          = name[0];
+            EXPECT_EQ(command_dispatch::find_command(mixed), command) << mixed;
+        }
+
+        server server(1, 4);
+        command_dispatch dispatch(server);
+        EXPECT_EQ(run_command(dispatch, { "pInG" }), "+PONG\r\n");
+        EXPECT_EQ(run_command(dispatch, { "set", "key", "value" }), "+OK\r\n");
+        EXPECT_EQ(run_command(dispatch, { "Get", "key" }), bulk_string("value"));
+    }
+
+    TEST(CommandDispatchTests, UnknownCommandsAreNotFound)
+    {
+        EXPECT_EQ(command_dispatch::find_command(""), nullptr);
+        EXPECT_EQ(command_dispatch::find_command("GE"), nullptr);
+        EXPECT_EQ(command_dispatch::find_command("GETS"), nullptr);
+        EXPECT_EQ(command_dispatch::find_command("BGREWRITEAOFS"), nullptr);
+        EXPECT_EQ(command_dispatch::find_command(std::string(10000, 'G')), nullptr);
+
+        // The table has a slot for every hash, so many unknown names land on the slot of a command and are only told apart
+        // by comparing the names. Names that differ from a command in one character are the closest to a match, unless
+        // they are another command, like MGET and MSET.
+        for (auto const name : command_names)
+        {
+            for (size_t i = 0; i < name.size(); ++i)
+            {
+                for (char c = 'A'; c <= 'Z'; ++c)
+                {
+                    std::string changed(name);
+                    changed[i] = c;
+                    if (std::ranges::find(command_names, changed) == std::end(command_names))
+                    {
+                        EXPECT_EQ(command_dispatch::find_command(changed), nullptr) << changed;
+                    }
+                }
+            }
+        }
+
+        for (size_t i = 0; i < 100000; ++i)
+        {
+            auto const name = "X" + std::to_string(i);
+            EXPECT_EQ(command_dispatch::find_command(name), nullptr) << name;
+        }
+
+        server server(1, 4);
+        command_dispatch dispatch(server);
+        EXPECT_EQ(run_command(dispatch, { "getx", "key" }), "-ERR unknown command 'getx'\r\n");
+        EXPECT_EQ(run_command(dispatch, { std::string(100, 'a') }), "-ERR unknown command '" + std::string(100, 'a') + "'\r\n");
+    }
+
+    TEST(CommandDispatchTests, ArityIsChecked)
+    {
+        server server(1, 4);
+        command_dispatch dispatch(server);
+
+        // A fixed arity is the exact number of arguments, including the name
+        EXPECT_EQ(run_command(dispatch, { "GET" }), "-ERR wrong number of arguments for 'GET' command\r\n");
+        EXPECT_EQ(run_command(dispatch, { "get", "a", "b" }), "-ERR wrong number of arguments for 'GET' command\r\n");
+        EXPECT_EQ(run_command(dispatch, { "INCRBY", "a" }), "-ERR wrong number of arguments for 'INCRBY' command\r\n");
+        EXPECT_EQ(run_command(dispatch, { "LASTSAVE", "a" }), "-ERR wrong number of arguments for 'LASTSAVE' command\r\n");
+
+        // A negative arity is the minimum number of arguments
+        EXPECT_EQ(run_command(dispatch, { "SET", "a" }), "-ERR wrong number of arguments for 'SET' command\r\n");
+        EXPECT_EQ(run_command(dispatch, { "DEL" }), "-ERR wrong number of arguments for 'DEL' command\r\n");
+        EXPECT_EQ(run_command(dispatch, { "MSET", "a" }), "-ERR wrong number of arguments for 'MSET' command\r\n");
+        EXPECT_EQ(run_command(dispatch, { "DEL", "a", "b", "c", "d" }), ":0\r\n");
+        EXPECT_EQ(run_command(dispatch, { "PING" }), "+PONG\r\n");
+
+        // Nothing ran for the refused commands
+        EXPECT_EQ(server.get_database(0)->get_statistics().num_keys, 0);
+    }
+} // namespace CommandDispatchTests
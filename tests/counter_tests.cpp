@@ -0,0 +1,180 @@
+import server;
+
+#include <gtest/gtest.h>
+
+#include "test_helpers.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <string>
+
+namespace CounterTests
+{
+    using namespace LambdaSnail::server;
+    using namespace TestHelpers;
+    using namespace std::chrono_literals;
+
+    constexpr auto not_an_integer = "-ERR value is not an integer or out of range\r\n";
+    constexpr auto overflow       = "-ERR increment or decrement would overflow\r\n";
+
+    std::string integer(int64_t const value)
+    {
+        return ":" + std::to_string(value) + "\r\n";
+    }
+
+    TEST(CounterTests, MissingAndExpiredKeysStartAtTheDelta)
+    {
+        server server(1, 4);
+        command_dispatch dispatch(server);
+        auto const db = server.get_database(0);
+
+        EXPECT_EQ(run_command(dispatch, { "INCR", "a" }), integer(1));
+        EXPECT_EQ(run_command(dispatch, { "DECR", "b" }), integer(-1));
+        EXPECT_EQ(run_command(dispatch, { "INCRBY", "c", "10" }), integer(10));
+        EXPECT_EQ(run_command(dispatch, { "DECRBY", "d", "10" }), integer(-10));
+        EXPECT_EQ(run_command(dispatch, { "INCRBYFLOAT", "e", "2.5" }), bulk_string("2.5"));
+
+        // An expired key is replaced, without its TTL
+        db->set_value("expired", "100", std::chrono::system_clock::now() - 1s);
+        EXPECT_EQ(run_command(dispatch, { "INCRBY", "expired", "5" }), integer(5));
+        EXPECT_FALSE(db->get_value("expired")->has_ttl());
+
+        db->set_value("expired", "not a number", std::chrono::system_clock::now() - 1s);
+        EXPECT_EQ(run_command(dispatch, { "INCRBYFLOAT", "expired", "1.5" }), bulk_string("1.5"));
+        EXPECT_FALSE(db->get_value("expired")->has_ttl());
+
+        EXPECT_EQ(db->increment("missing", 7), 7);
+        EXPECT_EQ(db->increment("missing", -8), -1);
+        EXPECT_EQ(db->get_value("missing")->integer(), -1);
+    }
+
+    TEST(CounterTests, OverflowIsAnError)
+    {
+        server server(1, 4);
+        command_dispatch dispatch(server);
+        auto const db = server.get_database(0);
+
+        auto const max = std::to_string(std::numeric_limits<int64_t>::max());
+        auto const min = std::to_string(std::numeric_limits<int64_t>::min());
+
+        db->set_value("max", max);
+        EXPECT_EQ(run_command(dispatch, { "INCR", "max" }), overflow);
+        EXPECT_EQ(run_command(dispatch, { "INCRBY", "max", max }), overflow);
+        EXPECT_EQ(run_command(dispatch, { "DECRBY", "max", min.substr(1) + "0" }), not_an_integer);
+        EXPECT_EQ(run_command(dispatch, { "DECR", "max" }), integer(std::numeric_limits<int64_t>::max() - 1));
+
+        db->set_value("min", min);
+        EXPECT_EQ(run_command(dispatch, { "DECR", "min" }), overflow);
+        EXPECT_EQ(run_command(dispatch, { "DECRBY", "min", "1" }), overflow);
+        EXPECT_EQ(run_command(dispatch, { "INCRBY", "min", "-1" }), overflow);
+        EXPECT_EQ(run_command(dispatch, { "INCR", "min" }), integer(std::numeric_limits<int64_t>::min() + 1));
+
+        // The negation of INT64_MIN does not fit, even where the result would
+        db->set_value("zero", "0");
+        EXPECT_EQ(run_command(dispatch, { "DECRBY", "zero", min }), "-ERR decrement would overflow\r\n");
+        EXPECT_EQ(run_command(dispatch, { "INCRBY", "zero", min }), integer(std::numeric_limits<int64_t>::min()));
+
+        // Failed updates leave the values as they were
+        EXPECT_EQ(run_command(dispatch, { "GET", "max" }), bulk_string(std::to_string(std::numeric_limits<int64_t>::max() - 1)));
+        EXPECT_EQ(run_command(dispatch, { "GET", "min" }), bulk_string(std::to_string(std::numeric_limits<int64_t>::min() + 1)));
+        EXPECT_EQ(db->increment("max", std::numeric_limits<int64_t>::max()), std::unexpected(value_error::overflow));
+    }
+
+    TEST(CounterTests, OnlyCanonicalIntegersAreCounters)
+    {
+        server server(1, 4);
+        command_dispatch dispatch(server);
+        auto const db = server.get_database(0);
+
+        for (auto const value : { "010", "-0", "+1", " 1", "1 ", "1.0", "", "abc", "99999999999999999999" })
+        {
+            db->set_value("key", value);
+            EXPECT_EQ(run_command(dispatch, { "INCR", "key" }), not_an_integer) << value;
+            EXPECT_EQ(db->get_value("key")->value(), value);
+        }
+
+        // The same rules apply to the increments
+        db->set_value("key", "1");
+        for (auto const delta : { "010", "-0", "+1", "1.0", "" })
+        {
+            EXPECT_EQ(run_command(dispatch, { "INCRBY", "key", delta }), not_an_integer) << delta;
+            EXPECT_EQ(run_command(dispatch, { "DECRBY", "key", delta }), not_an_integer) << delta;
+        }
+
+        EXPECT_EQ(run_command(dispatch, { "GET", "key" }), bulk_string("1"));
+    }
+
+    TEST(CounterTests, TimeToLiveIsKept)
+    {
+        server server(1, 4);
+        command_dispatch dispatch(server);
+        auto const db  = server.get_database(0);
+        auto const ttl = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() + 1h);
+
+        db->set_value("counter", "5", ttl);
+        auto const* const before = db->get_value("counter").get();
+        EXPECT_EQ(run_command(dispatch, { "INCR", "counter" }), integer(6));
+        EXPECT_EQ(run_command(dispatch, { "DECRBY", "counter", "3" }), integer(3));
+
+        // The entry is updated in place
+        EXPECT_EQ(db->get_value("counter").get(), before);
+        EXPECT_TRUE(db->get_value("counter")->has_ttl());
+        EXPECT_EQ(db->get_value("counter")->ttl(), ttl);
+
+        db->set_value("float", "1.5", ttl);
+        EXPECT_EQ(run_command(dispatch, { "INCRBYFLOAT", "float", "0.25" }), bulk_string("1.75"));
+        EXPECT_TRUE(db->get_value("float")->has_ttl());
+        EXPECT_EQ(db->get_value("float")->ttl(), ttl);
+
+        EXPECT_EQ(run_command(dispatch, { "INCRBYFLOAT", "counter", "0.5" }), bulk_string("3.5"));
+        EXPECT_EQ(db->get_value("counter")->ttl(), ttl);
+    }
+
+    TEST(CounterTests, FloatIncrementsAreFormattedLikeRedis)
+    {
+        server server(1, 4);
+        command_dispatch dispatch(server);
+        auto const db = server.get_database(0);
+
+        db->set_value("key", "10.50");
+        EXPECT_EQ(run_command(dispatch, { "INCRBYFLOAT", "key", "0.1" }), bulk_string("10.6"));
+        EXPECT_EQ(run_command(dispatch, { "INCRBYFLOAT", "key", "-5" }), bulk_string("5.6"));
+
+        // Exponents are accepted, the result is written without one
+        db->set_value("key", "5.0e3");
+        EXPECT_EQ(run_command(dispatch, { "INCRBYFLOAT", "key", "2.0e2" }), bulk_string("5200"));
+
+        // A whole result is stored as an integer, so it can be counted again
+        db->set_value("key", "1.5");
+        EXPECT_EQ(run_command(dispatch, { "INCRBYFLOAT", "key", "1.5" }), bulk_string("3"));
+        EXPECT_EQ(db->get_value("key")->encoding(), entry_encoding::integer);
+        EXPECT_EQ(run_command(dispatch, { "INCR", "key" }), integer(4));
+    }
+
+    TEST(CounterTests, FloatIncrementsMustBeFinite)
+    {
+        server server(1, 4);
+        command_dispatch dispatch(server);
+        auto const db = server.get_database(0);
+
+        constexpr auto not_a_float = "-ERR value is not a valid float\r\n";
+        db->set_value("key", "1");
+        for (auto const delta : { "inf", "-inf", "nan", "1e400", "abc", "", "1.0x" })
+        {
+            EXPECT_EQ(run_command(dispatch, { "INCRBYFLOAT", "key", delta }), not_a_float) << delta;
+        }
+
+        for (auto const value : { "inf", "nan", "abc" })
+        {
+            db->set_value("stored", value);
+            EXPECT_EQ(run_command(dispatch, { "INCRBYFLOAT", "stored", "1" }), not_a_float) << value;
+        }
+
+        db->set_value("large", "1.7e308");
+        EXPECT_EQ(run_command(dispatch, { "INCRBYFLOAT", "large", "1.7e308" }), "-ERR increment would produce NaN or Infinity\r\n");
+        EXPECT_EQ(db->increment_float("large", 1.7e308).error(), value_error::not_finite);
+
+        EXPECT_EQ(run_command(dispatch, { "GET", "key" }), bulk_string("1"));
+    }
+} // namespace CounterTests
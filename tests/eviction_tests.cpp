@@ -0,0 +1,211 @@
+import server;
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+namespace EvictionTests
+{
+    using namespace LambdaSnail::server;
+    using namespace std::chrono_literals;
+
+    auto const now = access_clock::time_point_t(std::chrono::hours(24 * 365 * 50));
+
+    TEST(EvictionTests, LruScoreIsIdleTime)
+    {
+        auto const clock = access_clock::initial(eviction_policy::allkeys_lru, now);
+
+        EXPECT_EQ(access_clock::eviction_score(eviction_policy::allkeys_lru, clock, now), 0);
+        EXPECT_EQ(access_clock::eviction_score(eviction_policy::allkeys_lru, clock, now + 100s), 100);
+
+        // The clock wraps after 65536 seconds
+        EXPECT_EQ(access_clock::eviction_score(eviction_policy::allkeys_lru, clock, now + 65537s), 1);
+
+        auto const touched = access_clock::touch(eviction_policy::allkeys_lru, clock, now + 100s);
+        EXPECT_EQ(access_clock::eviction_score(eviction_policy::allkeys_lru, touched, now + 100s), 0);
+    }
+
+    TEST(EvictionTests, LfuCountsAccessesAndDecays)
+    {
+        auto const clock = access_clock::initial(eviction_policy::allkeys_lfu, now);
+        EXPECT_EQ(access_clock::eviction_score(eviction_policy::allkeys_lfu, clock, now), 255 - access_clock::lfu_initial_counter);
+
+        // Counters up to the initial value are always incremented
+        auto const touched = access_clock::touch(eviction_policy::allkeys_lfu, clock, now);
+        EXPECT_EQ(access_clock::eviction_score(eviction_policy::allkeys_lfu, touched, now), 255 - access_clock::lfu_initial_counter - 1);
+
+        // Every idle minute takes one off the counter, down to zero
+        EXPECT_EQ(access_clock::eviction_score(eviction_policy::allkeys_lfu, clock, now + 3min), 255 - access_clock::lfu_initial_counter + 3);
+        EXPECT_EQ(access_clock::eviction_score(eviction_policy::allkeys_lfu, clock, now + 10min), 255);
+
+        // Counters grow logarithmically, ten thousand accesses do not saturate them
+        auto counter = clock;
+        for (int i = 0; i < 10000; ++i)
+        {
+            counter = access_clock::touch(eviction_policy::allkeys_lfu, counter, now);
+        }
+
+        auto const score = access_clock::eviction_score(eviction_policy::allkeys_lfu, counter, now);
+        EXPECT_LT(score, 255 - access_clock::lfu_initial_counter - 10);
+        EXPECT_GT(score, 0);
+    }
+
+    TEST(EvictionTests, OtherPoliciesDoNotScore)
+    {
+        for (auto const policy : { eviction_policy::noeviction, eviction_policy::volatile_ttl })
+        {
+            auto const clock = access_clock::initial(policy, now);
+            EXPECT_EQ(access_clock::eviction_score(policy, clock, now + 1h), 0);
+        }
+    }
+
+    TEST(EvictionTests, IdleTimeWrapsAfterTheMaximum)
+    {
+        for (auto const policy : { eviction_policy::noeviction, eviction_policy::allkeys_lru, eviction_policy::allkeys_lfu })
+        {
+            auto const clock    = access_clock::initial(policy, now);
+            auto const max_idle = access_clock::max_idle_time(policy);
+
+            EXPECT_EQ(access_clock::idle_time(policy, clock, now + max_idle), max_idle);
+            EXPECT_LT(access_clock::idle_time(policy, clock, now + max_idle + 1min), max_idle);
+        }
+
+        EXPECT_EQ(access_clock::max_idle_time(eviction_policy::allkeys_lfu), 255min);
+    }
+
+    TEST(EvictionTests, PoolKeepsTheBestCandidates)
+    {
+        eviction_pool pool;
+        for (uint64_t score = 0; score < 20; ++score)
+        {
+            pool.add(score, 0, "key:" + std::to_string(score));
+        }
+
+        EXPECT_EQ(pool.size(), eviction_pool::capacity);
+
+        // A full pool ignores candidates that are worse than all of its own
+        pool.add(1, 0, "worse");
+        EXPECT_EQ(pool.size(), eviction_pool::capacity);
+
+        // A key that is sampled again replaces its earlier score
+        pool.add(100, 0, "key:10");
+        EXPECT_EQ(pool.size(), eviction_pool::capacity);
+
+        auto const best = pool.take_best();
+        EXPECT_EQ(best.key, "key:10");
+        EXPECT_EQ(best.score, 100);
+        EXPECT_EQ(pool.take_best().key, "key:19");
+
+        // The same key in another database is another candidate
+        pool.add(50, 1, "key:18");
+        EXPECT_EQ(pool.take_best().database, 1);
+        EXPECT_EQ(pool.take_best().database, 0);
+
+        while (not pool.empty())
+        {
+            EXPECT_NE(pool.take_best().key, "worse");
+        }
+    }
+
+    TEST(EvictionTests, LruEvictsIdleKeysUntilWithinLimit)
+    {
+        constexpr size_t num_keys = 2000;
+        std::string const value(100, 'v');
+
+        auto const key_of = [](size_t const i) {
+            char key[16];
+            std::snprintf(key, sizeof(key), "key:%05zu", i);
+            return std::string(key);
+        };
+
+        database probe;
+        probe.set_value(key_of(0), value);
+        auto const key_size = *probe.memory_usage(key_of(0));
+
+        server server(1, 4, 0, key_size * num_keys * 3 / 4, eviction_policy::allkeys_lru);
+        auto const db = server.get_database(0);
+        for (size_t i = 0; i < num_keys; ++i)
+        {
+            db->set_value(key_of(i), value);
+        }
+
+        // The first half of the keys has not been used for a long time
+        auto const idle_clock = access_clock::initial(eviction_policy::allkeys_lru, std::chrono::system_clock::now() - 1h);
+        for (size_t i = 0; i < num_keys / 2; ++i)
+        {
+            db->get_value(key_of(i))->set_access_clock(idle_clock);
+        }
+
+        EXPECT_TRUE(server.get_memory_limit().is_exceeded());
+        EXPECT_TRUE(server.free_memory_if_needed());
+        EXPECT_FALSE(server.get_memory_limit().is_exceeded());
+
+        size_t num_idle_evicted   = 0;
+        size_t num_recent_evicted = 0;
+        for (size_t i = 0; i < num_keys; ++i)
+        {
+            if (not db->get_value(key_of(i)))
+            {
+                (i < num_keys / 2 ? num_idle_evicted : num_recent_evicted) += 1;
+            }
+        }
+
+        EXPECT_GE(num_idle_evicted + num_recent_evicted, num_keys / 4);
+        EXPECT_LT(num_recent_evicted, num_idle_evicted / 10);
+        EXPECT_EQ(db->get_statistics().evicted_keys, num_idle_evicted + num_recent_evicted);
+    }
+
+    TEST(EvictionTests, NoEvictionRefusesToFreeMemory)
+    {
+        server server(1, 4, 0, 1000, eviction_policy::noeviction);
+        auto const db = server.get_database(0);
+        for (size_t i = 0; i < 100; ++i)
+        {
+            db->set_value("key:" + std::to_string(i), std::string(100, 'v'));
+        }
+
+        EXPECT_FALSE(server.free_memory_if_needed());
+        EXPECT_EQ(db->get_statistics().num_keys, 100);
+        EXPECT_EQ(db->get_statistics().evicted_keys, 0);
+    }
+
+    TEST(EvictionTests, AccessClockIsOnlyKeptWhenItIsUsed)
+    {
+        constexpr uint16_t untouched = 1234;
+
+        for (auto const policy : { eviction_policy::noeviction, eviction_policy::volatile_ttl, eviction_policy::allkeys_lru })
+        {
+            server server(1, 4, 0, 0, policy);
+            auto const db = server.get_database(0);
+            db->set_value("value", "v");
+            ASSERT_TRUE(db->increment("counter", 1));
+            ASSERT_TRUE(db->increment_float("float", 1.5));
+
+            for (auto const key : { "value", "counter", "float" })
+            {
+                db->get_value(key)->set_access_clock(untouched);
+            }
+
+            ASSERT_TRUE(db->get_value("value"));
+            ASSERT_TRUE(db->increment("counter", 1));
+            ASSERT_TRUE(db->increment_float("float", 1.5));
+
+            for (auto const key : { "value", "counter", "float" })
+            {
+                auto const clock = db->get_value(key)->access_clock();
+                if (policy == eviction_policy::allkeys_lru)
+                {
+                    EXPECT_LE(access_clock::idle_time(policy, clock, std::chrono::system_clock::now()), 1s) << key;
+                }
+                else
+                {
+                    // INCRBYFLOAT replaces the entry, whose clock is then never set
+                    EXPECT_EQ(clock, key == std::string_view("float") ? 0 : untouched) << key;
+                }
+            }
+        }
+    }
+} // namespace EvictionTests
@@ -0,0 +1,72 @@
+import server;
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace ExpiryIndexTests
+{
+    using LambdaSnail::server::expiry_index;
+    using time_point_t = expiry_index::time_point_t;
+
+    TEST(ExpiryIndexTests, ExpireHandsOutDueKeys)
+    {
+        expiry_index index;
+        auto const now = time_point_t(std::chrono::seconds(1000));
+
+        index.add("past", now - std::chrono::seconds(1));
+        index.add("now", now);
+        index.add("future", now + std::chrono::seconds(1));
+
+        std::vector<std::string> expired;
+        EXPECT_EQ(index.expire(now, 10, [&](std::string_view key, time_point_t) { expired.emplace_back(key); }), 2);
+        std::ranges::sort(expired);
+        EXPECT_EQ(expired, (std::vector<std::string>{ "now", "past" }));
+        EXPECT_EQ(index.size(), 1);
+    }
+
+    TEST(ExpiryIndexTests, CompactDropsStaleRecords)
+    {
+        expiry_index index;
+        std::map<std::string, time_point_t> stored;
+        auto const start = time_point_t(std::chrono::seconds(1000));
+
+        // A key whose ttl is refreshed on every write leaves a record behind for every earlier ttl
+        for (int i = 0; i < 10000; ++i)
+        {
+            auto const key = "key:" + std::to_string(i % 10);
+            auto const ttl = start + std::chrono::milliseconds(i * 10);
+            index.add(key, ttl);
+            stored[key] = ttl;
+        }
+
+        // The same ttl given twice leaves two equal records
+        index.add("key:0", stored["key:0"]);
+        EXPECT_EQ(index.size(), 10001);
+
+        auto const is_current = [&stored](std::string_view key, time_point_t ttl) {
+            auto const entry = stored.find(std::string(key));
+            return entry != stored.end() and entry->second == ttl;
+        };
+
+        size_t num_calls = 0;
+        while (not index.compact(100, is_current))
+        {
+            ++num_calls;
+        }
+
+        EXPECT_GT(num_calls, 1);
+        EXPECT_EQ(index.size(), stored.size());
+
+        std::vector<std::string> expired;
+        index.expire(time_point_t::max(), 100, [&](std::string_view key, time_point_t ttl) {
+            EXPECT_TRUE(is_current(key, ttl));
+            expired.emplace_back(key);
+        });
+        EXPECT_EQ(expired.size(), stored.size());
+    }
+} // namespace ExpiryIndexTests
@@ -0,0 +1,139 @@
+import server;
+
+#include <gtest/gtest.h>
+
+#include <map>
+#include <random>
+#include <string>
+
+namespace FlatTableTests
+{
+    using LambdaSnail::server::flat_table;
+    using LambdaSnail::server::incremental_table;
+
+    size_t hash(std::string_view key)
+    {
+        return std::hash<std::string_view>{}(key);
+    }
+
+    TEST(FlatTableTests, InsertFindErase)
+    {
+        flat_table<int> table;
+
+        auto [value, inserted] = table.try_emplace("key", hash("key"));
+        ASSERT_TRUE(inserted);
+        *value = 42;
+
+        auto const [same_value, inserted_again] = table.try_emplace("key", hash("key"));
+        EXPECT_FALSE(inserted_again);
+        EXPECT_EQ(*same_value, 42);
+
+        ASSERT_NE(table.find("key", hash("key")), nullptr);
+        EXPECT_EQ(*table.find("key", hash("key")), 42);
+        EXPECT_EQ(table.find("other", hash("other")), nullptr);
+
+        EXPECT_TRUE(table.erase("key", hash("key")));
+        EXPECT_FALSE(table.erase("key", hash("key")));
+        EXPECT_TRUE(table.empty());
+    }
+
+    TEST(FlatTableTests, LongKeysAreStoredOutOfLine)
+    {
+        flat_table<int> table;
+        std::string const long_key(64, 'x');
+
+        *table.try_emplace("short", hash("short")).first = 1;
+        *table.try_emplace(long_key, hash(long_key)).first = 2;
+
+        EXPECT_EQ(*table.find("short", hash("short")), 1);
+        EXPECT_EQ(*table.find(long_key, hash(long_key)), 2);
+    }
+
+    TEST(FlatTableTests, MatchesReferenceMap)
+    {
+        flat_table<int> table;
+        std::map<std::string, int> reference;
+        std::mt19937 random_engine(1);
+
+        for (int i = 0; i < 100000; ++i)
+        {
+            std::string const key = "key:" + std::to_string(random_engine() % 5000) + (random_engine() % 3 == 0 ? std::string(20, 'x') : "");
+            switch (random_engine() % 3)
+            {
+                case 0:
+                {
+                    auto [value, inserted] = table.try_emplace(key, hash(key));
+                    EXPECT_EQ(inserted, not reference.contains(key));
+                    *value = reference[key] = i;
+                    break;
+                }
+                case 1:
+                {
+                    auto const* value = table.find(key, hash(key));
+                    if (reference.contains(key))
+                    {
+                        ASSERT_NE(value, nullptr);
+                        EXPECT_EQ(*value, reference[key]);
+                    }
+                    else
+                    {
+                        EXPECT_EQ(value, nullptr);
+                    }
+                    break;
+                }
+                default:
+                    EXPECT_EQ(table.erase(key, hash(key)), reference.erase(key) > 0);
+            }
+            ASSERT_EQ(table.size(), reference.size());
+        }
+
+        size_t num_visited = 0;
+        table.for_each([&](std::string_view key, int& value) {
+            ++num_visited;
+            EXPECT_EQ(reference.at(std::string(key)), value);
+        });
+        EXPECT_EQ(num_visited, reference.size());
+    }
+    TEST(FlatTableTests, IncrementalTableMigratesWhileGrowing)
+    {
+        incremental_table<int> table;
+
+        bool was_rehashing = false;
+        for (int i = 0; i < 10000; ++i)
+        {
+            auto const key = "key:" + std::to_string(i);
+            *table.try_emplace(key, hash(key)).first = i;
+            was_rehashing |= table.is_rehashing();
+
+            // Keys must be found in either table while a migration is in progress
+            auto const first_key = std::string("key:0");
+            ASSERT_NE(table.find(first_key, hash(first_key)), nullptr);
+        }
+
+        EXPECT_TRUE(was_rehashing);
+        EXPECT_EQ(table.size(), 10000);
+
+        table.migrate(table.capacity());
+        EXPECT_FALSE(table.is_rehashing());
+
+        for (int i = 0; i < 10000; ++i)
+        {
+            auto const key = "key:" + std::to_string(i);
+            ASSERT_NE(table.find(key, hash(key)), nullptr);
+            EXPECT_EQ(*table.find(key, hash(key)), i);
+        }
+    }
+
+    TEST(FlatTableTests, PresizedTableDoesNotRehash)
+    {
+        incremental_table<int> table;
+        table.reserve(1000);
+
+        for (int i = 0; i < 1000; ++i)
+        {
+            auto const key = "key:" + std::to_string(i);
+            *table.try_emplace(key, hash(key)).first = i;
+            ASSERT_FALSE(table.is_rehashing());
+        }
+    }
+} // namespace FlatTableTests
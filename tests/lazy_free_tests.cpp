@@ -0,0 +1,93 @@
+import server;
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+namespace LazyFreeTests
+{
+    using namespace LambdaSnail::server;
+
+    /**
+     * Waits for the lazy free thread to free the number of objects, returns whether it did within a few seconds.
+     */
+    bool wait_for_freed(server const& server, uint64_t const num_freed)
+    {
+        for (int i = 0; i < 500; ++i)
+        {
+            auto const statistics = server.get_lazy_free_statistics();
+            if (statistics.freed_objects >= num_freed and statistics.pending_objects == 0)
+            {
+                return statistics.freed_objects == num_freed;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        return false;
+    }
+
+    TEST(LazyFreeTests, LargeValuesAreFreedInTheBackground)
+    {
+        server server(1, 4);
+        auto const db = server.get_database(0);
+
+        std::string const large(lazy_free_worker::value_threshold, 'l');
+        std::string const small(lazy_free_worker::value_threshold / 2, 's');
+
+        db->set_value("large", large);
+        db->set_value("small", small);
+        db->set_value("large", "overwritten");
+        db->set_value("small", "overwritten");
+        EXPECT_TRUE(wait_for_freed(server, 1));
+
+        // A value that a reply still references is freed by the last reference instead
+        db->set_value("pinned", large);
+        auto const pinned = db->get_value("pinned");
+        db->set_value("pinned", "overwritten");
+        EXPECT_TRUE(wait_for_freed(server, 1));
+        EXPECT_EQ(pinned->value(), large);
+
+        std::string_view const keys[] = { "large", "small" };
+        db->set_value("large", large);
+        EXPECT_EQ(db->erase_values(keys, true), 2);
+        EXPECT_TRUE(wait_for_freed(server, 2));
+    }
+
+    TEST(LazyFreeTests, FlushedDatabaseStaysUsable)
+    {
+        constexpr size_t num_keys = 10000;
+
+        server server(1, 4, num_keys);
+        auto const db        = server.get_database(0);
+        auto const num_slots = db->get_statistics().num_slots;
+        EXPECT_GE(num_slots, num_keys);
+
+        auto const ttl = std::chrono::system_clock::now() + std::chrono::hours(1);
+        for (size_t i = 0; i < num_keys; ++i)
+        {
+            db->set_value("key:" + std::to_string(i), "value", i % 2 == 0 ? ttl : entry::time_point_t::min());
+        }
+
+        db->flush(true);
+        EXPECT_EQ(db->get_statistics().num_keys, 0);
+        EXPECT_EQ(db->get_memory_limit().used_bytes.load(), 0);
+        EXPECT_FALSE(db->get_value("key:0"));
+
+        // The flushed shards are freed in the background, and the presized room is kept
+        EXPECT_TRUE(wait_for_freed(server, db->num_shards()));
+        EXPECT_EQ(db->get_statistics().num_slots, num_slots);
+
+        db->set_value("key:0", "new value");
+        ASSERT_TRUE(db->get_value("key:0"));
+        EXPECT_EQ(db->get_value("key:0")->value(), "new value");
+        EXPECT_EQ(db->get_statistics().num_keys, 1);
+        EXPECT_EQ(db->handle_deletes(std::chrono::system_clock::now()).expired_keys, 0);
+
+        db->flush(false);
+        EXPECT_EQ(db->get_statistics().num_keys, 0);
+        EXPECT_EQ(db->get_statistics().num_slots, num_slots);
+    }
+} // namespace LazyFreeTests
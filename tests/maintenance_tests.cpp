@@ -0,0 +1,71 @@
+import resp;
+import server;
+
+#include <gtest/gtest.h>
+
+#include "test_helpers.hpp"
+
+#include <chrono>
+#include <string>
+#include <string_view>
+
+namespace MaintenanceTests
+{
+    using namespace LambdaSnail::server;
+    using namespace TestHelpers;
+    using namespace std::chrono_literals;
+
+    std::string memory_stats(server& server)
+    {
+        command_dispatch dispatch(server);
+        return run_command(dispatch, { "MEMORY", "STATS" });
+    }
+
+    std::string stat(std::string_view const name, int64_t const value)
+    {
+        return "$" + std::to_string(name.size()) + "\r\n" + std::string(name) + "\r\n:" + std::to_string(value) + "\r\n";
+    }
+
+    TEST(MaintenanceTests, CyclesAreCountedAndReported)
+    {
+        server server(2, 4);
+        timeout_worker worker(server, test_logger());
+        server.set_maintenance_worker(&worker);
+
+        auto const now = std::chrono::system_clock::now();
+        for (size_t i = 0; i < 10; ++i)
+        {
+            server.get_database(i % 2)->set_value("expired:" + std::to_string(i), "value", now - 1s);
+        }
+
+        server.get_database(0)->set_value("live", "value", now + 1h);
+
+        auto const first = worker.run_cycle(now);
+        EXPECT_EQ(first.expired_keys, 10);
+        EXPECT_FALSE(first.incomplete);
+        EXPECT_EQ(worker.run_cycle(now).expired_keys, 0);
+
+        auto const statistics = worker.get_statistics();
+        EXPECT_EQ(statistics.cycles, 2);
+        EXPECT_EQ(statistics.expired_keys, 10);
+        EXPECT_EQ(statistics.incomplete_cycles, 0);
+        EXPECT_GE(statistics.max_cycle_duration, statistics.last_cycle_duration);
+        EXPECT_EQ(server.get_database(0)->get_statistics().num_keys, 1);
+
+        auto const reply = memory_stats(server);
+        EXPECT_NE(reply.find(stat("maintenance.cycles", 2)), std::string::npos) << reply;
+        EXPECT_NE(reply.find(stat("maintenance.expired-keys", 10)), std::string::npos) << reply;
+        EXPECT_NE(reply.find(stat("maintenance.incomplete-cycles", 0)), std::string::npos) << reply;
+        EXPECT_NE(reply.find(stat("maintenance.max-cycle-us", statistics.max_cycle_duration.count())), std::string::npos) << reply;
+    }
+
+    TEST(MaintenanceTests, ServerWithoutMaintenanceReportsNothingDone)
+    {
+        server server(1, 4);
+        auto const reply = memory_stats(server);
+
+        EXPECT_TRUE(reply.starts_with("*48\r\n"));
+        EXPECT_NE(reply.find(stat("maintenance.cycles", 0)), std::string::npos) << reply;
+        EXPECT_NE(reply.find(stat("maintenance.spilled-values", 0)), std::string::npos) << reply;
+    }
+} // namespace MaintenanceTests
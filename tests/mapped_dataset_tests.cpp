@@ -0,0 +1,182 @@
+import server;
+
+#include <gtest/gtest.h>
+
+#include "test_helpers.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string>
+
+namespace MappedDatasetTests
+{
+    using namespace LambdaSnail::server;
+    using namespace TestHelpers;
+
+    /**
+     * Builds a dataset of numbered keys, with a key that is added twice, an empty key and a large value.
+     */
+    size_t build(std::filesystem::path const& path, size_t const num_keys)
+    {
+        mapped_dataset_builder builder;
+        for (size_t i = 0; i < num_keys; ++i)
+        {
+            EXPECT_TRUE(builder.add("key:" + std::to_string(i), "value:" + std::to_string(i)));
+        }
+
+        builder.add("key:5", "added again");
+        builder.add("", "empty key");
+        builder.add("large", std::string(100000, 'l'));
+
+        auto const written = builder.write(path);
+        EXPECT_TRUE(written) << written.error();
+        return written.value_or(0);
+    }
+
+    TEST(MappedDatasetTests, BuildMapAndLookUp)
+    {
+        auto const path = test_path("lookup.lsmd");
+        auto const size = build(path, 10000);
+        EXPECT_EQ(size, std::filesystem::file_size(path));
+
+        auto const dataset = mapped_dataset::open(path);
+        ASSERT_TRUE(dataset) << dataset.error();
+        EXPECT_EQ((*dataset)->size(), 10002);
+
+        for (size_t i = 0; i < 10000; ++i)
+        {
+            auto const value = (*dataset)->find("key:" + std::to_string(i));
+            ASSERT_TRUE(value) << i;
+            EXPECT_EQ(*value, i == 5 ? "added again" : "value:" + std::to_string(i));
+        }
+
+        EXPECT_EQ((*dataset)->find(""), "empty key");
+        EXPECT_EQ((*dataset)->find("large"), std::string(100000, 'l'));
+        EXPECT_FALSE((*dataset)->find("key:10000"));
+        EXPECT_FALSE((*dataset)->find("missing"));
+
+        // The first database serves the dataset and is read-only, the others stay writable
+        server server(2, 4);
+        server.set_mapped_dataset(*dataset);
+        EXPECT_TRUE(server.get_database(0)->is_read_only());
+        EXPECT_FALSE(server.get_database(1)->is_read_only());
+        EXPECT_EQ(server.get_database(0)->get_dataset_value("key:1"), "value:1");
+        EXPECT_FALSE(server.get_database(0)->get_dataset_value("missing"));
+        EXPECT_FALSE(server.get_database(1)->get_dataset_value("key:1"));
+
+        command_dispatch dispatch(server);
+        EXPECT_EQ(run_command(dispatch, { "GET", "key:2" }), bulk_string("value:2"));
+        EXPECT_EQ(run_command(dispatch, { "SET", "key:2", "changed" }), "-READONLY You can't write against a read only dataset.\r\n");
+        EXPECT_EQ(run_command(dispatch, { "DEL", "key:2" }), "-READONLY You can't write against a read only dataset.\r\n");
+        EXPECT_EQ(run_command(dispatch, { "GET", "key:2" }), bulk_string("value:2"));
+
+        EXPECT_EQ(run_command(dispatch, { "SELECT", "1" }), "+OK\r\n");
+        EXPECT_EQ(run_command(dispatch, { "SET", "key:2", "changed" }), "+OK\r\n");
+        EXPECT_EQ(run_command(dispatch, { "GET", "key:2" }), bulk_string("changed"));
+        EXPECT_EQ(run_command(dispatch, { "FLUSHDB" }), "+OK\r\n");
+
+        std::filesystem::remove(path);
+    }
+
+    TEST(MappedDatasetTests, RebuildingDoesNotDisturbTheMappedFile)
+    {
+        auto const path = test_path("rebuild.lsmd");
+        build(path, 100);
+
+        auto const dataset = mapped_dataset::open(path);
+        ASSERT_TRUE(dataset) << dataset.error();
+
+        mapped_dataset_builder builder;
+        builder.add("key:1", "rebuilt");
+        ASSERT_TRUE(builder.write(path));
+
+        EXPECT_EQ((*dataset)->find("key:1"), "value:1");
+        EXPECT_EQ((*dataset)->size(), 102);
+
+        auto const rebuilt = mapped_dataset::open(path);
+        ASSERT_TRUE(rebuilt) << rebuilt.error();
+        EXPECT_EQ((*rebuilt)->find("key:1"), "rebuilt");
+        EXPECT_EQ((*rebuilt)->size(), 1);
+
+        std::filesystem::remove(path);
+    }
+
+    TEST(MappedDatasetTests, CorruptedOrTruncatedFileIsRejected)
+    {
+        auto const path = test_path("corrupted.lsmd");
+        auto const size = build(path, 1000);
+        auto const contents = read_file(path);
+
+        std::filesystem::resize_file(path, size - 1);
+        auto const truncated = mapped_dataset::open(path);
+        ASSERT_FALSE(truncated);
+        EXPECT_EQ(truncated.error(), "The dataset is truncated");
+
+        write_file(path, contents.substr(0, 10));
+        EXPECT_FALSE(mapped_dataset::open(path));
+
+        auto wrong_magic = contents;
+        wrong_magic[0]   = 'X';
+        write_file(path, wrong_magic);
+        EXPECT_EQ(mapped_dataset::open(path).error(), "The file is not a dataset");
+
+        // A table that does not fit the file
+        auto too_many_slots = contents;
+        mapped_dataset_format::header header{};
+        std::memcpy(&header, too_many_slots.data(), sizeof(header));
+        header.num_slots <<= 8;
+        std::memcpy(too_many_slots.data(), &header, sizeof(header));
+        write_file(path, too_many_slots);
+        EXPECT_EQ(mapped_dataset::open(path).error(), "Invalid dataset header");
+
+        std::filesystem::remove(path);
+    }
+
+    TEST(MappedDatasetTests, CorruptedRecordsAreNotFound)
+    {
+        auto const path = test_path("records.lsmd");
+        build(path, 1000);
+        auto contents = read_file(path);
+
+        mapped_dataset_format::header header{};
+        std::memcpy(&header, contents.data(), sizeof(header));
+
+        // Points the slot of one key past the end of the file, and gives the record of another a length that overruns it
+        auto const slot_of = [&contents, &header](std::string_view const key) {
+            auto index = mapped_dataset_format::hash(key) & (header.num_slots - 1);
+            while (true)
+            {
+                mapped_dataset_format::slot slot{};
+                auto const offset = mapped_dataset_format::slots_offset + index * sizeof(slot);
+                std::memcpy(&slot, contents.data() + offset, sizeof(slot));
+                if (slot.hash == mapped_dataset_format::hash(key))
+                {
+                    return offset;
+                }
+
+                index = (index + 1) & (header.num_slots - 1);
+            }
+        };
+
+        mapped_dataset_format::slot slot{};
+        std::memcpy(&slot, contents.data() + slot_of("key:1"), sizeof(slot));
+        slot.offset = contents.size() + 1000;
+        std::memcpy(contents.data() + slot_of("key:1"), &slot, sizeof(slot));
+
+        std::memcpy(&slot, contents.data() + slot_of("key:2"), sizeof(slot));
+        mapped_dataset_format::record_header record{};
+        std::memcpy(&record, contents.data() + slot.offset, sizeof(record));
+        record.value_length = UINT32_MAX;
+        std::memcpy(contents.data() + slot.offset, &record, sizeof(record));
+
+        write_file(path, contents);
+        auto const dataset = mapped_dataset::open(path);
+        ASSERT_TRUE(dataset) << dataset.error();
+        EXPECT_FALSE((*dataset)->find("key:1"));
+        EXPECT_FALSE((*dataset)->find("key:2"));
+        EXPECT_EQ((*dataset)->find("key:3"), "value:3");
+
+        std::filesystem::remove(path);
+    }
+} // namespace MappedDatasetTests
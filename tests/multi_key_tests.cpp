@@ -0,0 +1,137 @@
+import server;
+
+#include <gtest/gtest.h>
+
+#include "test_helpers.hpp"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace MultiKeyTests
+{
+    using namespace LambdaSnail::server;
+    using namespace TestHelpers;
+    using namespace std::chrono_literals;
+
+    TEST(MultiKeyTests, MgetKeepsTheOrderOfTheArguments)
+    {
+        server server(1, 16);
+        command_dispatch dispatch(server);
+        auto const db  = server.get_database(0);
+        auto const now = std::chrono::system_clock::now();
+
+        // The keys are spread over the shards, which are visited one at a time
+        std::vector<std::string> command{ "MGET" };
+        std::string expected = "*100\r\n";
+        for (size_t i = 0; i < 100; ++i)
+        {
+            auto const key = "key:" + std::to_string(i);
+            command.push_back(key);
+
+            if (i % 3 == 0)
+            {
+                expected += "_\r\n";
+            }
+            else if (i % 5 == 0)
+            {
+                db->set_value(key, "expired", now - 1s);
+                expected += "_\r\n";
+            }
+            else
+            {
+                db->set_value(key, "value:" + std::to_string(i), i % 2 ? now + 1h : time_point_t::min());
+                expected += bulk_string("value:" + std::to_string(i));
+            }
+        }
+
+        EXPECT_EQ(run_command(dispatch, command), expected);
+        EXPECT_EQ(run_command(dispatch, { "MGET", "key:1", "key:0", "key:1" }), "*3\r\n" + bulk_string("value:1") + "_\r\n" + bulk_string("value:1"));
+    }
+
+    TEST(MultiKeyTests, MsetSetsEveryPair)
+    {
+        server server(1, 16);
+        command_dispatch dispatch(server);
+        auto const db = server.get_database(0);
+
+        db->set_value("a", "old", std::chrono::system_clock::now() + 1h);
+        EXPECT_EQ(run_command(dispatch, { "MSET", "a", "1", "b", "2", "c", "3", "b", "4" }), "+OK\r\n");
+        EXPECT_EQ(run_command(dispatch, { "MGET", "a", "b", "c" }), "*3\r\n" + bulk_string("1") + bulk_string("4") + bulk_string("3"));
+
+        // Like SET, MSET drops the TTL
+        EXPECT_FALSE(db->get_value("a")->has_ttl());
+
+        // The pairs are checked before anything is set
+        EXPECT_EQ(run_command(dispatch, { "MSET", "a" }), "-ERR wrong number of arguments for 'MSET' command\r\n");
+        EXPECT_EQ(run_command(dispatch, { "MSET", "a", "5", "d" }), "-ERR wrong number of arguments for 'MSET' command\r\n");
+        EXPECT_EQ(run_command(dispatch, { "MSETNX", "d" }), "-ERR wrong number of arguments for 'MSETNX' command\r\n");
+        EXPECT_EQ(run_command(dispatch, { "MSETNX", "d", "5", "e" }), "-ERR wrong number of arguments for 'MSETNX' command\r\n");
+        EXPECT_EQ(run_command(dispatch, { "MGET", "a", "d", "e" }), "*3\r\n" + bulk_string("1") + "_\r\n_\r\n");
+        EXPECT_EQ(db->get_statistics().num_keys, 3);
+    }
+
+    TEST(MultiKeyTests, MsetnxSetsNothingIfAnyKeyIsLive)
+    {
+        server server(1, 16);
+        command_dispatch dispatch(server);
+        auto const db = server.get_database(0);
+
+        db->set_value("live", "value", std::chrono::system_clock::now() + 1h);
+        EXPECT_EQ(run_command(dispatch, { "MSETNX", "a", "1", "b", "2", "live", "3" }), ":0\r\n");
+        EXPECT_EQ(run_command(dispatch, { "MGET", "a", "b", "live" }), "*3\r\n_\r\n_\r\n" + bulk_string("value"));
+
+        // Expired keys count as absent
+        db->set_value("expired", "value", std::chrono::system_clock::now() - 1s);
+        EXPECT_EQ(run_command(dispatch, { "MSETNX", "a", "1", "expired", "2" }), ":1\r\n");
+        EXPECT_EQ(run_command(dispatch, { "MGET", "a", "expired" }), "*2\r\n" + bulk_string("1") + bulk_string("2"));
+        EXPECT_FALSE(db->get_value("expired")->has_ttl());
+
+        EXPECT_EQ(run_command(dispatch, { "MSETNX", "a", "3" }), ":0\r\n");
+        EXPECT_EQ(run_command(dispatch, { "MSETNX", "c", "1", "c", "2" }), ":1\r\n");
+        EXPECT_EQ(run_command(dispatch, { "GET", "c" }), bulk_string("2"));
+    }
+
+    TEST(MultiKeyTests, RepeatedKeysAreCountedPerOccurrenceByExists)
+    {
+        server server(1, 16);
+        command_dispatch dispatch(server);
+        auto const db = server.get_database(0);
+
+        db->set_value("a", "1");
+        db->set_value("b", "2", std::chrono::system_clock::now() + 1h);
+        db->set_value("expired", "3", std::chrono::system_clock::now() - 1s);
+
+        EXPECT_EQ(run_command(dispatch, { "EXISTS", "a" }), ":1\r\n");
+        EXPECT_EQ(run_command(dispatch, { "EXISTS", "a", "a", "b", "missing", "expired" }), ":3\r\n");
+        EXPECT_EQ(run_command(dispatch, { "EXISTS", "missing", "expired" }), ":0\r\n");
+
+        // A key is only deleted once, however often it is given
+        EXPECT_EQ(run_command(dispatch, { "DEL", "a", "a", "missing", "expired" }), ":1\r\n");
+        EXPECT_EQ(run_command(dispatch, { "UNLINK", "b", "b", "a" }), ":1\r\n");
+        EXPECT_EQ(run_command(dispatch, { "EXISTS", "a", "b", "expired" }), ":0\r\n");
+        EXPECT_EQ(db->get_statistics().num_keys, 0);
+    }
+
+    TEST(MultiKeyTests, DeletesSpanTheShards)
+    {
+        server server(1, 16);
+        command_dispatch dispatch(server);
+        auto const db = server.get_database(0);
+
+        std::vector<std::string> del{ "DEL" };
+        std::vector<std::string> unlink{ "UNLINK" };
+        for (size_t i = 0; i < 100; ++i)
+        {
+            auto const key = "key:" + std::to_string(i);
+            db->set_value(key, std::string(i < 50 ? 10 : 1000, 'x'));
+            (i % 2 ? del : unlink).push_back(key);
+        }
+
+        del.push_back("missing");
+        EXPECT_EQ(run_command(dispatch, del), ":50\r\n");
+        EXPECT_EQ(run_command(dispatch, unlink), ":50\r\n");
+        EXPECT_EQ(run_command(dispatch, { "EXISTS", "key:0", "key:1", "key:99" }), ":0\r\n");
+        EXPECT_EQ(db->get_statistics().num_keys, 0);
+    }
+} // namespace MultiKeyTests
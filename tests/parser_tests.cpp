@@ -88,6 +88,196 @@ namespace ParseValidTests
     INSTANTIATE_TYPED_TEST_SUITE_P(TestMaterializeValidResp,RespStringTestFixture,ValidRespStringTest_Types);
 }
 
+namespace IncrementalParserTests
+{
+    using LambdaSnail::resp::incremental_parser;
+
+    TEST(IncrementalParserTest, SingleCommand)
+    {
+        incremental_parser parser;
+        std::string_view const message = "*2\r\n$3\r\nGET\r\n$3\r\nkey\r\n";
+
+        auto const result = parser.parse(message);
+        EXPECT_EQ(result.status, incremental_parser::parse_status::complete);
+        EXPECT_EQ(result.length, message.size());
+    }
+
+    TEST(IncrementalParserTest, PipelinedCommands)
+    {
+        incremental_parser parser;
+        std::string_view const message = "*1\r\n$4\r\nPING\r\n*2\r\n$4\r\nECHO\r\n$2\r\nhi\r\n";
+
+        auto const first = parser.parse(message);
+        ASSERT_EQ(first.status, incremental_parser::parse_status::complete);
+        EXPECT_EQ(first.length, 14);
+
+        auto const second = parser.parse(message.substr(first.length));
+        ASSERT_EQ(second.status, incremental_parser::parse_status::complete);
+        EXPECT_EQ(second.length, message.size() - first.length);
+    }
+
+    TEST(IncrementalParserTest, ByteByByte)
+    {
+        incremental_parser parser;
+        std::string_view const message = "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$5\r\nvalue\r\n";
+
+        for (size_t i = 0; i < message.size(); ++i)
+        {
+            EXPECT_EQ(parser.parse(message.substr(0, i)).status, incremental_parser::parse_status::incomplete);
+        }
+
+        auto const result = parser.parse(message);
+        EXPECT_EQ(result.status, incremental_parser::parse_status::complete);
+        EXPECT_EQ(result.length, message.size());
+    }
+
+    TEST(IncrementalParserTest, ReportsSizeOfLargeBulkString)
+    {
+        incremental_parser parser;
+        std::string const header = "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$4096\r\n";
+
+        auto const result = parser.parse(header + "partial value");
+        EXPECT_EQ(result.status, incremental_parser::parse_status::incomplete);
+        EXPECT_EQ(result.length, header.size() + 4096 + 2);
+
+        std::string const message = header + std::string(4096, 'x') + "\r\n";
+        auto const completed = parser.parse(message);
+        EXPECT_EQ(completed.status, incremental_parser::parse_status::complete);
+        EXPECT_EQ(completed.length, message.size());
+    }
+
+    TEST(IncrementalParserTest, BulkStringContainingLineEndings)
+    {
+        incremental_parser parser;
+        std::string_view const message = "*1\r\n$6\r\na\r\nb\r\n\r\n*1";
+
+        auto const result = parser.parse(message);
+        EXPECT_EQ(result.status, incremental_parser::parse_status::complete);
+        EXPECT_EQ(result.length, 16);
+    }
+
+    TEST(IncrementalParserTest, InvalidLength)
+    {
+        incremental_parser parser;
+        EXPECT_EQ(parser.parse("*2\r\n$x\r\n").status, incremental_parser::parse_status::error);
+    }
+
+    TEST(IncrementalParserTest, ArgumentTable)
+    {
+        incremental_parser parser;
+        std::string const value(100, 'v');
+        std::string const message = "*3\r\n$3\r\nSET\r\n$0\r\n\r\n$100\r\n" + value + "\r\n";
+
+        for (size_t i = 0; i < message.size(); ++i)
+        {
+            ASSERT_EQ(parser.parse(std::string_view(message).substr(0, i)).status, incremental_parser::parse_status::incomplete);
+        }
+
+        ASSERT_EQ(parser.parse(message).status, incremental_parser::parse_status::complete);
+
+        auto const arguments = parser.arguments();
+        ASSERT_EQ(arguments.size(), 3);
+        EXPECT_EQ(message.substr(arguments[0].offset, arguments[0].length), "SET");
+        EXPECT_EQ(arguments[1].length, 0);
+        EXPECT_EQ(message.substr(arguments[2].offset, arguments[2].length), value);
+    }
+
+    TEST(IncrementalParserTest, NoArgumentTableForOtherMessages)
+    {
+        incremental_parser parser;
+        ASSERT_EQ(parser.parse("*1\r\n$4\r\nPING\r\n").status, incremental_parser::parse_status::complete);
+        EXPECT_EQ(parser.arguments().size(), 1);
+
+        ASSERT_EQ(parser.parse("+PING\r\n").status, incremental_parser::parse_status::complete);
+        EXPECT_TRUE(parser.arguments().empty());
+
+        ASSERT_EQ(parser.parse("*2\r\n$3\r\nGET\r\n*1\r\n:1\r\n").status, incremental_parser::parse_status::complete);
+        EXPECT_TRUE(parser.arguments().empty());
+    }
+
+    TEST(IncrementalParserTest, ArrayElementsAreDecodedOnce)
+    {
+        LambdaSnail::resp::data_view const message("*2\r\n$4\r\nECHO\r\n$0\r\n\r\n");
+        auto const elements = message.materialize(LambdaSnail::resp::Array{});
+
+        ASSERT_EQ(elements.size(), 2);
+        EXPECT_TRUE(elements[0].is_decoded);
+        EXPECT_EQ(elements[0].materialize(LambdaSnail::resp::BulkString{}), "ECHO");
+        EXPECT_EQ(elements[1].materialize(LambdaSnail::resp::BulkString{}), "");
+    }
+}
+
+
+namespace ResponseWriterTests
+{
+    using LambdaSnail::resp::response_writer;
+    using LambdaSnail::resp::protocol_version;
+
+    TEST(ResponseWriterTest, TypedReplies)
+    {
+        response_writer writer;
+        writer.simple_string("OK");
+        writer.integer(-42);
+        writer.bulk_string("hello");
+        writer.array_header(2);
+        writer.error("ERR unknown command '", std::string_view("FOO"), "'");
+
+        EXPECT_EQ(writer.view(), "+OK\r\n:-42\r\n$5\r\nhello\r\n*2\r\n-ERR unknown command 'FOO'\r\n");
+    }
+
+    TEST(ResponseWriterTest, NullDependsOnProtocol)
+    {
+        response_writer writer(protocol_version::resp2);
+        writer.null();
+        writer.set_protocol(protocol_version::resp3);
+        writer.null();
+
+        EXPECT_EQ(writer.view(), "$-1\r\n_\r\n");
+    }
+
+    TEST(ResponseWriterTest, ClearKeepsWriterUsable)
+    {
+        response_writer writer;
+        writer.bulk_string(std::string(128 * 1024, 'x'));
+        writer.clear();
+        EXPECT_TRUE(writer.empty());
+
+        writer.raw(LambdaSnail::resp::replies::pong);
+        EXPECT_EQ(writer.view(), "+PONG\r\n");
+    }
+
+    TEST(ResponseWriterTest, LargeValuesAreReferenced)
+    {
+        response_writer writer;
+        auto const value = std::make_shared<std::string>(response_writer::min_reference_size, 'x');
+
+        writer.simple_string("OK");
+        writer.bulk_string(*value, value);
+        writer.integer(1);
+
+        auto const segments = writer.segments();
+        ASSERT_EQ(segments.size(), 3);
+        EXPECT_EQ(segments[0], "+OK\r\n$512\r\n");
+        EXPECT_EQ(segments[1].data(), value->data());
+        EXPECT_EQ(segments[2], "\r\n:1\r\n");
+        EXPECT_EQ(value.use_count(), 2);
+
+        writer.clear();
+        EXPECT_EQ(value.use_count(), 1);
+    }
+
+    TEST(ResponseWriterTest, SmallValuesAreCopied)
+    {
+        response_writer writer;
+        auto const value = std::make_shared<std::string>("small");
+
+        writer.bulk_string(*value, value);
+
+        ASSERT_EQ(writer.segments().size(), 1);
+        EXPECT_EQ(writer.view(), "$5\r\nsmall\r\n");
+        EXPECT_EQ(value.use_count(), 1);
+    }
+}
 
 
 // TYPED_TEST_SUITE_P(
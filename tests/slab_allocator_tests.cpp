@@ -0,0 +1,189 @@
+import memory;
+import server;
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace SlabAllocatorTests
+{
+    using LambdaSnail::memory::slab_allocator;
+    using LambdaSnail::server::entry;
+    using LambdaSnail::server::entry_ptr;
+
+    TEST(SlabAllocatorTests, AllocationSizes)
+    {
+        std::set<size_t> size_classes;
+        for (size_t size = 1; size <= slab_allocator::max_object_size; ++size)
+        {
+            auto const allocation_size = slab_allocator::allocation_size(size);
+            ASSERT_GE(allocation_size, size);
+            ASSERT_LE(allocation_size, size + size / 4 + 16) << size;
+            size_classes.insert(allocation_size);
+        }
+
+        EXPECT_EQ(size_classes.size(), 32);
+        EXPECT_EQ(slab_allocator::allocation_size(129), 160);
+        EXPECT_EQ(slab_allocator::allocation_size(slab_allocator::max_object_size), slab_allocator::max_object_size);
+    }
+
+    TEST(SlabAllocatorTests, AllocateAndDeallocateEverySizeClass)
+    {
+        slab_allocator allocator;
+
+        struct allocation
+        {
+            char* object;
+            size_t size;
+        };
+
+        // Enough objects of every class to fill more than one page
+        std::vector<allocation> allocations;
+        size_t expected_bytes   = 0;
+        size_t num_size_classes = 0;
+        for (size_t size = 1; size <= slab_allocator::max_object_size; size = slab_allocator::allocation_size(size) + 1)
+        {
+            ++num_size_classes;
+            auto const num_objects = 2 * slab_allocator::page_size / slab_allocator::allocation_size(size);
+            for (size_t i = 0; i < num_objects; ++i)
+            {
+                auto* const object = static_cast<char*>(allocator.allocate(size));
+                std::memset(object, static_cast<char>(allocations.size()), size);
+                allocations.push_back({ object, size });
+                expected_bytes += slab_allocator::allocation_size(size);
+            }
+        }
+
+        auto statistics = allocator.get_statistics();
+        EXPECT_EQ(statistics.allocated_bytes, expected_bytes);
+        EXPECT_GE(statistics.num_pages, 64);
+        EXPECT_EQ(statistics.num_large_allocations, 0);
+
+        for (size_t i = 0; i < allocations.size(); ++i)
+        {
+            auto const [object, size] = allocations[i];
+            ASSERT_EQ(object[0], static_cast<char>(i));
+            ASSERT_EQ(object[size - 1], static_cast<char>(i));
+            allocator.deallocate(object, size);
+        }
+
+        // Empty pages are returned right away, except the page each size class allocates from
+        statistics = allocator.get_statistics();
+        EXPECT_EQ(statistics.allocated_bytes, 0);
+        EXPECT_LE(statistics.num_pages, num_size_classes);
+        EXPECT_EQ(statistics.active_bytes, statistics.num_pages * slab_allocator::page_size);
+    }
+
+    TEST(SlabAllocatorTests, LargeObjectsComeFromTheHeap)
+    {
+        slab_allocator allocator;
+
+        auto* const object = allocator.allocate(slab_allocator::max_object_size + 1);
+        EXPECT_EQ(allocator.get_statistics().num_large_allocations, 1);
+        EXPECT_FALSE(allocator.should_move(object, slab_allocator::max_object_size + 1));
+
+        allocator.deallocate(object, slab_allocator::max_object_size + 1);
+        EXPECT_EQ(allocator.get_statistics().num_large_allocations, 0);
+        EXPECT_EQ(allocator.get_statistics().allocated_bytes, 0);
+    }
+
+    TEST(SlabAllocatorTests, MovingSparseObjectsReleasesPages)
+    {
+        slab_allocator allocator;
+
+        std::vector<void*> objects;
+        for (size_t i = 0; i < 100000; ++i)
+        {
+            objects.push_back(allocator.allocate(64));
+        }
+
+        for (size_t i = 0; i < objects.size(); ++i)
+        {
+            if (i % 10 != 0)
+            {
+                allocator.deallocate(objects[i], 64);
+                objects[i] = nullptr;
+            }
+        }
+
+        EXPECT_GT(allocator.get_statistics().fragmentation(), 5.0);
+
+        for (size_t pass = 0; pass < 3; ++pass)
+        {
+            for (auto& object : objects)
+            {
+                if (object and allocator.should_move(object, 64))
+                {
+                    auto* const moved = allocator.allocate(64);
+                    allocator.deallocate(object, 64);
+                    object = moved;
+                }
+            }
+        }
+
+        EXPECT_LT(allocator.get_statistics().fragmentation(), 1.2);
+
+        for (auto* const object : objects)
+        {
+            if (object)
+            {
+                allocator.deallocate(object, 64);
+            }
+        }
+    }
+
+    TEST(SlabAllocatorTests, DefragmentKeepsValueAndTtl)
+    {
+        auto const ttl = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() + std::chrono::hours(1));
+
+        // Longer values are allocated apart from their entry, both the entry and the value can move
+        std::string const raw_value(3000, 'r');
+
+        // The entries of the first half are thinned out, which leaves their pages emptier than average
+        std::vector<entry_ptr> entries;
+        for (size_t i = 0; i < 20000; ++i)
+        {
+            auto const value = i % 2 == 0 ? "value:" + std::to_string(i) : raw_value + std::to_string(i);
+            entries.push_back(entry_ptr::make(value, static_cast<entry::version_t>(i), ttl));
+        }
+
+        for (size_t i = 0; i < entries.size() / 2; ++i)
+        {
+            if (i % 20 > 1)
+            {
+                entries[i] = entry_ptr{};
+            }
+        }
+
+        // A reply that still references the entry keeps it in place
+        auto const pinned = entries.front();
+        auto const* const pinned_entry = pinned.get();
+        EXPECT_FALSE(entries.front().defragment());
+        EXPECT_EQ(entries.front().get(), pinned_entry);
+
+        size_t num_moved = 0;
+        for (size_t i = 1; i < entries.size(); ++i)
+        {
+            if (not entries[i])
+            {
+                continue;
+            }
+
+            num_moved += entries[i].defragment() ? 1 : 0;
+
+            auto const expected = i % 2 == 0 ? "value:" + std::to_string(i) : raw_value + std::to_string(i);
+            ASSERT_EQ(entries[i]->value(), expected);
+            ASSERT_TRUE(entries[i]->has_ttl());
+            ASSERT_EQ(entries[i]->ttl(), ttl);
+            ASSERT_EQ(entries[i]->version(), i);
+            ASSERT_EQ(entries[i]->use_count(), 1);
+        }
+
+        EXPECT_GT(num_moved, 0);
+        EXPECT_EQ(pinned->value(), "value:0");
+    }
+} // namespace SlabAllocatorTests
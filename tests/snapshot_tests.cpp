@@ -0,0 +1,188 @@
+import server;
+
+#include <gtest/gtest.h>
+
+#include "test_helpers.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+
+namespace SnapshotTests
+{
+    using namespace LambdaSnail::server;
+    using namespace TestHelpers;
+    using namespace std::chrono_literals;
+
+    /**
+     * Fills the databases with a key of every encoding, a value with a ttl and a value that has expired.
+     */
+    void fill(server& server, std::string const& cold_value)
+    {
+        auto const db = server.get_database(0);
+        db->set_value("embedded", "short");
+        db->set_value("raw", std::string(1000, 'r'));
+        db->set_value("integer", "-123456789");
+        db->set_value("largest", "9223372036854775807");
+        db->set_value("ttl", "expires", std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() + 1h));
+        db->set_value("expired", "gone", std::chrono::system_clock::now() - 1s);
+        db->set_value("cold", cold_value);
+
+        server.get_database(1)->set_value("other", "database");
+    }
+
+    void expect_filled(server const& server, std::string const& cold_value, entry::time_point_t const ttl)
+    {
+        auto const db = server.get_database(0);
+
+        auto const embedded = db->get_value("embedded");
+        ASSERT_TRUE(embedded);
+        EXPECT_EQ(embedded->encoding(), entry_encoding::embedded);
+        EXPECT_EQ(embedded->value(), "short");
+
+        auto const raw = db->get_value("raw");
+        ASSERT_TRUE(raw);
+        EXPECT_EQ(raw->encoding(), entry_encoding::raw);
+        EXPECT_EQ(raw->value(), std::string(1000, 'r'));
+
+        auto const integer = db->get_value("integer");
+        ASSERT_TRUE(integer);
+        EXPECT_EQ(integer->encoding(), entry_encoding::integer);
+        EXPECT_EQ(integer->integer(), -123456789);
+
+        auto const largest = db->get_value("largest");
+        ASSERT_TRUE(largest);
+        EXPECT_EQ(largest->encoding(), entry_encoding::integer);
+        EXPECT_EQ(largest->integer(), std::numeric_limits<int64_t>::max());
+
+        auto const with_ttl = db->get_value("ttl");
+        ASSERT_TRUE(with_ttl);
+        EXPECT_TRUE(with_ttl->has_ttl());
+        EXPECT_EQ(with_ttl->ttl(), ttl);
+
+        // Cold values are loaded as regular values
+        auto const cold = db->get_value("cold");
+        ASSERT_TRUE(cold);
+        EXPECT_EQ(cold->encoding(), entry_encoding::raw);
+        EXPECT_EQ(cold->value(), cold_value);
+
+        EXPECT_FALSE(db->get_value("expired"));
+        EXPECT_EQ(db->get_statistics().num_keys, 6);
+
+        auto const other = server.get_database(1)->get_value("other");
+        ASSERT_TRUE(other);
+        EXPECT_EQ(other->value(), "database");
+    }
+
+    TEST(SnapshotTests, SaveAndLoadEveryEncoding)
+    {
+        auto const snapshot_path = test_path("dump.lsdb");
+        std::string cold_value(8000, 'c');
+        for (size_t i = 0; i < cold_value.size(); ++i)
+        {
+            cold_value[i] = static_cast<char>('a' + i % 26);
+        }
+
+        auto tier = std::make_shared<cold_tier>(test_path("cold.bin"), 1024, 10s, 1);
+        ASSERT_TRUE(tier->start());
+
+        server saved(2, 4);
+        saved.set_snapshot_path(snapshot_path);
+        saved.set_cold_tier(tier);
+        fill(saved, cold_value);
+
+        auto const db  = saved.get_database(0);
+        auto const ttl = db->get_value("ttl")->ttl();
+        db->get_value("cold")->set_access_clock(access_clock::initial(eviction_policy::noeviction, std::chrono::system_clock::now() - 1h));
+        ASSERT_EQ(db->spill_cold_values(std::chrono::system_clock::now()).spilled_values, 1);
+        ASSERT_EQ(db->get_value("cold")->encoding(), entry_encoding::cold);
+
+        auto const saved_result = saved.save();
+        ASSERT_TRUE(saved_result) << saved_result.error();
+        EXPECT_FALSE(saved.get_save_status().last_save_failed);
+
+        {
+            server loaded(2, 4);
+            loaded.set_snapshot_path(snapshot_path);
+            auto const num_keys = loaded.load_snapshot();
+            ASSERT_TRUE(num_keys) << num_keys.error();
+            EXPECT_EQ(*num_keys, 7);
+            expect_filled(loaded, cold_value, ttl);
+        }
+
+        // A background save writes the same snapshot from a child process
+        std::filesystem::remove(snapshot_path);
+        ASSERT_TRUE(saved.background_save());
+
+        std::optional<bool> succeeded;
+        for (int i = 0; i < 500 and not succeeded; ++i)
+        {
+            std::this_thread::sleep_for(10ms);
+            succeeded = saved.poll_background_save();
+        }
+
+        ASSERT_TRUE(succeeded);
+        EXPECT_TRUE(*succeeded);
+
+        server loaded(2, 4);
+        loaded.set_snapshot_path(snapshot_path);
+        auto const num_keys = loaded.load_snapshot();
+        ASSERT_TRUE(num_keys) << num_keys.error();
+        expect_filled(loaded, cold_value, ttl);
+
+        // No temporary file is left behind
+        for (auto const& file : std::filesystem::directory_iterator(snapshot_path.parent_path()))
+        {
+            EXPECT_FALSE(file.path().filename().string().starts_with("temp-" + std::to_string(::getpid())));
+        }
+
+        std::filesystem::remove(snapshot_path);
+        std::filesystem::remove(tier->get_path());
+    }
+
+    TEST(SnapshotTests, CorruptedSnapshotIsRejected)
+    {
+        auto const snapshot_path = test_path("corrupted.lsdb");
+
+        {
+            server saved(1, 4);
+            saved.set_snapshot_path(snapshot_path);
+            for (size_t i = 0; i < 1000; ++i)
+            {
+                saved.get_database(0)->set_value("key:" + std::to_string(i), "value:" + std::to_string(i));
+            }
+
+            ASSERT_TRUE(saved.save());
+        }
+
+        auto const size = std::filesystem::file_size(snapshot_path);
+        {
+            std::fstream file(snapshot_path, std::ios::in | std::ios::out | std::ios::binary);
+            file.seekp(static_cast<std::streamoff>(size / 2));
+            file.put('Z');
+        }
+
+        server corrupted(1, 4);
+        corrupted.set_snapshot_path(snapshot_path);
+        auto const corrupted_result = corrupted.load_snapshot();
+        ASSERT_FALSE(corrupted_result);
+        EXPECT_NE(corrupted_result.error().find("checksum"), std::string::npos);
+        EXPECT_EQ(corrupted.get_database(0)->get_statistics().num_keys, 0);
+
+        // A truncated snapshot lacks the checksum that matches its contents
+        std::filesystem::resize_file(snapshot_path, size - 100);
+        server truncated(1, 4);
+        truncated.set_snapshot_path(snapshot_path);
+        EXPECT_FALSE(truncated.load_snapshot());
+        EXPECT_EQ(truncated.get_database(0)->get_statistics().num_keys, 0);
+
+        std::filesystem::remove(snapshot_path);
+    }
+} // namespace SnapshotTests
@@ -0,0 +1,102 @@
+#pragma once
+
+import logging;
+import resp;
+import server;
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+/**
+ * Helpers shared by the tests that work with files, need a logger or run commands.
+ */
+namespace TestHelpers
+{
+    /**
+     * A path in the temporary directory, named after the running test suite and the process, so that test runs
+     * in parallel do not share files.
+     */
+    inline std::filesystem::path test_path(std::string const& name)
+    {
+        auto const* const test = testing::UnitTest::GetInstance()->current_test_info();
+        auto const suite       = std::string(test ? test->test_suite_name() : "tests");
+        return std::filesystem::temp_directory_path() / (suite + "-" + std::to_string(::getpid()) + "-" + name);
+    }
+
+    /**
+     * The logger of the tests that need one. The loggers are registered by name, so they are only initialized once.
+     */
+    inline std::shared_ptr<LambdaSnail::logging::logger> test_logger()
+    {
+        static auto const logger = [] {
+            auto created = std::make_shared<LambdaSnail::logging::logger>();
+            created->init_logger(0, nullptr);
+            return created;
+        }();
+
+        return logger;
+    }
+
+    /**
+     * Runs a command and returns its reply. Waits for the cold values the reply refers to, like a connection does,
+     * and reports whether it had to in waited.
+     */
+    inline std::string run_command(LambdaSnail::server::command_dispatch& dispatch, std::vector<std::string> const& arguments,
+                                   bool* const waited = nullptr)
+    {
+        auto command = "*" + std::to_string(arguments.size()) + "\r\n";
+        for (auto const& argument : arguments)
+        {
+            command += "$" + std::to_string(argument.size()) + "\r\n" + argument + "\r\n";
+        }
+
+        LambdaSnail::resp::response_writer out;
+        dispatch.process_command(LambdaSnail::resp::data_view(command), out);
+
+        if (waited)
+        {
+            *waited = dispatch.has_cold_reads();
+        }
+
+        if (dispatch.has_cold_reads())
+        {
+            std::promise<bool> read;
+            auto result = read.get_future();
+            dispatch.read_cold_values([&read](bool const succeeded) { read.set_value(succeeded); });
+            EXPECT_TRUE(result.get());
+        }
+
+        std::string reply;
+        for (auto const segment : out.segments())
+        {
+            reply += segment;
+        }
+
+        return reply;
+    }
+
+    inline std::string bulk_string(std::string const& value)
+    {
+        return "$" + std::to_string(value.size()) + "\r\n" + value + "\r\n";
+    }
+
+    inline std::string read_file(std::filesystem::path const& path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        return { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+    }
+
+    inline void write_file(std::filesystem::path const& path, std::string const& contents)
+    {
+        std::ofstream(path, std::ios::binary | std::ios::trunc) << contents;
+    }
+} // namespace TestHelpers